@@ -0,0 +1,114 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __CLSYNC_BENCH_H
+#define __CLSYNC_BENCH_H
+
+// The helpers of the microbenchmarks ("make bench"). They are not a part of
+// clsync: every benchmark is a standalone program printing a table. Every
+// implementation is run in its own child process, so the growth of the
+// resident set is the memory of the implementation only.
+
+static inline uint64_t bench_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Return: the resident set size of the process in bytes
+
+static inline size_t bench_rss() {
+	unsigned long pages_total, pages_resident;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (f == NULL)
+		return 0;
+
+	if (fscanf(f, "%lu %lu", &pages_total, &pages_resident) != 2)
+		pages_resident = 0;
+	fclose(f);
+
+	return pages_resident * sysconf(_SC_PAGESIZE);
+}
+
+// A permutation of 0..count-1 to visit the entries out of the order of
+// their insertion
+
+static inline size_t *bench_shuffled(size_t count) {
+	size_t  *order = xmalloc(count * sizeof(*order));
+	uint64_t x     = 0x9E3779B97F4A7C15ULL;
+	size_t   i     = 0;
+
+	while (i < count) {
+		order[i] = i;
+		i++;
+	}
+
+	while (i > 1) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+
+		size_t j   = x % i--;
+		size_t tmp = order[i];
+		order[i]   = order[j];
+		order[j]   = tmp;
+	}
+
+	return order;
+}
+
+// Runs "funct(arg)" in a child process and waits for it
+// Return: the exit code of the child, -1 on fail
+
+static inline int bench_fork(void (*funct)(void *), void *arg) {
+	int status;
+	pid_t pid;
+
+	fflush(stdout);
+	pid = fork();
+
+	switch (pid) {
+		case -1:
+			return -1;
+		case 0:
+			funct(arg);
+			fflush(stdout);
+			_exit(0);
+	}
+
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		return -1;
+
+	return WEXITSTATUS(status);
+}
+
+static inline void bench_row(const char *impl, const char *op, size_t count, uint64_t ns) {
+	printf("%-12s %-16s %10zu %10.1f ns/op\n", impl, op, count, (double)ns / count);
+	return;
+}
+
+static inline void bench_memrow(const char *impl, size_t count, size_t bytes) {
+	printf("%-12s %-16s %10zu %10.1f bytes/entry (%.1f MiB)\n", impl, "memory", count, (double)bytes / count, (double)bytes / (1<<20));
+	return;
+}
+
+#endif
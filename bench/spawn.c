@@ -0,0 +1,121 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * The latency of starting a sync handler ("/bin/true") and waiting for it
+ * depending on the resident set of clsync: fork()+execvp() as it was,
+ * spawn_setuid_execvp() of procspawn.c (clone() with CLONE_VM|CLONE_VFORK
+ * if built with CLONE_SUPPORT) and posix_spawnp(). The resident set is
+ * grown by touched anonymous memory between the rounds.
+ *
+ * Usage: spawn [count]
+ */
+
+#include "common.h"
+#include "error.h"
+#include "malloc.h"
+#include "procspawn.h"
+#include "bench.h"
+
+#include <spawn.h>
+
+#define SPAWN_COUNT_DEFAULT	200
+#define SPAWN_HANDLER		"/bin/true"
+
+extern char **environ;
+
+static pid_t spawn_bench_fork(char *const argv[]) {
+	pid_t pid = fork();
+
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		_exit(errno);
+	}
+
+	return pid;
+}
+
+static pid_t spawn_bench_procspawn(char *const argv[]) {
+	return spawn_setuid_execvp(argv[0], argv, geteuid(), getegid());
+}
+
+static pid_t spawn_bench_posix_spawnp(char *const argv[]) {
+	pid_t pid;
+
+	if (posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ))
+		return -1;
+
+	return pid;
+}
+
+static void spawn_bench(const char *impl, const char *op, size_t count, pid_t (*spawn_funct)(char *const argv[])) {
+	char *argv[] = { SPAWN_HANDLER, NULL };
+	size_t i;
+	uint64_t tm;
+
+	tm = bench_ns();
+	for (i = 0; i < count; i++) {
+		int status;
+		pid_t pid = spawn_funct(argv);
+
+		if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status)) {
+			printf("%s: cannot run \"%s\"\n", impl, SPAWN_HANDLER);
+			return;
+		}
+	}
+	bench_row(impl, op, count, bench_ns() - tm);
+
+	return;
+}
+
+int main(int argc, char *argv[]) {
+	static int zero = 0;
+	static const size_t rss_mib[] = { 0, 64, 256, 1024 };
+	size_t count, i, ballast_size = 0;
+	char *ballast[sizeof(rss_mib)/sizeof(*rss_mib)];
+
+	error_init(&zero, &zero, &zero, &zero);
+
+	count = (argc > 1) ? strtoul(argv[1], NULL, 0) : SPAWN_COUNT_DEFAULT;
+	if (!count) {
+		fprintf(stderr, "Usage: %s [count]\n", argv[0]);
+		return EINVAL;
+	}
+
+	printf("%-12s %-16s %10s %10s\n", "impl", "op", "count", "result");
+	for (i = 0; i < sizeof(rss_mib)/sizeof(*rss_mib); i++) {
+		char op[BUFSIZ];
+		size_t size = (rss_mib[i] << 20) - ballast_size;
+
+		// Touching every page to get it into the page tables
+		ballast[i] = xmalloc(size + 1);
+		memset(ballast[i], 1, size + 1);
+		ballast_size += size;
+
+		snprintf(op, sizeof(op), "rss %zu MiB", bench_rss() >> 20);
+		spawn_bench("fork",         op, count, spawn_bench_fork);
+		spawn_bench("procspawn",    op, count, spawn_bench_procspawn);
+		spawn_bench("posix_spawnp", op, count, spawn_bench_posix_spawnp);
+	}
+
+	while (i--)
+		free(ballast[i]);
+	return 0;
+}
@@ -0,0 +1,220 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * The event tables ("path -> eventinfo_t") on the way of 1M events:
+ * inserting the new paths, coalescing the repeated events of them, the
+ * lookups, moving the entries into a queue table (as _sync_queuesync()
+ * does), copying a table for a sync thread and removing. The strmap of
+ * strmap.h is compared with the GHashTable of strdup()-ed keys and
+ * malloc()-ed values it replaced.
+ *
+ * Usage: strmap [count]
+ */
+
+#include "common.h"
+#include "error.h"
+#include "glibex.h"
+#include "strmap.h"
+#include "bench.h"
+
+#define STRMAP_COUNT_DEFAULT	1000000
+
+struct strmap_arg {
+	size_t	  count;
+	char	**fpaths;
+	size_t	 *fpath_lens;
+	size_t	 *order;
+};
+
+static inline void strmap_bench_evinfo(eventinfo_t *evinfo, size_t i) {
+	evinfo->evmask     |= 1 << (i % 12);
+	evinfo->seqid_max   = i;
+	evinfo->objtype_new = EOT_FILE;
+	evinfo->fsize       = i;
+	return;
+}
+
+static int strmap_bench_move(strmap_entry_t *entry, void *evinfo_v, void *map_v) {
+	int isnew;
+
+	memcpy(strmap_insert_hashed(map_v, entry->key, entry->key_len, entry->hash, &isnew), evinfo_v, sizeof(eventinfo_t));
+	return 1;
+}
+
+static void strmap_bench_strmap(void *_arg_p) {
+	struct strmap_arg *arg_p = _arg_p;
+	strmap_t *map, *queue_map, *thread_map;
+	size_t i, found = 0, rss;
+	uint64_t tm;
+	int isnew;
+
+	map       = strmap_new(sizeof(eventinfo_t));
+	queue_map = strmap_new(sizeof(eventinfo_t));
+	rss = bench_rss();
+
+	tm = bench_ns();
+	for (i = 0; i < arg_p->count; i++)
+		strmap_bench_evinfo(strmap_insert(map, arg_p->fpaths[i], &isnew), i);
+	bench_row("strmap", "insert", arg_p->count, bench_ns() - tm);
+	bench_memrow("strmap", arg_p->count, bench_rss() - rss);
+
+	tm = bench_ns();
+	for (i = 0; i < arg_p->count; i++)
+		strmap_bench_evinfo(strmap_insert(map, arg_p->fpaths[arg_p->order[i]], &isnew), i);
+	bench_row("strmap", "coalesce", arg_p->count, bench_ns() - tm);
+
+	tm = bench_ns();
+	for (i = 0; i < arg_p->count; i++)
+		found += (strmap_lookup(map, arg_p->fpaths[arg_p->order[i]]) != NULL);
+	bench_row("strmap", "lookup", arg_p->count, bench_ns() - tm);
+
+	tm = bench_ns();
+	strmap_foreach(map, strmap_bench_move, queue_map);
+	bench_row("strmap", "move to queue", arg_p->count, bench_ns() - tm);
+
+	tm = bench_ns();
+	thread_map = strmap_dup(queue_map);
+	bench_row("strmap", "dup", arg_p->count, bench_ns() - tm);
+
+	tm = bench_ns();
+	for (i = 0; i < arg_p->count; i++)
+		found += strmap_remove(thread_map, arg_p->fpaths[arg_p->order[i]]);
+	bench_row("strmap", "remove", arg_p->count, bench_ns() - tm);
+
+	if (found != 2*arg_p->count || strmap_count(map) || strmap_count(thread_map))
+		printf("strmap: found %zu of %zu\n", found, 2*arg_p->count);
+
+	strmap_free(map);
+	strmap_free(queue_map);
+	strmap_free(thread_map);
+	return;
+}
+
+static gboolean strmap_bench_ht_move(gpointer fpath_gp, gpointer evinfo_gp, gpointer ht_gp) {
+	eventinfo_t *evinfo = xmalloc(sizeof(*evinfo));
+
+	memcpy(evinfo, evinfo_gp, sizeof(*evinfo));
+	g_hash_table_insert(ht_gp, strdup(fpath_gp), evinfo);
+	return TRUE;
+}
+
+static gpointer strmap_bench_ht_eidup(gpointer evinfo_gp) {
+	eventinfo_t *evinfo = xmalloc(sizeof(*evinfo));
+
+	memcpy(evinfo, evinfo_gp, sizeof(*evinfo));
+	return evinfo;
+}
+
+static void strmap_bench_ht(void *_arg_p) {
+	struct strmap_arg *arg_p = _arg_p;
+	GHashTable *ht, *queue_ht, *thread_ht;
+	size_t i, found = 0, rss;
+	uint64_t tm;
+
+	ht       = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+	queue_ht = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+	rss = bench_rss();
+
+	tm = bench_ns();
+	for (i = 0; i < arg_p->count; i++) {
+		eventinfo_t *evinfo = g_hash_table_lookup(ht, arg_p->fpaths[i]);
+		if (evinfo == NULL) {
+			evinfo = xcalloc(1, sizeof(*evinfo));
+			g_hash_table_insert(ht, strdup(arg_p->fpaths[i]), evinfo);
+		}
+		strmap_bench_evinfo(evinfo, i);
+	}
+	bench_row("ghashtable", "insert", arg_p->count, bench_ns() - tm);
+	bench_memrow("ghashtable", arg_p->count, bench_rss() - rss);
+
+	tm = bench_ns();
+	for (i = 0; i < arg_p->count; i++) {
+		const char *fpath = arg_p->fpaths[arg_p->order[i]];
+		eventinfo_t *evinfo = g_hash_table_lookup(ht, fpath);
+		if (evinfo == NULL) {
+			evinfo = xcalloc(1, sizeof(*evinfo));
+			g_hash_table_insert(ht, strdup(fpath), evinfo);
+		}
+		strmap_bench_evinfo(evinfo, i);
+	}
+	bench_row("ghashtable", "coalesce", arg_p->count, bench_ns() - tm);
+
+	tm = bench_ns();
+	for (i = 0; i < arg_p->count; i++)
+		found += (g_hash_table_lookup(ht, arg_p->fpaths[arg_p->order[i]]) != NULL);
+	bench_row("ghashtable", "lookup", arg_p->count, bench_ns() - tm);
+
+	tm = bench_ns();
+	g_hash_table_foreach_remove(ht, strmap_bench_ht_move, queue_ht);
+	bench_row("ghashtable", "move to queue", arg_p->count, bench_ns() - tm);
+
+	tm = bench_ns();
+	thread_ht = g_hash_table_dup(queue_ht, g_str_hash, g_str_equal, free, free, (gpointer(*)(gpointer))strdup, strmap_bench_ht_eidup);
+	bench_row("ghashtable", "dup", arg_p->count, bench_ns() - tm);
+
+	tm = bench_ns();
+	for (i = 0; i < arg_p->count; i++)
+		found += g_hash_table_remove(thread_ht, arg_p->fpaths[arg_p->order[i]]);
+	bench_row("ghashtable", "remove", arg_p->count, bench_ns() - tm);
+
+	if (found != 2*arg_p->count || g_hash_table_size(ht) || g_hash_table_size(thread_ht))
+		printf("ghashtable: found %zu of %zu\n", found, 2*arg_p->count);
+
+	g_hash_table_destroy(ht);
+	g_hash_table_destroy(queue_ht);
+	g_hash_table_destroy(thread_ht);
+	return;
+}
+
+int main(int argc, char *argv[]) {
+	static int zero = 0;
+	struct strmap_arg arg;
+	size_t i;
+
+	error_init(&zero, &zero, &zero, &zero);
+
+	arg.count = (argc > 1) ? strtoul(argv[1], NULL, 0) : STRMAP_COUNT_DEFAULT;
+	if (!arg.count) {
+		fprintf(stderr, "Usage: %s [count]\n", argv[0]);
+		return EINVAL;
+	}
+
+	// The relative paths of the changed files as collected by clsync
+	arg.fpaths     = xmalloc(arg.count * sizeof(*arg.fpaths));
+	arg.fpath_lens = xmalloc(arg.count * sizeof(*arg.fpath_lens));
+	for (i = 0; i < arg.count; i++) {
+		char fpath[PATH_MAX];
+		arg.fpath_lens[i] = snprintf(fpath, sizeof(fpath), "home/user%03zu/src/%03zu/file%03zu.c", i / 10000, (i / 100) % 100, i % 100);
+		arg.fpaths[i]     = strdup(fpath);
+	}
+	arg.order = bench_shuffled(arg.count);
+
+	printf("%-12s %-16s %10s %10s\n", "impl", "op", "count", "result");
+	bench_fork(strmap_bench_strmap, &arg);
+	bench_fork(strmap_bench_ht,     &arg);
+
+	for (i = 0; i < arg.count; i++)
+		free(arg.fpaths[i]);
+	free(arg.fpaths);
+	free(arg.fpath_lens);
+	free(arg.order);
+	return 0;
+}
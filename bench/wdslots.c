@@ -0,0 +1,163 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * The indexes of the watched directories with 1M watches: adding, the
+ * lookups by the watching descriptor (every inotify event) and by the path,
+ * and removing. The slots of indexes.h are compared with the two hash
+ * tables ("wd2fpath_ht" and "fpath2wd_ht") they replaced.
+ *
+ * Usage: wdslots [count]
+ */
+
+#include "common.h"
+#include "error.h"
+#include "indexes.h"
+#include "bench.h"
+
+#define WDSLOTS_COUNT_DEFAULT	1000000
+
+struct wdslots_arg {
+	size_t	  count;
+	char	**fpaths;
+	size_t	 *fpath_lens;
+	size_t	 *order;
+};
+
+static void wdslots_bench_slots(void *_arg_p) {
+	struct wdslots_arg *arg_p = _arg_p;
+	indexes_t indexes;
+	size_t i, found = 0, rss;
+	uint64_t tm;
+
+	memset(&indexes, 0, sizeof(indexes));
+	indexes.fpath2wd_tree = pathtree_new();
+	rss = bench_rss();
+
+	tm = bench_ns();
+	for (i = 0; i < arg_p->count; i++)
+		indexes_add_wd(&indexes, i+1, arg_p->fpaths[i], arg_p->fpath_lens[i]);
+	bench_row("wdslots", "add", arg_p->count, bench_ns() - tm);
+	bench_memrow("wdslots", arg_p->count, bench_rss() - rss);
+
+	tm = bench_ns();
+	for (i = 0; i < arg_p->count; i++)
+		found += (indexes_wdslot(&indexes, arg_p->order[i]+1) != NULL);
+	bench_row("wdslots", "lookup by wd", arg_p->count, bench_ns() - tm);
+
+	tm = bench_ns();
+	for (i = 0; i < arg_p->count; i++)
+		found += (indexes_fpath2wd(&indexes, arg_p->fpaths[arg_p->order[i]]) != -1);
+	bench_row("wdslots", "lookup by path", arg_p->count, bench_ns() - tm);
+
+	tm = bench_ns();
+	for (i = 0; i < arg_p->count; i++)
+		indexes_remove_bywd(&indexes, arg_p->order[i]+1);
+	bench_row("wdslots", "remove", arg_p->count, bench_ns() - tm);
+
+	if (found != 2*arg_p->count)
+		printf("wdslots: found %zu of %zu\n", found, 2*arg_p->count);
+
+	indexes_wdslots_free(&indexes);
+	pathtree_free(indexes.fpath2wd_tree);
+	return;
+}
+
+static void wdslots_bench_ht(void *_arg_p) {
+	struct wdslots_arg *arg_p = _arg_p;
+	GHashTable *wd2fpath_ht, *fpath2wd_ht;
+	size_t i, found = 0, rss;
+	uint64_t tm;
+
+	wd2fpath_ht = g_hash_table_new_full(g_direct_hash, g_direct_equal, 0,    0);
+	fpath2wd_ht = g_hash_table_new_full(g_str_hash,    g_str_equal,    free, 0);
+	rss = bench_rss();
+
+	tm = bench_ns();
+	for (i = 0; i < arg_p->count; i++) {
+		char *fpath = xmalloc(arg_p->fpath_lens[i]+1);
+		memcpy(fpath, arg_p->fpaths[i], arg_p->fpath_lens[i]+1);
+		g_hash_table_insert(wd2fpath_ht, GINT_TO_POINTER(i+1), fpath);
+		g_hash_table_insert(fpath2wd_ht, fpath, GINT_TO_POINTER(i+1));
+	}
+	bench_row("ghashtable", "add", arg_p->count, bench_ns() - tm);
+	bench_memrow("ghashtable", arg_p->count, bench_rss() - rss);
+
+	tm = bench_ns();
+	for (i = 0; i < arg_p->count; i++)
+		found += (g_hash_table_lookup(wd2fpath_ht, GINT_TO_POINTER(arg_p->order[i]+1)) != NULL);
+	bench_row("ghashtable", "lookup by wd", arg_p->count, bench_ns() - tm);
+
+	tm = bench_ns();
+	for (i = 0; i < arg_p->count; i++)
+		found += (g_hash_table_lookup(fpath2wd_ht, arg_p->fpaths[arg_p->order[i]]) != NULL);
+	bench_row("ghashtable", "lookup by path", arg_p->count, bench_ns() - tm);
+
+	tm = bench_ns();
+	for (i = 0; i < arg_p->count; i++) {
+		gpointer wd_gp = GINT_TO_POINTER(arg_p->order[i]+1);
+		char *fpath = g_hash_table_lookup(wd2fpath_ht, wd_gp);
+		g_hash_table_remove(wd2fpath_ht, wd_gp);
+		g_hash_table_remove(fpath2wd_ht, fpath);	// frees "fpath"
+	}
+	bench_row("ghashtable", "remove", arg_p->count, bench_ns() - tm);
+
+	if (found != 2*arg_p->count)
+		printf("ghashtable: found %zu of %zu\n", found, 2*arg_p->count);
+
+	g_hash_table_destroy(wd2fpath_ht);
+	g_hash_table_destroy(fpath2wd_ht);
+	return;
+}
+
+int main(int argc, char *argv[]) {
+	static int zero = 0;
+	struct wdslots_arg arg;
+	size_t i;
+
+	error_init(&zero, &zero, &zero, &zero);
+
+	arg.count = (argc > 1) ? strtoul(argv[1], NULL, 0) : WDSLOTS_COUNT_DEFAULT;
+	if (!arg.count) {
+		fprintf(stderr, "Usage: %s [count]\n", argv[0]);
+		return EINVAL;
+	}
+
+	// A tree of directories as watched by clsync: /srv/watch/NNN/NNN/NNN
+	arg.fpaths     = xmalloc(arg.count * sizeof(*arg.fpaths));
+	arg.fpath_lens = xmalloc(arg.count * sizeof(*arg.fpath_lens));
+	for (i = 0; i < arg.count; i++) {
+		char fpath[PATH_MAX];
+		arg.fpath_lens[i] = snprintf(fpath, sizeof(fpath), "/srv/watch/%03zu/%03zu/%03zu", i / 10000, (i / 100) % 100, i % 100);
+		arg.fpaths[i]     = strdup(fpath);
+	}
+	arg.order = bench_shuffled(arg.count);
+
+	printf("%-12s %-16s %10s %10s\n", "impl", "op", "count", "result");
+	bench_fork(wdslots_bench_slots, &arg);
+	bench_fork(wdslots_bench_ht,    &arg);
+
+	for (i = 0; i < arg.count; i++)
+		free(arg.fpaths[i]);
+	free(arg.fpaths);
+	free(arg.fpath_lens);
+	free(arg.order);
+	return 0;
+}
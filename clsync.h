@@ -28,7 +28,7 @@
 #	include <clsync/port-hacks.h>
 #endif
 
-#define CLSYNC_API_VERSION 2
+#define CLSYNC_API_VERSION 3
 
 enum eventobjtype {
 	EOT_UNKNOWN	= 0,		// Unknown
@@ -47,6 +47,8 @@ struct api_eventinfo {
 	const char	*path;		// path
 	eventobjtype_t   objtype_old;	// type of object by path "path" before the event
 	eventobjtype_t   objtype_new;	// type of object by path "path" after  the event
+	size_t		 path_old_len;	// strlen(path_old)
+	const char	*path_old;	// the previous path of the object if EVIF_RENAMED is set, NULL otherwise
 };
 typedef struct api_eventinfo api_eventinfo_t;
 
@@ -61,6 +63,7 @@ enum eventinfo_flags {
 	EVIF_NONE		= 0x00000000,	// No modifier
 	EVIF_RECURSIVELY	= 0x00000001,	// Need to be synced recursively
 	EVIF_CONTENTRECURSIVELY	= 0x00000002,	// Affects recursively only on content of this dir
+	EVIF_RENAMED		= 0x00000004,	// The object has been renamed from "path_old" to "path"
 };
 typedef enum eventinfo_flags eventinfo_flags_t;
 
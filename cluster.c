@@ -36,6 +36,7 @@
 #include "sync.h"
 #include "calc.h"
 #include "malloc.h"
+#include "glibex.h"
 
 // Global variables. They will be initialized in cluster_init()
 
@@ -368,6 +369,7 @@ int node_update_status(uint8_t node_id, uint8_t node_status) {
 			nodeinfo_p->num			   = node_count;
 			nodeinfo_p->last_serial		   = -1;
 			nodeinfo_p->modtime_ht 		   = g_hash_table_new_full(g_str_hash,	  g_str_equal,	  free, 0);
+			nodeinfo_p->modtime_keys_bytes	   = 0;
 			nodeinfo_p->serial2queuedpacket_ht = g_hash_table_new_full(g_direct_hash, g_direct_equal, 0,    0);
 
 			node_ids[node_count] = node_id;
@@ -1514,8 +1516,11 @@ int cluster_modtime_update(const char *path, short int dirlevel, mode_t st_mode)
 		toupdate++;
 
 	//	g_hash_table_replace() will replace existent information about the directory or create it if it doesn't exist.
-	if (toupdate)
+	if (toupdate) {
+		if (ctime_gp == NULL)
+			nodeinfo_my->modtime_keys_bytes += dirpath_rel_end + 1;
 		g_hash_table_replace(nodeinfo_my->modtime_ht, strdup(dirpath_rel), GINT_TO_POINTER(stat64.st_ctime));
+	}
 
 	// Why I'm using "st_ctime" instead of "st_mtime"? Because "st_ctime" also updates on updating inode information.
 	
@@ -1690,5 +1695,29 @@ int cluster_capture(const char *path) {
 	return 0;
 }
 
+
+/**
+ * @brief 			Counts the entries and the bytes of "modtime_ht"-s of the known nodes.
+ * 
+ * @param[out]	entries_p	Pointer to the count of entries to be increased
+ * @param[out]	bytes_p		Pointer to the count of bytes to be increased (approximate)
+ * 
+ * @retval	zero 		Successfully counted
+ * 
+ */
+
+int cluster_meminfo(size_t *entries_p, size_t *bytes_p) {
+	int i = 0;
+
+	while (i < node_count) {
+		nodeinfo_t *nodeinfo_p = &nodeinfo[node_ids[i++]];
+
+		*entries_p += g_hash_table_size(nodeinfo_p->modtime_ht);
+		*bytes_p   += g_hash_table_memsize(nodeinfo_p->modtime_ht) + nodeinfo_p->modtime_keys_bytes;
+	}
+
+	return 0;
+}
+
 #endif
 
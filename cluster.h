@@ -107,6 +107,7 @@ struct nodeinfo {
 	nodestatus_t 	 status;
 	uint32_t    	 updatets;
 	GHashTable  	*modtime_ht;
+	size_t		 modtime_keys_bytes;
 	GHashTable	*serial2queuedpacket_ht;
 	packets_stats_t	 packets_in;
 	packets_stats_t	 packets_out;
@@ -261,6 +262,7 @@ extern int cluster_capture(const char *fpath);
 
 extern int cluster_modtime_update(const char *dirpath, short int dirlevel, mode_t st_mode);
 extern int cluster_initialsync();
+extern int cluster_meminfo(size_t *entries_p, size_t *bytes_p);
 
 #endif
 
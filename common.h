@@ -57,6 +57,11 @@
 #ifdef FANOTIFY_SUPPORT
 #	include <sys/fanotify.h>
 #endif
+#ifdef EPOLL_SUPPORT
+#	include <sys/epoll.h>
+#	include <sys/timerfd.h>
+#	include <sys/eventfd.h>
+#endif
 #include <sys/wait.h>
 #include <fts.h>
 #include <sys/time.h>
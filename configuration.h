@@ -48,10 +48,10 @@
 #	endif
 #endif
 #define DEFAULT_RULES_PERM		RA_ALL
-#define DEFAULT_COLLECTDELAY		30
+#define DEFAULT_COLLECTDELAY		(30 * 1000)		// in milliseconds
 #define DEFAULT_SYNCDELAY		(DEFAULT_COLLECTDELAY)
 #define DEFAULT_BFILETHRESHOLD		(128 * 1024 * 1024)
-#define DEFAULT_BFILECOLLECTDELAY	1800
+#define DEFAULT_BFILECOLLECTDELAY	(1800 * 1000)		// in milliseconds
 #define DEFAULT_LABEL			"nolabel"
 #define DEFAULT_RSYNCINCLUDELINESLIMIT	20000
 #define DEFAULT_SYNCTIMEOUT		(3600 * 24)
@@ -67,12 +67,52 @@
 #define DEFAULT_DUMPDIR			"/tmp/clsync-dump-%label%"
 #define DEFAULT_DETACH_IPC		1
 
-#define FANOTIFY_FLAGS			(FAN_CLOEXEC|FAN_UNLIMITED_QUEUE|FAN_UNLIMITED_MARKS)
+#define FANOTIFY_FLAGS			(FAN_CLASS_NOTIF|FAN_CLOEXEC|FAN_NONBLOCK|FAN_UNLIMITED_QUEUE|FAN_REPORT_DFID_NAME)
 #define FANOTIFY_EVFLAGS		(O_LARGEFILE|O_RDONLY|O_CLOEXEC)
 
-#define FANOTIFY_MARKMASK		(FAN_OPEN|FAN_MODIFY|FAN_CLOSE|FAN_ONDIR|FAN_EVENT_ON_CHILD)
+#define FANOTIFY_MARKMASK		(FAN_ATTRIB|FAN_CLOSE_WRITE|FAN_CREATE|FAN_DELETE|FAN_DELETE_SELF|FAN_MOVE_SELF|FAN_MOVED_FROM|FAN_MOVED_TO|FAN_MODIFY|FAN_ONDIR)
 
-#define INOTIFY_FLAGS			(IN_CLOEXEC)
+#define FANOTIFY_HANDLECACHE_MAX	(1<<16)	/* directories; the handle->path cache is dropped when it's exceeded */
+
+#define INOTIFY_FLAGS			(IN_CLOEXEC|IN_NONBLOCK)
+
+#define INOTIFY_RINGSIZE_DEFAULT	(1<<12)	/* events; used if "--inotify-ring" is set without a value */
+#define INOTIFY_RINGSIZE_MAX		(1<<20)
+#define INOTIFY_RINGSIZE_NOVALUE	INT_MIN	/* a mark of "--inotify-ring" set without a value, it's replaced by INOTIFY_RINGSIZE_DEFAULT */
+
+#define MARKTHREADS_MAX			(1<<8)
+#define MARKTHREADS_PROGRESS_INTERVAL	100000	/* directories; how often the mark threads report the progress */
+
+#define WALKTHREADS_MAX			(1<<8)
+#define TREEWALK_BATCH_ENTRIES		(1<<10)	/* entries passed from a walker thread to the initial sync at once */
+#define TREEWALK_BATCHES_MAX		64	/* batches waiting for the initial sync; the walker threads wait if there're more */
+#define TREEWALK_DENTS_BUFSIZ		(1<<15)	/* bytes; the buffer of getdents64() of a walker thread */
+
+#define INITSYNC_JOURNAL_MAGIC		"clsync-initsync-journal-2"	/* the first record of an "--initsync-journal" */
+
+#define HANDLERWORKERS_MAX		(1<<8)
+#define SHARDS_MAX			(1<<8)
+#define COPROCESS_ENV			"CLSYNC_COPROCESS"	/* the number of the coprocess is passed to the handler in this environment variable */
+#define COPROCESS_REPLY_MAX		16	/* bytes; the longest reply line of a coprocess */
+#define COPROCESS_EXIT_TIMEOUT		1000	/* ms; a coprocess is killed if it doesn't exit in this time after the end of it's stdin */
+
+#define SPAWN_STACK_SIZE		(1<<16)	/* bytes; the stack of a child between clone() and execvp() */
+
+#define WATCHBUDGET_MAXUSERWATCHES	"/proc/sys/fs/inotify/max_user_watches"
+#define WATCHBUDGET_KERNELSHARE		90	/* percents of max_user_watches; used if "--watch-budget" is set without a value */
+#define WATCHBUDGET_EVICT_DIVISOR	16	/* 1/16 of the budget is evicted at once to amortize the LRU sorting */
+#define WATCHBUDGET_POLLINTERVAL	(60 * 1000)	/* ms; how often the evicted directories are polled */
+
+#define STATBATCH_THREADS		4	/* threads lstat()-ing the coalesced event paths if io_uring is not available */
+#define STATBATCH_THREADS_MINBATCH	32	/* smaller batches are lstat()-ed in the calling thread */
+#define STATBATCH_URING_ENTRIES		256	/* io_uring submission queue size */
+#define INOTIFY_PATHBLOCK_SIZE		(1<<16)	/* bytes; the paths of the coalesced inotify events are copied into blocks of this size */
+#define FILEINFO_SLAB_RECORDS		(1<<12)	/* records in a slab block of the "--modification-signature" store */
+#define FILEINFO_SNAPSHOT_INTERVAL	300	/* seconds; how often the "--fileinfo-snapshot" is checkpointed */
+#define STRMAP_SLOTS_MIN		(1<<6)	/* slots of an empty event table (a power of two) */
+#define ARENA_BLOCK_SIZE_MIN		(1<<10)	/* bytes; the first block of an arena (the keys of an event table) */
+#define ARENA_BLOCK_SIZE		(1<<16)	/* bytes; the blocks of an arena grow up to this size */
+#define MEMINFO_INTERVAL		10	/* seconds; how often the memory usage of the indexes is recounted for the status file and the control socket */
 
 #define INOTIFY_MARKMASK		(IN_ATTRIB|IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|IN_DELETE_SELF|IN_MOVE_SELF|IN_MOVED_FROM|IN_MOVED_TO|IN_MODIFY|IN_DONT_FOLLOW)
 
@@ -65,6 +65,13 @@ int control_procclsyncsock(socket_sockthreaddata_t *arg, sockcmd_t *sockcmd_p) {
 		case SOCKCMD_REQUEST_INFO:
 			rc = socket_reply(clsyncsock_p, sockcmd_p, SOCKCMD_REPLY_INFO, ctx_p->config_block, ctx_p->label, ctx_p->flags, ctx_p->flags_set);
 			break;
+		case SOCKCMD_REQUEST_MEMINFO: {
+			// The reply is sent twice (the arguments and the description)
+			char meminfo[SOCKET_BUFSIZ/3];
+			sync_meminfo_format(meminfo, sizeof(meminfo), "", "; ");
+			rc = socket_reply(clsyncsock_p, sockcmd_p, SOCKCMD_REPLY_MEMINFO, meminfo);
+			break;
+		}
 		case SOCKCMD_REQUEST_SET: {
 			sockcmd_dat_set_t *dat = sockcmd_p->data;
 			rc = ctx_set(ctx_p, dat->key, dat->value);
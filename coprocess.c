@@ -0,0 +1,288 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include "malloc.h"
+#include "error.h"
+#include "coprocess.h"
+
+#include <pthread.h>
+
+/*
+ * "--handler-workers": the sync handler is started as a pool of long-lived
+ * processes ("coprocesses") instead of a fork() and exec() per call. The
+ * stdin and the stdout of a coprocess are the same socket. A call is
+ * written to it as the count of the arguments and the arguments (the ones
+ * that would be passed to the handler on exec, without the handler path),
+ * every one terminated by NUL:
+ *
+ *	"<argc>\0<argv[1]>\0...<argv[argc]>\0"
+ *
+ * The coprocess replies with the exitcode of the call and a newline:
+ *
+ *	"<exitcode>\n"
+ *
+ * A coprocess is started on the first call to it and is restarted on the
+ * next call after it's failed (died or broke the protocol).
+ */
+
+struct coprocess {
+	pid_t	pid;		// 0 if it's not started
+	int	fd;
+	int	busy;
+};
+
+static struct coprocess	*coprocesses       = NULL;
+static int		 coprocesses_count = 0;
+static pthread_mutex_t	 coprocesses_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 coprocesses_cond  = PTHREAD_COND_INITIALIZER;
+
+extern char **environ;
+
+static int coprocess_start(ctx_t *ctx_p, struct coprocess *coprocess_p, int num) {
+	char   num_env[sizeof(COPROCESS_ENV) + 16];
+	char  *argv[] = {ctx_p->handlerfpath, NULL};
+	char **envp;
+	int    envc = 0, fds[2];
+	pid_t  pid;
+
+	// The environment is prepared before fork(): the child may only exec
+	while (environ[envc] != NULL)
+		envc++;
+	envp = xmalloc((envc+2) * sizeof(*envp));
+	memcpy(envp, environ, envc * sizeof(*envp));
+	snprintf(num_env, sizeof(num_env), COPROCESS_ENV"=%i", num);
+	envp[envc]   = num_env;
+	envp[envc+1] = NULL;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, fds)) {
+		error("Cannot socketpair() for the coprocess #%i.", num);
+		free(envp);
+		return errno;
+	}
+
+	pid = fork();
+	switch (pid) {
+		case -1:
+			error("Cannot fork() the coprocess #%i.", num);
+			close(fds[0]);
+			close(fds[1]);
+			free(envp);
+			return errno;
+		case 0:
+			if ((dup2(fds[1], STDIN_FILENO) == -1) || (dup2(fds[1], STDOUT_FILENO) == -1))
+				_exit(errno);
+			if (setgid(ctx_p->synchandler_gid) || setuid(ctx_p->synchandler_uid))
+				_exit(errno);
+			execve(ctx_p->handlerfpath, argv, envp);
+			_exit(errno);
+	}
+
+	close(fds[1]);
+	free(envp);
+
+	coprocess_p->pid = pid;
+	coprocess_p->fd  = fds[0];
+	debug(1, "Started the coprocess #%i (pid %u).", num, pid);
+	return 0;
+}
+
+// The end of the stdin is the request to exit
+
+static void coprocess_stop(struct coprocess *coprocess_p, int num) {
+	int waited = 0;
+
+	if (coprocess_p->pid == 0)
+		return;
+
+	debug(1, "Stopping the coprocess #%i (pid %u).", num, coprocess_p->pid);
+	close(coprocess_p->fd);
+	coprocess_p->fd = -1;
+
+	while (waitpid(coprocess_p->pid, NULL, WNOHANG) == 0) {
+		if (waited >= COPROCESS_EXIT_TIMEOUT) {
+			warning("The coprocess #%i (pid %u) doesn't exit, killing it.", num, coprocess_p->pid);
+			kill(coprocess_p->pid, SIGKILL);
+			waitpid(coprocess_p->pid, NULL, 0);
+			break;
+		}
+		usleep(10*1000);
+		waited += 10;
+	}
+
+	coprocess_p->pid = 0;
+	return;
+}
+
+// Return: the exitcode of the call or -1 if the coprocess failed
+
+static int coprocess_request(struct coprocess *coprocess_p, char **argv) {
+	char   reply[COPROCESS_REPLY_MAX], *end;
+	char  *request, *ptr;
+	size_t request_size, reply_len = 0;
+	int    argc = 0;
+	long   exitcode;
+
+	while (argv[argc+1] != NULL)
+		argc++;
+
+	request_size = 16;
+	{
+		int i = 1;
+		while (i <= argc)
+			request_size += strlen(argv[i++]) + 1;
+	}
+
+	request = xmalloc(request_size);
+	ptr = request + sprintf(request, "%i", argc) + 1;
+	{
+		int i = 1;
+		while (i <= argc) {
+			size_t arg_size = strlen(argv[i]) + 1;
+			memcpy(ptr, argv[i++], arg_size);
+			ptr += arg_size;
+		}
+	}
+
+	request_size = ptr - request;
+	ptr = request;
+	while (request_size) {
+		ssize_t sent = send(coprocess_p->fd, ptr, request_size, MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno == EINTR)
+				continue;
+			error("Cannot send() the call to the coprocess (pid %u).", coprocess_p->pid);
+			free(request);
+			return -1;
+		}
+		ptr          += sent;
+		request_size -= sent;
+	}
+	free(request);
+
+	// The reply is short, so it's read byte by byte to not read beyond it
+	while (1) {
+		ssize_t r = read(coprocess_p->fd, &reply[reply_len], 1);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r != 1) {
+			if (r == 0)
+				errno = EPIPE;
+			error("Cannot read() the reply of the coprocess (pid %u).", coprocess_p->pid);
+			return -1;
+		}
+		if (reply[reply_len] == '\n')
+			break;
+		if (++reply_len >= sizeof(reply)) {
+			errno = EPROTO;
+			error("Too long reply of the coprocess (pid %u).", coprocess_p->pid);
+			return -1;
+		}
+	}
+	reply[reply_len] = 0;
+
+	errno = 0;
+	exitcode = strtol(reply, &end, 10);
+	if (errno || (end == reply) || (*end != 0) || (exitcode < 0) || (exitcode > INT_MAX)) {
+		errno = EPROTO;
+		error("Invalid reply of the coprocess (pid %u): \"%s\".", coprocess_p->pid, reply);
+		return -1;
+	}
+
+	return exitcode;
+}
+
+int coprocess_init(ctx_t *ctx_p) {
+	int i;
+
+	coprocesses_count = ctx_p->flags[HANDLERWORKERS];
+	coprocesses       = xcalloc(coprocesses_count, sizeof(*coprocesses));
+
+	i = 0;
+	while (i < coprocesses_count)
+		coprocesses[i++].fd = -1;
+
+	debug(1, "%i coprocesses of \"%s\".", coprocesses_count, ctx_p->handlerfpath);
+	return 0;
+}
+
+// Returns the exitcode of the call like exec_argv()
+
+int coprocess_call(ctx_t *ctx_p, char **argv, int *child_pid) {
+	struct coprocess *coprocess_p;
+	int num, exitcode;
+
+	pthread_mutex_lock(&coprocesses_mutex);
+	while (1) {
+		num = 0;
+		while ((num < coprocesses_count) && coprocesses[num].busy)
+			num++;
+		if (num < coprocesses_count)
+			break;
+
+		debug(3, "All the coprocesses are busy, waiting.");
+		pthread_cond_wait(&coprocesses_cond, &coprocesses_mutex);
+	}
+	coprocess_p = &coprocesses[num];
+	coprocess_p->busy = 1;
+	pthread_mutex_unlock(&coprocesses_mutex);
+
+	if (coprocess_p->pid == 0)
+		if ((exitcode = coprocess_start(ctx_p, coprocess_p, num)))
+			goto l_coprocess_call_end;
+
+	if (child_pid != NULL)
+		*child_pid = coprocess_p->pid;
+
+	debug(3, "Calling the coprocess #%i (pid %u).", num, coprocess_p->pid);
+	exitcode = coprocess_request(coprocess_p, argv);
+	if (exitcode == -1) {
+		exitcode = errno ? errno : EPIPE;
+		warning("The coprocess #%i (pid %u) failed. It will be restarted on the next call.", num, coprocess_p->pid);
+		coprocess_stop(coprocess_p, num);
+	}
+	debug(3, "The coprocess #%i returned %i.", num, exitcode);
+
+l_coprocess_call_end:
+	pthread_mutex_lock(&coprocesses_mutex);
+	coprocess_p->busy = 0;
+	pthread_cond_signal(&coprocesses_cond);
+	pthread_mutex_unlock(&coprocesses_mutex);
+	return exitcode;
+}
+
+void coprocess_deinit(ctx_t *ctx_p) {
+	int i;
+
+	if (coprocesses == NULL)
+		return;
+
+	i = 0;
+	while (i < coprocesses_count) {
+		coprocess_stop(&coprocesses[i], i);
+		i++;
+	}
+
+	free(coprocesses);
+	coprocesses       = NULL;
+	coprocesses_count = 0;
+	return;
+}
+
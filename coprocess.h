@@ -0,0 +1,29 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __CLSYNC_COPROCESS_H
+#define __CLSYNC_COPROCESS_H
+
+extern int  coprocess_init(struct ctx *ctx_p);
+extern int  coprocess_call(struct ctx *ctx_p, char **argv, int *child_pid);
+extern void coprocess_deinit(struct ctx *ctx_p);
+
+#endif
+
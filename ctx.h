@@ -128,6 +128,15 @@ enum flags_enum {
 	CANCEL_SYSCALLS		= 44|OPTION_LONGOPTONLY,
 	EXITONSYNCSKIP		= 45|OPTION_LONGOPTONLY,
 	DETACH_IPC		= 46|OPTION_LONGOPTONLY,
+	INOTIFYRING		= 47|OPTION_LONGOPTONLY,
+	MARKTHREADS		= 48|OPTION_LONGOPTONLY,
+	RENAMEEVENTS		= 49|OPTION_LONGOPTONLY,
+	WATCHBUDGET		= 50|OPTION_LONGOPTONLY,
+	FILEINFOSNAPSHOT	= 51|OPTION_LONGOPTONLY,
+	WALKTHREADS		= 52|OPTION_LONGOPTONLY,
+	INITSYNCJOURNAL		= 53|OPTION_LONGOPTONLY,
+	HANDLERWORKERS		= 54|OPTION_LONGOPTONLY,
+	SHARDS			= 55|OPTION_LONGOPTONLY,
 };
 typedef enum flags_enum flags_t;
 
@@ -209,8 +218,8 @@ struct rule {
 typedef struct rule rule_t;
 
 struct queueinfo {
-	unsigned int 	collectdelay;
-	time_t		stime;
+	unsigned int 	collectdelay;	// in milliseconds
+	uint64_t	stime;		// CLOCK_MONOTONIC, in milliseconds
 };
 typedef struct queueinfo queueinfo_t;
 
@@ -226,6 +235,7 @@ struct notifyenginefuncts {
 	int (*wait)(struct ctx *ctx_p, struct indexes *indexes_p, struct timeval *tv_p);
 	int (*handle)(struct ctx *ctx_p, struct indexes *indexes_p);
 	int (*add_watch_dir)(struct ctx *ctx_p, struct indexes *indexes_p, const char *const accpath);
+	int (*fd)(struct ctx *ctx_p);	// optional: a pollable descriptor to wait on instead of calling wait()
 };
 
 enum shflags {
@@ -331,6 +341,8 @@ struct ctx {
 	char *statusfile;
 	char *socketpath;
 	char *dump_path;
+	char *fileinfo_snapshot;
+	char *initsync_journal;
 #ifdef CGROUP_SUPPORT
 	char *cg_groupname;
 #endif
@@ -365,10 +377,10 @@ struct ctx {
 	struct notifyenginefuncts notifyenginefunct;
 	int retries;
 	size_t bfilethreshold;
-	unsigned int syncdelay;
+	unsigned int syncdelay;		// in milliseconds
 	queueinfo_t _queues[QUEUE_MAX];	// TODO: remove this from here
 	unsigned int rsyncinclimit;
-	time_t synctime;
+	uint64_t synctime;		// CLOCK_MONOTONIC, in milliseconds
 	unsigned int synctimeout;
 	sigset_t *sigset;
 	char isignoredexitcode[(1<<8)];
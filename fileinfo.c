@@ -0,0 +1,191 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+    
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include "malloc.h"
+#include "error.h"
+#include "fileinfo.h"
+
+#include <stddef.h>
+
+#define FILEINFO_FIELD(bit, field) {offsetof(stat64_t, field), 0, sizeof(((stat64_t *)0)->field), bit}
+
+static const struct fileinfo_field fileinfo_fields[] = {
+	FILEINFO_FIELD(STAT_FIELD_DEV,		st_dev),
+	FILEINFO_FIELD(STAT_FIELD_INO,		st_ino),
+	FILEINFO_FIELD(STAT_FIELD_MODE,		st_mode),
+	FILEINFO_FIELD(STAT_FIELD_NLINK,	st_nlink),
+	FILEINFO_FIELD(STAT_FIELD_UID,		st_uid),
+	FILEINFO_FIELD(STAT_FIELD_GID,		st_gid),
+	FILEINFO_FIELD(STAT_FIELD_RDEV,		st_rdev),
+	FILEINFO_FIELD(STAT_FIELD_SIZE,		st_size),
+	FILEINFO_FIELD(STAT_FIELD_BLKSIZE,	st_blksize),
+	FILEINFO_FIELD(STAT_FIELD_BLOCKS,	st_blocks),
+	FILEINFO_FIELD(STAT_FIELD_ATIME,	st_atime),
+	FILEINFO_FIELD(STAT_FIELD_MTIME,	st_mtime),
+	FILEINFO_FIELD(STAT_FIELD_CTIME,	st_ctime),
+};
+
+#undef FILEINFO_FIELD
+
+fileinfo_store_t *fileinfo_store_new(uint32_t mask) {
+	fileinfo_store_t *store = xcalloc(1, sizeof(*store));
+	size_t i = 0;
+
+	store->mask = mask;
+	while (i < sizeof(fileinfo_fields)/sizeof(*fileinfo_fields)) {
+		const struct fileinfo_field *field = &fileinfo_fields[i++];
+		if (!(mask & field->bit))
+			continue;
+
+		struct fileinfo_field *field_rec = &store->fields[store->fields_count++];
+		memcpy(field_rec, field, sizeof(*field_rec));
+		field_rec->rec_offset = store->recsize;
+		store->recsize += field->size;
+	}
+
+	// The freed records are chained through their first bytes
+	if (store->recsize < sizeof(fileinfo_t *))
+		store->recsize = sizeof(fileinfo_t *);
+
+	store->tree = pathtree_new();
+
+	debug(3, "mask == 0x%x; record size == %zu", mask, store->recsize);
+	return store;
+}
+
+void fileinfo_store_free(fileinfo_store_t *store) {
+	if (store == NULL)
+		return;
+
+	pathtree_free(store->tree);
+
+	while (store->slab_count)
+		free(store->slab[--store->slab_count]);
+	free(store->slab);
+
+	free(store);
+	return;
+}
+
+static inline fileinfo_t *fileinfo_rec_alloc(fileinfo_store_t *store) {
+	fileinfo_t *finfo = store->rec_free;
+
+	if (finfo != NULL) {
+		memcpy(&store->rec_free, finfo, sizeof(store->rec_free));
+		return finfo;
+	}
+
+	size_t block = store->rec_used / FILEINFO_SLAB_RECORDS;
+	if (block >= store->slab_count) {
+		store->slab = xrealloc(store->slab, (store->slab_count+1) * sizeof(*store->slab));
+		store->slab[store->slab_count++] = xmalloc(FILEINFO_SLAB_RECORDS * store->recsize);
+	}
+
+	finfo = (fileinfo_t *)&store->slab[block][(store->rec_used % FILEINFO_SLAB_RECORDS) * store->recsize];
+	store->rec_used++;
+
+	return finfo;
+}
+
+static inline void fileinfo_rec_free(fileinfo_store_t *store, fileinfo_t *finfo) {
+	memcpy(finfo, &store->rec_free, sizeof(store->rec_free));
+	store->rec_free = finfo;
+	return;
+}
+
+void fileinfo_set(fileinfo_store_t *store, fileinfo_t *finfo, stat64_t *lstat_p) {
+	int i = 0;
+	while (i < store->fields_count) {
+		struct fileinfo_field *field = &store->fields[i++];
+		memcpy(&((char *)finfo)[field->rec_offset], &((char *)lstat_p)[field->stat_offset], field->size);
+	}
+
+	return;
+}
+
+// Return: STAT_FIELD_* bits of the remembered fields that differ from "lstat_p"
+
+uint32_t fileinfo_diff(fileinfo_store_t *store, fileinfo_t *finfo, stat64_t *lstat_p) {
+	uint32_t difference = 0;
+	int i = 0;
+
+	while (i < store->fields_count) {
+		struct fileinfo_field *field = &store->fields[i++];
+		if (memcmp(&((char *)finfo)[field->rec_offset], &((char *)lstat_p)[field->stat_offset], field->size))
+			difference |= field->bit;
+	}
+
+	return difference;
+}
+
+fileinfo_t *fileinfo_add(fileinfo_store_t *store, const char *path, stat64_t *lstat_p) {
+	fileinfo_t *finfo = fileinfo_lookup(store, path);
+
+	if (finfo == NULL) {
+		finfo = fileinfo_rec_alloc(store);
+		pathtree_set(store->tree, path, 0, finfo);
+	}
+
+	fileinfo_set(store, finfo, lstat_p);
+	return finfo;
+}
+
+// Return: 0 on success, ENOENT if there's no information about the path
+
+int fileinfo_remove(fileinfo_store_t *store, const char *path) {
+	void *finfo;
+
+	if (!pathtree_remove(store->tree, path, &finfo))
+		return ENOENT;
+
+	fileinfo_rec_free(store, finfo);
+	return 0;
+}
+
+static int fileinfo_forget_entry(const char *path, uint32_t flags, void *finfo, void *store_p) {
+	fileinfo_rec_free(store_p, finfo);
+	return 0;
+}
+
+// Forgets the information about "path" and everything under it
+
+void fileinfo_remove_subtree(fileinfo_store_t *store, const char *path) {
+	pathtree_remove_subtree(store->tree, path, fileinfo_forget_entry, store);
+	return;
+}
+
+// Moves the information about "path_old" and everything under it to be
+// under "path_new" (the information about "path_new" and everything under
+// it is forgotten). It costs a descent to both paths, not a scan of the store.
+// Return: 0 on success, ENOENT if there's no information about "path_old"
+// or anything under it, EINVAL if one of the paths is under another one
+
+int fileinfo_rename(fileinfo_store_t *store, const char *path_old, const char *path_new) {
+	return pathtree_move(store->tree, path_old, path_new, fileinfo_forget_entry, store);
+}
+
+// Return: approximate bytes allocated by the store (the slab and the trie)
+
+size_t fileinfo_memsize(fileinfo_store_t *store) {
+	return sizeof(*store)
+		+ store->slab_count * (FILEINFO_SLAB_RECORDS * store->recsize + sizeof(*store->slab))
+		+ pathtree_memsize(store->tree);
+}
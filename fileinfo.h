@@ -0,0 +1,84 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+    
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLSYNC_FILEINFO_H
+#define __CLSYNC_FILEINFO_H
+
+#include "pathtree.h"
+
+// Remembered stat() information about files for "--modification-signature".
+// Only the fields selected by the signature mask are stored: every record is
+// a packed blob of these fields in a slab. The records are indexed by a path
+// trie, so the common path prefixes are stored once and a renamed directory
+// is moved with its whole subtree in one step.
+
+typedef struct fileinfo fileinfo_t;	// a record in the slab, opaque
+
+struct fileinfo_store {
+	uint32_t	  mask;		// STAT_FIELD_*
+	size_t		  recsize;
+	int		  fields_count;
+	struct fileinfo_field {
+		size_t	  stat_offset;
+		size_t	  rec_offset;
+		size_t	  size;
+		uint32_t  bit;
+	} fields[16];
+
+	char		**slab;		// blocks of FILEINFO_SLAB_RECORDS records
+	size_t		  slab_count;
+	size_t		  rec_used;	// records handed out from the slab (including the freed ones)
+	fileinfo_t	 *rec_free;	// the freed records are chained through their first bytes
+
+	pathtree_t	 *tree;		// path -> record
+};
+typedef struct fileinfo_store fileinfo_store_t;
+
+extern fileinfo_store_t *fileinfo_store_new(uint32_t mask);
+extern void        fileinfo_store_free(fileinfo_store_t *store);
+extern fileinfo_t *fileinfo_add(fileinfo_store_t *store, const char *path, stat64_t *lstat_p);
+extern void        fileinfo_set(fileinfo_store_t *store, fileinfo_t *finfo, stat64_t *lstat_p);
+extern uint32_t    fileinfo_diff(fileinfo_store_t *store, fileinfo_t *finfo, stat64_t *lstat_p);
+extern int         fileinfo_remove(fileinfo_store_t *store, const char *path);
+extern void        fileinfo_remove_subtree(fileinfo_store_t *store, const char *path);
+extern int         fileinfo_rename(fileinfo_store_t *store, const char *path_old, const char *path_new);
+extern size_t      fileinfo_memsize(fileinfo_store_t *store);
+
+static inline fileinfo_t *fileinfo_lookup(fileinfo_store_t *store, const char *path) {
+	void *finfo;
+
+	if (!pathtree_get(store->tree, path, NULL, &finfo))
+		return NULL;
+
+	return (fileinfo_t *)finfo;
+}
+
+// Calls "funct(path, 0, finfo, arg)" for every remembered file (sorted by
+// the path components)
+
+static inline void fileinfo_foreach(fileinfo_store_t *store, pathtree_funct_t funct, void *arg) {
+	pathtree_foreach(store->tree, funct, arg);
+}
+
+static inline size_t fileinfo_count(fileinfo_store_t *store) {
+	return pathtree_count(store->tree);
+}
+
+#endif
+
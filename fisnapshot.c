@@ -0,0 +1,407 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+    
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include "malloc.h"
+#include "error.h"
+#include "fisnapshot.h"
+
+static int fisnapshot_drop_pending_entry(const char *path, uint32_t flags, void *data, void *store_p) {
+	fileinfo_store_t *store = store_p;
+
+	if (flags & (EVIF_RECURSIVELY | EVIF_CONTENTRECURSIVELY)) {
+		fileinfo_remove_subtree(store, path);
+		return 1;
+	}
+
+	fileinfo_remove(store, path);
+	return 0;
+}
+
+// Forgets the states of the "pending" objects (and of the ones under the
+// recursive entries of "pending"): their new states could be not synced, yet
+
+void fisnapshot_drop_pending(fileinfo_store_t *store, pathtree_t *pending) {
+	pathtree_foreach(pending, fisnapshot_drop_pending_entry, store);
+	return;
+}
+
+// Writes the remembered states of the files to "path" atomically. The trie
+// of the store is written as is, so nothing is copied but the order of the
+// nodes.
+// Return: 0 on success, errno on fail
+
+int fisnapshot_write(fileinfo_store_t *store, const char *path) {
+	struct fisnapshot_header header;
+	struct pathtree_node **order;
+	size_t order_count, i;
+	int ret = 0;
+
+	// Breadth-first order: the children of every node get contiguous numbers
+
+	size_t order_alloc = ALLOC_PORTION;
+	order       = xmalloc(order_alloc * sizeof(*order));
+	order[0]    = &store->tree->root;
+	order_count = 1;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, FISNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = FISNAPSHOT_VERSION;
+	header.mask    = store->mask;
+	header.recsize = store->recsize;
+
+	i = 0;
+	while (i < order_count) {
+		struct pathtree_node *node = order[i++];
+
+		if (node->child_count) {
+			if (order_count + node->child_count > order_alloc) {
+				while (order_count + node->child_count > order_alloc)
+					order_alloc <<= 1;
+				order = xrealloc(order, order_alloc * sizeof(*order));
+			}
+			memcpy(&order[order_count], node->child, node->child_count * sizeof(*order));
+			order_count += node->child_count;
+		}
+
+		header.labels_size += node->label_len;
+		if (node->isset)
+			header.recs_count++;
+	}
+
+	if (order_count > UINT32_MAX) {
+		error("Too many entries to be saved: %zu.", order_count);
+		ret = EFBIG;
+		goto l_fisnapshot_write_end;
+	}
+	header.nodes_count = order_count;
+
+	size_t path_tmp_len = strlen(path);
+	char  *path_tmp     = alloca(path_tmp_len + sizeof(".tmp"));
+	memcpy(path_tmp, path, path_tmp_len);
+	memcpy(&path_tmp[path_tmp_len], ".tmp", sizeof(".tmp"));
+
+	FILE *f = fopen(path_tmp, "w");
+	if (f == NULL) {
+		ret = errno;
+		error("Cannot open \"%s\" for writing.", path_tmp);
+		goto l_fisnapshot_write_end;
+	}
+
+	int werr = (fwrite(&header, sizeof(header), 1, f) != 1);
+
+	// The nodes
+	{
+		uint64_t label_off   = 0;
+		uint32_t child_first = 1;
+		uint32_t rec         = 0;
+
+		i = 0;
+		while (!werr && i < order_count) {
+			struct pathtree_node  *node = order[i++];
+			struct fisnapshot_node snode;
+
+			snode.label_off   = label_off;
+			snode.label_len   = node->label_len;
+			snode.child_first = child_first;
+			snode.child_count = node->child_count;
+			snode.rec         = node->isset ? ++rec : 0;
+
+			label_off   += node->label_len;
+			child_first += node->child_count;
+
+			werr = (fwrite(&snode, sizeof(snode), 1, f) != 1);
+		}
+	}
+
+	// The records
+	i = 0;
+	while (!werr && i < order_count) {
+		struct pathtree_node *node = order[i++];
+		if (node->isset)
+			werr = (fwrite(node->data, store->recsize, 1, f) != 1);
+	}
+
+	// The labels
+	i = 0;
+	while (!werr && i < order_count) {
+		struct pathtree_node *node = order[i++];
+		if (node->label_len)
+			werr = (fwrite(node->label, node->label_len, 1, f) != 1);
+	}
+
+	if (werr || fflush(f) || fsync(fileno(f))) {
+		ret = errno ? errno : EIO;
+		error("Cannot write to \"%s\".", path_tmp);
+		fclose(f);
+		unlink(path_tmp);
+		goto l_fisnapshot_write_end;
+	}
+
+	if (fclose(f)) {
+		ret = errno;
+		error("Cannot close \"%s\".", path_tmp);
+		unlink(path_tmp);
+		goto l_fisnapshot_write_end;
+	}
+
+	if (rename(path_tmp, path)) {
+		ret = errno;
+		error("Cannot rename \"%s\" to \"%s\".", path_tmp, path);
+		unlink(path_tmp);
+		goto l_fisnapshot_write_end;
+	}
+
+	debug(1, "Saved %u file states to \"%s\".", header.recs_count, path);
+
+l_fisnapshot_write_end:
+	free(order);
+	return ret;
+}
+
+// Writes the snapshot from a child process. The child has a copy-on-write
+// image of the store, so the store is neither copied nor locked, and the
+// event loop doesn't wait for the disk. The result is the exit code of the
+// child: 0 on success, errno on fail.
+// Return: the pid of the child, -1 on fail
+
+pid_t fisnapshot_write_fork(fileinfo_store_t *store, const char *path, pathtree_t *pending) {
+	pid_t pid = fork();
+
+	switch (pid) {
+		case -1:
+			error("Cannot fork() to save the snapshot \"%s\".", path);
+			return -1;
+		case 0:
+			fisnapshot_drop_pending(store, pending);
+			_exit(fisnapshot_write(store, path));
+	}
+
+	debug(2, "Saving the snapshot \"%s\" by pid %u.", path, pid);
+	return pid;
+}
+
+// Maps the snapshot "path" if it's compatible with the store
+// Return: the snapshot, or NULL if there's no compatible snapshot
+
+fisnapshot_t *fisnapshot_open(fileinfo_store_t *store, const char *path) {
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			debug(1, "There's no snapshot \"%s\", yet.", path);
+		} else {
+			warning("Cannot open the snapshot \"%s\".", path);
+		}
+		return NULL;
+	}
+
+	if (fstat(fd, &st)) {
+		warning("Cannot fstat() the snapshot \"%s\".", path);
+		close(fd);
+		return NULL;
+	}
+
+	if ((size_t)st.st_size < sizeof(struct fisnapshot_header)) {
+		warning("The snapshot \"%s\" is truncated. Ignoring it.", path);
+		close(fd);
+		return NULL;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		warning("Cannot mmap() the snapshot \"%s\".", path);
+		return NULL;
+	}
+
+	struct fisnapshot_header *header = map;
+	if (memcmp(header->magic, FISNAPSHOT_MAGIC, sizeof(header->magic)) || header->version != FISNAPSHOT_VERSION) {
+		warning("\"%s\" is not a snapshot of this version. Ignoring it.", path);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	if (header->mask != store->mask || header->recsize != store->recsize) {
+		warning("The snapshot \"%s\" was saved with another \"--modification-signature\". Ignoring it.", path);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	uint64_t size_expected = sizeof(*header) +
+		(uint64_t)header->nodes_count * sizeof(struct fisnapshot_node) +
+		(uint64_t)header->recs_count  * header->recsize +
+		header->labels_size;
+
+	if (!header->nodes_count || size_expected != (uint64_t)st.st_size) {
+		warning("The snapshot \"%s\" is corrupted. Ignoring it.", path);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	fisnapshot_t *snapshot = xcalloc(1, sizeof(*snapshot));
+	snapshot->map      = map;
+	snapshot->map_size = st.st_size;
+	snapshot->header   = header;
+	snapshot->nodes    = (struct fisnapshot_node *)&header[1];
+	snapshot->recs     = (char *)&snapshot->nodes[header->nodes_count];
+	snapshot->labels   = &snapshot->recs[(size_t)header->recs_count * header->recsize];
+	snapshot->visited  = xcalloc(header->recs_count + 1, sizeof(*snapshot->visited));
+
+	madvise(map, st.st_size, MADV_WILLNEED);
+
+	debug(1, "Loaded %u file states from \"%s\".", header->recs_count, path);
+	return snapshot;
+}
+
+static inline int fisnapshot_node_isvalid(fisnapshot_t *snapshot, struct fisnapshot_node *node) {
+	struct fisnapshot_header *header = snapshot->header;
+
+	return	node->label_off + node->label_len <= header->labels_size &&
+		(uint64_t)node->child_first + node->child_count <= header->nodes_count &&
+		node->rec <= header->recs_count;
+}
+
+// Return: the remembered state of "path" (the record is marked as visited), NULL if there's no one
+
+fileinfo_t *fisnapshot_lookup(fisnapshot_t *snapshot, const char *path) {
+	struct fisnapshot_node *node = snapshot->nodes;
+	size_t len = strlen(path);
+
+	while (len) {
+		if (!fisnapshot_node_isvalid(snapshot, node))
+			return NULL;
+
+		size_t comp_len = pathtree_complen(path, len);
+		size_t l = node->child_first, r = (size_t)node->child_first + node->child_count;
+		struct fisnapshot_node *child = NULL;
+
+		while (l < r) {
+			size_t m = (l + r) / 2;
+			struct fisnapshot_node *cur = &snapshot->nodes[m];
+			const char *label = &snapshot->labels[cur->label_off];
+			int rc = pathtree_compcmp(label, pathtree_complen(label, cur->label_len), path, comp_len);
+
+			if (!rc) {
+				child = cur;
+				break;
+			}
+
+			if (rc < 0)
+				l = m + 1;
+			else
+				r = m;
+		}
+
+		if (child == NULL || !fisnapshot_node_isvalid(snapshot, child))
+			return NULL;
+
+		const char *label = &snapshot->labels[child->label_off];
+		if (child->label_len > len || memcmp(label, path, child->label_len))
+			return NULL;
+
+		if (child->label_len == len) {
+			len = 0;
+		} else {
+			if (path[child->label_len] != '/')
+				return NULL;
+			path += child->label_len + 1;
+			len  -= child->label_len + 1;
+		}
+
+		node = child;
+	}
+
+	if (!node->rec)
+		return NULL;
+
+	if (!snapshot->visited[node->rec]) {
+		snapshot->visited[node->rec] = 1;
+		snapshot->visited_count++;
+	}
+
+	return (fileinfo_t *)&snapshot->recs[(size_t)(node->rec - 1) * snapshot->header->recsize];
+}
+
+static int fisnapshot_foreach_unvisited_node(fisnapshot_t *snapshot, struct fisnapshot_node *node, char **path_p, size_t *path_size_p, size_t path_len, fisnapshot_funct_t funct, void *arg) {
+	int rc;
+
+	if (!fisnapshot_node_isvalid(snapshot, node))
+		return 0;
+
+	if (node->label_len) {
+		size_t len = path_len + (path_len != 0) + node->label_len;
+
+		if (*path_size_p < len + 1) {
+			*path_size_p = len + 1 + ALLOC_PORTION;
+			*path_p      = xrealloc(*path_p, *path_size_p);
+		}
+
+		if (path_len)
+			(*path_p)[path_len++] = '/';
+		memcpy(&(*path_p)[path_len], &snapshot->labels[node->label_off], node->label_len);
+		path_len += node->label_len;
+	}
+	(*path_p)[path_len] = 0;
+
+	if (node->rec && !snapshot->visited[node->rec])
+		if ((rc = funct(*path_p, arg)))
+			return rc;
+
+	uint32_t i = 0;
+	while (i < node->child_count) {
+		if ((rc = fisnapshot_foreach_unvisited_node(snapshot, &snapshot->nodes[node->child_first + i++], path_p, path_size_p, path_len, funct, arg)))
+			return rc;
+	}
+
+	return 0;
+}
+
+// Calls "funct" for every remembered path that was not looked up (the
+// objects that disappeared while clsync was not running)
+// Return: 0 or the return value of "funct" that stopped the loop
+
+int fisnapshot_foreach_unvisited(fisnapshot_t *snapshot, fisnapshot_funct_t funct, void *arg) {
+	size_t path_size = ALLOC_PORTION;
+	char  *path      = xmalloc(path_size);
+
+	if (snapshot->visited_count >= snapshot->header->recs_count) {
+		free(path);
+		return 0;
+	}
+
+	int rc = fisnapshot_foreach_unvisited_node(snapshot, snapshot->nodes, &path, &path_size, 0, funct, arg);
+
+	free(path);
+	return rc;
+}
+
+void fisnapshot_close(fisnapshot_t *snapshot) {
+	if (snapshot == NULL)
+		return;
+
+	munmap(snapshot->map, snapshot->map_size);
+	free(snapshot->visited);
+	free(snapshot);
+
+	return;
+}
+
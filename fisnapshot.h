@@ -0,0 +1,77 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+    
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLSYNC_FISNAPSHOT_H
+#define __CLSYNC_FISNAPSHOT_H
+
+#include "fileinfo.h"
+#include "pathtree.h"
+
+// An on-disk snapshot of the fileinfo store for "--fileinfo-snapshot". The
+// file is memory-mapped on start: it's a path trie stored breadth-first
+// (so the children of a node are contiguous and sorted) followed by the
+// records of the store and the labels of the nodes.
+
+#define FISNAPSHOT_MAGIC	"clsyncFS"
+#define FISNAPSHOT_VERSION	1
+
+struct fisnapshot_header {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	mask;		// STAT_FIELD_* of the records
+	uint32_t	recsize;
+	uint32_t	nodes_count;
+	uint32_t	recs_count;
+	uint32_t	reserved;
+	uint64_t	labels_size;
+};
+
+struct fisnapshot_node {
+	uint64_t	label_off;
+	uint32_t	label_len;	// the label is one or more path components (see pathtree.h)
+	uint32_t	child_first;
+	uint32_t	child_count;
+	uint32_t	rec;		// the record number + 1, 0 if the node is not an entry
+};
+
+struct fisnapshot {
+	void			 *map;
+	size_t			  map_size;
+	struct fisnapshot_header *header;
+	struct fisnapshot_node	 *nodes;
+	char			 *recs;
+	char			 *labels;
+	uint8_t			 *visited;	// by the record number
+	size_t			  visited_count;
+};
+typedef struct fisnapshot fisnapshot_t;
+
+// Return: non-zero to stop
+typedef int (*fisnapshot_funct_t)(const char *path, void *arg);
+
+extern void          fisnapshot_drop_pending(fileinfo_store_t *store, pathtree_t *pending);
+extern int           fisnapshot_write(fileinfo_store_t *store, const char *path);
+extern pid_t         fisnapshot_write_fork(fileinfo_store_t *store, const char *path, pathtree_t *pending);
+extern fisnapshot_t *fisnapshot_open(fileinfo_store_t *store, const char *path);
+extern fileinfo_t   *fisnapshot_lookup(fisnapshot_t *snapshot, const char *path);
+extern int           fisnapshot_foreach_unvisited(fisnapshot_t *snapshot, fisnapshot_funct_t funct, void *arg);
+extern void          fisnapshot_close(fisnapshot_t *snapshot);
+
+#endif
+
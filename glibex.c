@@ -53,6 +53,14 @@ GHashTable *g_hash_table_dup(GHashTable *src, GHashFunc hash_funct, GEqualFunc k
 	return dst;
 }
 
+// Return: approximate bytes of the table itself (without its keys and values).
+// GLib keeps a hash, a key and a value for every slot, and a table is
+// kept at least a quarter full
+
+size_t g_hash_table_memsize(GHashTable *ht) {
+	return g_hash_table_size(ht) * 2 * (sizeof(guint) + 2*sizeof(gpointer));
+}
+
 gboolean g_tree_dup_item(gpointer k, gpointer v, gpointer arg_gp) {
 	GTree *bt_dst		= ((struct keyvalue_copy_arg *)arg_gp)->bt_dst;
 	GDupFunc k_dup_funct	= ((struct keyvalue_copy_arg *)arg_gp)->k_dup_funct;
@@ -25,62 +25,210 @@
 #include "common.h"
 #include "error.h"
 #include "malloc.h"
+#include "pathtree.h"
+#include "strmap.h"
+#include "fileinfo.h"
+#include "fisnapshot.h"
+
+struct rename {
+	char		*fpath_old;
+	char		*fpath_new;
+	eventobjtype_t	 objtype;
+	uint32_t	 evmask;
+};
+typedef struct rename rename_t;
+
+// A watched directory. The slots are stored in an array indexed by the
+// watching descriptor: the descriptors are small, mostly growing integers
 
-struct fileinfo {
-	stat64_t lstat;
+struct wdslot {
+	char		*fpath;		// NULL if the slot is not used
+	size_t		 fpath_len;
 };
-typedef struct fileinfo fileinfo_t;
+typedef struct wdslot wdslot_t;
 
 struct indexes {
-	GHashTable *wd2fpath_ht;			// watching descriptor -> file path
-	GHashTable *fpath2wd_ht;			// file path -> watching descriptor
-	GHashTable *fpath2ei_ht;			// file path -> event information
-	GHashTable *exc_fpath_ht;			// excluded file path
-	GHashTable *exc_fpath_coll_ht[QUEUE_MAX];	// excluded file path aggregation hashtable for every queue
-	GHashTable *fpath2ei_coll_ht[QUEUE_MAX];	// "file path -> event information" aggregation hashtable for every queue
-	GHashTable *out_lines_aggr_ht;			// output lines aggregation hashtable
-	GHashTable *nonthreaded_syncing_fpath2ei_ht;	// events that are synchronized in signle-mode (non threaded)
-	GHashTable *fileinfo_ht;			// to search "fileinfo" structures (that contains secondary sorts of things about any files/dirs)
+	wdslot_t   *wdslots;				// watching descriptor -> file path
+	int         wdslots_alloc;
+	int         wdslots_used;
+	int        *wdfree;				// released watching descriptors to be reused (see indexes_wd_unused())
+	size_t      wdfree_count;
+	size_t      wdfree_alloc;
+	pathtree_t *fpath2wd_tree;			// file path (without the leading slashes) -> watching descriptor
+	strmap_t   *fpath2ei_ht;			// file path -> event information
+	pathtree_t *exc_fpath_tree;			// excluded file path
+	strmap_t   *exc_fpath_coll_ht[QUEUE_MAX];	// excluded file path -> flags aggregation hashtable for every queue
+	strmap_t   *fpath2ei_coll_ht[QUEUE_MAX];	// "file path -> event information" aggregation hashtable for every queue
+	strmap_t   *out_lines_aggr_ht;			// output line -> flags aggregation hashtable
+	strmap_t   *nonthreaded_syncing_fpath2ei_ht;	// events that are synchronized in signle-mode (non threaded)
+	fileinfo_store_t *fileinfo;			// to search "fileinfo" records (the fields of stat() selected by "--modification-signature" about any files/dirs)
+	fisnapshot_t *fisnapshot;			// the "--fileinfo-snapshot" of the previous run (until the initial sync is done)
+	rename_t   *renames;				// renames to be passed to the sync handler before other events (in order of appearance)
+	size_t      renames_count;
+	size_t      renames_alloc;
+	pathtree_t *renames_waiting;			// the paths of the renames waiting for the sync threads (see sync_renames_islocked())
+	pathtree_t *renames_lockset;			// the paths of the renames passed to the sync handler, to be locked by its thread
 #ifdef CLUSTER_SUPPORT
 	GHashTable *nodenames_ht;			// node_name -> node_id
 #endif
 };
 typedef struct indexes indexes_t;
 
+static inline wdslot_t *indexes_wdslot(indexes_t *indexes_p, int wd) {
+	// Negative descriptors become huge and are rejected by the same check
+	if ((unsigned int)wd >= (unsigned int)indexes_p->wdslots_alloc)
+		return NULL;
+
+	wdslot_t *wdslot = &indexes_p->wdslots[wd];
+	return wdslot->fpath == NULL ? NULL : wdslot;
+}
+
+// Return: count of watched directories
+
+static inline int indexes_wdcount(indexes_t *indexes_p) {
+	return indexes_p->wdslots_used;
+}
+
+// Calls "funct(GINT_TO_POINTER(wd), fpath, arg)" for every watched directory
+
+static inline void indexes_wd_foreach(indexes_t *indexes_p, GHFunc funct, gpointer arg) {
+	int wd = 0;
+	while (wd < indexes_p->wdslots_alloc) {
+		wdslot_t *wdslot = &indexes_p->wdslots[wd];
+		if (wdslot->fpath != NULL)
+			funct(GINT_TO_POINTER(wd), wdslot->fpath, arg);
+		wd++;
+	}
+
+	return;
+}
+
+// Return: a watching descriptor that is not used, for the monitors that
+// choose the descriptors themselves
+
+static inline int indexes_wd_unused(indexes_t *indexes_p) {
+	while (indexes_p->wdfree_count) {
+		int wd = indexes_p->wdfree[--indexes_p->wdfree_count];
+		if (indexes_wdslot(indexes_p, wd) == NULL)
+			return wd;
+	}
+
+	int wd = indexes_p->wdslots_alloc;
+	while (wd > 0 && indexes_p->wdslots[wd-1].fpath == NULL)
+		wd--;
+
+	return wd ? wd : 1;	// starting from 1 as inotify does
+}
+
+// The paths are absolute, but the trie is keyed by the path components
+// (see pathtree.h), so the leading slashes are skipped
+
+static inline const char *indexes_fpath2wd_key(const char *fpath) {
+	while (*fpath == '/')
+		fpath++;
+
+	return fpath;
+}
+
+// Frees the slot of the watching descriptor (its path should be already
+// removed from "fpath2wd_tree")
+
+static inline void indexes_wdslot_clear(indexes_t *indexes_p, int wd) {
+	wdslot_t *wdslot = &indexes_p->wdslots[wd];
+
+	free(wdslot->fpath);
+	memset(wdslot, 0, sizeof(*wdslot));
+	indexes_p->wdslots_used--;
+
+	if (indexes_p->wdfree_count >= indexes_p->wdfree_alloc) {
+		indexes_p->wdfree_alloc += ALLOC_PORTION;
+		indexes_p->wdfree        = xrealloc(indexes_p->wdfree, indexes_p->wdfree_alloc * sizeof(*indexes_p->wdfree));
+	}
+	indexes_p->wdfree[indexes_p->wdfree_count++] = wd;
+
+	return;
+}
+
+// Frees the slot of the watching descriptor and forgets its path
+
+static inline void indexes_wdslot_release(indexes_t *indexes_p, int wd) {
+	pathtree_remove(indexes_p->fpath2wd_tree, indexes_fpath2wd_key(indexes_p->wdslots[wd].fpath), NULL);
+	indexes_wdslot_clear(indexes_p, wd);
+	return;
+}
+
+static inline void indexes_wdslots_free(indexes_t *indexes_p) {
+	int wd = 0;
+	while (wd < indexes_p->wdslots_alloc)
+		free(indexes_p->wdslots[wd++].fpath);
+
+	free(indexes_p->wdslots);
+	free(indexes_p->wdfree);
+	indexes_p->wdslots       = NULL;
+	indexes_p->wdslots_alloc = 0;
+	indexes_p->wdslots_used  = 0;
+	indexes_p->wdfree        = NULL;
+	indexes_p->wdfree_count  = 0;
+	indexes_p->wdfree_alloc  = 0;
+
+	return;
+}
+
+// Composes the path of "name" in the watched directory "wdslot" (or of the
+// directory itself if "name" is NULL) into *buf_p, the buffer is grown if required
+// Return: the length of the path
+
+static inline size_t indexes_wdslot_fpath(wdslot_t *wdslot, const char *name, size_t name_len, char **buf_p, size_t *buf_size_p) {
+	size_t len = wdslot->fpath_len + ((name != NULL) ? name_len + 1 : 0);
+
+	if (*buf_size_p < len + 1) {
+		*buf_size_p = len + 1;
+		*buf_p      = xrealloc(*buf_p, *buf_size_p);
+	}
+
+	memcpy(*buf_p, wdslot->fpath, wdslot->fpath_len);
+	if (name != NULL) {
+		(*buf_p)[wdslot->fpath_len] = '/';
+		memcpy(&(*buf_p)[wdslot->fpath_len + 1], name, name_len);
+	}
+	(*buf_p)[len] = 0;
+
+	return len;
+}
+
 // Removes necessary rows from hash_tables if some watching descriptor closed
 // Return: 0 on success, non-zero on fail
 
 static inline int indexes_remove_bywd(indexes_t *indexes_p, int wd) {
-	int ret=0;
-
-	char *fpath = g_hash_table_lookup(indexes_p->wd2fpath_ht, GINT_TO_POINTER(wd));
-
-	ret |= g_hash_table_remove(indexes_p->wd2fpath_ht, GINT_TO_POINTER(wd));
-	if(fpath == NULL) {
+	if (indexes_wdslot(indexes_p, wd) == NULL) {
 		error("Cannot remove from index \"fpath2wd\" by wd %i.", wd);
 		return -1;
 	}
-	ret |= g_hash_table_remove(indexes_p->fpath2wd_ht, fpath);
 
-	return ret;
+	indexes_wdslot_release(indexes_p, wd);
+	return 0;
 }
 
 // Lookups file path by watching descriptor from hash_tables
 // Return: file path on success, NULL on fail
 
 static inline char *indexes_wd2fpath(indexes_t *indexes_p, int wd) {
-	return g_hash_table_lookup(indexes_p->wd2fpath_ht, GINT_TO_POINTER(wd));
+	if ((unsigned int)wd >= (unsigned int)indexes_p->wdslots_alloc)
+		return NULL;
+
+	return indexes_p->wdslots[wd].fpath;
 }
 
 // Lookups watching descriptor by file path from hash_tables
 // Return: watching descriptor on success, -1 on fail
 
 static inline int indexes_fpath2wd(indexes_t *indexes_p, const char *fpath) {
-	gpointer gint_p = g_hash_table_lookup(indexes_p->fpath2wd_ht, fpath);
-	if(gint_p == NULL)
+	void *wd_p;
+
+	if (!pathtree_get(indexes_p->fpath2wd_tree, indexes_fpath2wd_key(fpath), NULL, &wd_p))
 		return -1;
 
-	return GPOINTER_TO_INT(gint_p);
+	return GPOINTER_TO_INT(wd_p);
 }
 
 // Adds necessary rows to hash_tables if some watching descriptor opened
@@ -89,104 +237,246 @@ static inline int indexes_fpath2wd(indexes_t *indexes_p, const char *fpath) {
 static inline int indexes_add_wd(indexes_t *indexes_p, int wd, const char *fpath_const, size_t fpathlen) {
 	debug(4, "indexes_add_wd(indexes_p, %i, \"%s\", %i)", wd, fpath_const, fpathlen);
 
+	if (wd < 0) {
+		error("Invalid watching descriptor %i of \"%s\".", wd, fpath_const);
+		return EINVAL;
+	}
+
+	if (wd >= indexes_p->wdslots_alloc) {
+		int alloc = indexes_p->wdslots_alloc ? indexes_p->wdslots_alloc : ALLOC_PORTION;
+		while (alloc <= wd)
+			alloc *= 2;
+
+		indexes_p->wdslots = xrealloc(indexes_p->wdslots, alloc * sizeof(*indexes_p->wdslots));
+		memset(&indexes_p->wdslots[indexes_p->wdslots_alloc], 0, (alloc - indexes_p->wdslots_alloc) * sizeof(*indexes_p->wdslots));
+		indexes_p->wdslots_alloc = alloc;
+	}
+
+	// The descriptor is reused by the kernel
+	if (indexes_p->wdslots[wd].fpath != NULL) {
+		debug(3, "Forgetting the old path \"%s\" of wd %i", indexes_p->wdslots[wd].fpath, wd);
+		indexes_wdslot_release(indexes_p, wd);
+	}
+
 	char *fpath = xmalloc(fpathlen+1);
 	memcpy(fpath, fpath_const, fpathlen+1);
 
-	g_hash_table_insert(indexes_p->wd2fpath_ht, GINT_TO_POINTER(wd), fpath);
-	g_hash_table_insert(indexes_p->fpath2wd_ht, fpath, GINT_TO_POINTER(wd));
+	// The path could be watched by another (stale) descriptor
+	int wd_stale = indexes_fpath2wd(indexes_p, fpath);
+	if (wd_stale != -1) {
+		debug(3, "Forgetting stale wd %i of \"%s\"", wd_stale, fpath);
+		indexes_wdslot_clear(indexes_p, wd_stale);
+	}
+
+	pathtree_set(indexes_p->fpath2wd_tree, indexes_fpath2wd_key(fpath), 0, GINT_TO_POINTER(wd));
+
+	wdslot_t *wdslot  = &indexes_p->wdslots[wd];
+	wdslot->fpath     = fpath;
+	wdslot->fpath_len = fpathlen;
+	indexes_p->wdslots_used++;
+
+	return 0;
+}
+
+struct indexes_rename_wd_arg {
+	int	*wds;
+	size_t	 wds_count;
+	size_t	 wds_alloc;
+};
+
+static inline int indexes_rename_wd_collect(const char *fpath, uint32_t flags, void *wd_p, void *arg_v) {
+	struct indexes_rename_wd_arg *arg_p = arg_v;
+
+	if (arg_p->wds_count >= arg_p->wds_alloc) {
+		arg_p->wds_alloc += ALLOC_PORTION;
+		arg_p->wds        = xrealloc(arg_p->wds, arg_p->wds_alloc * sizeof(*arg_p->wds));
+	}
+	arg_p->wds[arg_p->wds_count++] = GPOINTER_TO_INT(wd_p);
+
+	return 0;
+}
+
+// Rewrites paths of the directory "fpath_old" and all it's subdirectories in
+// the watching descriptors' indexes to be under "fpath_new" (the directory
+// is renamed, so the watching descriptors are still valid). Only the
+// subtrees of both paths are visited, not every watched directory.
+// Return: count of rewritten rows
+
+static inline int indexes_rename_wd(indexes_t *indexes_p, const char *fpath_old, const char *fpath_new) {
+	struct indexes_rename_wd_arg moved = {0}, stale = {0};
+	size_t fpath_old_len = strlen(fpath_old);
+	size_t fpath_new_len = strlen(fpath_new);
+
+	pathtree_foreach_subtree(indexes_p->fpath2wd_tree, indexes_fpath2wd_key(fpath_old), indexes_rename_wd_collect, &moved);
+	if (!moved.wds_count)
+		return 0;
+
+	// The objects by the new path are replaced with the rename
+	if (pathtree_move(indexes_p->fpath2wd_tree, indexes_fpath2wd_key(fpath_old), indexes_fpath2wd_key(fpath_new), indexes_rename_wd_collect, &stale)) {
+		free(moved.wds);
+		return 0;
+	}
+
+	size_t i = 0;
+	while (i < stale.wds_count) {
+		int wd_stale = stale.wds[i++];
+		debug(3, "Forgetting stale wd %i of \"%s\"", wd_stale, indexes_p->wdslots[wd_stale].fpath);
+		indexes_wdslot_clear(indexes_p, wd_stale);
+	}
+
+	i = 0;
+	while (i < moved.wds_count) {
+		int       wd     = moved.wds[i++];
+		wdslot_t *wdslot = &indexes_p->wdslots[wd];
+		size_t fpath_rest_len = wdslot->fpath_len - fpath_old_len;
+
+		char *fpath_renamed = xmalloc(fpath_new_len + fpath_rest_len + 1);
+		memcpy(fpath_renamed, fpath_new, fpath_new_len);
+		memcpy(&fpath_renamed[fpath_new_len], &wdslot->fpath[fpath_old_len], fpath_rest_len+1);
+
+		debug(4, "wd %i: \"%s\" -> \"%s\"", wd, wdslot->fpath, fpath_renamed);
 
+		free(wdslot->fpath);
+		wdslot->fpath     = fpath_renamed;
+		wdslot->fpath_len = fpath_new_len + fpath_rest_len;
+	}
+
+	free(stale.wds);
+	free(moved.wds);
+	return moved.wds_count;
+}
+
+// Remembers the rename to pass it to the sync handler
+// Return: 0 on success, non-zero on fail
+
+static inline int indexes_rename_add(indexes_t *indexes_p, const char *fpath_old, const char *fpath_new, eventobjtype_t objtype, uint32_t evmask) {
+	if (indexes_p->renames_count >= indexes_p->renames_alloc) {
+		indexes_p->renames_alloc += ALLOC_PORTION;
+		indexes_p->renames        = xrealloc(indexes_p->renames, indexes_p->renames_alloc * sizeof(*indexes_p->renames));
+	}
+
+	rename_t *rename_p = &indexes_p->renames[indexes_p->renames_count++];
+	rename_p->fpath_old = strdup(fpath_old);
+	rename_p->fpath_new = strdup(fpath_new);
+	rename_p->objtype   = objtype;
+	rename_p->evmask    = evmask;
+
+	debug(3, "indexes_rename_add(indexes_p, \"%s\", \"%s\", %i). It's now %zu renames collected.", fpath_old, fpath_new, objtype, indexes_p->renames_count);
 	return 0;
 }
 
+static inline void indexes_renames_cleanup(indexes_t *indexes_p) {
+	while (indexes_p->renames_count) {
+		rename_t *rename_p = &indexes_p->renames[--indexes_p->renames_count];
+		free(rename_p->fpath_old);
+		free(rename_p->fpath_new);
+	}
+	return;
+}
+
 static inline eventinfo_t *indexes_fpath2ei(indexes_t *indexes_p, const char *fpath) {
-	return (eventinfo_t *)g_hash_table_lookup(indexes_p->fpath2ei_ht, fpath);
+	return (eventinfo_t *)strmap_lookup(indexes_p->fpath2ei_ht, fpath);
 }
 
-static inline int indexes_fpath2ei_add(indexes_t *indexes_p, char *fpath, eventinfo_t *evinfo) {
+// Returns the event information of "fpath" to be filled (zeroed if "*isnew_p" is set)
+
+static inline eventinfo_t *indexes_fpath2ei_add(indexes_t *indexes_p, const char *fpath, size_t fpath_len, strmap_hash_t hash, int *isnew_p) {
 	debug(5, "\"%s\"", fpath);
-	g_hash_table_replace(indexes_p->fpath2ei_ht, fpath, evinfo);
+	return (eventinfo_t *)strmap_insert_hashed(indexes_p->fpath2ei_ht, fpath, fpath_len, hash, isnew_p);
+}
 
-	return 0;
+static inline void indexes_fpath2ei_clear(indexes_t *indexes_p) {
+	strmap_clear(indexes_p->fpath2ei_ht);
+	return;
 }
 
-static inline int indexes_queueevent(indexes_t *indexes_p, char *fpath, eventinfo_t *evinfo, queue_id_t queue_id) {
+static inline eventinfo_t *indexes_queueevent(indexes_t *indexes_p, const char *fpath, size_t fpath_len, strmap_hash_t hash, queue_id_t queue_id, int *isnew_p) {
+	eventinfo_t *evinfo = strmap_insert_hashed(indexes_p->fpath2ei_coll_ht[queue_id], fpath, fpath_len, hash, isnew_p);
 
-	g_hash_table_replace(indexes_p->fpath2ei_coll_ht[queue_id], fpath, evinfo);
+	debug(3, "indexes_queueevent(indexes_p, \"%s\", evinfo, %i). It's now %zu events collected in queue %i.", fpath, queue_id, strmap_count(indexes_p->fpath2ei_coll_ht[queue_id]), queue_id);
+	return evinfo;
+}
 
-	debug(3, "indexes_queueevent(indexes_p, \"%s\", evinfo, %i). It's now %i events collected in queue %i.", fpath, queue_id, g_hash_table_size(indexes_p->fpath2ei_coll_ht[queue_id]), queue_id);
-	return 0;
+static inline void indexes_queueclear(indexes_t *indexes_p, queue_id_t queue_id) {
+	strmap_clear(indexes_p->fpath2ei_coll_ht[queue_id]);
+	return;
 }
 
 static inline eventinfo_t *indexes_lookupinqueue(indexes_t *indexes_p, const char *fpath, queue_id_t queue_id) {
-	return (eventinfo_t *)g_hash_table_lookup(indexes_p->fpath2ei_coll_ht[queue_id], fpath);
+	return (eventinfo_t *)strmap_lookup(indexes_p->fpath2ei_coll_ht[queue_id], fpath);
 }
 
-static inline int indexes_queuelen(indexes_t *indexes_p, queue_id_t queue_id) {
-	return g_hash_table_size(indexes_p->fpath2ei_coll_ht[queue_id]);
+static inline eventinfo_t *indexes_lookupinqueue_hashed(indexes_t *indexes_p, const char *fpath, size_t fpath_len, strmap_hash_t hash, queue_id_t queue_id) {
+	return (eventinfo_t *)strmap_lookup_hashed(indexes_p->fpath2ei_coll_ht[queue_id], fpath, fpath_len, hash);
 }
 
-static inline int indexes_removefromqueue(indexes_t *indexes_p, char *fpath, queue_id_t queue_id) {
-//	debug(3, "indexes_removefromqueue(indexes_p, \"%s\", %i).", fpath, queue_id);
+static inline int indexes_queuelen(indexes_t *indexes_p, queue_id_t queue_id) {
+	return strmap_count(indexes_p->fpath2ei_coll_ht[queue_id]);
+}
 
-	g_hash_table_remove(indexes_p->fpath2ei_coll_ht[queue_id], fpath);
+static inline int indexes_removefromqueue_hashed(indexes_t *indexes_p, const char *fpath, size_t fpath_len, strmap_hash_t hash, queue_id_t queue_id) {
+	strmap_remove_hashed(indexes_p->fpath2ei_coll_ht[queue_id], fpath, fpath_len, hash);
 
-	debug(3, "indexes_removefromqueue(indexes_p, \"%s\", %i). It's now %i events collected in queue %i.", fpath, queue_id, g_hash_table_size(indexes_p->fpath2ei_coll_ht[queue_id]), queue_id);
+	debug(3, "indexes_removefromqueue(indexes_p, \"%s\", %i). It's now %zu events collected in queue %i.", fpath, queue_id, strmap_count(indexes_p->fpath2ei_coll_ht[queue_id]), queue_id);
 	return 0;
 }
 
-static inline int indexes_addexclude(indexes_t *indexes_p, char *fpath, eventinfo_flags_t flags, queue_id_t queue_id) {
-	g_hash_table_replace(indexes_p->exc_fpath_coll_ht[queue_id], fpath, GINT_TO_POINTER(flags));
+static inline int indexes_addexclude(indexes_t *indexes_p, const char *fpath, eventinfo_flags_t flags, queue_id_t queue_id) {
+	int isnew;
+	*(eventinfo_flags_t *)strmap_insert(indexes_p->exc_fpath_coll_ht[queue_id], fpath, &isnew) = flags;
 
-	debug(3, "indexes_addexclude(indexes_p, \"%s\", %i). It's now %i events collected in queue %i.", fpath, queue_id, g_hash_table_size(indexes_p->exc_fpath_coll_ht[queue_id]), queue_id);
+	debug(3, "indexes_addexclude(indexes_p, \"%s\", %i). It's now %zu events collected in queue %i.", fpath, queue_id, strmap_count(indexes_p->exc_fpath_coll_ht[queue_id]), queue_id);
 	return 0;
 }
 
-static inline int indexes_addexclude_aggr(indexes_t *indexes_p, char *fpath, eventinfo_flags_t flags) {
+static inline int indexes_addexclude_aggr(indexes_t *indexes_p, const char *fpath, eventinfo_flags_t flags) {
 	debug(3, "indexes_addexclude_aggr(indexes_p, \"%s\", %u).", fpath, flags);
 
-	gpointer flags_gp = g_hash_table_lookup(indexes_p->exc_fpath_ht, fpath);
-	if(flags_gp != NULL)
-		flags |= GPOINTER_TO_INT(flags_gp);
+	uint32_t flags_old;
+	if(pathtree_get(indexes_p->exc_fpath_tree, fpath, &flags_old, NULL))
+		flags |= flags_old;
 
 	// Removing extra flags
 	if((flags&(EVIF_RECURSIVELY | EVIF_CONTENTRECURSIVELY)) == (EVIF_RECURSIVELY | EVIF_CONTENTRECURSIVELY))
 		flags &= ~EVIF_CONTENTRECURSIVELY;
 
-	g_hash_table_replace(indexes_p->exc_fpath_ht, fpath, GINT_TO_POINTER(flags));
+	pathtree_set(indexes_p->exc_fpath_tree, fpath, flags, NULL);
 
 	debug(3, "indexes_addexclude_aggr(indexes_p, \"%s\", flags): %u.", fpath, flags);
 	return 0;
 }
 
-static inline int indexes_outaggr_add(indexes_t *indexes_p, char *outline, eventinfo_flags_t flags) {
-	gpointer flags_gp = g_hash_table_lookup(indexes_p->out_lines_aggr_ht, outline);
-	if(flags_gp != NULL)
-		flags |= GPOINTER_TO_INT(flags_gp);
+static inline int indexes_outaggr_add(indexes_t *indexes_p, const char *outline, eventinfo_flags_t flags) {
+	int isnew;
+	eventinfo_flags_t *flags_p = strmap_insert(indexes_p->out_lines_aggr_ht, outline, &isnew);
+	if(!isnew)
+		flags |= *flags_p;
 
 	// Removing extra flags
 	if((flags&(EVIF_RECURSIVELY | EVIF_CONTENTRECURSIVELY)) == (EVIF_RECURSIVELY | EVIF_CONTENTRECURSIVELY))
 		flags &= ~EVIF_CONTENTRECURSIVELY;
 
-	g_hash_table_replace(indexes_p->out_lines_aggr_ht, outline, GINT_TO_POINTER(flags));
+	*flags_p = flags;
 
 	debug(3, "indexes_outaggr_aggr(indexes_p, \"%s\").", outline);
 	return 0;
 }
 
 static inline fileinfo_t *indexes_fileinfo(indexes_t *indexes_p, const char *fpath) {
-	return (fileinfo_t *)g_hash_table_lookup(indexes_p->fileinfo_ht, fpath);
+	return fileinfo_lookup(indexes_p->fileinfo, fpath);
 }
 
-static inline int indexes_fileinfo_add(indexes_t *indexes_p, const char *fpath_const, fileinfo_t *fi) {
-	size_t fpathlen = strlen(fpath_const);
-	debug(4, "indexes_add_wd(indexes_p, \"%s\", %p)", fpath_const, fpathlen);
+static inline int indexes_fileinfo_add(indexes_t *indexes_p, const char *fpath, stat64_t *lstat_p) {
+	debug(4, "indexes_fileinfo_add(indexes_p, \"%s\", %p)", fpath, lstat_p);
 
-	char *fpath = xmalloc(fpathlen+1);
-	memcpy(fpath, fpath_const, fpathlen+1);
+	fileinfo_add(indexes_p->fileinfo, fpath, lstat_p);
+	return 0;
+}
 
-	g_hash_table_insert(indexes_p->fileinfo_ht, fpath, fi);
+static inline int indexes_fileinfo_remove(indexes_t *indexes_p, const char *fpath) {
+	debug(4, "indexes_fileinfo_remove(indexes_p, \"%s\")", fpath);
 
-	return 0;
+	return fileinfo_remove(indexes_p->fileinfo, fpath);
 }
 
 #endif
@@ -144,6 +144,7 @@ static const struct option long_options[] =
 	{"lists-dir",		required_argument,	NULL,	OUTLISTSDIR},
 	{"have-recursive-sync",	optional_argument,	NULL,	HAVERECURSIVESYNC},
 	{"synclist-simplify",	optional_argument,	NULL,	SYNCLISTSIMPLIFY},
+	{"rename-events",	optional_argument,	NULL,	RENAMEEVENTS},
 	{"auto-add-rules-w",	optional_argument,	NULL,	AUTORULESW},
 	{"rsync-inclimit",	required_argument,	NULL,	RSYNCINCLIMIT},
 	{"rsync-prefer-include",optional_argument,	NULL,	RSYNCPREFERINCLUDE},
@@ -159,8 +160,18 @@ static const struct option long_options[] =
 	{"verbose",		optional_argument,	NULL,	VERBOSE},
 	{"debug",		optional_argument,	NULL,	DEBUG},
 	{"dump-dir",		required_argument,	NULL,	DUMPDIR},
+	{"fileinfo-snapshot",	required_argument,	NULL,	FILEINFOSNAPSHOT},
+	{"walk-threads",	required_argument,	NULL,	WALKTHREADS},
+	{"initsync-journal",	required_argument,	NULL,	INITSYNCJOURNAL},
+	{"handler-workers",	required_argument,	NULL,	HANDLERWORKERS},
+	{"shards",		required_argument,	NULL,	SHARDS},
 	{"quiet",		optional_argument,	NULL,	QUIET},
 	{"monitor",		required_argument,	NULL,	MONITOR},
+#ifdef INOTIFY_SUPPORT
+	{"inotify-ring",	optional_argument,	NULL,	INOTIFYRING},
+	{"mark-threads",	required_argument,	NULL,	MARKTHREADS},
+	{"watch-budget",	optional_argument,	NULL,	WATCHBUDGET},
+#endif
 	{"label",		required_argument,	NULL,	LABEL},
 	{"help",		optional_argument,	NULL,	HELP},
 	{"version",		optional_argument,	NULL,	SHOW_VERSION},
@@ -516,6 +527,9 @@ int version() {
 #ifdef GETMNTENT_SUPPORT
 		" -DGETMNTENT_SUPPORT"
 #endif
+#ifdef EPOLL_SUPPORT
+		" -DEPOLL_SUPPORT"
+#endif
 #ifdef UNSHARE_SUPPORT
 		" -DUNSHARE_SUPPORT"
 #endif
@@ -808,6 +822,32 @@ static int synchandler_arg1(char *arg, size_t arg_len, void *_ctx_p) {
 	return synchandler_arg(arg, arg_len, _ctx_p, SHARGS_INITIAL);
 }
 
+/**
+ * @brief 			Parses a delay given in seconds (fractions are allowed: "0.2")
+ *
+ * @param[in] 	arg 		The value
+ * @param[out] 	delay_p 	Pointer to the delay in milliseconds
+ *
+ * @retval	zero 		Successfully parsed
+ * @retval	non-zero 	Got error, while parsing (see errno)
+ *
+ */
+static int parse_delay(const char *arg, unsigned int *delay_p) {
+	char *end;
+	double delay;
+
+	errno = 0;
+	delay = strtod(arg, &end);
+	if (errno || (end == arg) || (*end) || (delay < 0) || (delay * 1000 >= COLLECTDELAY_INSTANT)) {
+		errno = EINVAL;
+		error("Invalid delay value: \"%s\" (expected a number of seconds, e.g. \"30\" or \"0.2\")", arg);
+		return EINVAL;
+	}
+
+	*delay_p = (unsigned int)(delay * 1000 + 0.5);
+	return 0;
+}
+
 int parse_customsignals(ctx_t *ctx_p, char *arg) {
 	char *ptr = arg, *start = arg;
 	unsigned int signal;
@@ -1334,14 +1374,11 @@ int parse_parameter(ctx_t *ctx_p, uint16_t param_id, char *arg, paramsource_t pa
 			break;
 		}
 		case SYNCDELAY: 
-			ctx_p->syncdelay		= (unsigned int)atol(arg);
-			break;
+			return parse_delay(arg, &ctx_p->syncdelay);
 		case DELAY:
-			ctx_p->_queues[QUEUE_NORMAL].collectdelay  = (unsigned int)atol(arg);
-			break;
+			return parse_delay(arg, &ctx_p->_queues[QUEUE_NORMAL].collectdelay);
 		case BFILEDELAY:
-			ctx_p->_queues[QUEUE_BIGFILE].collectdelay = (unsigned int)atol(arg);
-			break;
+			return parse_delay(arg, &ctx_p->_queues[QUEUE_BIGFILE].collectdelay);
 		case BFILETHRESHOLD:
 			ctx_p->bfilethreshold = (unsigned long)atol(arg);
 			break;
@@ -1591,6 +1628,17 @@ int parse_parameter(ctx_t *ctx_p, uint16_t param_id, char *arg, paramsource_t pa
 		case DUMPDIR:
 			ctx_p->dump_path	= arg;
 			break;
+		case FILEINFOSNAPSHOT:
+			ctx_p->fileinfo_snapshot = arg;
+			break;
+		case INITSYNCJOURNAL:
+			ctx_p->initsync_journal = arg;
+			break;
+#ifdef INOTIFY_SUPPORT
+		case INOTIFYRING:
+			ctx_p->flags[INOTIFYRING] = (arg == NULL) ? INOTIFY_RINGSIZE_NOVALUE : atoi(arg);
+			break;
+#endif
 		case MODE: {
 			char *value;
 
@@ -1768,6 +1816,25 @@ int configs_parse(ctx_t *ctx_p, paramsource_t paramsource) {
 	return 0;
 }
 
+#ifdef INOTIFY_SUPPORT
+// Return: fs.inotify.max_user_watches on success, -1 on fail
+
+static int watchbudget_kernellimit() {
+	int max_user_watches = -1;
+	FILE *f = fopen(WATCHBUDGET_MAXUSERWATCHES, "r");
+
+	if (f == NULL)
+		return -1;
+
+	if (fscanf(f, "%i", &max_user_watches) != 1)
+		max_user_watches = -1;
+
+	fclose(f);
+	debug(2, "max_user_watches == %i", max_user_watches);
+	return max_user_watches;
+}
+#endif
+
 int ctx_check(ctx_t *ctx_p) {
 	int ret = 0;
 #ifdef CLUSTER_SUPPORT
@@ -2020,11 +2087,191 @@ int ctx_check(ctx_t *ctx_p) {
 		error("Option \"--synclist-simplify\" with nodes \"rsyncdirect\" and \"rsyncshell\" are incompatible.");
 	}
 
+	if (ctx_p->flags[RENAMEEVENTS]) {
+		// The handler should be able to distinguish the rename from other events
+		if (!(
+			(ctx_p->flags[MODE] == MODE_SO) ||
+			(
+				(ctx_p->flags[MODE] == MODE_DIRECT || ctx_p->flags[MODE] == MODE_SHELL) &&
+				 (ctx_p->synchandler_argf & SHFL_INCLUDE_LIST_PATH) &&
+				!ctx_p->flags[SYNCLISTSIMPLIFY]
+			)
+		)) {
+			ret = errno = EINVAL;
+			error("Option \"--rename-events\" can be used only with mode \"so\" or with list files (%%INCLUDE-LIST-PATH%%) without \"--synclist-simplify\" in modes \"direct\" and \"shell\".");
+		}
+#ifdef INOTIFY_SUPPORT
+		if (ctx_p->flags[MONITOR] != NE_INOTIFY)
+			warning("Option \"--rename-events\" has effect only with \"--monitor=inotify\".");
+#endif
+	}
+
+#ifdef INOTIFY_SUPPORT
+	if (ctx_p->flags[INOTIFYRING]) {
+		if (ctx_p->flags[MONITOR] != NE_INOTIFY) {
+			ret = errno = EINVAL;
+			error("Option \"--inotify-ring\" can be used only with \"--monitor=inotify\".");
+		}
+
+		if (ctx_p->flags[INOTIFYRING] == INOTIFY_RINGSIZE_NOVALUE)
+			ctx_p->flags[INOTIFYRING] = INOTIFY_RINGSIZE_DEFAULT;
+
+		if (ctx_p->flags[INOTIFYRING] < 0 || ctx_p->flags[INOTIFYRING] > INOTIFY_RINGSIZE_MAX) {
+			ret = errno = EINVAL;
+			error("Option \"--inotify-ring\" should be in range [0, %i].", INOTIFY_RINGSIZE_MAX);
+		}
+	}
+
+	if (ctx_p->flags[WATCHBUDGET]) {
+		if (ctx_p->flags[MONITOR] != NE_INOTIFY) {
+			ret = errno = EINVAL;
+			error("Option \"--watch-budget\" can be used only with \"--monitor=inotify\".");
+		}
+
+		// The mark threads do not evict watches
+		if (ctx_p->flags[MARKTHREADS] > 1) {
+			ret = errno = EINVAL;
+			error("Option \"--watch-budget\" cannot be used with \"--mark-threads\".");
+		}
+
+		if (ctx_p->flags[WATCHBUDGET] == 1) {	// Set without a value
+			int max_user_watches = watchbudget_kernellimit();
+			if (max_user_watches > 0)
+				ctx_p->flags[WATCHBUDGET] = (long)max_user_watches * WATCHBUDGET_KERNELSHARE / 100;
+			else {
+				ret = errno = EINVAL;
+				error("Cannot get the kernel limit of inotify watches from \""WATCHBUDGET_MAXUSERWATCHES"\", set the value of \"--watch-budget\" explicitly.");
+			}
+		}
+
+		if (ctx_p->flags[WATCHBUDGET] < 0) {
+			ret = errno = EINVAL;
+			error("Option \"--watch-budget\" should be positive.");
+		}
+	}
+#endif
+
+	if (ctx_p->fileinfo_snapshot != NULL) {
+		if (!ctx_p->flags[MODSIGN]) {
+			ret = errno = EINVAL;
+			error("Option \"--fileinfo-snapshot\" requires \"--modification-signature\".");
+		}
+
+		// The snapshot is used only if the initial sync is done object by object
+		if (ctx_p->flags[HAVERECURSIVESYNC] || (
+			(
+				(ctx_p->flags[MODE] == MODE_RSYNCDIRECT) ||
+				(ctx_p->flags[MODE] == MODE_RSYNCSHELL)  ||
+				(ctx_p->flags[MODE] == MODE_RSYNCSO)
+			) && !ctx_p->flags[RSYNCPREFERINCLUDE]
+		)) {
+			ret = errno = EINVAL;
+			error("Option \"--fileinfo-snapshot\" cannot be used with \"--have-recursive-sync\" or with \"rsync\" modes without \"--rsync-prefer-include\".");
+		}
+	}
+
+	if (ctx_p->flags[MARKTHREADS] > 1) {
+#ifdef INOTIFY_SUPPORT
+		if (ctx_p->flags[MONITOR] != NE_INOTIFY) {
+			ret = errno = EINVAL;
+			error("Option \"--mark-threads\" can be used only with \"--monitor=inotify\".");
+		}
+#endif
+		// The privileged helper serves one request at a time
+		if (ctx_p->flags[SPLITTING] != SM_OFF) {
+			ret = errno = EINVAL;
+			error("Option \"--mark-threads\" cannot be used with \"--splitting\".");
+		}
+
+		if (ctx_p->flags[MARKTHREADS] > MARKTHREADS_MAX) {
+			ret = errno = EINVAL;
+			error("Option \"--mark-threads\" should be in range [0, %i].", MARKTHREADS_MAX);
+		}
+	}
+
+	if (ctx_p->flags[WALKTHREADS]) {
+		// The walker threads read the directories by themselves, not via the privileged helper
+		if (ctx_p->flags[SPLITTING] != SM_OFF) {
+			ret = errno = EINVAL;
+			error("Option \"--walk-threads\" cannot be used with \"--splitting\".");
+		}
+
+		if (ctx_p->flags[WALKTHREADS] < 0 || ctx_p->flags[WALKTHREADS] > WALKTHREADS_MAX) {
+			ret = errno = EINVAL;
+			error("Option \"--walk-threads\" should be in range [0, %i].", WALKTHREADS_MAX);
+		}
+	}
+
+	if (ctx_p->initsync_journal != NULL) {
+		// A unit is journaled only after it's handler is finished
+		if (ctx_p->flags[THREADING]) {
+			ret = errno = EINVAL;
+			error("Conflicting options: This value of \"--threading\" cannot be used in conjunction with \"--initsync-journal\".");
+		}
+		if (ctx_p->flags[SKIPINITSYNC]) {
+			ret = errno = EINVAL;
+			error("Conflicting options: \"--skip-initialsync\" and \"--initsync-journal\" cannot be used together.");
+		}
+		if (ctx_p->flags[MAXITERATIONS]) {
+			ret = errno = EINVAL;
+			error("Conflicting options: \"--max-iterations\" and \"--initsync-journal\" cannot be used together.");
+		}
+		// The snapshot is processed in one walk of the whole directory
+		if (ctx_p->fileinfo_snapshot != NULL) {
+			ret = errno = EINVAL;
+			error("Conflicting options: \"--fileinfo-snapshot\" and \"--initsync-journal\" cannot be used together.");
+		}
+#ifdef CLUSTER_SUPPORT
+		if (ctx_p->cluster_iface != NULL) {
+			ret = errno = EINVAL;
+			error("Option \"--initsync-journal\" cannot be used with the cluster.");
+		}
+#endif
+	}
+
+	if (ctx_p->flags[HANDLERWORKERS]) {
+		// The direct modes exec rsync/cp and the "so" modes don't exec anything
+		if ((ctx_p->flags[MODE] != MODE_SIMPLE) && (ctx_p->flags[MODE] != MODE_SHELL) && (ctx_p->flags[MODE] != MODE_RSYNCSHELL)) {
+			ret = errno = EINVAL;
+			error("Option \"--handler-workers\" can be used only in modes \"simple\", \"shell\" and \"rsyncshell\".");
+		}
+		// The coprocesses are connected to clsync by sockets, so they're started by clsync itself
+		if (ctx_p->flags[SPLITTING] != SM_OFF) {
+			ret = errno = EINVAL;
+			error("Option \"--handler-workers\" cannot be used with \"--splitting\".");
+		}
+
+		if (ctx_p->flags[HANDLERWORKERS] < 0 || ctx_p->flags[HANDLERWORKERS] > HANDLERWORKERS_MAX) {
+			ret = errno = EINVAL;
+			error("Option \"--handler-workers\" should be in range [0, %i].", HANDLERWORKERS_MAX);
+		}
+	}
+
+	if (ctx_p->flags[SHARDS]) {
+		// The shards are the list files of an iteration
+		if ((ctx_p->flags[MODE] == MODE_SIMPLE) || (ctx_p->flags[MODE] == MODE_SO)) {
+			ret = errno = EINVAL;
+			error("Option \"--shards\" cannot be used in modes \"simple\" and \"so\".");
+		}
+		// The shards are synced in parallel by the threads
+		if (!ctx_p->flags[THREADING]) {
+			ret = errno = EINVAL;
+			error("Option \"--shards\" requires \"--threading\".");
+		}
+
+		if (ctx_p->flags[SHARDS] < 0 || ctx_p->flags[SHARDS] > SHARDS_MAX) {
+			ret = errno = EINVAL;
+			error("Option \"--shards\" should be in range [0, %i].", SHARDS_MAX);
+		}
+	}
+
 #ifdef FANOTIFY_SUPPORT
-	if (ctx_p->flags[MONITOR] == NE_FANOTIFY)
-		critical("fanotify is not supported, now!");
-	else
+	if ((ctx_p->flags[MONITOR] == NE_FANOTIFY) && (ctx_p->flags[SPLITTING] == SM_PROCESS)) {
+		ret = errno = EINVAL;
+		error("\"--monitor=fanotify\" cannot be used with \"--splitting=process\".");
+	}
 #endif
+
 	switch (ctx_p->flags[MONITOR]) {
 #ifdef INOTIFY_SUPPORT
 		case NE_INOTIFY:
@@ -2211,14 +2458,51 @@ int main_rehash(ctx_t *ctx_p) {
 }
 
 FILE *main_statusfile_f;
+static state_t         main_status_state_old = STATE_UNKNOWN;
+static pthread_mutex_t main_statusfile_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Rewrites the status file: the status on the first line and the memory
+// usage of the indexes (see sync_meminfo_format()) on the next lines
+
+static int main_statusfile_write(ctx_t *ctx_p, state_t state) {
+	char meminfo[BUFSIZ];
+	int  ret = 0;
+
+	sync_meminfo_format(meminfo, sizeof(meminfo), "\nmeminfo ", "");
+
+	pthread_mutex_lock(&main_statusfile_mutex);
+	if (ftruncate(fileno(main_statusfile_f), 0)) {
+		error("Cannot ftruncate() the file \"%s\".",
+			ctx_p->statusfile);
+		ret = errno;
+		goto l_main_statusfile_write_end;
+	}
+	rewind(main_statusfile_f);
+	if (fprintf(main_statusfile_f, "%s%s", status_descr[state], meminfo) <= 0) {	// TODO: check output length
+		error("Cannot write to file \"%s\".",
+			ctx_p->statusfile);
+		ret = errno;
+		goto l_main_statusfile_write_end;
+	}
+	if (fflush(main_statusfile_f)) {
+		error("Cannot fflush() on file \"%s\".",
+			ctx_p->statusfile);
+		ret = errno;
+		goto l_main_statusfile_write_end;
+	}
+
+l_main_statusfile_write_end:
+	pthread_mutex_unlock(&main_statusfile_mutex);
+	return ret;
+}
+
 int main_status_update(ctx_t *ctx_p) {
-	static state_t state_old = STATE_UNKNOWN;
-	state_t        state     = ctx_p->state;
+	state_t state = ctx_p->state;
 
 	debug(4, "%u", state);
 
-	if (state == state_old) {
-		debug(3, "State unchanged: %u == %u", state, state_old);
+	if (state == main_status_state_old) {
+		debug(3, "State unchanged: %u == %u", state, main_status_state_old);
 		return 0;
 	}
 
@@ -2235,28 +2519,18 @@ int main_status_update(ctx_t *ctx_p) {
 		return 0;
 
 	debug(3, "Setting status to %i: %s.", state, status_descr[state]);
-	state_old=state;
+	main_status_state_old=state;
 
-	int ret = 0;
+	return main_statusfile_write(ctx_p, state);
+}
 
-	if (ftruncate(fileno(main_statusfile_f), 0)) {
-		error("Cannot ftruncate() the file \"%s\".",
-			ctx_p->statusfile);
-		return errno;
-	}
-	rewind(main_statusfile_f);
-	if (fprintf(main_statusfile_f, "%s", status_descr[state]) <= 0) {	// TODO: check output length
-		error("Cannot write to file \"%s\".",
-			ctx_p->statusfile);
-		return errno;
-	}
-	if (fflush(main_statusfile_f)) {
-		error("Cannot fflush() on file \"%s\".",
-			ctx_p->statusfile);
-		return errno;
-	}
+// Rewrites the status file with the recounted memory usage of the indexes
 
-	return ret;
+int main_status_meminfo_update(ctx_t *ctx_p) {
+	if (ctx_p->statusfile == NULL || main_status_state_old == STATE_UNKNOWN)
+		return 0;
+
+	return main_statusfile_write(ctx_p, main_status_state_old);
 }
 
 int argc;
@@ -24,6 +24,7 @@ extern char *argv[];
 
 extern int main_rehash(ctx_t *ctx_p);
 extern int main_status_update(ctx_t *ctx_p);
+extern int main_status_meminfo_update(ctx_t *ctx_p);
 extern int ctx_set(ctx_t *ctx_p, const char *const parameter_name, const char *const parameter_value);
 extern int config_block_parse(ctx_t *ctx_p, const char *const config_block_name);
 extern int rules_count(ctx_t *ctx_p);
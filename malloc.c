@@ -180,6 +180,77 @@ int memory_init() {
 	return 0;
 }
 
+#define ARENA_ALIGN(size) (((size) + sizeof(void *)-1) & ~(sizeof(void *)-1))
+
+void *arena_alloc(arena_t *arena_p, size_t size) {
+	struct arena_block *block = arena_p->head;
+	debug(20, "(%p, %li)", arena_p, size);
+
+	size = ARENA_ALIGN(size);
+
+	if (block == NULL || block->size - block->used < size) {
+		// The blocks grow with the arena, so small arenas stay small
+		size_t block_size = arena_p->allocated < ARENA_BLOCK_SIZE_MIN ? ARENA_BLOCK_SIZE_MIN : arena_p->allocated;
+		if (block_size > ARENA_BLOCK_SIZE)
+			block_size = ARENA_BLOCK_SIZE;
+		if (size > block_size)
+			block_size = size;
+
+		block	     = xmalloc(sizeof(*block) + block_size);
+		block->next  = arena_p->head;
+		block->size  = block_size;
+		block->used  = 0;
+		arena_p->head       = block;
+		arena_p->allocated += block_size;
+	}
+
+	void *ret = &block->data[block->used];
+	block->used += size;
+
+#ifdef PARANOID
+	memset(ret, 0, size);
+#endif
+	return ret;
+}
+
+char *arena_strdup(arena_t *arena_p, const char *src) {
+	size_t size = strlen(src)+1;
+	char  *dst  = arena_alloc(arena_p, size);
+
+	memcpy(dst, src, size);
+	return dst;
+}
+
+// The current block is kept to not call malloc() again on the next iteration
+
+void arena_reset(arena_t *arena_p) {
+	struct arena_block *block = arena_p->head;
+	debug(15, "(%p): %li bytes", arena_p, arena_p->allocated);
+
+	if (block == NULL)
+		return;
+
+	struct arena_block *next = block->next;
+	while (next != NULL) {
+		struct arena_block *next_next = next->next;
+		free(next);
+		next = next_next;
+	}
+
+	block->next	   = NULL;
+	block->used	   = 0;
+	arena_p->allocated = block->size;
+	return;
+}
+
+void arena_free(arena_t *arena_p) {
+	arena_reset(arena_p);
+	free(arena_p->head);
+	arena_p->head	   = NULL;
+	arena_p->allocated = 0;
+	return;
+}
+
 void *shm_malloc_try(size_t size) {
 	void *ret;
 #ifdef PARANOID
@@ -17,6 +17,9 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifndef __CLSYNC_MALLOC_H
+#define __CLSYNC_MALLOC_H
+
 #include <sys/types.h>
 
 extern void *xmalloc(size_t size);
@@ -37,3 +40,25 @@ extern void shm_free(void *ptr);
 
 extern int memory_init();
 
+// A bump allocator for short-living objects that are dropped all at once:
+// the objects cannot be freed one by one, only the whole arena is reset
+
+struct arena_block {
+	struct arena_block *next;
+	size_t		    size;
+	size_t		    used;
+	char		    data[];
+};
+
+struct arena {
+	struct arena_block *head;	// the current block (the others are linked to it)
+	size_t		    allocated;	// bytes in all the blocks
+};
+typedef struct arena arena_t;
+
+extern void *arena_alloc(arena_t *arena_p, size_t size);
+extern char *arena_strdup(arena_t *arena_p, const char *src);
+extern void  arena_reset(arena_t *arena_p);
+extern void  arena_free(arena_t *arena_p);
+
+#endif
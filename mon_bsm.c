@@ -544,7 +544,7 @@ int bsm_handle_allevents(struct ctx *ctx_p, struct indexes *indexes_p, bsm_handl
 	count     = 0;
 
 #ifdef PARANOID
-	g_hash_table_remove_all(indexes_p->fpath2ei_ht);
+	indexes_fpath2ei_clear(indexes_p);
 #endif
 
 	do {
@@ -806,15 +806,8 @@ int bsm_handle_noprefetch(struct ctx *ctx_p, struct indexes *indexes_p) {
 	return bsm_handle_allevents(ctx_p, indexes_p, BSM_HANDLE_CALLWAIT);
 }
 int bsm_add_watch_dir(struct ctx *ctx_p, struct indexes *indexes_p, const char *const accpath) {
-	static int id = 1;
-	if (id == -1)
-		id = (int)((unsigned int)~0 >> 2);
-
-	// TODO: optimize this line out:
-	while (indexes_wd2fpath(indexes_p, id) != NULL)
-		id++;
-
-	return id++;
+	// The ids index a dense array, so the released ones are reused
+	return indexes_wd_unused(indexes_p);
 }
 int bsm_deinit(ctx_t *ctx_p) {
 	void *ret;
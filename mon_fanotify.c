@@ -1,62 +1,395 @@
 /*
     clsync - file tree sync utility based on inotify/kqueue
-    
+
     Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
-    
+
     This program is free software: you can redistribute it and/or modify
     it under the terms of the GNU General Public License as published by
     the Free Software Foundation, either version 3 of the License, or
     (at your option) any later version.
-    
+
     This program is distributed in the hope that it will be useful,
     but WITHOUT ANY WARRANTY; without even the implied warranty of
     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
     GNU General Public License for more details.
-    
+
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#if 0
+#include "common.h"
+#include "malloc.h"
+#include "error.h"
+#include "sync.h"
+#include "indexes.h"
+#include "mon_fanotify.h"
+
+#include <glib.h>
+
+/*
+ * The whole filesystem of the watch directory is marked once with
+ * FAN_MARK_FILESYSTEM, so no per-directory watches are required. The
+ * events are reported as "directory file handle + name"
+ * (FAN_REPORT_DFID_NAME), the handles are resolved to paths with
+ * open_by_handle_at() and the results are cached.
+ */
+
+struct fanotify_mondata {
+	int		 mount_fd;	// a descriptor on the watched filesystem for open_by_handle_at()
+	GHashTable	*handle2path_ht;
+	uint64_t	 cache_hits;
+	uint64_t	 cache_misses;
+};
+
+static struct fanotify_mondata mondata = {-1, NULL, 0, 0};
+
+struct recognize_event_return {
+	eventobjtype_t objtype_old;
+	eventobjtype_t objtype_new;
+};
+
+static inline void recognize_event(struct recognize_event_return *r, uint32_t event) {
+	eventobjtype_t type;
+	int is_created;
+	int is_deleted;
+
+	type = (event & FAN_ONDIR ? EOT_DIR : EOT_FILE);
+	is_created = event & (FAN_CREATE|FAN_MOVED_TO);
+	is_deleted = event & (FAN_DELETE_SELF|FAN_DELETE|FAN_MOVED_FROM);
+
+	debug(4, "type == %x; is_created == %x; is_deleted == %x", type, is_created, is_deleted);
+
+	r->objtype_old = (is_created ? EOT_DOESNTEXIST : type);
+	r->objtype_new = (is_deleted ? EOT_DOESNTEXIST : type);
+
+	return;
+}
+
+int fanotify_start(ctx_t *ctx_p) {
+	int fanotify_d = (int)(long)ctx_p->fsmondata;
+
+	mondata.mount_fd = open(ctx_p->watchdir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (mondata.mount_fd == -1) {
+		error("Cannot open(\"%s\", O_RDONLY|O_DIRECTORY).", ctx_p->watchdir);
+		return errno;
+	}
+
+	if (fanotify_mark(fanotify_d, FAN_MARK_ADD|FAN_MARK_FILESYSTEM, FANOTIFY_MARKMASK, AT_FDCWD, ctx_p->watchdir) == -1) {
+		error("Cannot fanotify_mark(%i, FAN_MARK_ADD|FAN_MARK_FILESYSTEM, 0x%x, AT_FDCWD, \"%s\").", fanotify_d, FANOTIFY_MARKMASK, ctx_p->watchdir);
+		return errno;
+	}
+
+	mondata.handle2path_ht = g_hash_table_new_full(g_str_hash, g_str_equal, free, free);
+
+	debug(1, "Marked the filesystem of \"%s\" (fanotify_d == %i; mount_fd == %i)", ctx_p->watchdir, fanotify_d, mondata.mount_fd);
+	return 0;
+}
+
+int fanotify_add_watch_dir(ctx_t *ctx_p, indexes_t *indexes_p, const char *const accpath) {
+	// The filesystem mark set by fanotify_start() covers all the directories
+	debug(5, "(ctx_p, indexes_p, \"%s\"): nothing to do", accpath);
+	return 0;
+}
+
+int fanotify_fd(ctx_t *ctx_p) {
+	return (int)(long)ctx_p->fsmondata;
+}
+
+int fanotify_wait(ctx_t *ctx_p, struct indexes *indexes_p, struct timeval *tv_p) {
+	int fanotify_d = (int)(long)ctx_p->fsmondata;
+
+	debug(3, "select with timeout %li secs (fd == %u).", tv_p->tv_sec, fanotify_d);
+	fd_set rfds;
+	FD_ZERO(&rfds);
+	FD_SET(fanotify_d, &rfds);
+	return select(fanotify_d+1, &rfds, NULL, NULL, tv_p);
+}
+
+static inline void fanotify_cache_invalidate() {
+	debug(3, "Dropping the handle->path cache (%u entries)", g_hash_table_size(mondata.handle2path_ht));
+	g_hash_table_remove_all(mondata.handle2path_ht);
+	return;
+}
+
+struct fanotify_cache_subtree {
+	const char	*path;
+	size_t		 path_len;
+};
+
+static gboolean fanotify_cache_isinsubtree(gpointer key_gp, gpointer path_gp, gpointer subtree_gp) {
+	struct fanotify_cache_subtree *subtree_p = subtree_gp;
+	const char *path = path_gp;
+
+	return !strncmp(path, subtree_p->path, subtree_p->path_len) && ((path[subtree_p->path_len] == '/') || (path[subtree_p->path_len] == 0));
+}
+
+// Drops the cached paths of the directory and its subdirectories only ("path" shouldn't be owned by the cache)
+
+static inline void fanotify_cache_invalidate_subtree(const char *path) {
+	struct fanotify_cache_subtree subtree = {path, strlen(path)};
+	g_hash_table_foreach_remove(mondata.handle2path_ht, fanotify_cache_isinsubtree, &subtree);
+
+	debug(3, "Dropped the entries of the handle->path cache under \"%s\"", path);
+	return;
+}
+
+/**
+ * @brief 			Resolves a directory file handle to its path (using the cache)
+ *
+ * @param[in] 	handle 		The file handle from the event
+ *
+ * @retval	char *		Pointer to the full path (owned by the cache)
+ * @retval	NULL		The directory cannot be resolved (e.g. has been already deleted)
+ *
+ */
+static const char *fanotify_handle2path(struct file_handle *handle) {
+	char key[sizeof(handle->handle_type)*2 + MAX_HANDLE_SZ*2 + 2], *key_p;
+	char link[sizeof("/proc/self/fd/") + 3*sizeof(int)];
+	char path[PATH_MAX+1];
+	const char *path_cached;
+	unsigned int i;
+	ssize_t len;
+	int fd;
+
+	if (handle->handle_bytes > MAX_HANDLE_SZ) {
+		error("Too long file handle: %u > "XTOSTR(MAX_HANDLE_SZ), handle->handle_bytes);
+		return NULL;
+	}
+
+	key_p = key + sprintf(key, "%x:", handle->handle_type);
+	for (i = 0; i < handle->handle_bytes; i++)
+		key_p += sprintf(key_p, "%02x", handle->f_handle[i]);
+
+	path_cached = g_hash_table_lookup(mondata.handle2path_ht, key);
+	if (path_cached != NULL) {
+		mondata.cache_hits++;
+		return path_cached;
+	}
+	mondata.cache_misses++;
+
+	fd = open_by_handle_at(mondata.mount_fd, handle, O_PATH|O_CLOEXEC);
+	if (fd == -1) {
+		debug(2, "Cannot open_by_handle_at(%i, {%s}): %s", mondata.mount_fd, key, strerror(errno));
+		return NULL;
+	}
+
+	sprintf(link, "/proc/self/fd/%i", fd);
+	len = readlink(link, path, PATH_MAX);
+	close(fd);
+	if (len == -1) {
+		error("Cannot readlink(\"%s\").", link);
+		return NULL;
+	}
+	path[len] = 0;
 
-int fanotify_add_watch_dir(int fanotify_d, struct ctx *ctx_p, const char *const accpath) {
-	return fanotify_mark(fanotify_d, FAN_MARK_ADD | FAN_MARK_DONT_FOLLOW,
-		FANOTIFY_MARKMASK, AT_FDCWD, accpath);
+	if (g_hash_table_size(mondata.handle2path_ht) >= FANOTIFY_HANDLECACHE_MAX)
+		fanotify_cache_invalidate();
+
+	path_cached = strdup(path);
+	g_hash_table_insert(mondata.handle2path_ht, strdup(key), (gpointer)path_cached);
+	debug(4, "{%s} -> \"%s\"", key, path_cached);
+
+	return path_cached;
 }
 
-int fanotify_loop(int fanotify_d, ctx_t *ctx_p, indexes_t *indexes_p) {
-	struct fanotify_event_metadata buf[BUFSIZ/sizeof(struct fanotify_event_metadata) + 1];
-	int state = STATE_RUNNING;
-	state_p = &state;
+struct fanotify_handle_buf {
+	char   *path_rel;
+	size_t  path_rel_len;
+	char   *path_full;
+	size_t  path_full_size;
+};
+
+static inline int fanotify_handle_event(ctx_t *ctx_p, indexes_t *indexes_p, struct fanotify_handle_buf *buf_p, struct fanotify_event_metadata *metadata) {
+	struct fanotify_event_info_fid *fid = NULL;
+	struct file_handle *handle;
+	const char *dirpath, *name;
+	uint32_t mask = metadata->mask;
 
-	while(state != STATE_EXIT) {
+	// Looking for the "directory file handle + name" record
+
+	{
+		char *ptr = (char *)metadata + metadata->metadata_len;
+		char *end = (char *)metadata + metadata->event_len;
+		while (ptr < end) {
+			struct fanotify_event_info_header *hdr = (struct fanotify_event_info_header *)ptr;
+
+			if (hdr->len == 0)
+				break;
+
+			if ((hdr->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) || (hdr->info_type == FAN_EVENT_INFO_TYPE_DFID)) {
+				fid = (struct fanotify_event_info_fid *)hdr;
+				break;
+			}
+			ptr += hdr->len;
+		}
+	}
+
+	if (fid == NULL) {
+		debug(2, "Event %p without a directory file handle. Skipping.", (void *)(long)mask);
+		return 0;
+	}
+
+	handle = (struct file_handle *)fid->handle;
+	name   = (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) ? (char *)handle->f_handle + handle->handle_bytes : ".";
+
+	dirpath = fanotify_handle2path(handle);
+	if (dirpath == NULL) {
+		debug(2, "Event %p on \"%s\" in an unresolvable directory. Skipping.", (void *)(long)mask, name);
+		return 0;
+	}
+
+	// The mark covers the whole filesystem, so skipping everything outside of the watch directory
+
+	int is_outside = strncmp(dirpath, ctx_p->watchdir, ctx_p->watchdirlen) || ((dirpath[ctx_p->watchdirlen] != '/') && (dirpath[ctx_p->watchdirlen] != 0));
+
+	debug(is_outside ? 5 : 2, "Event %p on \"%s\" (dirpath: \"%s\"; outside of the watch directory: %i).", (void *)(long)mask, name, dirpath, is_outside);
+
+	// Getting full path
+
+	size_t path_full_memreq = strlen(dirpath) + strlen(name) + 2;
+	if (buf_p->path_full_size < path_full_memreq) {
+		buf_p->path_full      = xrealloc(buf_p->path_full, path_full_memreq);
+		buf_p->path_full_size = path_full_memreq;
+	}
+
+	if (strcmp(name, "."))
+		sprintf(buf_p->path_full, "%s/%s", dirpath, name);
+	else
+		strcpy(buf_p->path_full, dirpath);
+
+	// A renamed or deleted directory makes the cached paths of its subdirectories
+	// stale (even outside of the watch directory: it may be moved into it).
+	// "dirpath" may be dropped here, so it's not used below.
+
+	if ((mask & FAN_ONDIR) && (mask & (FAN_MOVED_FROM|FAN_MOVED_TO|FAN_DELETE|FAN_DELETE_SELF|FAN_MOVE_SELF)))
+		fanotify_cache_invalidate_subtree(buf_p->path_full);
+
+	if (is_outside)
+		return 0;
+
+	// Getting infomation about file/dir/etc
+
+	struct  recognize_event_return r = {0};
+	recognize_event(&r, mask);
+
+	stat64_t lstat, *lstat_p;
+	mode_t st_mode;
+	size_t st_size;
+	if ((r.objtype_new == EOT_DOESNTEXIST) || (ctx_p->flags[CANCEL_SYSCALLS]&CSC_MON_STAT) || lstat64(buf_p->path_full, &lstat)) {
+		debug(2, "Cannot lstat64(\"%s\", lstat). Seems, that the object had been deleted (%i) or option \"--cancel-syscalls mon_stat\" (%i) is set.", buf_p->path_full, r.objtype_new == EOT_DOESNTEXIST, ctx_p->flags[CANCEL_SYSCALLS]&CSC_MON_STAT);
+		st_mode = (mask & FAN_ONDIR ? S_IFDIR : S_IFREG);
+		st_size = 0;
+		lstat_p = NULL;
+	} else {
+		st_mode = lstat.st_mode;
+		st_size = lstat.st_size;
+		lstat_p = &lstat;
+	}
+
+	if (sync_prequeue_loadmark(1, ctx_p, indexes_p, buf_p->path_full, NULL, lstat_p, r.objtype_old, r.objtype_new, mask, 0, st_mode, st_size, &buf_p->path_rel, &buf_p->path_rel_len, NULL))
+		return -1;
+
+	return 0;
+}
+
+int fanotify_handle(ctx_t *ctx_p, indexes_t *indexes_p) {
+	int fanotify_d = (int)(long)ctx_p->fsmondata;
+	struct fanotify_handle_buf hbuf = {0};
+	int count = 0, overflowed = 0;
+	char buf[BUFSIZ] __attribute__ ((aligned(__alignof__(struct fanotify_event_metadata))));
+
+#ifdef PARANOID
+	indexes_fpath2ei_clear(indexes_p);
+#endif
+
+	// fanotify_d is non-blocking (FAN_NONBLOCK), so reading until EAGAIN
+	while (1) {
 		struct fanotify_event_metadata *metadata;
-		size_t len = read(fanotify_d, (void *)buf, sizeof(buf)-sizeof(*buf));
-		metadata=buf;
-		if(len == -1) {
-			error("cannot read(%i, &metadata, sizeof(metadata)).", fanotify_d);
-			return errno;
+		ssize_t r = read(fanotify_d, buf, sizeof(buf));
+		if (r <= 0) {
+			if ((r == -1) && (errno == EAGAIN))
+				break;
+			if ((r == -1) && (errno == EINTR))
+				continue;
+
+			error("Got error while reading events from fanotify with read().");
+			count = -1;
+			goto l_fanotify_handle_end;
 		}
-		while(FAN_EVENT_OK(metadata, len)) {
-			debug(2, "metadata->pid: %i; metadata->fd: %i", metadata->pid, metadata->fd);
-			if (metadata->fd != FAN_NOFD) {
-				if (metadata->fd >= 0) {
-					char *fpath = fd2fpath_malloc(metadata->fd);
-					sync_queuesync(fpath_rel, 0, ctx_p, indexes_p, QUEUE_AUTO);
-					debug(2, "Event %i on \"%s\".", metadata->mask, fpath);
-					free(fpath);
-				}
+
+		metadata = (struct fanotify_event_metadata *)buf;
+		while (FAN_EVENT_OK(metadata, r)) {
+			if (metadata->vers != FANOTIFY_METADATA_VERSION) {
+				critical("Unsupported fanotify metadata version: %u (expected: %u)", metadata->vers, FANOTIFY_METADATA_VERSION);
+			}
+
+			if (metadata->mask & FAN_Q_OVERFLOW) {
+				warning("fanotify event queue overflowed. The whole tree will be resynced.");
+				overflowed++;
+			} else
+			if (fanotify_handle_event(ctx_p, indexes_p, &hbuf, metadata)) {
+				count = -1;
+				goto l_fanotify_handle_end;
 			}
-			close(metadata->fd);
-			metadata = FAN_EVENT_NEXT(metadata, len);
+
+			// There's no descriptor in events reported with file handles, but just in case
+			if (metadata->fd >= 0)
+				close(metadata->fd);
+
+			metadata = FAN_EVENT_NEXT(metadata, r);
+			count++;
 		}
-		int ret;
-		if((ret=sync_idle(fanotify_d, ctx_p, indexes_p))) {
-			error("got error while sync_idle().");
-			return ret;
+
+		// Globally queueing captured events:
+		// Moving events from local queue to global ones
+		sync_prequeue_unload(ctx_p, indexes_p);
+	}
+
+	if (overflowed) {
+		fanotify_cache_invalidate();
+		if (sync_initialsync(ctx_p->watchdir, ctx_p, indexes_p, INITSYNC_FULL)) {
+			error("Cannot resync the tree after fanotify queue overflow.");
+			count = -1;
 		}
 	}
-	return 0;
+
+l_fanotify_handle_end:
+	if (hbuf.path_full != NULL)
+		free(hbuf.path_full);
+
+	if (hbuf.path_rel != NULL)
+		free(hbuf.path_rel);
+
+	return count;
+}
+
+void fanotify_dump(ctx_t *ctx_p, int fd_out) {
+	if (mondata.handle2path_ht == NULL)
+		return;
+
+	dprintf(fd_out,
+		"fanotify handle cache:\n\tsize == %u\n\thits == %lu\n\tmisses == %lu\n",
+			g_hash_table_size(mondata.handle2path_ht),
+			(unsigned long)mondata.cache_hits,
+			(unsigned long)mondata.cache_misses
+		);
+	return;
+}
+
+int fanotify_deinit(ctx_t *ctx_p) {
+	int fanotify_d = (int)(long)ctx_p->fsmondata;
+
+	if (mondata.handle2path_ht != NULL) {
+		g_hash_table_destroy(mondata.handle2path_ht);
+		mondata.handle2path_ht = NULL;
+	}
+
+	if (mondata.mount_fd != -1) {
+		close(mondata.mount_fd);
+		mondata.mount_fd = -1;
+	}
+
+	debug(3, "Closing fanotify_d");
+	return close(fanotify_d);
 }
-#endif
 
@@ -17,5 +17,11 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-extern int fanotify_add_watch_dir(struct ctx *ctx_p, const char *const accpath);
+extern int fanotify_start(ctx_t *ctx_p);
+extern int fanotify_wait(struct ctx *ctx_p, struct indexes *indexes_p, struct timeval *tv_p);
+extern int fanotify_handle(struct ctx *ctx_p, struct indexes *indexes_p);
+extern int fanotify_add_watch_dir(struct ctx *ctx_p, struct indexes *indexes_p, const char *const accpath);
+extern int fanotify_fd(ctx_t *ctx_p);
+extern int fanotify_deinit(ctx_t *ctx_p);
+extern void fanotify_dump(ctx_t *ctx_p, int fd_out);
 
@@ -18,10 +18,12 @@
  */
 
 #include "common.h"
+#include "malloc.h"
 #include "error.h"
 #include "sync.h"
 #include "indexes.h"
 #include "privileged.h"
+#include "statbatch.h"
 #include "mon_inotify.h"
 
 enum event_bits {
@@ -52,14 +54,255 @@ static inline void recognize_event(struct recognize_event_return *r, uint32_t ev
 	return;
 }
 
+struct inotify_ringevent {
+	int		wd;
+	uint32_t	mask;
+	uint32_t	cookie;
+	uint32_t	len;
+	time_t		since;		// IN_Q_OVERFLOW only: events may be lost since this time
+	char		name[NAME_MAX+1];
+};
+
+/*
+ * Single-producer/single-consumer ring between inotify_reader() and
+ * inotify_handle(). "head" is written only by the reader thread and
+ * "tail" only by the main thread, so no locks are required.
+ */
+struct inotify_ring {
+	struct inotify_ringevent *event;
+	uint32_t		  size;		// power of 2
+	uint32_t		  head;
+	uint32_t		  tail;
+	uint32_t		  drained_head;	// "head" after the last read() that drained the inotify queue
+	uint32_t		  highwatermark;
+	uint64_t		  received;
+	uint64_t		  dropped;
+	uint64_t		  overflows;
+	int			  overflow_pending;
+	time_t			  overflow_since;
+	int			  notify_fd[2];	// reader -> main thread wake-ups
+	int			  stop_fd[2];	// inotify_deinit() -> reader
+	volatile int		  running;
+	pthread_t		  reader;
+};
+
+static struct inotify_ring ring = {0};
+
+#define INOTIFY_RING_DEPTH(head, tail) ((uint32_t)((head) - (tail)))
+
 int inotify_add_watch_dir(ctx_t *ctx_p, indexes_t *indexes_p, const char *const accpath) {
 	int inotify_d = (int)(long)ctx_p->fsmondata;
 	return privileged_inotify_add_watch(inotify_d, accpath, INOTIFY_MARKMASK, PC_INOTIFY_ADD_WATCH_DIR);
 }
 
+static inline int inotify_ring_push(int wd, uint32_t mask, uint32_t cookie, uint32_t len, const char *name, time_t since) {
+	uint32_t head  = ring.head;
+	uint32_t tail  = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+	uint32_t depth = INOTIFY_RING_DEPTH(head, tail);
+	struct inotify_ringevent *ev;
+
+	if (depth >= ring.size)
+		return ENOBUFS;
+
+	ev = &ring.event[head & (ring.size-1)];
+	ev->wd     = wd;
+	ev->mask   = mask;
+	ev->cookie = cookie;
+	ev->len    = len;
+	ev->since  = since;
+	if (len) {
+		// inotify pads the name with zeroes, so it may be shorter than "len"
+		size_t name_len = strnlen(name, MIN(len, NAME_MAX));
+		memcpy(ev->name, name, name_len);
+		ev->name[name_len] = 0;
+	} else
+		*ev->name = 0;
+
+	__atomic_store_n(&ring.head, head+1, __ATOMIC_RELEASE);
+
+	if (depth+1 > ring.highwatermark)
+		__atomic_store_n(&ring.highwatermark, depth+1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+static void *inotify_reader(ctx_t *ctx_p) {
+	int inotify_d = (int)(long)ctx_p->fsmondata;
+	char buf[BUFSIZ + 1];
+	// The time of the last read() that drained the queue: the events of the next reads may happen since then only
+	time_t lastdrained = 0, readtime;
+	int drained = 1;
+
+	debug(1, "started (inotify_d == %i; ring.size == %u)", inotify_d, ring.size);
+
+	while (ring.running) {
+		// inotify_d is non-blocking, so reading until the queue is drained (to
+		// report it to the main thread) and only then waiting for new events
+		if (drained) {
+			fd_set rfds;
+			FD_ZERO(&rfds);
+			FD_SET(inotify_d,       &rfds);
+			FD_SET(ring.stop_fd[0], &rfds);
+
+			if (select(MAX(inotify_d, ring.stop_fd[0])+1, &rfds, NULL, NULL, NULL) == -1) {
+				if (errno == EINTR)
+					continue;
+				error("Got error while select() on inotify_d");
+				break;
+			}
+
+			if (FD_ISSET(ring.stop_fd[0], &rfds))
+				break;
+		}
+
+		readtime = time(NULL);
+		ssize_t r = read(inotify_d, buf, BUFSIZ);
+		if (r <= 0) {
+			if (r == -1 && errno == EAGAIN && !drained) {
+				drained     = 1;
+				lastdrained = readtime;
+				__atomic_store_n(&ring.drained_head, ring.head, __ATOMIC_RELEASE);
+				if (write(ring.notify_fd[1], "", 1) == -1 && errno != EAGAIN)
+					error("Cannot write() to ring.notify_fd[1]");
+			}
+			if (r == -1 && (errno == EINTR || errno == EAGAIN))
+				continue;
+			error("Got error while reading events from inotify with read().");
+			break;
+		}
+
+		char *ptr =  buf;
+		char *end = &buf[r];
+		while (ptr < end) {
+			struct inotify_event *event = (struct inotify_event *)ptr;
+			ptr += sizeof(struct inotify_event) + event->len;
+			__atomic_fetch_add(&ring.received, 1, __ATOMIC_RELAXED);
+
+			// Kernel's way to report lost events is used for the ring too
+			if (ring.overflow_pending) {
+				if (inotify_ring_push(-1, IN_Q_OVERFLOW, 0, 0, NULL, ring.overflow_since)) {
+					__atomic_fetch_add(&ring.dropped, 1, __ATOMIC_RELAXED);
+					continue;
+				}
+				ring.overflow_pending = 0;
+			}
+
+			if (inotify_ring_push(event->wd, event->mask, event->cookie, event->len, event->name, lastdrained)) {
+				__atomic_fetch_add(&ring.dropped, 1, __ATOMIC_RELAXED);
+				// Counting overflows, not the dropped events
+				if (!ring.overflow_pending) {
+					__atomic_fetch_add(&ring.overflows, 1, __ATOMIC_RELAXED);
+					ring.overflow_pending = 1;
+					ring.overflow_since   = lastdrained;
+				}
+				continue;
+			}
+		}
+
+		// See the comment about "drained" in inotify_handle()
+		drained = (BUFSIZ - r >= sizeof(struct inotify_event) + NAME_MAX + 1);
+		if (drained) {
+			lastdrained = readtime;
+			__atomic_store_n(&ring.drained_head, ring.head, __ATOMIC_RELEASE);
+		}
+
+		if (write(ring.notify_fd[1], "", 1) == -1 && errno != EAGAIN)
+			error("Cannot write() to ring.notify_fd[1]");
+	}
+
+	debug(1, "finished");
+	ring.running = 0;
+	if (write(ring.notify_fd[1], "", 1) == -1 && errno != EAGAIN)
+		error("Cannot write() to ring.notify_fd[1]");
+	return NULL;
+}
+
+int inotify_reader_start(ctx_t *ctx_p) {
+	uint32_t size = 2;
+
+	while (size < (uint32_t)ctx_p->flags[INOTIFYRING])
+		size <<= 1;
+
+	debug(2, "ring size: %u (requested %i)", size, ctx_p->flags[INOTIFYRING]);
+
+	ring.size  = size;
+	ring.event = xcalloc(size, sizeof(*ring.event));
+
+	if (pipe2(ring.notify_fd, O_CLOEXEC|O_NONBLOCK) || pipe2(ring.stop_fd, O_CLOEXEC)) {
+		error("Cannot pipe2()");
+		return -1;
+	}
+
+	ring.running = 1;
+	if (pthread_create(&ring.reader, NULL, (void *(*)(void *))inotify_reader, ctx_p)) {
+		error("Cannot pthread_create() the inotify reader thread");
+		ring.running = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+void inotify_dump(ctx_t *ctx_p, int fd_out) {
+	if (ring.event == NULL)
+		return;
+
+	uint32_t head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+	uint32_t tail = __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE);
+
+	dprintf(fd_out,
+		"inotify ring:\n\tsize == %u\n\tdepth == %u\n\thighwatermark == %u\n\treceived == %lu\n\tdropped == %lu\n\toverflows == %lu\n",
+			ring.size,
+			INOTIFY_RING_DEPTH(head, tail),
+			__atomic_load_n(&ring.highwatermark, __ATOMIC_RELAXED),
+			(unsigned long)__atomic_load_n(&ring.received,  __ATOMIC_RELAXED),
+			(unsigned long)__atomic_load_n(&ring.dropped,   __ATOMIC_RELAXED),
+			(unsigned long)__atomic_load_n(&ring.overflows, __ATOMIC_RELAXED)
+		);
+
+	return;
+}
+
+static inline void inotify_notify_drain() {
+	char buf[BUFSIZ];
+	while (read(ring.notify_fd[0], buf, sizeof(buf)) > 0);
+	return;
+}
+
+static int inotify_wait_ring(ctx_t *ctx_p, struct indexes *indexes_p, struct timeval *tv_p) {
+	while (1) {
+		uint32_t head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+
+		if (INOTIFY_RING_DEPTH(head, ring.tail))
+			return 1;
+
+		if (!ring.running) {
+			errno = EPIPE;
+			return -1;
+		}
+
+		debug(3, "select with timeout %li secs (fd == %u).", tv_p->tv_sec, ring.notify_fd[0]);
+		fd_set rfds;
+		FD_ZERO(&rfds);
+		FD_SET(ring.notify_fd[0], &rfds);
+
+		int rc = select(ring.notify_fd[0]+1, &rfds, NULL, NULL, tv_p);
+		if (rc <= 0)
+			return rc;
+
+		// The wake-up may be stale (the events could be already consumed), so checking the ring again
+		inotify_notify_drain();
+	}
+
+	return 0;
+}
+
 int inotify_wait(ctx_t *ctx_p, struct indexes *indexes_p, struct timeval *tv_p) {
 	int inotify_d = (int)(long)ctx_p->fsmondata;
 
+	if (ring.event != NULL)
+		return inotify_wait_ring(ctx_p, indexes_p, tv_p);
+
 	debug(3, "select with timeout %li secs (fd == %u).", tv_p->tv_sec, inotify_d);
 	fd_set rfds;
 	FD_ZERO(&rfds);
@@ -67,38 +310,464 @@ int inotify_wait(ctx_t *ctx_p, struct indexes *indexes_p, struct timeval *tv_p)
 	return select(inotify_d+1, &rfds, NULL, NULL, tv_p);
 }
 
-#define INOTIFY_HANDLE_CONTINUE {\
-	ptr += sizeof(struct inotify_event) + event->len;\
-	count++;\
-	continue;\
+int inotify_fd(ctx_t *ctx_p) {
+	if (ring.event != NULL)
+		return ring.notify_fd[0];
+
+	return (int)(long)ctx_p->fsmondata;
+}
+
+struct inotify_pending {
+	const char     *path_full;	// in the "pathblock" chain
+	size_t          path_full_len;
+	int             wd;
+	uint32_t        mask;
+	eventobjtype_t  objtype_old;
+	eventobjtype_t  objtype_new;
+	ssize_t         statreq_idx;	// -1 if lstat() is not required
+	stat64_t        lstat;
+};
+
+// The paths of the pending events are copied into blocks which are reused
+// batch after batch, so coalescing does not allocate memory per event
+
+struct inotify_pathblock {
+	struct inotify_pathblock *next;
+	size_t                    used;
+	char                      data[INOTIFY_PATHBLOCK_SIZE];
+};
+
+struct inotify_handle_buf {
+	char   *path_rel;
+	size_t  path_rel_len;
+	char   *path_full;
+	size_t  path_full_size;
+	time_t  overflow_since;
+	int     overflowed;
+
+	// IN_MOVED_FROM is held until the next event to pair it with IN_MOVED_TO
+	int      movedfrom;
+	int      movedfrom_wd;
+	uint32_t movedfrom_mask;
+	uint32_t movedfrom_cookie;
+	uint32_t movedfrom_len;
+	time_t   movedfrom_since;
+	char     movedfrom_name[NAME_MAX+1];
+
+	// Events are coalesced per path and lstat()-ed in batches by inotify_handle_pending_flush()
+	GHashTable              *pending_ht;	// path_full -> index in "pending" + 1
+	struct inotify_pending  *pending;
+	size_t                   pending_count;
+	size_t                   pending_alloc;
+	statbatch_req_t         *statreq;
+	size_t                   statreq_alloc;
+	struct inotify_pathblock *pathblock_head;
+	struct inotify_pathblock *pathblock_cur;
+};
+
+static const char *inotify_pathblock_strdup(struct inotify_handle_buf *buf_p, const char *path, size_t path_len) {
+	struct inotify_pathblock *block = buf_p->pathblock_cur;
+
+	while (block == NULL || block->used + path_len + 1 > sizeof(block->data)) {
+		if (block != NULL && block->next != NULL) {
+			block = block->next;
+			block->used = 0;
+			continue;
+		}
+
+		struct inotify_pathblock *block_new = xmalloc(sizeof(*block_new));
+		block_new->next = NULL;
+		block_new->used = 0;
+
+		if (block == NULL)
+			buf_p->pathblock_head = block_new;
+		else
+			block->next = block_new;
+		block = block_new;
+	}
+	buf_p->pathblock_cur = block;
+
+	char *path_copy = &block->data[block->used];
+	memcpy(path_copy, path, path_len + 1);
+	block->used += path_len + 1;
+
+	return path_copy;
+}
+
+static inline void inotify_pathblock_reset(struct inotify_handle_buf *buf_p) {
+	buf_p->pathblock_cur = buf_p->pathblock_head;
+	if (buf_p->pathblock_cur != NULL)
+		buf_p->pathblock_cur->used = 0;
+	return;
+}
+
+// Passes the coalesced events to sync_prequeue_loadmark() in the order they came, lstat()-ing each path once
+
+static int inotify_handle_pending_flush(ctx_t *ctx_p, indexes_t *indexes_p, struct inotify_handle_buf *buf_p) {
+	size_t i, statreq_count = 0;
+	int ret = 0;
+
+	if (!buf_p->pending_count)
+		return 0;
+
+	if (buf_p->statreq_alloc < buf_p->pending_count) {
+		buf_p->statreq_alloc = buf_p->pending_alloc;
+		buf_p->statreq       = xrealloc(buf_p->statreq, buf_p->statreq_alloc * sizeof(*buf_p->statreq));
+	}
+
+	for (i = 0; i < buf_p->pending_count; i++) {
+		struct inotify_pending *p = &buf_p->pending[i];
+
+		if ((p->objtype_new == EOT_DOESNTEXIST) || (ctx_p->flags[CANCEL_SYSCALLS]&CSC_MON_STAT)) {
+			p->statreq_idx = -1;
+			continue;
+		}
+
+		statbatch_req_t *req_p = &buf_p->statreq[statreq_count];
+		req_p->path    = p->path_full;
+		req_p->lstat_p = &p->lstat;
+		p->statreq_idx = statreq_count++;
+	}
+
+	debug(3, "events on %u paths, lstat()-ing %u of them", buf_p->pending_count, statreq_count);
+
+	if (statreq_count)
+		if ((ret = statbatch_lstat(buf_p->statreq, statreq_count)))
+			goto l_inotify_handle_pending_flush_end;
+
+	for (i = 0; i < buf_p->pending_count; i++) {
+		struct inotify_pending *p = &buf_p->pending[i];
+		stat64_t *lstat_p;
+		mode_t st_mode;
+		size_t st_size;
+
+		if (p->statreq_idx == -1 || buf_p->statreq[p->statreq_idx].rc) {
+			debug(2, "Cannot lstat64(\"%s\", lstat). Seems, that the object had been deleted (%i) or option \"--cancel-syscalls mon_stat\" (%i) is set.", p->path_full, p->objtype_new == EOT_DOESNTEXIST, ctx_p->flags[CANCEL_SYSCALLS]&CSC_MON_STAT);
+			st_mode = (p->mask & IN_ISDIR ? S_IFDIR : S_IFREG);
+			st_size = 0;
+			lstat_p = NULL;
+		} else {
+			st_mode = p->lstat.st_mode;
+			st_size = p->lstat.st_size;
+			lstat_p = &p->lstat;
+		}
+
+		const char *path_rel = sync_path_abs2rel_inplace(ctx_p, p->path_full, p->path_full_len);
+
+		if (sync_prequeue_loadmark(1, ctx_p, indexes_p, p->path_full, path_rel, lstat_p, p->objtype_old, p->objtype_new, p->mask, p->wd, st_mode, st_size, &buf_p->path_rel, &buf_p->path_rel_len, NULL)) {
+			ret = -1;
+			break;
+		}
+	}
+
+l_inotify_handle_pending_flush_end:
+	buf_p->pending_count = 0;
+	g_hash_table_remove_all(buf_p->pending_ht);
+	inotify_pathblock_reset(buf_p);
+
+	return ret;
+}
+
+static int inotify_handle_pending_add(ctx_t *ctx_p, indexes_t *indexes_p, struct inotify_handle_buf *buf_p, size_t path_full_len, int wd, uint32_t mask, struct recognize_event_return *r_p) {
+	struct inotify_pending *p;
+
+	if (buf_p->pending_ht == NULL)
+		buf_p->pending_ht = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, NULL);
+
+	size_t idx = (size_t)(long)g_hash_table_lookup(buf_p->pending_ht, buf_p->path_full);
+	if (idx) {
+		p = &buf_p->pending[idx-1];
+
+		// Merging the events the same way as sync_prequeue_loadmark() merges them into one eventinfo.
+		// A directory (re)creation cannot be merged: the directory must be marked and walked.
+		if ((r_p->objtype_old == p->objtype_new) && !(r_p->objtype_new == EOT_DIR && r_p->objtype_old == EOT_DOESNTEXIST)) {
+			p->wd           = wd;
+			p->mask        |= mask;
+			p->objtype_new  = r_p->objtype_new;
+			return 0;
+		}
+
+		debug(3, "Cannot coalesce event %p on \"%s\", flushing the pending events.", (void *)(long)mask, buf_p->path_full);
+		if (inotify_handle_pending_flush(ctx_p, indexes_p, buf_p))
+			return -1;
+	}
+
+	if (buf_p->pending_count >= buf_p->pending_alloc) {
+		buf_p->pending_alloc += ALLOC_PORTION;
+		buf_p->pending        = xrealloc(buf_p->pending, buf_p->pending_alloc * sizeof(*buf_p->pending));
+	}
+
+	p = &buf_p->pending[buf_p->pending_count++];
+	p->path_full     = inotify_pathblock_strdup(buf_p, buf_p->path_full, path_full_len);
+	p->path_full_len = path_full_len;
+	p->wd            = wd;
+	p->mask          = mask;
+	p->objtype_old   = r_p->objtype_old;
+	p->objtype_new   = r_p->objtype_new;
+
+	g_hash_table_insert(buf_p->pending_ht, (char *)p->path_full, (void *)(long)buf_p->pending_count);
+	return 0;
+}
+
+static void inotify_handle_buf_free(struct inotify_handle_buf *buf_p) {
+	while (buf_p->pathblock_head != NULL) {
+		struct inotify_pathblock *block = buf_p->pathblock_head;
+		buf_p->pathblock_head = block->next;
+		free(block);
+	}
+
+	if (buf_p->pending_ht != NULL)
+		g_hash_table_destroy(buf_p->pending_ht);
+
+	free(buf_p->pending);
+	free(buf_p->statreq);
+	free(buf_p->path_full);
+	free(buf_p->path_rel);
+
+	return;
+}
+
+static int inotify_handle_event_single(ctx_t *ctx_p, indexes_t *indexes_p, struct inotify_handle_buf *buf_p, int wd, uint32_t mask, uint32_t len, const char *name, time_t since) {
+
+	// Events are lost. Remembering the oldest moment the changes could be missed since.
+
+	if (mask & IN_Q_OVERFLOW) {
+		warning("inotify event queue overflowed. Changed directories will be rescanned.");
+		if (!buf_p->overflowed || since < buf_p->overflow_since)
+			buf_p->overflow_since = since;
+		buf_p->overflowed = 1;
+		return 0;
+	}
+
+	// Removing stale wd-s
+
+	if (mask & IN_IGNORED) {
+		debug(2, "Cleaning up info about watch descriptor %i.", wd);
+		sync_watchbudget_forget(ctx_p, wd);
+		// The watch could be already forgotten if it's evicted and the directory is marked again
+		if (indexes_wd2fpath(indexes_p, wd) != NULL)
+			indexes_remove_bywd(indexes_p, wd);
+		return 0;
+	}
+
+	// Getting the directory
+
+	wdslot_t *wdslot = indexes_wdslot(indexes_p, wd);
+
+	if (wdslot == NULL) {
+		debug(2, "Event %p on stale watch (wd: %i).", (void *)(long)mask, wd);
+		return 0;
+	}
+	debug(2, "Event %p on \"%s\" (wd: %i; dir: \"%s\").", (void *)(long)mask, len>0?name:"", wd, wdslot->fpath);
+	sync_watchbudget_touch(ctx_p, wd);
+
+	// Getting full path
+
+	size_t path_full_len = indexes_wdslot_fpath(wdslot, len>0 ? name : NULL, len>0 ? strnlen(name, len) : 0, &buf_p->path_full, &buf_p->path_full_size);
+
+	// Getting infomation about file/dir/etc
+
+	struct  recognize_event_return r = {0};
+	recognize_event(&r, mask);
+
+	return inotify_handle_pending_add(ctx_p, indexes_p, buf_p, path_full_len, wd, mask, &r);
+}
+
+// Passes the held IN_MOVED_FROM as is (it's a deletion if there's no IN_MOVED_TO for it)
+
+static inline int inotify_handle_movedfrom_flush(ctx_t *ctx_p, indexes_t *indexes_p, struct inotify_handle_buf *buf_p) {
+	if (!buf_p->movedfrom)
+		return 0;
+
+	buf_p->movedfrom = 0;
+	return inotify_handle_event_single(ctx_p, indexes_p, buf_p, buf_p->movedfrom_wd, buf_p->movedfrom_mask, buf_p->movedfrom_len, buf_p->movedfrom_name, buf_p->movedfrom_since);
+}
+
+// Return: 0 if the rename is handled, 1 if it should be handled as two separate events, -1 on error
+
+static inline int inotify_handle_rename(ctx_t *ctx_p, indexes_t *indexes_p, struct inotify_handle_buf *buf_p, int wd, uint32_t mask, uint32_t len, const char *name) {
+	const char *fpath_old = indexes_wd2fpath(indexes_p, buf_p->movedfrom_wd);
+	const char *fpath_new = indexes_wd2fpath(indexes_p, wd);
+
+	if (fpath_old == NULL || fpath_new == NULL || !buf_p->movedfrom_len || !len)
+		return 1;
+
+	// The indexes are rewritten by sync_prequeue_rename(), so copying the paths
+	size_t path_old_size = strlen(fpath_old) + buf_p->movedfrom_len + 2;
+	size_t path_new_size = strlen(fpath_new) + len + 2;
+	char *path_old_full  = xmalloc(path_old_size);
+	char *path_new_full  = xmalloc(path_new_size);
+	snprintf(path_old_full, path_old_size, "%s/%s", fpath_old, buf_p->movedfrom_name);
+	snprintf(path_new_full, path_new_size, "%s/%s", fpath_new, name);
+
+	debug(2, "Rename \"%s\" -> \"%s\" (cookie: %u).", path_old_full, path_new_full, buf_p->movedfrom_cookie);
+
+	int rc = sync_prequeue_rename(ctx_p, indexes_p, path_old_full, path_new_full, mask & IN_ISDIR ? EOT_DIR : EOT_FILE, buf_p->movedfrom_mask | mask);
+
+	free(path_old_full);
+	free(path_new_full);
+	return rc;
+}
+
+static inline int inotify_handle_event(ctx_t *ctx_p, indexes_t *indexes_p, struct inotify_handle_buf *buf_p, int wd, uint32_t mask, uint32_t cookie, uint32_t len, const char *name, time_t since) {
+
+	// The kernel queues IN_MOVED_FROM and IN_MOVED_TO of a rename one right
+	// after another with the same cookie, so pairing them here
+
+	if (buf_p->movedfrom) {
+		if ((mask & IN_MOVED_TO) && (cookie == buf_p->movedfrom_cookie)) {
+			// The rename moves the queued events, so the preceding ones should be queued first
+			if (inotify_handle_pending_flush(ctx_p, indexes_p, buf_p))
+				return -1;
+
+			switch (inotify_handle_rename(ctx_p, indexes_p, buf_p, wd, mask, len, name)) {
+				case 0:
+					buf_p->movedfrom = 0;
+					return 0;
+				case -1:
+					return -1;
+			}
+		}
+
+		if (inotify_handle_movedfrom_flush(ctx_p, indexes_p, buf_p))
+			return -1;
+	}
+
+	if (mask & IN_MOVED_FROM) {
+		size_t name_len = strnlen(name, MIN(len, NAME_MAX));
+
+		buf_p->movedfrom        = 1;
+		buf_p->movedfrom_wd     = wd;
+		buf_p->movedfrom_mask   = mask;
+		buf_p->movedfrom_cookie = cookie;
+		buf_p->movedfrom_len    = name_len;
+		buf_p->movedfrom_since  = since;
+		memcpy(buf_p->movedfrom_name, name, name_len);
+		buf_p->movedfrom_name[name_len] = 0;
+		return 0;
+	}
+
+	return inotify_handle_event_single(ctx_p, indexes_p, buf_p, wd, mask, len, name, since);
+}
+
+static inline void inotify_handle_movedfrom_move(struct inotify_handle_buf *dst_p, struct inotify_handle_buf *src_p) {
+	dst_p->movedfrom        = src_p->movedfrom;
+	dst_p->movedfrom_wd     = src_p->movedfrom_wd;
+	dst_p->movedfrom_mask   = src_p->movedfrom_mask;
+	dst_p->movedfrom_cookie = src_p->movedfrom_cookie;
+	dst_p->movedfrom_len    = src_p->movedfrom_len;
+	dst_p->movedfrom_since  = src_p->movedfrom_since;
+	memcpy(dst_p->movedfrom_name, src_p->movedfrom_name, src_p->movedfrom_len+1);
+	src_p->movedfrom = 0;
+	return;
+}
+
+static int inotify_handle_ring(ctx_t *ctx_p, indexes_t *indexes_p) {
+	// IN_MOVED_FROM that is held till the next call as its pair is not read from the kernel, yet
+	static struct inotify_handle_buf movedfrom_buf = {0};
+	struct inotify_handle_buf buf = {0};
+	int count = 0;
+
+	inotify_notify_drain();
+
+	if (movedfrom_buf.movedfrom)
+		inotify_handle_movedfrom_move(&buf, &movedfrom_buf);
+
+	uint32_t head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+	uint32_t tail = ring.tail;
+
+	debug(3, "ring depth: %u (highwatermark: %u; dropped: %lu)", INOTIFY_RING_DEPTH(head, tail), __atomic_load_n(&ring.highwatermark, __ATOMIC_RELAXED), (unsigned long)__atomic_load_n(&ring.dropped, __ATOMIC_RELAXED));
+
+#ifdef PARANOID
+	indexes_fpath2ei_clear(indexes_p);
+#endif
+
+	while (tail != head) {
+		struct inotify_ringevent *ev = &ring.event[tail & (ring.size-1)];
+
+		if (inotify_handle_event(ctx_p, indexes_p, &buf, ev->wd, ev->mask, ev->cookie, ev->len, ev->name, ev->since)) {
+			count = -1;
+			break;
+		}
+
+		// Releasing the slot only after the event has been processed
+		__atomic_store_n(&ring.tail, ++tail, __ATOMIC_RELEASE);
+		count++;
+	}
+
+	// The pair of IN_MOVED_FROM may be in the next read() of the reader thread
+	// only if it hasn't drained the inotify queue after this event (the same as
+	// in inotify_handle())
+	if ((count >= 0) && buf.movedfrom) {
+		if (ring.running && (__atomic_load_n(&ring.drained_head, __ATOMIC_ACQUIRE) != tail)) {
+			debug(3, "Holding IN_MOVED_FROM till the queue is drained.");
+			inotify_handle_movedfrom_move(&movedfrom_buf, &buf);
+		} else {
+			if (inotify_handle_movedfrom_flush(ctx_p, indexes_p, &buf))
+				count = -1;
+			else
+			if (!count)
+				count++;	// The held event
+		}
+	}
+
+	if (count > 0)
+		if (inotify_handle_pending_flush(ctx_p, indexes_p, &buf))
+			count = -1;
+
+	if (count > 0 && buf.overflowed)
+		if (sync_rescan_changed(ctx_p, indexes_p, buf.overflow_since))
+			count = -1;
+
+	if (count > 0)
+		sync_prequeue_unload(ctx_p, indexes_p);
+
+	inotify_handle_buf_free(&buf);
+	return count;
 }
 
 int inotify_handle(ctx_t *ctx_p, indexes_t *indexes_p) {
-	static struct timeval tv={0};
+	// The time of the last read() that drained the queue: if the queue is
+	// overflowed, the events may be lost since then (not since the previous
+	// read(), as an overflowed queue is read by a few read()-s)
+	static time_t lastdrained = 0;
 	int inotify_d = (int)(long)ctx_p->fsmondata;
+	struct inotify_handle_buf hbuf = {0};
 
-	int count = 0;
+	if (ring.event != NULL)
+		return inotify_handle_ring(ctx_p, indexes_p);
 
-	fd_set rfds;
-	FD_ZERO(&rfds);
-	FD_SET(inotify_d, &rfds);
+	int count = 0;
+	int drained = 0;
+	time_t since = lastdrained;
 
-	char   *path_rel	= NULL;
-	size_t  path_rel_len	= 0;
-	char   *path_full	= NULL;
-	size_t  path_full_size	= 0;
-	while (select(FD_SETSIZE, &rfds, NULL, NULL, &tv)) {
+	// inotify_d is non-blocking, so reading until the queue is drained without select()-ing before each read()
+	while (!drained) {
 
 		char buf[BUFSIZ + 1];
-		size_t r = read(inotify_d, buf, BUFSIZ);
+		time_t readtime = time(NULL);
+		ssize_t r = read(inotify_d, buf, BUFSIZ);
 		if (r <= 0) {
+			if ((r == -1) && (errno == EAGAIN)) {
+				lastdrained = readtime;
+				break;
+			}
+			if ((r == -1) && (errno == EINTR))
+				continue;
+
 			error("Got error while reading events from inotify with read().");
 			count = -1;
 			goto l_inotify_handle_end;
 		}
 
+		// The kernel fills the buffer while the next event fits, so a read() leaving
+		// room for the longest event means the queue is empty. Saving a read() then.
+		drained = (BUFSIZ - r >= sizeof(struct inotify_event) + NAME_MAX + 1);
+		if (drained)
+			lastdrained = readtime;
+
 #ifdef PARANOID
-		g_hash_table_remove_all(indexes_p->fpath2ei_ht);
+		indexes_fpath2ei_clear(indexes_p);
 #endif
 
 		char *ptr =  buf;
@@ -106,62 +775,32 @@ int inotify_handle(ctx_t *ctx_p, indexes_t *indexes_p) {
 		while (ptr < end) {
 			struct inotify_event *event = (struct inotify_event *)ptr;
 
-			// Removing stale wd-s
-
-			if (event->mask & IN_IGNORED) {
-				debug(2, "Cleaning up info about watch descriptor %i.", event->wd);
-				indexes_remove_bywd(indexes_p, event->wd);
-				INOTIFY_HANDLE_CONTINUE;
-			}
-
-			// Getting path
-
-			char *fpath = indexes_wd2fpath(indexes_p, event->wd);
-
-			if (fpath == NULL) {
-				debug(2, "Event %p on stale watch (wd: %i).", (void *)(long)event->mask, event->wd);
-				INOTIFY_HANDLE_CONTINUE;
+			if (inotify_handle_event(ctx_p, indexes_p, &hbuf, event->wd, event->mask, event->cookie, event->len, event->name, since)) {
+				count = -1;
+				goto l_inotify_handle_end;
 			}
-			debug(2, "Event %p on \"%s\" (wd: %i; fpath: \"%s\").", (void *)(long)event->mask, event->len>0?event->name:"", event->wd, fpath);
-
-			// Getting full path
 
-			size_t path_full_memreq = strlen(fpath) + event->len + 2;
-			if (path_full_size < path_full_memreq) {
-				path_full      = xrealloc(path_full, path_full_memreq);
-				path_full_size = path_full_memreq;
-			}
+			ptr += sizeof(struct inotify_event) + event->len;
+			count++;
+		}
 
-			if (event->len>0)
-				sprintf(path_full, "%s/%s", fpath, event->name);
-			else
-				sprintf(path_full, "%s", fpath);
-
-			// Getting infomation about file/dir/etc
-
-			struct  recognize_event_return r = {0};
-			recognize_event(&r, event->mask);
-
-			stat64_t lstat, *lstat_p;
-			mode_t st_mode;
-			size_t st_size;
-			if ((r.objtype_new == EOT_DOESNTEXIST) || (ctx_p->flags[CANCEL_SYSCALLS]&CSC_MON_STAT) || lstat64(path_full, &lstat)) {
-				debug(2, "Cannot lstat64(\"%s\", lstat). Seems, that the object had been deleted (%i) or option \"--cancel-syscalls mon_stat\" (%i) is set.", path_full, r.objtype_new == EOT_DOESNTEXIST, ctx_p->flags[CANCEL_SYSCALLS]&CSC_MON_STAT);
-				st_mode = (event->mask & IN_ISDIR ? S_IFDIR : S_IFREG);
-				st_size = 0;
-				lstat_p = NULL;
-			} else {
-				st_mode = lstat.st_mode;
-				st_size = lstat.st_size;
-				lstat_p = &lstat;
-			}
+		if (inotify_handle_pending_flush(ctx_p, indexes_p, &hbuf)) {
+			count = -1;
+			goto l_inotify_handle_end;
+		}
 
-			if (sync_prequeue_loadmark(1, ctx_p, indexes_p, path_full, NULL, lstat_p, r.objtype_old, r.objtype_new, event->mask, event->wd, st_mode, st_size, &path_rel, &path_rel_len, NULL)) {
+		if (hbuf.overflowed) {
+			if (sync_rescan_changed(ctx_p, indexes_p, hbuf.overflow_since)) {
 				count = -1;
 				goto l_inotify_handle_end;
 			}
+			hbuf.overflowed = 0;
+		}
 
-			INOTIFY_HANDLE_CONTINUE;
+		// The pair of IN_MOVED_FROM may be in the next read() only if the queue is not drained
+		if (drained && (inotify_handle_movedfrom_flush(ctx_p, indexes_p, &hbuf) || inotify_handle_pending_flush(ctx_p, indexes_p, &hbuf))) {
+			count = -1;
+			goto l_inotify_handle_end;
 		}
 
 		// Globally queueing captured events:
@@ -169,19 +808,38 @@ int inotify_handle(ctx_t *ctx_p, indexes_t *indexes_p) {
 		sync_prequeue_unload(ctx_p, indexes_p);
 	}
 
-l_inotify_handle_end:
-	if (path_full != NULL)
-		free(path_full);
-
-	if (path_rel != NULL)
-		free(path_rel);
+	if (hbuf.movedfrom) {
+		if (inotify_handle_movedfrom_flush(ctx_p, indexes_p, &hbuf) || inotify_handle_pending_flush(ctx_p, indexes_p, &hbuf)) {
+			count = -1;
+			goto l_inotify_handle_end;
+		}
+		sync_prequeue_unload(ctx_p, indexes_p);
+	}
 
+l_inotify_handle_end:
+	inotify_handle_buf_free(&hbuf);
 	return count;
 }
 
 int inotify_deinit(ctx_t *ctx_p) {
 	int inotify_d = (int)(long)ctx_p->fsmondata;
+
+	if (ring.event != NULL) {
+		debug(3, "Stopping the inotify reader thread");
+		ring.running = 0;
+		if (write(ring.stop_fd[1], "", 1) == -1)
+			error("Cannot write() to ring.stop_fd[1]");
+		pthread_join(ring.reader, NULL);
+		close(ring.notify_fd[0]);
+		close(ring.notify_fd[1]);
+		close(ring.stop_fd[0]);
+		close(ring.stop_fd[1]);
+		free(ring.event);
+		ring.event = NULL;
+	}
+
+	statbatch_deinit();
+
 	debug(3, "Closing inotify_d");
 	return close(inotify_d);
 }
-
@@ -21,4 +21,7 @@ extern int inotify_wait(struct ctx *ctx_p, struct indexes *indexes_p, struct tim
 extern int inotify_handle(struct ctx *ctx_p, struct indexes *indexes_p);
 extern int inotify_add_watch_dir(struct ctx *ctx_p, struct indexes *indexes_p, const char *const accpath);
 extern int inotify_deinit(ctx_t *ctx_p);
+extern int inotify_reader_start(ctx_t *ctx_p);
+extern void inotify_dump(ctx_t *ctx_p, int fd_out);
 
+extern int inotify_fd(ctx_t *ctx_p);
@@ -785,7 +785,7 @@ int kqueue_handle(ctx_t *ctx_p, indexes_t *indexes_p) {
 	do {
 		int i = 0;
 #ifdef PARANOID
-		g_hash_table_remove_all(indexes_p->fpath2ei_ht);
+		indexes_fpath2ei_clear(indexes_p);
 #endif
 
 		while (i < dat->eventlist_count) {
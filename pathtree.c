@@ -0,0 +1,713 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+    
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include "malloc.h"
+#include "error.h"
+#include "pathtree.h"
+
+// Return: the length of the common prefix of "a" and "b" in whole components
+
+static inline size_t pathtree_commonprefix(const char *a, size_t a_len, const char *b, size_t b_len) {
+	size_t i = 0, common = 0;
+
+	while (i < a_len && i < b_len && a[i] == b[i]) {
+		i++;
+		if ((i == a_len || a[i] == '/') && (i == b_len || b[i] == '/'))
+			common = i;
+	}
+
+	return common;
+}
+
+// Return: the first bytes of the first component of a label, the keys are
+// in the order of pathtree_compcmp() if they differ (the components don't
+// contain zero bytes, so a shorter component is padded with smaller bytes)
+
+static inline uint64_t pathtree_key(const char *label, size_t comp_len) {
+	uint64_t key = 0;
+	size_t   i   = 0;
+
+	while (i < sizeof(key)) {
+		key <<= 8;
+		if (i < comp_len)
+			key |= (unsigned char)label[i];
+		i++;
+	}
+
+	return key;
+}
+
+// Looks up the child by the first component of "path" with the binary search.
+// The keys of the children are compared first, so a child node is read only
+// if its key is the same.
+// Return: 1 if found (*idx_p is its index), 0 if not (*idx_p is where to insert it)
+
+static int pathtree_child_find(struct pathtree_node *node, const char *path, size_t comp_len, size_t *idx_p) {
+	size_t   l = 0, r = node->child_count;
+	uint64_t key = pathtree_key(path, comp_len);
+
+	while (l < r) {
+		size_t m = (l + r) / 2;
+		int rc;
+
+		if (node->child_key[m] != key) {
+			rc = (node->child_key[m] < key) ? -1 : 1;
+		} else {
+			struct pathtree_node *child = node->child[m];
+			rc = pathtree_compcmp(child->label, pathtree_complen(child->label, child->label_len), path, comp_len);
+		}
+
+		if (!rc) {
+			*idx_p = m;
+			return 1;
+		}
+
+		if (rc < 0)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	*idx_p = l;
+	return 0;
+}
+
+static struct pathtree_node *pathtree_node_new(const char *label, size_t label_len) {
+	struct pathtree_node *node = xcalloc(1, sizeof(*node));
+
+	node->label     = xmalloc(label_len + 1);
+	node->label_len = label_len;
+	memcpy(node->label, label, label_len);
+	node->label[label_len] = 0;
+
+	return node;
+}
+
+static void pathtree_child_insert(struct pathtree_node *node, size_t idx, struct pathtree_node *child) {
+	if (node->child_count >= node->child_alloc) {
+		node->child_alloc = node->child_alloc ? node->child_alloc << 1 : 2;
+		node->child       = xrealloc(node->child,     node->child_alloc * sizeof(*node->child));
+		node->child_key   = xrealloc(node->child_key, node->child_alloc * sizeof(*node->child_key));
+	}
+
+	memmove(&node->child[idx+1],     &node->child[idx],     (node->child_count - idx) * sizeof(*node->child));
+	memmove(&node->child_key[idx+1], &node->child_key[idx], (node->child_count - idx) * sizeof(*node->child_key));
+	node->child[idx]     = child;
+	node->child_key[idx] = pathtree_key(child->label, pathtree_complen(child->label, child->label_len));
+	node->child_count++;
+
+	return;
+}
+
+static void pathtree_node_free_children(struct pathtree_node *node) {
+	while (node->child_count) {
+		struct pathtree_node *child = node->child[--node->child_count];
+
+		pathtree_node_free_children(child);
+		free(child->label);
+		free(child);
+	}
+
+	free(node->child);
+	free(node->child_key);
+	node->child       = NULL;
+	node->child_key   = NULL;
+	node->child_alloc = 0;
+
+	return;
+}
+
+// Descents to the node of "path"
+// Return: the node if it's in the tree (even if it's not set), NULL otherwise
+
+static struct pathtree_node *pathtree_descend(pathtree_t *tree, const char *path, uint32_t recursive_flags, struct pathtree_node **including_p) {
+	struct pathtree_node *node = &tree->root;
+	size_t len = strlen(path);
+
+	while (1) {
+		if (!len)
+			return node;
+
+		// The entries of the ancestors that include the whole their content
+		if (including_p != NULL && node->isset && (node->flags & recursive_flags)) {
+			*including_p = node;
+			return NULL;
+		}
+
+		size_t idx;
+		if (!pathtree_child_find(node, path, pathtree_complen(path, len), &idx))
+			return NULL;
+
+		struct pathtree_node *child = node->child[idx];
+		if (child->label_len > len || memcmp(child->label, path, child->label_len))
+			return NULL;
+
+		if (child->label_len == len) {
+			len = 0;
+		} else {
+			if (path[child->label_len] != '/')
+				return NULL;
+			path += child->label_len + 1;
+			len  -= child->label_len + 1;
+		}
+
+		node = child;
+	}
+}
+
+pathtree_t *pathtree_new() {
+	pathtree_t *tree = xcalloc(1, sizeof(*tree));
+
+	tree->root.label = xcalloc(1, 1);
+	return tree;
+}
+
+void pathtree_clear(pathtree_t *tree) {
+	pathtree_node_free_children(&tree->root);
+
+	tree->root.isset = 0;
+	tree->root.flags = 0;
+	tree->root.data  = NULL;
+	tree->count      = 0;
+
+	return;
+}
+
+void pathtree_free(pathtree_t *tree) {
+	if (tree == NULL)
+		return;
+
+	pathtree_clear(tree);
+	free(tree->root.label);
+	free(tree);
+
+	return;
+}
+
+// Adds the entry or replaces it if it's already in the tree
+
+void pathtree_set(pathtree_t *tree, const char *path, uint32_t flags, void *data) {
+	struct pathtree_node *node = &tree->root;
+	size_t len = strlen(path);
+
+	while (len) {
+		size_t idx, comp_len = pathtree_complen(path, len);
+
+		if (!pathtree_child_find(node, path, comp_len, &idx)) {
+			struct pathtree_node *leaf = pathtree_node_new(path, len);
+			pathtree_child_insert(node, idx, leaf);
+			node = leaf;
+			break;
+		}
+
+		struct pathtree_node *child = node->child[idx];
+		size_t common = pathtree_commonprefix(child->label, child->label_len, path, len);
+
+		if (common < child->label_len) {
+			// Splitting the node by the last common component
+			struct pathtree_node *middle = pathtree_node_new(child->label, common);
+
+			child->label_len -= common + 1;
+			memmove(child->label, &child->label[common + 1], child->label_len + 1);
+
+			pathtree_child_insert(middle, 0, child);
+			node->child[idx] = middle;
+			child = middle;
+		}
+
+		node = child;
+		if (common == len)
+			break;
+
+		path += common + 1;
+		len  -= common + 1;
+	}
+
+	if (!node->isset)
+		tree->count++;
+
+	node->isset = 1;
+	node->flags = flags;
+	node->data  = data;
+
+	return;
+}
+
+// Return: 1 if "path" is in the tree, 0 otherwise
+
+int pathtree_get(pathtree_t *tree, const char *path, uint32_t *flags_p, void **data_p) {
+	struct pathtree_node *node = pathtree_descend(tree, path, 0, NULL);
+
+	if (node == NULL || !node->isset)
+		return 0;
+
+	if (flags_p != NULL)
+		*flags_p = node->flags;
+	if (data_p != NULL)
+		*data_p  = node->data;
+
+	return 1;
+}
+
+// Checks if "path" is in the tree or it's under a directory that is in the
+// tree with EVIF_RECURSIVELY or EVIF_CONTENTRECURSIVELY
+// Return: 1 if it is (the entry is returned via *flags_p and *data_p), 0 otherwise
+
+int pathtree_isincluded(pathtree_t *tree, const char *path, uint32_t *flags_p, void **data_p) {
+	struct pathtree_node *including = NULL;
+	struct pathtree_node *node = pathtree_descend(tree, path, EVIF_RECURSIVELY | EVIF_CONTENTRECURSIVELY, &including);
+
+	if (node == NULL || !node->isset)
+		node = including;
+
+	if (node == NULL)
+		return 0;
+
+	debug(5, "\"%s\" is included by an entry with flags 0x%x", path, node->flags);
+
+	if (flags_p != NULL)
+		*flags_p = node->flags;
+	if (data_p != NULL)
+		*data_p  = node->data;
+
+	return 1;
+}
+
+// Checks if "path" or any entry under it is in the tree (every node has an
+// entry in its subtree, see pathtree_node_tidy())
+// Return: 1 if it is, 0 otherwise
+
+int pathtree_hassubtree(pathtree_t *tree, const char *path) {
+	struct pathtree_node *node = &tree->root;
+	size_t len = strlen(path);
+
+	if (!len)
+		return tree->count != 0;
+
+	while (len) {
+		size_t idx;
+		if (!pathtree_child_find(node, path, pathtree_complen(path, len), &idx))
+			return 0;
+
+		struct pathtree_node *child = node->child[idx];
+
+		// The label of the node is longer than the rest of the path
+		if (child->label_len > len)
+			return !memcmp(child->label, path, len) && (child->label[len] == '/');
+
+		if (memcmp(child->label, path, child->label_len))
+			return 0;
+
+		if (child->label_len == len)
+			break;
+		if (path[child->label_len] != '/')
+			return 0;
+
+		path += child->label_len + 1;
+		len  -= child->label_len + 1;
+		node  = child;
+	}
+
+	return 1;
+}
+
+static void pathtree_foreach_node(struct pathtree_node *node, char **buf_p, size_t *buf_size_p, size_t len, pathtree_funct_t funct, void *arg) {
+	size_t i;
+
+	if (node->isset)
+		if (funct(*buf_p, node->flags, node->data, arg))
+			return;
+
+	for (i = 0; i < node->child_count; i++) {
+		struct pathtree_node *child = node->child[i];
+		size_t child_len = len + (len ? 1 : 0) + child->label_len;
+
+		if (*buf_size_p < child_len + 1) {
+			*buf_size_p = child_len + 1 + PATH_MAX;
+			*buf_p      = xrealloc(*buf_p, *buf_size_p);
+		}
+
+		if (len)
+			(*buf_p)[len] = '/';
+		memcpy(&(*buf_p)[child_len - child->label_len], child->label, child->label_len + 1);
+
+		pathtree_foreach_node(child, buf_p, buf_size_p, child_len, funct, arg);
+	}
+	(*buf_p)[len] = 0;
+
+	return;
+}
+
+// Calls "funct" for every entry, the entries of a directory are visited after
+// the directory itself (in the order of the components)
+
+void pathtree_foreach(pathtree_t *tree, pathtree_funct_t funct, void *arg) {
+	size_t buf_size = PATH_MAX + 1;
+	char  *buf      = xmalloc(buf_size);
+
+	buf[0] = 0;
+	pathtree_foreach_node(&tree->root, &buf, &buf_size, 0, funct, arg);
+
+	free(buf);
+	return;
+}
+
+// Descends to the node of "path" (the root for ""), the node is split if
+// "path" ends in the middle of its label
+// Return: the node (*parent_p and *idx_p are its parent and its index in the
+// parent), or NULL if there's nothing at or under "path" in the tree
+
+static struct pathtree_node *pathtree_locate(pathtree_t *tree, const char *path, struct pathtree_node **parent_p, size_t *idx_p) {
+	struct pathtree_node *node = &tree->root;
+	size_t len = strlen(path);
+
+	*parent_p = NULL;
+	*idx_p    = 0;
+
+	while (len) {
+		size_t idx;
+		if (!pathtree_child_find(node, path, pathtree_complen(path, len), &idx))
+			return NULL;
+
+		struct pathtree_node *child = node->child[idx];
+		size_t common = pathtree_commonprefix(child->label, child->label_len, path, len);
+
+		if (common != len && common != child->label_len)
+			return NULL;
+
+		if (common < child->label_len) {
+			// Splitting the node by the end of the path
+			struct pathtree_node *middle = pathtree_node_new(child->label, common);
+
+			child->label_len -= common + 1;
+			memmove(child->label, &child->label[common + 1], child->label_len + 1);
+
+			pathtree_child_insert(middle, 0, child);
+			node->child[idx] = middle;
+			child = middle;
+		}
+
+		*parent_p = node;
+		*idx_p    = idx;
+		node      = child;
+
+		if (common == len)
+			break;
+
+		path += common + 1;
+		len  -= common + 1;
+	}
+
+	return node;
+}
+
+// Keeps the tree compact after an entry or a subtree is removed from under
+// "node": a node without an entry and without children is freed, and a node
+// without an entry and with the only child is merged with the child
+// Return: 1 if the node is freed (it should be dropped by the parent), 0 otherwise
+
+static int pathtree_node_tidy(struct pathtree_node *node) {
+	if (node->isset || node->child_count > 1)
+		return 0;
+
+	if (!node->child_count) {
+		free(node->child);
+		free(node->child_key);
+		free(node->label);
+		free(node);
+		return 1;
+	}
+
+	struct pathtree_node *child = node->child[0];
+	size_t label_len = node->label_len + 1 + child->label_len;
+	char  *label     = xmalloc(label_len + 1);
+
+	memcpy(label, node->label, node->label_len);
+	label[node->label_len] = '/';
+	memcpy(&label[node->label_len + 1], child->label, child->label_len + 1);
+
+	free(node->label);
+	free(node->child);
+	free(node->child_key);
+	node->label       = label;
+	node->label_len   = label_len;
+	node->child       = child->child;
+	node->child_key   = child->child_key;
+	node->child_count = child->child_count;
+	node->child_alloc = child->child_alloc;
+	node->isset       = child->isset;
+	node->flags       = child->flags;
+	node->data        = child->data;
+
+	free(child->label);
+	free(child);
+	return 0;
+}
+
+// Tidies the nodes on the way from the root to "path" (from the bottom)
+
+static void pathtree_tidy_path(struct pathtree_node *node, const char *path, size_t len) {
+	size_t idx;
+
+	if (!len)
+		return;
+
+	if (!pathtree_child_find(node, path, pathtree_complen(path, len), &idx))
+		return;
+
+	struct pathtree_node *child = node->child[idx];
+	if (child->label_len < len && !memcmp(child->label, path, child->label_len) && path[child->label_len] == '/')
+		pathtree_tidy_path(child, &path[child->label_len + 1], len - child->label_len - 1);
+
+	if (pathtree_node_tidy(child)) {
+		memmove(&node->child[idx],     &node->child[idx+1],     (node->child_count - idx - 1) * sizeof(*node->child));
+		memmove(&node->child_key[idx], &node->child_key[idx+1], (node->child_count - idx - 1) * sizeof(*node->child_key));
+		node->child_count--;
+	}
+
+	return;
+}
+
+// Removes the entry "path" (the entries under it are kept)
+// Return: 1 if it was in the tree (its data is returned via *data_p), 0 otherwise
+
+int pathtree_remove(pathtree_t *tree, const char *path, void **data_p) {
+	struct pathtree_node *node = pathtree_descend(tree, path, 0, NULL);
+
+	if (node == NULL || !node->isset)
+		return 0;
+
+	if (data_p != NULL)
+		*data_p = node->data;
+
+	node->isset = 0;
+	node->flags = 0;
+	node->data  = NULL;
+	tree->count--;
+
+	pathtree_tidy_path(&tree->root, path, strlen(path));
+	return 1;
+}
+
+static size_t pathtree_node_count(struct pathtree_node *node) {
+	size_t count = node->isset, i = 0;
+
+	while (i < node->child_count)
+		count += pathtree_node_count(node->child[i++]);
+
+	return count;
+}
+
+// Takes the subtree of "path" out of the tree (the root of the tree is never
+// taken out, its children are taken for "")
+// Return: the root of the subtree (to be freed by the caller) or NULL if there's nothing under "path"
+
+static struct pathtree_node *pathtree_detach(pathtree_t *tree, const char *path) {
+	struct pathtree_node *parent, *node;
+	size_t idx;
+
+	node = pathtree_locate(tree, path, &parent, &idx);
+	if (node == NULL)
+		return NULL;
+
+	if (parent == NULL) {
+		struct pathtree_node *root = xcalloc(1, sizeof(*root));
+
+		memcpy(root, node, sizeof(*root));
+		root->label = xcalloc(1, 1);
+		node->child       = NULL;
+		node->child_key   = NULL;
+		node->child_count = 0;
+		node->child_alloc = 0;
+		node->isset       = 0;
+		node->flags       = 0;
+		node->data        = NULL;
+		tree->count       = 0;
+		return root;
+	}
+
+	memmove(&parent->child[idx],     &parent->child[idx+1],     (parent->child_count - idx - 1) * sizeof(*parent->child));
+	memmove(&parent->child_key[idx], &parent->child_key[idx+1], (parent->child_count - idx - 1) * sizeof(*parent->child_key));
+	parent->child_count--;
+	tree->count -= pathtree_node_count(node);
+
+	const char *slash = strrchr(path, '/');
+	if (slash != NULL)
+		pathtree_tidy_path(&tree->root, path, slash - path);
+
+	return node;
+}
+
+static void pathtree_node_free(struct pathtree_node *node) {
+	pathtree_node_free_children(node);
+	free(node->label);
+	free(node);
+	return;
+}
+
+// Removes "path" and all the entries under it, "funct" (if not NULL) is
+// called for every removed entry before its removal
+
+void pathtree_remove_subtree(pathtree_t *tree, const char *path, pathtree_funct_t funct, void *arg) {
+	struct pathtree_node *node = pathtree_detach(tree, path);
+
+	if (node == NULL)
+		return;
+
+	if (funct != NULL) {
+		size_t len      = strlen(path);
+		size_t buf_size = len + 1 + PATH_MAX;
+		char  *buf      = xmalloc(buf_size);
+
+		memcpy(buf, path, len + 1);
+		pathtree_foreach_node(node, &buf, &buf_size, len, funct, arg);
+		free(buf);
+	}
+
+	pathtree_node_free(node);
+	return;
+}
+
+// Moves "path_old" and all the entries under it to be under "path_new". The
+// entries at and under "path_new" are replaced, "funct" (if not NULL) is
+// called for every replaced entry before its removal. The cost depends on
+// the depth of the paths, not on the count of the moved entries.
+// Return: 0 on success, ENOENT if there's nothing to move, EINVAL if one path is under another
+
+int pathtree_move(pathtree_t *tree, const char *path_old, const char *path_new, pathtree_funct_t funct, void *arg) {
+	size_t path_old_len = strlen(path_old);
+	size_t len          = strlen(path_new);
+
+	size_t common       = MIN(path_old_len, len);
+
+	if (!common)
+		return EINVAL;
+
+	// One path is under another one (or they are the same)
+	if (!memcmp(path_old, path_new, common) && (path_old[common] == '/' || path_old[common] == 0) && (path_new[common] == '/' || path_new[common] == 0))
+		return EINVAL;
+
+	struct pathtree_node *moved = pathtree_detach(tree, path_old);
+	if (moved == NULL)
+		return ENOENT;
+	size_t moved_count = pathtree_node_count(moved);
+
+	pathtree_remove_subtree(tree, path_new, funct, arg);
+
+	// Linking the subtree as a new leaf ("path_new" is not in the tree already)
+	struct pathtree_node *node = &tree->root;
+	const char *path = path_new;
+	while (1) {
+		size_t idx, comp_len = pathtree_complen(path, len);
+
+		if (!pathtree_child_find(node, path, comp_len, &idx)) {
+			free(moved->label);
+			moved->label     = xmalloc(len + 1);
+			moved->label_len = len;
+			memcpy(moved->label, path, len);
+			moved->label[len] = 0;
+
+			// A detached mid-label split may have left "moved" without
+			// an entry and with the only child
+			pathtree_node_tidy(moved);
+			pathtree_child_insert(node, idx, moved);
+			break;
+		}
+
+		struct pathtree_node *child = node->child[idx];
+		common = pathtree_commonprefix(child->label, child->label_len, path, len);
+
+		if (common < child->label_len) {
+			struct pathtree_node *middle = pathtree_node_new(child->label, common);
+
+			child->label_len -= common + 1;
+			memmove(child->label, &child->label[common + 1], child->label_len + 1);
+
+			pathtree_child_insert(middle, 0, child);
+			node->child[idx] = middle;
+			child = middle;
+		}
+
+		// "path_new" is removed above, so it's deeper than "child"
+		node  = child;
+		path += common + 1;
+		len  -= common + 1;
+	}
+
+	tree->count += moved_count;
+	return 0;
+}
+
+// Calls "funct" for "path" and every entry under it (in the order of pathtree_foreach())
+
+void pathtree_foreach_subtree(pathtree_t *tree, const char *path, pathtree_funct_t funct, void *arg) {
+	struct pathtree_node *node = &tree->root;
+	size_t path_len = strlen(path), len = path_len, tail_len = 0;
+	const char *rest = path;
+
+	while (len) {
+		size_t idx;
+		if (!pathtree_child_find(node, rest, pathtree_complen(rest, len), &idx))
+			return;
+
+		struct pathtree_node *child = node->child[idx];
+		size_t common = pathtree_commonprefix(child->label, child->label_len, rest, len);
+
+		if (common != len && common != child->label_len)
+			return;
+
+		node = child;
+		if (common == len) {
+			// "path" could end in the middle of the label
+			tail_len = child->label_len - common;
+			break;
+		}
+
+		rest += common + 1;
+		len  -= common + 1;
+	}
+
+	size_t buf_size = path_len + tail_len + 1 + PATH_MAX;
+	char  *buf      = xmalloc(buf_size);
+
+	memcpy(buf, path, path_len);
+	memcpy(&buf[path_len], &node->label[node->label_len - tail_len], tail_len + 1);
+	pathtree_foreach_node(node, &buf, &buf_size, path_len + tail_len, funct, arg);
+
+	free(buf);
+	return;
+}
+
+static size_t pathtree_node_memsize(struct pathtree_node *node) {
+	size_t size = node->label_len + 1 + node->child_alloc * (sizeof(*node->child) + sizeof(*node->child_key));
+	size_t i    = 0;
+
+	while (i < node->child_count)
+		size += sizeof(struct pathtree_node) + pathtree_node_memsize(node->child[i++]);
+
+	return size;
+}
+
+// Return: bytes allocated by the tree (the nodes and their labels)
+
+size_t pathtree_memsize(pathtree_t *tree) {
+	return sizeof(*tree) + pathtree_node_memsize(&tree->root);
+}
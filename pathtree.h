@@ -0,0 +1,84 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+    
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLSYNC_PATHTREE_H
+#define __CLSYNC_PATHTREE_H
+
+// A compressed path-component trie. Every node holds one or more whole path
+// components, so an entry is found (or all its ancestors are checked) in a
+// single descent instead of a lookup per path prefix.
+
+struct pathtree_node {
+	char			 *label;	// path components without the leading and the trailing slashes
+	size_t			  label_len;
+	struct pathtree_node	**child;	// sorted by the first component of the label
+	uint64_t		 *child_key;	// the first bytes of the first components of the children (see pathtree_child_find())
+	size_t			  child_count;
+	size_t			  child_alloc;
+	int			  isset;
+	uint32_t		  flags;	// eventinfo_flags_t
+	void			 *data;
+};
+
+struct pathtree {
+	struct pathtree_node	  root;		// "" (the watch directory itself)
+	size_t			  count;
+};
+typedef struct pathtree pathtree_t;
+
+// Return: non-zero to skip the entries under "path"
+typedef int (*pathtree_funct_t)(const char *path, uint32_t flags, void *data, void *arg);
+
+extern pathtree_t *pathtree_new();
+extern void pathtree_free(pathtree_t *tree);
+extern void pathtree_clear(pathtree_t *tree);
+extern void pathtree_set(pathtree_t *tree, const char *path, uint32_t flags, void *data);
+extern int  pathtree_get(pathtree_t *tree, const char *path, uint32_t *flags_p, void **data_p);
+extern int  pathtree_isincluded(pathtree_t *tree, const char *path, uint32_t *flags_p, void **data_p);
+extern int  pathtree_hassubtree(pathtree_t *tree, const char *path);
+extern void pathtree_foreach(pathtree_t *tree, pathtree_funct_t funct, void *arg);
+extern void pathtree_foreach_subtree(pathtree_t *tree, const char *path, pathtree_funct_t funct, void *arg);
+extern int  pathtree_remove(pathtree_t *tree, const char *path, void **data_p);
+extern void pathtree_remove_subtree(pathtree_t *tree, const char *path, pathtree_funct_t funct, void *arg);
+extern int  pathtree_move(pathtree_t *tree, const char *path_old, const char *path_new, pathtree_funct_t funct, void *arg);
+extern size_t pathtree_memsize(pathtree_t *tree);
+
+static inline size_t pathtree_count(pathtree_t *tree) {
+	return tree->count;
+}
+
+// Return: the length of the first component of "path"
+
+static inline size_t pathtree_complen(const char *path, size_t path_len) {
+	const char *slash = memchr(path, '/', path_len);
+	return (slash == NULL) ? path_len : (size_t)(slash - path);
+}
+
+// The order of the children of a node (by their first components)
+
+static inline int pathtree_compcmp(const char *a, size_t a_len, const char *b, size_t b_len) {
+	int rc = memcmp(a, b, MIN(a_len, b_len));
+	if (rc)
+		return rc;
+
+	return (a_len > b_len) - (a_len < b_len);
+}
+
+#endif
+
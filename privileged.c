@@ -24,6 +24,7 @@
 #include "main.h"			// ncpus
 #include "pthreadex.h"			// pthread_*_shared()
 #include "malloc.h"			// xmalloc()
+#include "procspawn.h"			// spawn_setuid_execvp()
 
 #ifdef CAPABILITIES_SUPPORT
 # include <pthread.h>			// pthread_create()
@@ -80,6 +81,29 @@
 	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, __NR_##syscall, 0, 1),	\
 	SECCOMP_ALLOW
 
+# ifdef EPOLL_SUPPORT
+#  define FILTER_TABLE_NONPRIV_EPOLL					\
+	SECCOMP_ALLOW_ACCUM_SYSCALL(epoll_wait),			\
+	SECCOMP_ALLOW_ACCUM_SYSCALL(timerfd_settime),
+# else
+#  define FILTER_TABLE_NONPRIV_EPOLL
+# endif
+
+# ifdef FANOTIFY_SUPPORT
+#  define FILTER_TABLE_NONPRIV_FANOTIFY					\
+	SECCOMP_ALLOW_ACCUM_SYSCALL(open_by_handle_at),			\
+	SECCOMP_ALLOW_ACCUM_SYSCALL(readlink),
+# else
+#  define FILTER_TABLE_NONPRIV_FANOTIFY
+# endif
+
+# ifdef IOURING_SUPPORT
+#  define FILTER_TABLE_NONPRIV_IOURING					\
+	SECCOMP_ALLOW_ACCUM_SYSCALL(io_uring_enter),
+# else
+#  define FILTER_TABLE_NONPRIV_IOURING
+# endif
+
 # define FILTER_TABLE_NONPRIV						\
 	SECCOMP_ALLOW_ACCUM_SYSCALL(futex),				\
 	SECCOMP_ALLOW_ACCUM_SYSCALL(inotify_init1),			\
@@ -106,6 +130,9 @@
 	SECCOMP_ALLOW_ACCUM_SYSCALL(rt_sigprocmask),			\
 	SECCOMP_ALLOW_ACCUM_SYSCALL(rt_sigaction),			\
 	SECCOMP_ALLOW_ACCUM_SYSCALL(nanosleep),				\
+	FILTER_TABLE_NONPRIV_EPOLL					\
+	FILTER_TABLE_NONPRIV_FANOTIFY					\
+	FILTER_TABLE_NONPRIV_IOURING
 
 
 /* Syscalls allowed to non-privileged thread */
@@ -1010,17 +1037,7 @@ int privileged_handler(ctx_t *ctx_p)
 				if (use_args_check)
 					privileged_execvp_check_arguments(opts, file, argv);
 
-				pid_t pid = fork();
-				switch (pid) {
-					case -1: 
-						error("Cannot fork().");
-						break;
-					case  0:
-						debug(4, "setgid(%u) == %i", exec_gid, setgid(exec_gid));
-						debug(4, "setuid(%u) == %i", exec_uid, setuid(exec_uid));
-						debug(3, "execvp(\"%s\", argv)", file);
-						exit(execvp(file, argv));
-				}
+				pid_t pid = spawn_setuid_execvp(file, argv, exec_uid, exec_gid);
 				cmd_ret_p->ret = (void *)(long)pid;
 				debug(21, "/PA_FORK_EXECVP");
 				break;
@@ -1587,20 +1604,7 @@ gid_t __privileged_fork_execvp_gid;
 int __privileged_fork_execvp(const char *file, char *const argv[])
 {
 	debug(4, "");
-	pid_t pid = fork();
-	switch (pid) {
-		case -1: 
-			error("Cannot fork().");
-			return -1;
-		case  0:
-			debug(4, "setgid(%u) == %i", __privileged_fork_execvp_gid, setgid(__privileged_fork_execvp_gid));
-			debug(4, "setuid(%u) == %i", __privileged_fork_execvp_uid, setuid(__privileged_fork_execvp_uid));
-			errno = 0;
-			execvp(file, argv);
-			exit(errno);
-	}
-
-	return pid;
+	return spawn_setuid_execvp(file, argv, __privileged_fork_execvp_uid, __privileged_fork_execvp_gid);
 }
 
 #ifdef CAPABILITIES_SUPPORT
@@ -34,6 +34,15 @@ enum priv_callid {
 	PC_SYNC_MARK_WALK_FTS_READ,
 	PC_SYNC_MARK_WALK_FTS_CLOSE,
 	PC_INOTIFY_ADD_WATCH_DIR,
+	PC_SYNC_RESCAN_FTS_OPEN,
+	PC_SYNC_RESCAN_FTS_READ,
+	PC_SYNC_RESCAN_FTS_CLOSE,
+	PC_SYNC_WATCHBUDGET_FTS_OPEN,
+	PC_SYNC_WATCHBUDGET_FTS_READ,
+	PC_SYNC_WATCHBUDGET_FTS_CLOSE,
+	PC_SYNC_INITSYNCJOURNAL_FTS_OPEN,
+	PC_SYNC_INITSYNCJOURNAL_FTS_READ,
+	PC_SYNC_INITSYNCJOURNAL_FTS_CLOSE,
 
 	PC_MAX
 };
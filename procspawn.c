@@ -0,0 +1,168 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include "error.h"
+#include "procspawn.h"
+
+#ifdef CLONE_SUPPORT
+#	include <sched.h>		// clone()
+#	include <sys/syscall.h>		// SYS_*
+#else
+#	include <spawn.h>		// posix_spawnp()
+#endif
+
+/*
+ * The sync handlers are started without copying the address space of
+ * clsync: the child shares the memory of the parent (CLONE_VM) and the
+ * parent is suspended until the child calls execvp() or exits
+ * (CLONE_VFORK). So the cost of a start doesn't depend on the size of the
+ * indexes, as it does with fork() that copies the page tables.
+ *
+ * Until execvp() the child works in the memory of the parent on its own
+ * stack, so it doesn't take any locks and doesn't allocate memory. All the
+ * signals are blocked in the parent around clone() and the child resets
+ * the handlers to the defaults before unblocking them, so no handler of the
+ * parent runs in the child.
+ */
+
+#ifdef CLONE_SUPPORT
+struct spawn_arg {
+	const char	 *file;
+	char *const	 *argv;
+	uid_t		  uid;
+	gid_t		  gid;
+	sigset_t	 *sigset_p;
+	int		  err;
+};
+
+static int spawn_child(void *_arg_p) {
+	struct spawn_arg *arg_p = _arg_p;
+	struct sigaction sa_dfl, sa_old;
+	int signum;
+
+	memset(&sa_dfl, 0, sizeof(sa_dfl));
+	sa_dfl.sa_handler = SIG_DFL;
+	for (signum = 1; signum < _NSIG; signum++) {
+		if (sigaction(signum, NULL, &sa_old))
+			continue;
+		if ((sa_old.sa_handler != SIG_IGN) && (sa_old.sa_handler != SIG_DFL))
+			sigaction(signum, &sa_dfl, NULL);
+	}
+	sigprocmask(SIG_SETMASK, arg_p->sigset_p, NULL);
+
+	// The raw syscalls: the glibc wrappers of setgid()/setuid() would apply the ids to the threads of the parent
+# ifdef SYS_setgid32
+	syscall(SYS_setgid32, arg_p->gid);
+	syscall(SYS_setuid32, arg_p->uid);
+# else
+	syscall(SYS_setgid,   arg_p->gid);
+	syscall(SYS_setuid,   arg_p->uid);
+# endif
+
+	errno = 0;
+	execvp(arg_p->file, arg_p->argv);
+	arg_p->err = errno;
+	_exit(errno);
+}
+
+pid_t spawn_setuid_execvp(const char *file, char *const argv[], uid_t uid, gid_t gid) {
+	struct spawn_arg arg = {
+		.file	= file,
+		.argv	= argv,
+		.uid	= uid,
+		.gid	= gid,
+		.err	= 0,
+	};
+	sigset_t sigset_all, sigset_old;
+	pid_t pid;
+	void *stack;
+	int err;
+
+	debug(4, "execvp(\"%s\", argv) with uid %u and gid %u", file, uid, gid);
+
+	stack = mmap(NULL, SPAWN_STACK_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED) {
+		error("Cannot mmap() the stack for the child.");
+		return -1;
+	}
+
+	sigfillset(&sigset_all);
+	pthread_sigmask(SIG_BLOCK, &sigset_all, &sigset_old);
+	arg.sigset_p = &sigset_old;
+
+	// The stack grows down
+	pid = clone(spawn_child, (char *)stack + SPAWN_STACK_SIZE, CLONE_VM|CLONE_VFORK|SIGCHLD, &arg);
+	err = errno;
+
+	pthread_sigmask(SIG_SETMASK, &sigset_old, NULL);
+	munmap(stack, SPAWN_STACK_SIZE);
+
+	if (pid == -1) {
+		errno = err;
+		error("Cannot clone().");
+		return -1;
+	}
+
+	// The child has already exited with the errno as the exitcode, it's reaped by the caller as usual
+	if (arg.err)
+		debug(1, "Cannot execvp(\"%s\", argv) in the child %u: %s (%i).", file, pid, strerror(arg.err), arg.err);
+
+	return pid;
+}
+
+#else
+
+extern char **environ;
+
+pid_t spawn_setuid_execvp(const char *file, char *const argv[], uid_t uid, gid_t gid) {
+	pid_t pid;
+
+	debug(4, "execvp(\"%s\", argv) with uid %u and gid %u", file, uid, gid);
+
+	// posix_spawnp() cannot change the ids, so fork() is left for the case they should be changed
+	if ((uid == geteuid()) && (gid == getegid())) {
+		int err = posix_spawnp(&pid, file, NULL, NULL, argv, environ);
+		if (err) {
+			errno = err;
+			error("Cannot posix_spawnp(\"%s\", argv).", file);
+			return -1;
+		}
+		return pid;
+	}
+
+	pid = fork();
+	switch (pid) {
+		case -1: 
+			error("Cannot fork().");
+			return -1;
+		case  0:
+			debug(4, "setgid(%u) == %i", gid, setgid(gid));
+			debug(4, "setuid(%u) == %i", uid, setuid(uid));
+			errno = 0;
+			execvp(file, argv);
+			exit(errno);
+	}
+
+	return pid;
+}
+
+#endif
+
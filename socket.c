@@ -76,6 +76,7 @@ const char *const textmessage_args[SOCKCMD_MAXID] = {
 	[SOCKCMD_REPLY_EINVAL]		= "%u %lu",
 	[SOCKCMD_REPLY_VERSION]		= "%u %u %s",
 	[SOCKCMD_REPLY_INFO]		= "%s\003/ %s\003/ %x %x",
+	[SOCKCMD_REPLY_MEMINFO]		= "%s\003/",
 	[SOCKCMD_REPLY_UNKNOWNCMD]	= "%u %lu",
 	[SOCKCMD_REPLY_INVALIDCMDID]	= "%lu",
 	[SOCKCMD_REPLY_EEXIST]		= "%s\003/",
@@ -96,6 +97,7 @@ const char *const textmessage_descr[SOCKCMD_MAXID] = {
 	[SOCKCMD_REPLY_INFO]		= "config_block == \"%s\"; label == \"%s\"; flags == %x; flags_set == %x.",
 	[SOCKCMD_REPLY_SET]		= "Set",
 	[SOCKCMD_REPLY_DUMP]		= "Ready",
+	[SOCKCMD_REPLY_MEMINFO]		= "Memory usage (name entries bytes): %s",
 	[SOCKCMD_REPLY_UNKNOWNCMD]	= "Unknown command.",
 	[SOCKCMD_REPLY_INVALIDCMDID]	= "Invalid command id. Required: 0 <= cmd_id < 1000.",
 	[SOCKCMD_REPLY_EEXIST]		= "File exists: \"%s\".",
@@ -109,6 +109,7 @@ enum sockcmd_id {
 	SOCKCMD_REQUEST_VERSION		= 200,
 	SOCKCMD_REQUEST_INFO		= 201,
 	SOCKCMD_REQUEST_DUMP		= 202,
+	SOCKCMD_REQUEST_MEMINFO		= 203,
 	SOCKCMD_REQUEST_LOGIN		= 210,
 	SOCKCMD_REQUEST_SET		= 211,
 	SOCKCMD_REQUEST_DIE		= 240,
@@ -116,6 +117,7 @@ enum sockcmd_id {
 	SOCKCMD_REPLY_VERSION		= 300,
 	SOCKCMD_REPLY_INFO		= 301,
 	SOCKCMD_REPLY_DUMP		= 302,
+	SOCKCMD_REPLY_MEMINFO		= 303,
 	SOCKCMD_REPLY_LOGIN		= 310,
 	SOCKCMD_REPLY_SET		= 311,
 	SOCKCMD_REPLY_DIE		= 340,
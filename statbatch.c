@@ -0,0 +1,323 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+    
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include "malloc.h"
+#include "error.h"
+#include "statbatch.h"
+
+#include <pthread.h>
+#ifdef IOURING_SUPPORT
+#	include <liburing.h>
+#	include <sys/sysmacros.h>
+#endif
+
+/*
+ * lstat()-s a batch of paths at once. The batch is submitted to io_uring
+ * as statx() requests if it's available, otherwise it's distributed
+ * between a pool of threads (the calling thread takes a part, too).
+ */
+
+struct statbatch {
+	int		 initialized;
+
+	pthread_t	 thread[STATBATCH_THREADS];
+	int		 threads_count;
+	pthread_mutex_t	 mutex;
+	pthread_cond_t	 cond_job;	// statbatch_lstat() -> workers
+	pthread_cond_t	 cond_done;	// workers -> statbatch_lstat()
+	int		 running;
+	uint64_t	 generation;
+
+	statbatch_req_t	*req;
+	size_t		 count;
+	size_t		 next;		// the next request to be taken, atomic
+	size_t		 done;
+	int		 active;	// workers running statbatch_run() on the current batch
+
+	uint64_t	 batches;
+	uint64_t	 requests;
+
+#ifdef IOURING_SUPPORT
+	int		 uring_ok;
+	struct io_uring	 uring;
+	struct statx	*stx;
+	size_t		 stx_alloc;
+#endif
+};
+
+static struct statbatch sb = {0};
+
+static inline void statbatch_req_lstat(statbatch_req_t *req_p) {
+	req_p->rc = lstat64(req_p->path, req_p->lstat_p) ? errno : 0;
+	return;
+}
+
+/*
+ * "req" and "count" are the snapshot of the batch taken under the mutex. A batch
+ * is replaced (and "next" is reset) only when no worker runs on it, so a worker
+ * that woke up late cannot pair the counter of one batch with another one.
+ */
+
+static size_t statbatch_run(statbatch_req_t *req, size_t count) {
+	size_t i, done = 0;
+
+	while ((i = __atomic_fetch_add(&sb.next, 1, __ATOMIC_ACQ_REL)) < count) {
+		statbatch_req_lstat(&req[i]);
+		done++;
+	}
+
+	return done;
+}
+
+static void *statbatch_worker(void *arg) {
+	uint64_t generation = 0;
+
+	pthread_mutex_lock(&sb.mutex);
+	while (1) {
+		while (sb.running && sb.generation == generation)
+			pthread_cond_wait(&sb.cond_job, &sb.mutex);
+
+		if (!sb.running)
+			break;
+
+		generation = sb.generation;
+		statbatch_req_t *req = sb.req;
+		size_t count = sb.count;
+		sb.active++;
+		pthread_mutex_unlock(&sb.mutex);
+
+		size_t done = statbatch_run(req, count);
+
+		pthread_mutex_lock(&sb.mutex);
+		sb.done += done;
+		sb.active--;
+		if ((sb.done >= sb.count) && !sb.active)
+			pthread_cond_signal(&sb.cond_done);
+	}
+	pthread_mutex_unlock(&sb.mutex);
+
+	return NULL;
+}
+
+static int statbatch_threads(statbatch_req_t *req, size_t count) {
+	pthread_mutex_lock(&sb.mutex);
+	// A worker woken up late may still be running on the previous batch
+	while (sb.active)
+		pthread_cond_wait(&sb.cond_done, &sb.mutex);
+	sb.req   = req;
+	sb.count = count;
+	sb.done  = 0;
+	__atomic_store_n(&sb.next, 0, __ATOMIC_RELEASE);
+	sb.generation++;
+	pthread_cond_broadcast(&sb.cond_job);
+	pthread_mutex_unlock(&sb.mutex);
+
+	size_t done = statbatch_run(req, count);
+
+	pthread_mutex_lock(&sb.mutex);
+	sb.done += done;
+	while ((sb.done < sb.count) || sb.active)
+		pthread_cond_wait(&sb.cond_done, &sb.mutex);
+	pthread_mutex_unlock(&sb.mutex);
+
+	return 0;
+}
+
+#ifdef IOURING_SUPPORT
+static inline void statx2stat64(stat64_t *st_p, struct statx *stx_p) {
+	memset(st_p, 0, sizeof(*st_p));
+
+	st_p->st_dev		= makedev(stx_p->stx_dev_major,  stx_p->stx_dev_minor);
+	st_p->st_ino		= stx_p->stx_ino;
+	st_p->st_mode		= stx_p->stx_mode;
+	st_p->st_nlink		= stx_p->stx_nlink;
+	st_p->st_uid		= stx_p->stx_uid;
+	st_p->st_gid		= stx_p->stx_gid;
+	st_p->st_rdev		= makedev(stx_p->stx_rdev_major, stx_p->stx_rdev_minor);
+	st_p->st_size		= stx_p->stx_size;
+	st_p->st_blksize	= stx_p->stx_blksize;
+	st_p->st_blocks		= stx_p->stx_blocks;
+	st_p->st_atim.tv_sec	= stx_p->stx_atime.tv_sec;
+	st_p->st_atim.tv_nsec	= stx_p->stx_atime.tv_nsec;
+	st_p->st_mtim.tv_sec	= stx_p->stx_mtime.tv_sec;
+	st_p->st_mtim.tv_nsec	= stx_p->stx_mtime.tv_nsec;
+	st_p->st_ctim.tv_sec	= stx_p->stx_ctime.tv_sec;
+	st_p->st_ctim.tv_nsec	= stx_p->stx_ctime.tv_nsec;
+
+	return;
+}
+
+static int statbatch_uring(statbatch_req_t *req, size_t count) {
+	if (sb.stx_alloc < STATBATCH_URING_ENTRIES) {
+		sb.stx       = xcalloc(STATBATCH_URING_ENTRIES, sizeof(*sb.stx));
+		sb.stx_alloc = STATBATCH_URING_ENTRIES;
+	}
+
+	size_t offset = 0;
+	while (offset < count) {
+		size_t i, chunk = MIN(count - offset, STATBATCH_URING_ENTRIES);
+
+		for (i = 0; i < chunk; i++) {
+			struct io_uring_sqe *sqe = io_uring_get_sqe(&sb.uring);
+			critical_on (sqe == NULL);
+
+			io_uring_prep_statx(sqe, AT_FDCWD, req[offset+i].path, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &sb.stx[i]);
+			io_uring_sqe_set_data(sqe, (void *)(long)i);
+		}
+
+		int rc = io_uring_submit_and_wait(&sb.uring, chunk);
+		if (rc < 0) {
+			errno = -rc;
+			error("Cannot io_uring_submit_and_wait().");
+			return errno;
+		}
+
+		for (i = 0; i < chunk; i++) {
+			struct io_uring_cqe *cqe;
+
+			rc = io_uring_wait_cqe(&sb.uring, &cqe);
+			if (rc < 0) {
+				errno = -rc;
+				error("Cannot io_uring_wait_cqe().");
+				return errno;
+			}
+
+			size_t idx = (size_t)(long)io_uring_cqe_get_data(cqe);
+			statbatch_req_t *req_p = &req[offset+idx];
+
+			if (cqe->res < 0)
+				req_p->rc = -cqe->res;
+			else {
+				req_p->rc = 0;
+				statx2stat64(req_p->lstat_p, &sb.stx[idx]);
+			}
+
+			io_uring_cqe_seen(&sb.uring, cqe);
+		}
+
+		offset += chunk;
+	}
+
+	return 0;
+}
+#endif
+
+int statbatch_lstat(statbatch_req_t *req, size_t count) {
+	size_t i;
+
+	debug(3, "count == %u", count);
+
+	sb.batches++;
+	sb.requests += count;
+
+#ifdef IOURING_SUPPORT
+	if (sb.uring_ok)
+		return statbatch_uring(req, count);
+#endif
+
+	if (sb.threads_count && count >= STATBATCH_THREADS_MINBATCH)
+		return statbatch_threads(req, count);
+
+	for (i = 0; i < count; i++)
+		statbatch_req_lstat(&req[i]);
+
+	return 0;
+}
+
+int statbatch_init(ctx_t *ctx_p) {
+	if (sb.initialized)
+		return 0;
+
+	sb.initialized = 1;
+
+#ifdef IOURING_SUPPORT
+	int rc = io_uring_queue_init(STATBATCH_URING_ENTRIES, &sb.uring, 0);
+	if (rc == 0) {
+		debug(1, "Using io_uring to lstat() the event paths.");
+		sb.uring_ok = 1;
+		return 0;
+	}
+	debug(1, "Cannot io_uring_queue_init(): %s. Falling back to the thread pool.", strerror(-rc));
+#endif
+
+	pthread_mutex_init(&sb.mutex, NULL);
+	pthread_cond_init(&sb.cond_job,  NULL);
+	pthread_cond_init(&sb.cond_done, NULL);
+
+	sb.running = 1;
+	while (sb.threads_count < STATBATCH_THREADS) {
+		if (pthread_create(&sb.thread[sb.threads_count], NULL, statbatch_worker, NULL)) {
+			// The batches are lstat()-ed by the calling thread and the already created threads
+			warning("Cannot pthread_create() the lstat() thread #%i.", sb.threads_count);
+			break;
+		}
+		sb.threads_count++;
+	}
+
+	debug(1, "Started %i lstat() threads.", sb.threads_count);
+	return 0;
+}
+
+void statbatch_dump(int fd_out) {
+	if (!sb.initialized)
+		return;
+
+	dprintf(fd_out,
+		"lstat batches:\n\tbackend == %s\n\tbatches == %lu\n\trequests == %lu\n",
+#ifdef IOURING_SUPPORT
+			sb.uring_ok ? "io_uring" :
+#endif
+			"threads",
+			(unsigned long)sb.batches,
+			(unsigned long)sb.requests
+		);
+
+	return;
+}
+
+void statbatch_deinit() {
+	if (!sb.initialized)
+		return;
+
+#ifdef IOURING_SUPPORT
+	if (sb.uring_ok) {
+		io_uring_queue_exit(&sb.uring);
+		free(sb.stx);
+		memset(&sb, 0, sizeof(sb));
+		return;
+	}
+#endif
+
+	pthread_mutex_lock(&sb.mutex);
+	sb.running = 0;
+	pthread_cond_broadcast(&sb.cond_job);
+	pthread_mutex_unlock(&sb.mutex);
+
+	while (sb.threads_count)
+		pthread_join(sb.thread[--sb.threads_count], NULL);
+
+	pthread_cond_destroy(&sb.cond_done);
+	pthread_cond_destroy(&sb.cond_job);
+	pthread_mutex_destroy(&sb.mutex);
+
+	memset(&sb, 0, sizeof(sb));
+	return;
+}
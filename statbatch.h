@@ -0,0 +1,32 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+    
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+struct statbatch_req {
+	const char *path;
+	stat64_t   *lstat_p;
+	int         rc;		// 0 on success, errno on fail
+};
+typedef struct statbatch_req statbatch_req_t;
+
+extern int  statbatch_init(struct ctx *ctx_p);
+extern int  statbatch_lstat(statbatch_req_t *req, size_t count);
+extern void statbatch_dump(int fd_out);
+extern void statbatch_deinit();
+
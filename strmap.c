@@ -0,0 +1,266 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+    
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "malloc.h"
+#include "error.h"
+#include "configuration.h"
+#include "strmap.h"
+
+#define STRMAP_ALIGN(size) (((size) + sizeof(void *)-1) & ~(sizeof(void *)-1))
+
+static inline strmap_entry_t *strmap_slot(strmap_t *map, size_t i) {
+	return (strmap_entry_t *)&map->slots[i * map->slot_size];
+}
+
+static inline void *strmap_value(strmap_entry_t *entry) {
+	return (char *)entry + STRMAP_ALIGN(sizeof(*entry));
+}
+
+static void strmap_slots_alloc(strmap_t *map, size_t slots_count) {
+	map->slots = xcalloc(slots_count, map->slot_size);
+	map->mask  = slots_count - 1;
+	map->count = 0;
+	map->used  = 0;
+	return;
+}
+
+strmap_t *strmap_new(size_t value_size) {
+	strmap_t *map = xcalloc(1, sizeof(*map));
+
+	map->value_size = value_size;
+	map->slot_size  = STRMAP_ALIGN(sizeof(strmap_entry_t)) + STRMAP_ALIGN(value_size);
+	strmap_slots_alloc(map, STRMAP_SLOTS_MIN);
+
+	return map;
+}
+
+void strmap_free(strmap_t *map) {
+	if (map == NULL)
+		return;
+
+	arena_free(&map->keys);
+	free(map->slots);
+	free(map);
+	return;
+}
+
+// The slots array is shrunk back after a burst of events to not keep
+// iterating over a huge, mostly empty array
+
+void strmap_clear(strmap_t *map) {
+	if (map->mask + 1 > STRMAP_SLOTS_MIN) {
+		free(map->slots);
+		strmap_slots_alloc(map, STRMAP_SLOTS_MIN);
+	} else if (map->used) {
+		memset(map->slots, 0, (map->mask + 1) * map->slot_size);
+		map->count = 0;
+		map->used  = 0;
+	}
+
+	arena_reset(&map->keys);
+	return;
+}
+
+// FNV-1a
+
+strmap_hash_t strmap_hash(const char *key, size_t key_len) {
+	strmap_hash_t hash = 2166136261U;
+	const unsigned char *p = (const unsigned char *)key, *end = p + key_len;
+
+	while (p < end) {
+		hash ^= *(p++);
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static inline int strmap_entry_match(strmap_entry_t *entry, const char *key, size_t key_len, strmap_hash_t hash) {
+	return entry->hash == hash && entry->key_len == key_len && !entry->deleted && !memcmp(entry->key, key, key_len);
+}
+
+static strmap_entry_t *strmap_find(strmap_t *map, const char *key, size_t key_len, strmap_hash_t hash) {
+	size_t i = hash & map->mask;
+
+	while (1) {
+		strmap_entry_t *entry = strmap_slot(map, i);
+
+		if (entry->key == NULL)
+			return NULL;
+		if (strmap_entry_match(entry, key, key_len, hash))
+			return entry;
+
+		i = (i + 1) & map->mask;
+	}
+}
+
+// Puts the entries to a new slots array and copies the keys to a new arena,
+// so the deleted entries and their keys are dropped
+
+static void strmap_resize(strmap_t *map, size_t slots_count) {
+	char	*slots_old	 = map->slots;
+	size_t	 slots_count_old = map->mask + 1;
+	arena_t	 keys_old	 = map->keys;
+	size_t	 i = 0;
+
+	debug(10, "(%p, %zu): count == %zu; used == %zu", map, slots_count, map->count, map->used);
+
+	memset(&map->keys, 0, sizeof(map->keys));
+	strmap_slots_alloc(map, slots_count);
+
+	while (i < slots_count_old) {
+		strmap_entry_t *entry = (strmap_entry_t *)&slots_old[(i++) * map->slot_size];
+
+		if (entry->key == NULL || entry->deleted)
+			continue;
+
+		size_t j = entry->hash & map->mask;
+		while (strmap_slot(map, j)->key != NULL)
+			j = (j + 1) & map->mask;
+
+		strmap_entry_t *entry_new = strmap_slot(map, j);
+		char *key = arena_alloc(&map->keys, entry->key_len + 1);
+		memcpy(key, entry->key, entry->key_len + 1);
+
+		memcpy(entry_new, entry, map->slot_size);
+		entry_new->key = key;
+		map->count++;
+		map->used++;
+	}
+
+	arena_free(&keys_old);
+	free(slots_old);
+	return;
+}
+
+void *strmap_lookup_hashed(strmap_t *map, const char *key, size_t key_len, strmap_hash_t hash) {
+	strmap_entry_t *entry = strmap_find(map, key, key_len, hash);
+
+	return entry == NULL ? NULL : strmap_value(entry);
+}
+
+void *strmap_insert_hashed(strmap_t *map, const char *key, size_t key_len, strmap_hash_t hash, int *isnew_p) {
+	strmap_entry_t *entry = strmap_find(map, key, key_len, hash);
+
+	if (entry != NULL) {
+		*isnew_p = 0;
+		return strmap_value(entry);
+	}
+
+	// Keeping the load (including the deleted entries) under 3/4
+	if ((map->used + 1) * 4 > (map->mask + 1) * 3)
+		strmap_resize(map, (map->count + 1) * 2 > map->mask + 1 ? (map->mask + 1) * 2 : map->mask + 1);
+
+	size_t i = hash & map->mask;
+	while (1) {
+		entry = strmap_slot(map, i);
+		if (entry->key == NULL || entry->deleted)
+			break;
+		i = (i + 1) & map->mask;
+	}
+
+	if (entry->key == NULL)
+		map->used++;
+	map->count++;
+
+	char *key_dup = arena_alloc(&map->keys, key_len + 1);
+	memcpy(key_dup, key, key_len);
+	key_dup[key_len] = 0;
+
+	entry->key     = key_dup;
+	entry->key_len = key_len;
+	entry->hash    = hash;
+	entry->deleted = 0;
+	memset(strmap_value(entry), 0, map->value_size);
+
+	*isnew_p = 1;
+	return strmap_value(entry);
+}
+
+static inline void strmap_entry_remove(strmap_t *map, strmap_entry_t *entry) {
+	// The slot is kept to not break the probe sequences going through it
+	entry->deleted = 1;
+	map->count--;
+	return;
+}
+
+int strmap_remove_hashed(strmap_t *map, const char *key, size_t key_len, strmap_hash_t hash) {
+	strmap_entry_t *entry = strmap_find(map, key, key_len, hash);
+
+	if (entry == NULL)
+		return 0;
+
+	strmap_entry_remove(map, entry);
+	return 1;
+}
+
+// Moves the value of "key_old" to "key_new" (replacing the value of "key_new" if any)
+
+int strmap_rekey(strmap_t *map, const char *key_old, const char *key_new) {
+	size_t key_old_len = strlen(key_old), key_new_len = strlen(key_new);
+	strmap_entry_t *entry = strmap_find(map, key_old, key_old_len, strmap_hash(key_old, key_old_len));
+	int isnew;
+
+	if (entry == NULL)
+		return 0;
+
+	void *value = alloca(map->value_size);
+	memcpy(value, strmap_value(entry), map->value_size);
+	strmap_entry_remove(map, entry);
+
+	memcpy(strmap_insert_hashed(map, key_new, key_new_len, strmap_hash(key_new, key_new_len), &isnew), value, map->value_size);
+	return 1;
+}
+
+// "funct" may remove the entries of the map only by its return value
+
+void strmap_foreach(strmap_t *map, strmap_foreach_funct_t funct, void *arg) {
+	size_t i = 0, slots_count = map->mask + 1;
+
+	while (i < slots_count) {
+		strmap_entry_t *entry = strmap_slot(map, i++);
+
+		if (entry->key == NULL || entry->deleted)
+			continue;
+
+		if (funct(entry, strmap_value(entry), arg))
+			strmap_entry_remove(map, entry);
+	}
+
+	if (!map->count && map->used)
+		strmap_clear(map);
+
+	return;
+}
+
+strmap_t *strmap_dup(strmap_t *map) {
+	strmap_t *dup = xcalloc(1, sizeof(*dup));
+	size_t slots_size = (map->mask + 1) * map->slot_size;
+
+	memcpy(dup, map, sizeof(*dup));
+	memset(&dup->keys, 0, sizeof(dup->keys));
+	dup->slots = xmalloc(slots_size);
+	memcpy(dup->slots, map->slots, slots_size);
+
+	// The keys still point to the arena of "map": strmap_resize() copies them
+	strmap_resize(dup, dup->mask + 1);
+
+	return dup;
+}
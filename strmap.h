@@ -0,0 +1,97 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+    
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLSYNC_STRMAP_H
+#define __CLSYNC_STRMAP_H
+
+#include "malloc.h"
+
+// An open-addressing "path -> value" map for the event tables. The values
+// are stored in the slots (not boxed as pointers), every slot caches the
+// hash and the length of its key, and the keys are copied into an arena of
+// the map. The hash of a key is passed between the tables with the entry,
+// so a path is hashed once on its way from the prequeue to a sync thread.
+//
+// A pointer to a value is valid until the next insertion into the map.
+
+typedef uint32_t strmap_hash_t;
+
+struct strmap_entry {
+	const char	*key;		// NULL if the slot is empty
+	size_t		 key_len;
+	strmap_hash_t	 hash;
+	int		 deleted;
+};
+typedef struct strmap_entry strmap_entry_t;
+
+struct strmap {
+	char		*slots;		// the entries interleaved with the values
+	size_t		 slot_size;
+	size_t		 value_size;
+	size_t		 mask;		// the count of slots minus one
+	size_t		 count;
+	size_t		 used;		// "count" plus the deleted entries
+	arena_t		 keys;
+};
+typedef struct strmap strmap_t;
+
+// Returns non-zero to remove the entry from the map
+
+typedef int (*strmap_foreach_funct_t)(strmap_entry_t *entry, void *value, void *arg);
+
+extern strmap_t *strmap_new(size_t value_size);
+extern strmap_t *strmap_dup(strmap_t *map);
+extern void      strmap_free(strmap_t *map);
+extern void      strmap_clear(strmap_t *map);
+extern strmap_hash_t strmap_hash(const char *key, size_t key_len);
+extern void     *strmap_lookup_hashed(strmap_t *map, const char *key, size_t key_len, strmap_hash_t hash);
+extern void     *strmap_insert_hashed(strmap_t *map, const char *key, size_t key_len, strmap_hash_t hash, int *isnew_p);
+extern int       strmap_remove_hashed(strmap_t *map, const char *key, size_t key_len, strmap_hash_t hash);
+extern int       strmap_rekey(strmap_t *map, const char *key_old, const char *key_new);
+extern void      strmap_foreach(strmap_t *map, strmap_foreach_funct_t funct, void *arg);
+
+static inline void *strmap_lookup(strmap_t *map, const char *key) {
+	size_t key_len = strlen(key);
+	return strmap_lookup_hashed(map, key, key_len, strmap_hash(key, key_len));
+}
+
+// Returns the value of "key" (zeroed if "*isnew_p" is set to 1)
+
+static inline void *strmap_insert(strmap_t *map, const char *key, int *isnew_p) {
+	size_t key_len = strlen(key);
+	return strmap_insert_hashed(map, key, key_len, strmap_hash(key, key_len), isnew_p);
+}
+
+static inline int strmap_remove(strmap_t *map, const char *key) {
+	size_t key_len = strlen(key);
+	return strmap_remove_hashed(map, key, key_len, strmap_hash(key, key_len));
+}
+
+// Return: bytes allocated by the map (the slots and the keys)
+
+static inline size_t strmap_memsize(strmap_t *map) {
+	return sizeof(*map) + (map->mask+1) * map->slot_size + map->keys.allocated;
+}
+
+static inline size_t strmap_count(strmap_t *map) {
+	return map->count;
+}
+
+#endif
+
@@ -48,6 +48,9 @@
 #include "indexes.h"
 #include "privileged.h"
 #include "rules.h"
+#include "statbatch.h"
+#include "treewalk.h"
+#include "coprocess.h"
 #if CGROUP_SUPPORT
 #	include "cgroup.h"
 #endif
@@ -58,6 +61,22 @@
 
 pthread_t pthread_sighandler;
 
+#ifdef EPOLL_SUPPORT
+// The main loop waits in a single epoll_wait() on all of these descriptors
+enum evloop_fd {
+	EVLOOP_MONITOR = 0,	// FS monitor subsystem (inotify_d or the ring notification pipe)
+	EVLOOP_TIMER,		// timerfd armed to the nearest queue/thread deadline
+	EVLOOP_THREADS,		// eventfd written by finished sync threads
+
+	EVLOOP_MAX
+};
+
+static struct evloop {
+	int epoll_fd;
+	int fd[EVLOOP_MAX];
+} evloop = {-1, {-1, -1, -1}};
+#endif
+
 // seqid - is a counter of main loop. But it may overflow and it's required to compare
 // seqid-values anyway.
 // So if (a-b) is too big, let's assume, that "b<a".
@@ -72,6 +91,21 @@ static inline unsigned int sync_seqid() {
 	return _sync_seqid_value++;
 }
 
+// The collect/sync delays are in milliseconds and are measured on CLOCK_MONOTONIC
+static inline uint64_t clock_monotonic_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static inline void sleep_ms(unsigned int ms) {
+	struct timespec ts;
+	ts.tv_sec  = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+	return;
+}
+
 static inline void setenv_iteration(uint32_t iteration_num)
 {
 	char iterations[sizeof("4294967296")];	// 4294967296 == 2**32
@@ -94,15 +128,6 @@ static inline void finish_iteration(ctx_t *ctx_p) {
 	return;
 }
 
-gpointer eidup(gpointer ei_gp) {
-	eventinfo_t *ei = (eventinfo_t *)ei_gp;
-
-	eventinfo_t *ei_dup = (eventinfo_t *)xmalloc(sizeof(*ei));
-	memcpy(ei_dup, ei, sizeof(*ei));
-
-	return (gpointer)ei_dup;
-}
-
 static inline void evinfo_merge(ctx_t *ctx_p, eventinfo_t *evinfo_dst, eventinfo_t *evinfo_src) {
 	debug(3, "evinfo_dst: seqid_min == %u; seqid_max == %u; objtype_old == %i; objtype_new == %i; \t"
 			"evinfo_src: seqid_min == %u; seqid_max == %u; objtype_old == %i; objtype_new == %i",
@@ -239,6 +264,106 @@ int threads_foreach(int (*funct)(threadinfo_t *, void *), state_t state, void *a
 	return thread_info_unlock(rc);
 }
 
+/*
+ * The threads with expiretime are kept in a binary min-heap of their numbers
+ * ordered by expiretime, so the nearest deadline is known without scanning
+ * all the threads. Every heap function is called with the threads info lock
+ * held.
+ */
+
+static inline time_t thread_expireheap_key(threadsinfo_t *threadsinfo_p, int pos) {
+	return threadsinfo_p->threads[threadsinfo_p->expireheap[pos]].expiretime;
+}
+
+static inline void thread_expireheap_place(threadsinfo_t *threadsinfo_p, int pos, int thread_num) {
+	threadsinfo_p->expireheap[pos] = thread_num;
+	threadsinfo_p->threads[thread_num].expireheap_pos = pos;
+	return;
+}
+
+static void thread_expireheap_siftup(threadsinfo_t *threadsinfo_p, int pos) {
+	int    thread_num = threadsinfo_p->expireheap[pos];
+	time_t expiretime = threadsinfo_p->threads[thread_num].expiretime;
+
+	while (pos) {
+		int parent = (pos - 1) / 2;
+
+		if (thread_expireheap_key(threadsinfo_p, parent) <= expiretime)
+			break;
+
+		thread_expireheap_place(threadsinfo_p, pos, threadsinfo_p->expireheap[parent]);
+		pos = parent;
+	}
+
+	thread_expireheap_place(threadsinfo_p, pos, thread_num);
+	return;
+}
+
+static void thread_expireheap_siftdown(threadsinfo_t *threadsinfo_p, int pos) {
+	int    thread_num = threadsinfo_p->expireheap[pos];
+	time_t expiretime = threadsinfo_p->threads[thread_num].expiretime;
+
+	while (1) {
+		int child = pos*2 + 1;
+
+		if (child >= threadsinfo_p->expireheaplen)
+			break;
+
+		if ((child+1 < threadsinfo_p->expireheaplen) && (thread_expireheap_key(threadsinfo_p, child+1) < thread_expireheap_key(threadsinfo_p, child)))
+			child++;
+
+		if (expiretime <= thread_expireheap_key(threadsinfo_p, child))
+			break;
+
+		thread_expireheap_place(threadsinfo_p, pos, threadsinfo_p->expireheap[child]);
+		pos = child;
+	}
+
+	thread_expireheap_place(threadsinfo_p, pos, thread_num);
+	return;
+}
+
+static void thread_expireheap_remove(threadsinfo_t *threadsinfo_p, threadinfo_t *threadinfo_p) {
+	int pos = threadinfo_p->expireheap_pos, thread_num_last;
+
+	if (pos == -1)
+		return;
+
+	threadinfo_p->expireheap_pos = -1;
+
+	if (pos == --threadsinfo_p->expireheaplen)
+		return;
+
+	// Moving the last element to the freed position and restoring the heap order around it
+	thread_num_last = threadsinfo_p->expireheap[threadsinfo_p->expireheaplen];
+	thread_expireheap_place(threadsinfo_p, pos, thread_num_last);
+	thread_expireheap_siftup  (threadsinfo_p, pos);
+	thread_expireheap_siftdown(threadsinfo_p, threadsinfo_p->threads[thread_num_last].expireheap_pos);
+	return;
+}
+
+static void thread_expiretime_set(threadinfo_t *threadinfo_p, time_t expiretime) {
+	threadsinfo_t *threadsinfo_p = thread_info_lock();
+#ifdef PARANOID
+	if (threadsinfo_p == NULL) {
+		thread_info_unlock(0);
+		return;
+	}
+#endif
+
+	thread_expireheap_remove(threadsinfo_p, threadinfo_p);
+	threadinfo_p->expiretime = expiretime;
+
+	if (expiretime) {
+		int pos = threadsinfo_p->expireheaplen++;
+		thread_expireheap_place(threadsinfo_p, pos, threadinfo_p->thread_num);
+		thread_expireheap_siftup(threadsinfo_p, pos);
+	}
+
+	thread_info_unlock(0);
+	return;
+}
+
 time_t thread_nextexpiretime() {
 	time_t nextexpiretime = 0;
 	threadsinfo_t *threadsinfo_p = thread_info_lock();
@@ -247,27 +372,118 @@ time_t thread_nextexpiretime() {
 		return thread_info_unlock(0);
 #endif
 
-	int thread_num = threadsinfo_p->used;
+	if (threadsinfo_p->expireheaplen)
+		nextexpiretime = thread_expireheap_key(threadsinfo_p, 0);
 
-	while(thread_num--) {
-		threadinfo_t *threadinfo_p = &threadsinfo_p->threads[thread_num];
-		debug(3, "threadsinfo_p->threads[%i].state == %i;\tthreadsinfo_p->threads[%i].pthread == %p;\tthreadsinfo_p->threads[%i].expiretime == %i", 
-			thread_num, threadinfo_p->state,thread_num, threadinfo_p->pthread, thread_num, threadinfo_p->expiretime);
+	thread_info_unlock(0);
+	debug(3, "nextexpiretime == %i", nextexpiretime);
+	return nextexpiretime;
+}
 
-		if(threadinfo_p->state == STATE_EXIT)
-			continue;
+// The paths being synced by a thread are indexed to check if a path is locked
+// by the thread with one descent (see sync_islocked())
 
-		if(threadinfo_p->expiretime) {
-			if(nextexpiretime)
-				nextexpiretime = MIN(nextexpiretime, threadinfo_p->expiretime);
-			else
-				nextexpiretime = threadinfo_p->expiretime;
-		}
+static int thread_lockset_add(strmap_entry_t *entry, void *evinfo_v, void *tree_v) {
+	pathtree_set(tree_v, entry->key, ((eventinfo_t *)evinfo_v)->flags, NULL);
+	return 0;
+}
+
+/*
+ * The paths locked by all the running threads are merged into one index.
+ * The index is rebuilt under the threads info lock when a thread starts or
+ * finishes and is published by a pointer swap, so sync_islocked() reads it
+ * without any lock and doesn't depend on the count of the threads. Only the
+ * main thread reads the index, so the replaced indexes are freed by the
+ * main thread in thread_gc() where it doesn't hold any of them.
+ */
+
+static pathtree_t  *thread_lockindex         = NULL;
+static pathtree_t **thread_lockindex_retired = NULL;
+static size_t       thread_lockindex_retired_count = 0;
+static size_t       thread_lockindex_retired_alloc = 0;
+
+static int thread_lockindex_add(const char *path, uint32_t flags, void *data, void *tree_v) {
+	uint32_t flags_old;
+
+	if (pathtree_get(tree_v, path, &flags_old, NULL))
+		flags |= flags_old;
+
+	pathtree_set(tree_v, path, flags, NULL);
+	return 0;
+}
+
+// Is called with the threads info lock held
+
+static void thread_lockindex_rebuild(threadsinfo_t *threadsinfo_p) {
+	pathtree_t *tree = pathtree_new(), *tree_old;
+	int i = 0;
+
+	while (i < threadsinfo_p->used) {
+		threadinfo_t *threadinfo_p = &threadsinfo_p->threads[i++];
+
+		if ((threadinfo_p->state == STATE_RUNNING) && (threadinfo_p->fpath2ei_tree != NULL))
+			pathtree_foreach(threadinfo_p->fpath2ei_tree, thread_lockindex_add, tree);
+	}
+
+	if (!pathtree_count(tree)) {
+		pathtree_free(tree);
+		tree = NULL;
+	}
+
+	tree_old = __atomic_exchange_n(&thread_lockindex, tree, __ATOMIC_ACQ_REL);
+	if (tree_old == NULL)
+		return;
+
+	if (thread_lockindex_retired_count >= thread_lockindex_retired_alloc) {
+		thread_lockindex_retired_alloc += ALLOC_PORTION;
+		thread_lockindex_retired = xrealloc(thread_lockindex_retired, thread_lockindex_retired_alloc * sizeof(*thread_lockindex_retired));
+	}
+	thread_lockindex_retired[thread_lockindex_retired_count++] = tree_old;
+	return;
+}
+
+// Is called by the main thread with the threads info lock held
+
+static void thread_lockindex_reclaim() {
+	while (thread_lockindex_retired_count)
+		pathtree_free(thread_lockindex_retired[--thread_lockindex_retired_count]);
+
+	return;
+}
+
+static void thread_lockindex_free() {
+	thread_lockindex_reclaim();
+	free(thread_lockindex_retired);
+	thread_lockindex_retired       = NULL;
+	thread_lockindex_retired_alloc = 0;
+
+	if (thread_lockindex != NULL)
+		pathtree_free(thread_lockindex);
+	thread_lockindex = NULL;
+	return;
+}
+
+static inline void thread_lockset_init(ctx_t *ctx_p, indexes_t *indexes_p, threadinfo_t *threadinfo_p) {
+	threadinfo_p->fpath2ei_tree = NULL;
+
+	if (ctx_p->flags[THREADING] != PM_SAFE)
+		return;
+
+	pathtree_t *tree = pathtree_new();
+	strmap_foreach(threadinfo_p->fpath2ei_ht, thread_lockset_add, tree);
+
+	// The renames are passed to the handler with the events of the thread
+	if (indexes_p->renames_lockset != NULL) {
+		pathtree_foreach(indexes_p->renames_lockset, thread_lockindex_add, tree);
+		pathtree_free(indexes_p->renames_lockset);
+		indexes_p->renames_lockset = NULL;
 	}
 
+	threadsinfo_t *threadsinfo_p = thread_info_lock();
+	threadinfo_p->fpath2ei_tree = tree;
+	thread_lockindex_rebuild(threadsinfo_p);
 	thread_info_unlock(0);
-	debug(3, "nextexpiretime == %i", nextexpiretime);
-	return nextexpiretime;
+	return;
 }
 
 threadinfo_t *thread_new() {
@@ -293,6 +509,10 @@ threadinfo_t *thread_new() {
 											sizeof(*threadsinfo_p->threads)     *(threadsinfo_p->allocated+2));
 			threadsinfo_p->threadsstack = (threadinfo_t **)xrealloc((char *)threadsinfo_p->threadsstack,
 											sizeof(*threadsinfo_p->threadsstack)*(threadsinfo_p->allocated+2));
+			threadsinfo_p->threadsdone  = (int *)          xrealloc((char *)threadsinfo_p->threadsdone,
+											sizeof(*threadsinfo_p->threadsdone) *(threadsinfo_p->allocated+2));
+			threadsinfo_p->expireheap   = (int *)          xrealloc((char *)threadsinfo_p->expireheap,
+											sizeof(*threadsinfo_p->expireheap)  *(threadsinfo_p->allocated+2));
 		}
 
 		thread_num = threadsinfo_p->used++;
@@ -306,6 +526,8 @@ threadinfo_t *thread_new() {
 	threadinfo_p->errcode    = 0;
 	threadinfo_p->exitcode   = 0;
 #endif
+	threadinfo_p->fpath2ei_tree  = NULL;
+	threadinfo_p->expireheap_pos = -1;
 	threadinfo_p->thread_num = thread_num;
 	threadinfo_p->state	 = STATE_RUNNING;
 
@@ -328,6 +550,10 @@ int thread_del_bynum(int thread_num) {
 
 	threadinfo_t *threadinfo_p = &threadsinfo_p->threads[thread_num];
 	threadinfo_p->state = STATE_EXIT;
+	thread_expireheap_remove(threadsinfo_p, threadinfo_p);
+
+	pathtree_free(threadinfo_p->fpath2ei_tree);
+	threadinfo_p->fpath2ei_tree = NULL;
 
 	char **ptr = threadinfo_p->argv;
 	if(ptr != NULL) {
@@ -363,7 +589,6 @@ int thread_del_bynum(int thread_num) {
 }
 
 int thread_gc(ctx_t *ctx_p) {
-	int thread_num;
 	time_t tm = time(NULL);
 	debug(3, "tm == %i; thread %p", tm, pthread_self());
 	if (!ctx_p->flags[THREADING])
@@ -375,44 +600,29 @@ int thread_gc(ctx_t *ctx_p) {
 		return thread_info_unlock(errno);
 #endif
 
-	debug(2, "There're %i threads.", threadsinfo_p->used);
-	thread_num=-1;
-	while (++thread_num < threadsinfo_p->used) {
-		int err;
+	thread_lockindex_reclaim();
+
+	// Joining only the threads that reported their finish by thread_exit()
+
+	debug(2, "There're %i threads; %i of them are finished.", threadsinfo_p->used - threadsinfo_p->stacklen, threadsinfo_p->threadsdonelen);
+	while (threadsinfo_p->threadsdonelen) {
+		int err, thread_num = threadsinfo_p->threadsdone[--threadsinfo_p->threadsdonelen];
 		threadinfo_t *threadinfo_p = &threadsinfo_p->threads[thread_num];
 
 		debug(3, "Trying thread #%i (==%i) (state: %i; expire at: %i, now: %i, exitcode: %i, errcode: %i; i_p: %p; p: %p).", 
 			thread_num, threadinfo_p->thread_num, threadinfo_p->state, threadinfo_p->expiretime, tm, threadinfo_p->exitcode, 
 			threadinfo_p->errcode, threadinfo_p, threadinfo_p->pthread);
 
-		if (threadinfo_p->state == STATE_EXIT)
-			continue;
-
-		if (threadinfo_p->expiretime && (threadinfo_p->expiretime <= tm)) {
-			if(pthread_tryjoin_np(threadinfo_p->pthread, NULL)) {	// TODO: check this pthread_tryjoin_np() on error returnings
-				error("Debug3: thread_gc(): Thread #%i is alive too long: %lu <= %lu (started at %lu)", thread_num, threadinfo_p->expiretime, tm, threadinfo_p->starttime);
-				return thread_info_unlock(ETIME);
-			}
-		}
-
-#ifndef VERYPARANOID
+#ifdef PARANOID
 		if (threadinfo_p->state != STATE_TERM) {
-			debug(3, "Thread #%i is busy, skipping (#0).", thread_num);
-			continue;
+			error("Thread #%i is in the finished threads list, but its state is %i.", thread_num, threadinfo_p->state);
+			return thread_info_unlock(EINVAL);
 		}
 #endif
 
-
 		debug(3, "Trying to join thread #%i: %p", thread_num, threadinfo_p->pthread);
 
-#ifndef VERYPARANOID
 		switch ((err=pthread_join(threadinfo_p->pthread, NULL))) {
-#else
-		switch ((err=pthread_tryjoin_np(threadinfo_p->pthread, NULL))) {
-			case EBUSY:
-				debug(3, "Thread #%i is busy, skipping (#1).", thread_num);
-				continue;
-#endif
 			case EDEADLK:
 			case EINVAL:
 			case 0:
@@ -420,16 +630,16 @@ int thread_gc(ctx_t *ctx_p) {
 					thread_num, threadinfo_p->exitcode, threadinfo_p->errcode, threadinfo_p);
 				break;
 			default:
-				error("Got error while pthread_join() or pthread_tryjoin_np().", strerror(err), err);
-				return thread_info_unlock(errno);
-
+				error("Got error while pthread_join().", strerror(err), err);
+				return thread_info_unlock(err);
 		}
 
 		if (threadinfo_p->errcode) {
-			error("Got error from thread #%i: errcode %i.", thread_num, threadinfo_p->errcode);
+			int errcode = threadinfo_p->errcode;
+			error("Got error from thread #%i: errcode %i.", thread_num, errcode);
 			thread_info_unlock(0);
 			thread_del_bynum(thread_num);
-			return threadinfo_p->errcode;
+			return errcode;
 		}
 
 		thread_info_unlock(0);
@@ -438,6 +648,24 @@ int thread_gc(ctx_t *ctx_p) {
 		thread_info_lock();
 	}
 
+	// thread_exit() drops the finished threads from the heap, but a not running thread on the top
+	// would hide the expired ones below it, so such threads are dropped here, too
+
+	while (threadsinfo_p->expireheaplen) {
+		threadinfo_t *threadinfo_p = &threadsinfo_p->threads[threadsinfo_p->expireheap[0]];
+
+		if (threadinfo_p->state != STATE_RUNNING) {
+			thread_expireheap_remove(threadsinfo_p, threadinfo_p);
+			continue;
+		}
+
+		if (threadinfo_p->expiretime <= tm) {
+			error("Debug3: thread_gc(): Thread #%i is alive too long: %lu <= %lu (started at %lu)", threadinfo_p->thread_num, threadinfo_p->expiretime, tm, threadinfo_p->starttime);
+			return thread_info_unlock(ETIME);
+		}
+		break;
+	}
+
 	debug(3, "There're %i threads left.", threadsinfo_p->used - threadsinfo_p->stacklen);
 	return thread_info_unlock(0);
 }
@@ -472,13 +700,18 @@ int thread_cleanup(ctx_t *ctx_p) {
 		while (*ptr)
 			free(*(ptr++));
 		free(threadinfo_p->argv);
+		pathtree_free(threadinfo_p->fpath2ei_tree);
 	}
 	debug(3, "All threads are closed.");
 
 	// Freeing
+	thread_lockindex_free();
+
 	if (threadsinfo_p->allocated) {
 		free(threadsinfo_p->threads);
 		free(threadsinfo_p->threadsstack);
+		free(threadsinfo_p->threadsdone);
+		free(threadsinfo_p->expireheap);
 	}
 
 	if (threadsinfo_p->mutex_init) {
@@ -513,6 +746,11 @@ int exec_argv(char **argv, int *child_pid) {
 //	debug(3, "After fork thread %p"")".", pthread_self() );
 	debug(3, "Child pid is %u", pid);
 
+	if (pid == -1) {
+		error("Cannot start \"%s\".", argv[0]);
+		return errno ? errno : ECHILD;
+	}
+
 	// Setting *child_pid value
 	if (child_pid)
 		*child_pid = pid;
@@ -576,7 +814,22 @@ static inline int thread_exit(threadinfo_t *threadinfo_p, int exitcode ) {
 	}
 
 	// Notifying the parent-thread, that it's time to collect garbage threads
+	threadsinfo_t *threadsinfo_p = thread_info_lock();
 	threadinfo_p->state    = STATE_TERM;
+	threadsinfo_p->threadsdone[threadsinfo_p->threadsdonelen++] = threadinfo_p->thread_num;
+	thread_expireheap_remove(threadsinfo_p, threadinfo_p);		// The deadline doesn't matter anymore
+	if (threadinfo_p->fpath2ei_tree != NULL)
+		thread_lockindex_rebuild(threadsinfo_p);	// Unlocking the paths of the thread
+	thread_info_unlock(0);
+#ifdef EPOLL_SUPPORT
+	if ((evloop.fd[EVLOOP_THREADS] != -1) && (threadinfo_p->ctx_p->flags[THREADING] != PM_OFF)) {
+		uint64_t one = 1;
+		debug(3, "thread %p is notifying the main loop to call GC", threadinfo_p->pthread);
+		if (write(evloop.fd[EVLOOP_THREADS], &one, sizeof(one)) == sizeof(one))
+			return 0;
+		error("Cannot write() to the thread completion eventfd, falling back to the signal.");
+	}
+#endif
 	debug(3, "thread %p is sending signal to sighandler to call GC", threadinfo_p->pthread);
 	return pthread_kill(pthread_sighandler, SIGUSR_THREAD_GC);
 }
@@ -593,6 +846,8 @@ static inline void so_call_sync_finished(int n, api_eventinfo_t *ei) {
 		}
 #endif
 		free((char *)ei_i->path);
+		if (ei_i->path_old != NULL)
+			free((char *)ei_i->path_old);
 		ei_i++;
 		i++;
 	}
@@ -621,8 +876,8 @@ int so_call_sync_thread(threadinfo_t *threadinfo_p) {
 			try_again = ((!ctx_p->retries) || (threadinfo_p->try_n < ctx_p->retries)) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT);
 			warning("Bad exitcode %i (errcode %i). %s.", rc, err, try_again?"Retrying":"Give up");
 			if (try_again) {
-				debug(2, "Sleeping for %u seconds before the retry.", ctx_p->syncdelay);
-				sleep(ctx_p->syncdelay);
+				debug(2, "Sleeping for %u ms before the retry.", ctx_p->syncdelay);
+				sleep_ms(ctx_p->syncdelay);
 			}
 		}
 
@@ -672,8 +927,8 @@ static inline int so_call_sync(ctx_t *ctx_p, indexes_t *indexes_p, int n, api_ev
 				try_again = ((!ctx_p->retries) || (try_n < ctx_p->retries)) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT);
 				warning("Bad exitcode %i (errcode %i). %s.", rc, err, try_again?"Retrying":"Give up");
 				if (try_again) {
-					debug(2, "Sleeping for %u seconds before the retry.", ctx_p->syncdelay);
-					sleep(ctx_p->syncdelay);
+					debug(2, "Sleeping for %u ms before the retry.", ctx_p->syncdelay);
+					sleep_ms(ctx_p->syncdelay);
 				}
 			}
 		} while (err && ((!ctx_p->retries) || (try_n < ctx_p->retries)) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT));
@@ -702,13 +957,14 @@ static inline int so_call_sync(ctx_t *ctx_p, indexes_t *indexes_p, int n, api_ev
 	threadinfo_p->argv        = NULL;
 	threadinfo_p->ctx_p       = ctx_p;
 	threadinfo_p->starttime	  = time(NULL);
-	threadinfo_p->fpath2ei_ht = g_hash_table_dup(indexes_p->fpath2ei_ht, g_str_hash, g_str_equal, free, free, (gpointer(*)(gpointer))strdup, eidup);
+	threadinfo_p->fpath2ei_ht = strmap_dup(indexes_p->fpath2ei_ht);
+	thread_lockset_init(ctx_p, indexes_p, threadinfo_p);
 	threadinfo_p->n           = n;
 	threadinfo_p->ei          = ei;
 	threadinfo_p->iteration   = ctx_p->iteration_num;
 
 	if (ctx_p->synctimeout)
-		threadinfo_p->expiretime = threadinfo_p->starttime + ctx_p->synctimeout;
+		thread_expiretime_set(threadinfo_p, threadinfo_p->starttime + ctx_p->synctimeout);
 
 	if (pthread_create(&threadinfo_p->pthread, NULL, (void *(*)(void *))so_call_sync_thread, threadinfo_p)) {
 		error("Cannot pthread_create().");
@@ -764,8 +1020,8 @@ int so_call_rsync_thread(threadinfo_t *threadinfo_p) {
 			try_again = ((!ctx_p->retries) || (threadinfo_p->try_n < ctx_p->retries)) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT);
 			warning("Bad exitcode %i (errcode %i). %s.", rc, err, try_again?"Retrying":"Give up");
 			if (try_again) {
-				debug(2, "Sleeping for %u seconds before the retry.", ctx_p->syncdelay);
-				sleep(ctx_p->syncdelay);
+				debug(2, "Sleeping for %u ms before the retry.", ctx_p->syncdelay);
+				sleep_ms(ctx_p->syncdelay);
 			}
 		}
 	} while (try_again);
@@ -821,8 +1077,8 @@ static inline int so_call_rsync(ctx_t *ctx_p, indexes_t *indexes_p, const char *
 				try_again = ((!ctx_p->retries) || (try_n < ctx_p->retries)) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT);
 				warning("Bad exitcode %i (errcode %i). %s.", rc, err, try_again?"Retrying":"Give up");
 				if (try_again) {
-					debug(2, "Sleeping for %u seconds before the retry.", ctx_p->syncdelay);
-					sleep(ctx_p->syncdelay);
+					debug(2, "Sleeping for %u ms before the retry.", ctx_p->syncdelay);
+					sleep_ms(ctx_p->syncdelay);
 				}
 			}
 		} while (try_again);
@@ -853,14 +1109,15 @@ static inline int so_call_rsync(ctx_t *ctx_p, indexes_t *indexes_p, const char *
 	threadinfo_p->argv        = xmalloc(sizeof(char *) * 3);
 	threadinfo_p->ctx_p       = ctx_p;
 	threadinfo_p->starttime	  = time(NULL);
-	threadinfo_p->fpath2ei_ht = g_hash_table_dup(indexes_p->fpath2ei_ht, g_str_hash, g_str_equal, free, free, (gpointer(*)(gpointer))strdup, eidup);
+	threadinfo_p->fpath2ei_ht = strmap_dup(indexes_p->fpath2ei_ht);
+	thread_lockset_init(ctx_p, indexes_p, threadinfo_p);
 	threadinfo_p->iteration   = ctx_p->iteration_num;
 
 	threadinfo_p->argv[0]	  = strdup(inclistfile);
 	threadinfo_p->argv[1]	  = strdup(exclistfile);
 
 	if(ctx_p->synctimeout)
-		threadinfo_p->expiretime = threadinfo_p->starttime + ctx_p->synctimeout;
+		thread_expiretime_set(threadinfo_p, threadinfo_p->starttime + ctx_p->synctimeout);
 
 	if(pthread_create(&threadinfo_p->pthread, NULL, (void *(*)(void *))so_call_rsync_thread, threadinfo_p)) {
 		error("Cannot pthread_create().");
@@ -940,6 +1197,18 @@ char *sync_path_rel2abs(ctx_t *ctx_p, const char *path_rel, size_t path_rel_len,
 	return path_abs;
 }
 
+// The same as sync_path_abs2rel() but returns a pointer into "path_abs" instead of a copy
+
+const char *sync_path_abs2rel_inplace(ctx_t *ctx_p, const char *path_abs, size_t path_abs_len) {
+	size_t watchdirlen = 
+		(ctx_p->watchdir == ctx_p->watchdirwslash) ? 0 : ctx_p->watchdirlen;
+
+	if (path_abs_len <= watchdirlen+1)
+		return &path_abs[path_abs_len];	// ""
+
+	return &path_abs[watchdirlen+1];
+}
+
 char *sync_path_abs2rel(ctx_t *ctx_p, const char *path_abs, size_t path_abs_len, size_t *path_rel_len_p, char *path_rel_oldptr) {
 	if (path_abs == NULL)
 		return NULL;
@@ -1008,6 +1277,15 @@ pid_t clsyncapi_fork(ctx_t *ctx_p) {
 	return pid;
 }
 
+// The handler is called by a coprocess if "--handler-workers" is set
+
+static inline int sync_exec_handler(ctx_t *ctx_p, char **argv, int *child_pid) {
+	if (ctx_p->flags[HANDLERWORKERS])
+		return coprocess_call(ctx_p, argv, child_pid);
+
+	return exec_argv(argv, child_pid);
+}
+
 int sync_exec_argv(ctx_t *ctx_p, indexes_t *indexes_p, thread_callbackfunct_t callback, thread_callbackfunct_arg_t *callback_arg_p, char **argv) {
 	debug(2, "");
 
@@ -1026,7 +1304,7 @@ int sync_exec_argv(ctx_t *ctx_p, indexes_t *indexes_p, thread_callbackfunct_t ca
 
 		alarm(ctx_p->synctimeout);
 		ctx_p->children = 1;
-		exitcode = exec_argv(argv, ctx_p->child_pid );
+		exitcode = sync_exec_handler(ctx_p, argv, ctx_p->child_pid);
 		ctx_p->children = 0;
 		alarm(0);
 
@@ -1039,8 +1317,8 @@ int sync_exec_argv(ctx_t *ctx_p, indexes_t *indexes_p, thread_callbackfunct_t ca
 			try_again = ((!ctx_p->retries) || (try_n < ctx_p->retries)) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT);
 			warning("Bad exitcode %i (errcode %i). %s.", exitcode, err, try_again?"Retrying":"Give up");
 			if (try_again) {
-				debug(2, "Sleeping for %u seconds before the retry.", ctx_p->syncdelay);
-				sleep(ctx_p->syncdelay);
+				debug(2, "Sleeping for %u ms before the retry.", ctx_p->syncdelay);
+				sleep_ms(ctx_p->syncdelay);
 			}
 		}
 	} while(try_again);
@@ -1095,14 +1373,14 @@ int __sync_exec_thread(threadinfo_t *threadinfo_p) {
 		try_again = 0;
 		threadinfo_p->try_n++;
 
-		exec_exitcode = exec_argv(argv, &threadinfo_p->child_pid );
+		exec_exitcode = sync_exec_handler(ctx_p, argv, &threadinfo_p->child_pid);
 
 		if ((err=exitcode_process(threadinfo_p->ctx_p, exec_exitcode))) {
 			try_again = ((!ctx_p->retries) || (threadinfo_p->try_n < ctx_p->retries)) && (ctx_p->state != STATE_TERM) && (ctx_p->state != STATE_EXIT);
 			warning("__sync_exec_thread(): Bad exitcode %i (errcode %i). %s.", exec_exitcode, err, try_again?"Retrying":"Give up");
 			if (try_again) {
-				debug(2, "Sleeping for %u seconds before the retry.", ctx_p->syncdelay);
-				sleep(ctx_p->syncdelay);
+				debug(2, "Sleeping for %u ms before the retry.", ctx_p->syncdelay);
+				sleep_ms(ctx_p->syncdelay);
 			}
 		}
 
@@ -1113,7 +1391,11 @@ int __sync_exec_thread(threadinfo_t *threadinfo_p) {
 		threadinfo_p->errcode = err;
 	}
 
-	g_hash_table_destroy(threadinfo_p->fpath2ei_ht);
+	// The copy is counted by the main thread (see sync_meminfo_threads())
+	thread_info_lock();
+	strmap_free(threadinfo_p->fpath2ei_ht);
+	threadinfo_p->fpath2ei_ht = NULL;
+	thread_info_unlock(0);
 
 	if ((err=thread_exit(threadinfo_p, exec_exitcode))) {
 		exitcode = err;	// This's global variable "exitcode"
@@ -1140,11 +1422,12 @@ static inline int sync_exec_argv_thread(ctx_t *ctx_p, indexes_t *indexes_p, thre
 	threadinfo_p->argv         = argv;
 	threadinfo_p->ctx_p        = ctx_p;
 	threadinfo_p->starttime	   = time(NULL);
-	threadinfo_p->fpath2ei_ht  = g_hash_table_dup(indexes_p->fpath2ei_ht, g_str_hash, g_str_equal, free, free, (gpointer(*)(gpointer))strdup, eidup);
+	threadinfo_p->fpath2ei_ht  = strmap_dup(indexes_p->fpath2ei_ht);
+	thread_lockset_init(ctx_p, indexes_p, threadinfo_p);
 	threadinfo_p->iteration    = ctx_p->iteration_num;
 
 	if (ctx_p->synctimeout)
-		threadinfo_p->expiretime = threadinfo_p->starttime + ctx_p->synctimeout;
+		thread_expiretime_set(threadinfo_p, threadinfo_p->starttime + ctx_p->synctimeout);
 
 	if (pthread_create(&threadinfo_p->pthread, NULL, (void *(*)(void *))__sync_exec_thread, threadinfo_p)) {
 		error("Cannot pthread_create().");
@@ -1169,7 +1452,9 @@ static inline int sync_exec_thread(ctx_t *ctx_p, indexes_t *indexes_p, thread_ca
 
 // } === SYNC_EXEC() ===
 
-static int sync_queuesync(const char *fpath_rel, eventinfo_t *evinfo, ctx_t *ctx_p, indexes_t *indexes_p, queue_id_t queue_id) {
+// "hash" is the strmap_hash() of "fpath_rel" (it's carried between the event tables)
+
+static int _sync_queuesync(const char *fpath_rel, size_t fpath_rel_len, strmap_hash_t hash, eventinfo_t *evinfo, ctx_t *ctx_p, indexes_t *indexes_p, queue_id_t queue_id) {
 
 	debug(3, "sync_queuesync(\"%s\", ...): fsize == %lu; tres == %lu, queue_id == %u", fpath_rel, evinfo->fsize, ctx_p->bfilethreshold, queue_id);
 	if(queue_id == QUEUE_AUTO)
@@ -1178,7 +1463,7 @@ static int sync_queuesync(const char *fpath_rel, eventinfo_t *evinfo, ctx_t *ctx
 	queueinfo_t *queueinfo = &ctx_p->_queues[queue_id];
 
 	if(!queueinfo->stime)
-		queueinfo->stime = time(NULL);
+		queueinfo->stime = clock_monotonic_ms();
 
 //	char *fpath_rel = sync_path_abs2rel(ctx_p, fpath, -1, NULL, NULL);
 
@@ -1194,23 +1479,28 @@ static int sync_queuesync(const char *fpath_rel, eventinfo_t *evinfo, ctx_t *ctx
 		cluster_capture(fpath_rel);
 #endif
 
-	eventinfo_t *evinfo_q   = indexes_lookupinqueue(indexes_p, fpath_rel, queue_id);
-	if(evinfo_q == NULL) {
-		eventinfo_t *evinfo_dup = (eventinfo_t *)xmalloc(sizeof(*evinfo_dup));
-		memcpy(evinfo_dup, evinfo, sizeof(*evinfo_dup));
-		return indexes_queueevent(indexes_p, strdup(fpath_rel), evinfo_dup, queue_id);
-	} else {
+	int isnew;
+	eventinfo_t *evinfo_q   = indexes_queueevent(indexes_p, fpath_rel, fpath_rel_len, hash, queue_id, &isnew);
+	if(isnew)
+		memcpy(evinfo_q, evinfo, sizeof(*evinfo_q));
+	else
 		evinfo_merge(ctx_p, evinfo_q, evinfo);
-	}
 
 	return 0;
 }
 
+static inline int sync_queuesync(const char *fpath_rel, eventinfo_t *evinfo, ctx_t *ctx_p, indexes_t *indexes_p, queue_id_t queue_id) {
+	size_t fpath_rel_len = strlen(fpath_rel);
+	return _sync_queuesync(fpath_rel, fpath_rel_len, strmap_hash(fpath_rel, fpath_rel_len), evinfo, ctx_p, indexes_p, queue_id);
+}
+
 static inline void evinfo_initialevmask(ctx_t *ctx_p, eventinfo_t *evinfo_p, int isdir) {
 	switch(ctx_p->flags[MONITOR]) {
 #ifdef FANOTIFY_SUPPORT
 		case NE_FANOTIFY:
-			critical("fanotify is not supported");
+			evinfo_p->evmask = FAN_CREATE;
+			if (isdir)
+				evinfo_p->evmask |= FAN_ONDIR;
 			break;
 #endif
 #if INOTIFY_SUPPORT | KQUEUE_SUPPORT
@@ -1251,62 +1541,349 @@ static inline void api_evinfo_initialevmask(ctx_t *ctx_p, api_eventinfo_t *evinf
 	return;
 }
 
+static inline void evinfo_deletedevmask(ctx_t *ctx_p, eventinfo_t *evinfo_p) {
+	switch(ctx_p->flags[MONITOR]) {
+#ifdef FANOTIFY_SUPPORT
+		case NE_FANOTIFY:
+#ifdef FAN_DELETE
+			evinfo_p->evmask = FAN_DELETE;
+#else
+			evinfo_p->evmask = FAN_MODIFY;
+#endif
+			break;
+#endif
+#if INOTIFY_SUPPORT | KQUEUE_SUPPORT
+#ifdef INOTIFY_SUPPORT
+		case NE_INOTIFY:
+#endif
+#ifdef KQUEUE_SUPPORT
+		case NE_KQUEUE:
+#endif
+			evinfo_p->evmask = IN_DELETE;
+			break;
+#endif
+#ifdef BSM_SUPPORT
+		case NE_BSM:
+		case NE_BSM_PREFETCH:
+			evinfo_p->evmask = AUE_UNLINK;
+			break;
+#endif
+#ifdef GIO_SUPPORT
+		case NE_GIO:
+			evinfo_p->evmask = G_FILE_MONITOR_EVENT_DELETED;
+			break;
+#endif
+#ifdef VERYPARANOID
+		default:
+			critical("Unknown monitor subsystem: %u", ctx_p->flags[MONITOR]);
+#endif
+	}
+	return;
+}
+
 int sync_dosync(const char *fpath, uint32_t evmask, ctx_t *ctx_p, indexes_t *indexes_p);
-int sync_initialsync_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_p, queue_id_t queue_id, initsync_t initsync) {
-	int ret = 0;
-	const char *rootpaths[] = {dirpath, NULL};
-	eventinfo_t evinfo;
-	FTS *tree;
-	rule_t *rules_p = ctx_p->rules;
-	debug(2, "(ctx_p, \"%s\", indexes_p, %i, %i).", dirpath, queue_id, initsync);
 
-	char skip_rules = (initsync==INITSYNC_FULL) && ctx_p->flags[INITFULL];
+/*
+ * "--fileinfo-snapshot": the initial sync skips the objects which states
+ * are the same as in the snapshot of the previous run, and syncs the
+ * objects of the snapshot that disappeared since then.
+ */
 
-	char rsync_and_prefer_excludes =
-			(
-				(ctx_p->flags[MODE]==MODE_RSYNCDIRECT) ||
-				(ctx_p->flags[MODE]==MODE_RSYNCSHELL)  ||
-				(ctx_p->flags[MODE]==MODE_RSYNCSO)
-			) && 
-			!ctx_p->flags[RSYNCPREFERINCLUDE];
+static inline void stat_to_stat64(stat64_t *dst, const struct stat *src) {
+	memset(dst, 0, sizeof(*dst));
+	dst->st_dev	= src->st_dev;
+	dst->st_ino	= src->st_ino;
+	dst->st_mode	= src->st_mode;
+	dst->st_nlink	= src->st_nlink;
+	dst->st_uid	= src->st_uid;
+	dst->st_gid	= src->st_gid;
+	dst->st_rdev	= src->st_rdev;
+	dst->st_size	= src->st_size;
+	dst->st_blksize	= src->st_blksize;
+	dst->st_blocks	= src->st_blocks;
+	dst->st_atime	= src->st_atime;
+	dst->st_mtime	= src->st_mtime;
+	dst->st_ctime	= src->st_ctime;
+	return;
+}
+
+static inline int sync_initialsync_snapshot_isunchanged(indexes_t *indexes_p, fisnapshot_t *snapshot, const char *path_rel, const struct stat *st) {
+	stat64_t lstat;
+	stat_to_stat64(&lstat, st);
 
-	if ((!ctx_p->flags[RSYNCPREFERINCLUDE]) && skip_rules)
+	// The current state is saved to the next snapshot after the object is synced
+	indexes_fileinfo_add(indexes_p, path_rel, &lstat);
+
+	fileinfo_t *finfo = fisnapshot_lookup(snapshot, path_rel);
+	if (finfo == NULL)
 		return 0;
 
-	skip_rules |= (ctx_p->rules_count == 0);
+	return !fileinfo_diff(indexes_p->fileinfo, finfo, &lstat);
+}
 
-	char fts_no_stat =
-		(
-			(
-				initsync == INITSYNC_FULL
-			) ||
-			(
-				ctx_p->_queues[QUEUE_NORMAL ].collectdelay ==
-				ctx_p->_queues[QUEUE_BIGFILE].collectdelay
-			) ||
-			(
-				ctx_p->bfilethreshold == 0
-			)
-		) && !(ctx_p->flags[EXCLUDEMOUNTPOINTS]);
+struct sync_initialsync_vanished_arg {
+	ctx_t		*ctx_p;
+	indexes_t	*indexes_p;
+	queue_id_t	 queue_id;
+	char		*path_full;
+	size_t		 path_full_len;
+};
 
-	int fts_opts =  FTS_NOCHDIR | FTS_PHYSICAL | 
-			(fts_no_stat			? FTS_NOSTAT	: 0) | 
-			(ctx_p->flags[ONEFILESYSTEM] 	? FTS_XDEV	: 0); 
+static int sync_initialsync_snapshot_vanished(const char *path_rel, void *arg_gp) {
+	struct sync_initialsync_vanished_arg *arg_p = arg_gp;
+	ctx_t *ctx_p = arg_p->ctx_p;
+	eventinfo_t evinfo;
 
-        debug(3, "fts_opts == %p", (void *)(long)fts_opts);
+	debug(2, "\"%s\" disappeared since the snapshot.", path_rel);
 
-	tree = privileged_fts_open((char *const *)&rootpaths, fts_opts, NULL, PC_SYNC_INIIALSYNC_WALK_FTS_OPEN);
+	memset(&evinfo, 0, sizeof(evinfo));
+	evinfo_deletedevmask(ctx_p, &evinfo);
 
-	if (tree == NULL) {
-		error("Cannot privileged_fts_open() on \"%s\".", dirpath);
-		return errno;
+	if (ctx_p->flags[MODE] == MODE_SIMPLE) {
+		arg_p->path_full = sync_path_rel2abs(ctx_p, path_rel, -1, &arg_p->path_full_len, arg_p->path_full);
+		return sync_dosync(arg_p->path_full, evinfo.evmask, ctx_p, arg_p->indexes_p);
 	}
 
-	memset(&evinfo, 0, sizeof(evinfo));
+	evinfo.seqid_min   = sync_seqid();
+	evinfo.seqid_max   = evinfo.seqid_min;
+	evinfo.objtype_old = EOT_FILE;	// the type is not remembered
+	evinfo.objtype_new = EOT_DOESNTEXIST;
 
-	FTSENT *node;
-	char  *path_rel		= NULL;
-	size_t path_rel_len	= 0;
+	return sync_queuesync(path_rel, &evinfo, ctx_p, arg_p->indexes_p, arg_p->queue_id);
+}
+
+#ifdef CLUSTER_SUPPORT
+static inline int sync_mark_walk_cluster_modtime_update(ctx_t *ctx_p, const char *path, short int dirlevel, mode_t st_mode) {
+	if(ctx_p->cluster_iface) {
+		int ret=cluster_modtime_update(path, dirlevel, st_mode);
+		if(ret) error("cannot cluster_modtime_update()");
+		return ret;
+	}
+	return 0;
+}
+#endif
+
+struct sync_initialsync_walk_arg {
+	ctx_t		*ctx_p;
+	indexes_t	*indexes_p;
+	queue_id_t	 queue_id;
+	char		 skip_rules;
+	char		 rsync_and_prefer_excludes;
+	char		 fts_no_stat;
+};
+
+static inline void sync_initialsync_walk_addexclude(struct sync_initialsync_walk_arg *arg_p, const char *path_rel, eventinfo_flags_t flags) {
+	if (arg_p->queue_id == QUEUE_AUTO) {
+		int i=0;
+		while (i<QUEUE_MAX)
+			indexes_addexclude(arg_p->indexes_p, path_rel, flags, i++);
+	} else
+		indexes_addexclude(arg_p->indexes_p, path_rel, flags, arg_p->queue_id);
+
+	return;
+}
+
+// "--exclude-mount-points"
+
+static inline void sync_initialsync_walk_mountpoint(struct sync_initialsync_walk_arg *arg_p, const char *path_rel, dev_t st_dev) {
+	ctx_t *ctx_p = arg_p->ctx_p;
+
+	if (arg_p->rsync_and_prefer_excludes) {
+		if (st_dev != ctx_p->st_dev)
+			sync_initialsync_walk_addexclude(arg_p, path_rel, EVIF_CONTENTRECURSIVELY);
+	} else
+	if (!ctx_p->flags[RSYNCPREFERINCLUDE])
+		error("Excluding mount points is not implentemted for non \"rsync*\" modes.");
+
+	return;
+}
+
+static int sync_initialsync_walk_queue(struct sync_initialsync_walk_arg *arg_p, const char *path_full, const char *path_rel, int isdir, off_t fsize) {
+	ctx_t *ctx_p = arg_p->ctx_p;
+	eventinfo_t evinfo;
+
+	memset(&evinfo, 0, sizeof(evinfo));
+	evinfo_initialevmask(ctx_p, &evinfo, isdir);
+
+	switch (ctx_p->flags[MODE]) {
+		case MODE_SIMPLE:
+			SAFE(sync_dosync(path_full, evinfo.evmask, ctx_p, arg_p->indexes_p), debug(1, "fpath == \"%s\"; evmask == 0x%o", path_full, evinfo.evmask); return -1;);
+			return 0;
+		default:
+			break;
+	}
+
+	evinfo.seqid_min    = sync_seqid();
+	evinfo.seqid_max    = evinfo.seqid_min;
+	evinfo.objtype_old  = EOT_DOESNTEXIST;
+	evinfo.objtype_new  = isdir ? EOT_DIR : EOT_FILE;
+	evinfo.fsize        = fsize;
+	debug(3, "queueing \"%s\" with int-flags %p", path_full, (void *)(unsigned long)evinfo.flags);
+
+	if (sync_queuesync(path_rel, &evinfo, ctx_p, arg_p->indexes_p, arg_p->queue_id)) {
+		error("Got error while queueing \"%s\".", path_full);
+		return errno;
+	}
+
+	return 0;
+}
+
+/*
+ * "--walk-threads": the tree is walked by the threads of treewalk(). The
+ * rules are checked by the walking threads, the excludes and the events
+ * are added to the indexes by the calling thread.
+ */
+
+static treewalk_check_t sync_initialsync_walk_check(treewalk_entry_t *entry, void *_arg_p) {
+	struct sync_initialsync_walk_arg *arg_p = _arg_p;
+	ctx_t *ctx_p = arg_p->ctx_p;
+	treewalk_check_t check = TWC_NONE;
+	ruleaction_t perm = RA_ALL;
+
+	if (!arg_p->skip_rules) {
+		perm = rules_getperm(sync_path_abs2rel_inplace(ctx_p, entry->path, entry->path_len), entry->st_mode, ctx_p->rules, RA_WALK|RA_MONITOR);
+
+		if (!(perm&RA_WALK))
+			check |= TWC_SKIP;
+	}
+	entry->data = perm;
+
+	// Only the excludes are collected
+	if (arg_p->rsync_and_prefer_excludes && !ctx_p->flags[EXCLUDEMOUNTPOINTS]) {
+		if (perm&RA_MONITOR)
+			check |= TWC_DROP;
+		if (arg_p->skip_rules)
+			check |= TWC_SKIP;
+	}
+
+	return check;
+}
+
+static int sync_initialsync_walk_entry(treewalk_entry_t *entry, void *_arg_p) {
+	struct sync_initialsync_walk_arg *arg_p = _arg_p;
+	ctx_t *ctx_p = arg_p->ctx_p;
+	const char *path_rel = sync_path_abs2rel_inplace(ctx_p, entry->path, entry->path_len);
+	int isdir = S_ISDIR(entry->st_mode);
+
+	debug(3, "Pointing to \"%s\"", path_rel);
+
+	if (ctx_p->flags[EXCLUDEMOUNTPOINTS] && isdir)
+		sync_initialsync_walk_mountpoint(arg_p, path_rel, entry->st_dev);
+
+	if (!(entry->data & RA_MONITOR)) {
+		debug(3, "Excluding \"%s\".", path_rel);
+		if (arg_p->rsync_and_prefer_excludes)
+			sync_initialsync_walk_addexclude(arg_p, path_rel, EVIF_NONE);
+		return 0;
+	}
+
+	if (arg_p->rsync_and_prefer_excludes)
+		return 0;
+
+	return sync_initialsync_walk_queue(arg_p, entry->path, path_rel, isdir, entry->st_size);
+}
+
+static int sync_initialsync_walk_parallel(struct sync_initialsync_walk_arg *arg_p, const char *dirpath) {
+	ctx_t *ctx_p = arg_p->ctx_p;
+	treewalk_flags_t flags =
+		(arg_p->fts_no_stat		? TWF_NONE : TWF_STAT) |
+		(ctx_p->flags[ONEFILESYSTEM]	? TWF_XDEV : TWF_NONE);
+
+	debug(1, "Walking \"%s\" using %i threads.", dirpath, ctx_p->flags[WALKTHREADS]);
+
+	int ret = treewalk(dirpath, ctx_p->flags[WALKTHREADS], flags, sync_initialsync_walk_check, sync_initialsync_walk_entry, arg_p);
+	if (ret)
+		error("Got error while walking \"%s\".", dirpath);
+
+	return ret;
+}
+
+int sync_notify_mark(ctx_t *ctx_p, const char *accpath, const char *path, size_t pathlen, indexes_t *indexes_p);
+int sync_mark_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_p);
+#ifdef INOTIFY_SUPPORT
+static inline int sync_watchbudget_ispolled(const char *path_full);
+#endif
+
+/*
+ * If "mark" is set, the directories are also marked by the walk (instead of
+ * a separate sync_mark_walk() before it): a created subtree is walked once
+ * to be watched and queued.
+ */
+int sync_initialsync_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_p, queue_id_t queue_id, initsync_t initsync, int mark) {
+	int ret = 0;
+	const char *rootpaths[] = {dirpath, NULL};
+	FTS *tree;
+	rule_t *rules_p = ctx_p->rules;
+	debug(2, "(ctx_p, \"%s\", indexes_p, %i, %i, %i).", dirpath, queue_id, initsync, mark);
+
+#ifdef FANOTIFY_SUPPORT
+	// The filesystem mark is already set by fanotify_start(), there's nothing to mark
+	if (ctx_p->flags[MONITOR] == NE_FANOTIFY)
+		mark = 0;
+#endif
+
+	char skip_rules = (initsync==INITSYNC_FULL) && ctx_p->flags[INITFULL];
+
+	char rsync_and_prefer_excludes =
+			(
+				(ctx_p->flags[MODE]==MODE_RSYNCDIRECT) ||
+				(ctx_p->flags[MODE]==MODE_RSYNCSHELL)  ||
+				(ctx_p->flags[MODE]==MODE_RSYNCSO)
+			) && 
+			!ctx_p->flags[RSYNCPREFERINCLUDE];
+
+	if ((!ctx_p->flags[RSYNCPREFERINCLUDE]) && skip_rules && !mark)
+		return 0;
+
+	skip_rules |= (ctx_p->rules_count == 0);
+
+	char fts_no_stat =
+		(
+			(
+				initsync == INITSYNC_FULL
+			) ||
+			(
+				ctx_p->_queues[QUEUE_NORMAL ].collectdelay ==
+				ctx_p->_queues[QUEUE_BIGFILE].collectdelay
+			) ||
+			(
+				ctx_p->bfilethreshold == 0
+			)
+		) && !(ctx_p->flags[EXCLUDEMOUNTPOINTS]);
+
+	// The states of the objects are compared with the snapshot
+	fisnapshot_t *snapshot = (initsync == INITSYNC_FULL) ? indexes_p->fisnapshot : NULL;
+	if (snapshot != NULL)
+		fts_no_stat = 0;
+
+	struct sync_initialsync_walk_arg arg;
+	arg.ctx_p                     = ctx_p;
+	arg.indexes_p                 = indexes_p;
+	arg.queue_id                  = queue_id;
+	arg.skip_rules                = skip_rules;
+	arg.rsync_and_prefer_excludes = rsync_and_prefer_excludes;
+	arg.fts_no_stat               = fts_no_stat;
+
+	// The snapshot and the marks are not thread-safe, so they're walked by FTS only
+	if (ctx_p->flags[WALKTHREADS] && initsync == INITSYNC_FULL && snapshot == NULL && !mark)
+		return sync_initialsync_walk_parallel(&arg, dirpath);
+
+	int fts_opts =  FTS_NOCHDIR | FTS_PHYSICAL | 
+			(fts_no_stat			? FTS_NOSTAT	: 0) | 
+			(ctx_p->flags[ONEFILESYSTEM] 	? FTS_XDEV	: 0); 
+
+        debug(3, "fts_opts == %p", (void *)(long)fts_opts);
+
+	tree = privileged_fts_open((char *const *)&rootpaths, fts_opts, NULL, PC_SYNC_INIIALSYNC_WALK_FTS_OPEN);
+
+	if (tree == NULL) {
+		error("Cannot privileged_fts_open() on \"%s\".", dirpath);
+		return errno;
+	}
+
+	FTSENT *node;
+	char  *path_rel		= NULL;
+	size_t path_rel_len	= 0;
 
 	while ((node = privileged_fts_read(tree, PC_SYNC_INIIALSYNC_WALK_FTS_READ))) {
 		switch (node->fts_info) {
@@ -1344,73 +1921,70 @@ int sync_initialsync_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_
 				ret = EINVAL;
 				goto l_sync_initialsync_walk_end;
 		}
+		int isdir = node->fts_info == FTS_D || node->fts_info == FTS_DC || node->fts_info == FTS_DOT;
+
+#ifdef CLUSTER_SUPPORT
+		if (mark && (ret=sync_mark_walk_cluster_modtime_update(ctx_p, node->fts_path, node->fts_level, isdir ? S_IFDIR : S_IFREG)))
+			goto l_sync_initialsync_walk_end;
+#endif
 		path_rel = sync_path_abs2rel(ctx_p, node->fts_path, -1, &path_rel_len, path_rel);
 
 		debug(3, "Pointing to \"%s\" (node->fts_info == %i)", path_rel, node->fts_info);
 
-		if (ctx_p->flags[EXCLUDEMOUNTPOINTS] && node->fts_info==FTS_D) {
-			if (rsync_and_prefer_excludes) {
-				if (node->fts_statp->st_dev != ctx_p->st_dev) {
-					if (queue_id == QUEUE_AUTO) {
-						int i=0;
-						while (i<QUEUE_MAX)
-							indexes_addexclude(indexes_p, strdup(path_rel), EVIF_CONTENTRECURSIVELY, i++);
-					} else
-						indexes_addexclude(indexes_p, strdup(path_rel), EVIF_CONTENTRECURSIVELY, queue_id);
-				}
-			} else
-			if (!ctx_p->flags[RSYNCPREFERINCLUDE])
-				error("Excluding mount points is not implentemted for non \"rsync*\" modes.");
-		}
+		if (ctx_p->flags[EXCLUDEMOUNTPOINTS] && node->fts_info==FTS_D)
+			sync_initialsync_walk_mountpoint(&arg, path_rel, node->fts_statp->st_dev);
 
 		mode_t st_mode = fts_no_stat ? (node->fts_info==FTS_D ? S_IFDIR : S_IFREG) : node->fts_statp->st_mode;
 
+		ruleaction_t perm = RA_ALL;
 		if (!skip_rules) {
-			ruleaction_t perm = rules_getperm(path_rel, st_mode, rules_p, RA_WALK|RA_MONITOR);
+			perm = rules_getperm(path_rel, st_mode, rules_p, RA_WALK|RA_MONITOR);
 
 			if (!(perm&RA_WALK)) {
 				debug(3, "Rejecting to walk into \"%s\".", path_rel);
 				fts_set(tree, node, FTS_SKIP);
 			}
+		}
 
-			if (!(perm&RA_MONITOR)) {
-				debug(3, "Excluding \"%s\".", path_rel);
-				if (rsync_and_prefer_excludes) {
-					if (queue_id == QUEUE_AUTO) {
-						int i=0;
-						while (i<QUEUE_MAX)
-							indexes_addexclude(indexes_p, strdup(path_rel), EVIF_NONE, i++);
-					} else
-						indexes_addexclude(indexes_p, strdup(path_rel), EVIF_NONE, queue_id);
-				}
-				continue;
+		if (mark && isdir && (perm&RA_WALK)) {
+			debug(2, "marking \"%s\" (depth %u)", node->fts_path, node->fts_level);
+			int wd = sync_notify_mark(ctx_p, node->fts_accpath, node->fts_path, node->fts_pathlen, indexes_p);
+			switch (wd) {
+				case -1:
+					error_or_debug((ctx_p->state == STATE_STARTING) ?-1:2, "Got error while notify-marking \"%s\".", node->fts_path);
+					ret = errno;
+					goto l_sync_initialsync_walk_end;
+				case -2:
+#ifdef INOTIFY_SUPPORT
+					// The subdirectories of a polled directory are still to be marked and queued
+					if (sync_watchbudget_ispolled(node->fts_path)) {
+						debug(2, "\"%s\" is polled.", node->fts_path);
+						break;
+					}
+#endif
+					debug(1, "Seems, that directory \"%s\" disappeared, while trying to mark it.", node->fts_path);
+					fts_set(tree, node, FTS_SKIP);
+					continue;
+				default:
+					debug(2, "watching descriptor is %i.", wd);
 			}
 		}
 
-		if (!rsync_and_prefer_excludes) {
-			evinfo_initialevmask(ctx_p, &evinfo, node->fts_info==FTS_D);
+		if (!(perm&RA_MONITOR)) {
+			debug(3, "Excluding \"%s\".", path_rel);
+			if (rsync_and_prefer_excludes)
+				sync_initialsync_walk_addexclude(&arg, path_rel, EVIF_NONE);
+			continue;
+		}
 
-			switch (ctx_p->flags[MODE]) {
-				case MODE_SIMPLE:
-					SAFE(sync_dosync(node->fts_path, evinfo.evmask, ctx_p, indexes_p), debug(1, "fpath == \"%s\"; evmask == 0x%o", node->fts_path, evinfo.evmask); return -1;);
-					continue;
-				default:
-					break;
+		if (!rsync_and_prefer_excludes) {
+			if (snapshot != NULL && sync_initialsync_snapshot_isunchanged(indexes_p, snapshot, path_rel, node->fts_statp)) {
+				debug(4, "\"%s\" is not changed since the snapshot.", path_rel);
+				continue;
 			}
 
-			evinfo.seqid_min    = sync_seqid();
-			evinfo.seqid_max    = evinfo.seqid_min;
-			evinfo.objtype_old  = EOT_DOESNTEXIST;
-			evinfo.objtype_new  = node->fts_info==FTS_D ? EOT_DIR : EOT_FILE;
-			evinfo.fsize        = fts_no_stat ? 0 : node->fts_statp->st_size;
-			debug(3, "queueing \"%s\" (depth: %i) with int-flags %p", node->fts_path, node->fts_level, (void *)(unsigned long)evinfo.flags);
-			int _ret = sync_queuesync(path_rel, &evinfo, ctx_p, indexes_p, queue_id);
-
-			if (_ret) {
-				error("Got error while queueing \"%s\".", node->fts_path);
-				ret = errno;
+			if ((ret = sync_initialsync_walk_queue(&arg, node->fts_path, path_rel, node->fts_info==FTS_D, fts_no_stat ? 0 : node->fts_statp->st_size)))
 				goto l_sync_initialsync_walk_end;
-			}
 			continue;
 		}
 
@@ -1418,7 +1992,8 @@ int sync_initialsync_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_
 		if (
 			skip_rules					&&
 			node->fts_info == FTS_D				&&
-			!ctx_p->flags[EXCLUDEMOUNTPOINTS]
+			!ctx_p->flags[EXCLUDEMOUNTPOINTS]		&&
+			!mark
 		) {
 			debug(4, "\"FTS optimizator\"");
 			fts_set(tree, node, FTS_SKIP);
@@ -1436,9 +2011,27 @@ int sync_initialsync_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_
 		goto l_sync_initialsync_walk_end;
 	}
 
+	if (snapshot != NULL) {
+		struct sync_initialsync_vanished_arg arg = {0};
+
+		arg.ctx_p     = ctx_p;
+		arg.indexes_p = indexes_p;
+		arg.queue_id  = queue_id;
+
+		ret = fisnapshot_foreach_unvisited(snapshot, sync_initialsync_snapshot_vanished, &arg);
+		if (ret)
+			error("Got error while queueing the objects disappeared since the snapshot.");
+
+		free(arg.path_full);
+	}
+
 l_sync_initialsync_walk_end:
 	if (path_rel != NULL)
 		free(path_rel);
+	if (snapshot != NULL) {
+		fisnapshot_close(snapshot);
+		indexes_p->fisnapshot = NULL;
+	}
 	return ret;
 }
 
@@ -1557,10 +2150,13 @@ static inline int sync_initialsync_finish(ctx_t *ctx_p, initsync_t initsync, int
 	return ret;
 }
 
-int sync_initialsync(const char *path, ctx_t *ctx_p, indexes_t *indexes_p, initsync_t initsync) {
+// If "mark" is set, the directories of "path" are marked by the walk of the
+// initial sync (see sync_initialsync_walk())
+
+static int _sync_initialsync(const char *path, ctx_t *ctx_p, indexes_t *indexes_p, initsync_t initsync, int mark) {
 	int ret;
 	queue_id_t queue_id;
-	debug(3, "(\"%s\", ctx_p, indexes_p, %i)", path, initsync);
+	debug(3, "(\"%s\", ctx_p, indexes_p, %i, %i)", path, initsync, mark);
 
 #ifdef CLUSTER_SUPPORT
 	if(initsync == INITSYNC_FULL) {
@@ -1585,6 +2181,12 @@ int sync_initialsync(const char *path, ctx_t *ctx_p, indexes_t *indexes_p, inits
 		debug(3, "syncing \"%s\"", path);
 
 		if(ctx_p->flags[HAVERECURSIVESYNC]) {
+			// The directory is synced recursively without walking it, so it's marked by a separate walk
+			if (mark && sync_mark_walk(ctx_p, path, indexes_p)) {
+				debug(1, "Seems, that directory \"%s\" disappeared, while trying to mark it.", path);
+				return 0;
+			}
+
 			if(ctx_p->flags[MODE] == MODE_SO) {
 				api_eventinfo_t *ei = (api_eventinfo_t *)xmalloc(sizeof(*ei));
 #ifdef PARANIOD
@@ -1597,6 +2199,8 @@ int sync_initialsync(const char *path, ctx_t *ctx_p, indexes_t *indexes_p, inits
 				ei->path        = strdup(path);
 				ei->objtype_old = EOT_DOESNTEXIST;
 				ei->objtype_new = EOT_DIR;
+				ei->path_old_len = 0;
+				ei->path_old    = NULL;
 
 				ret = so_call_sync(ctx_p, indexes_p, 1, ei);
 				return sync_initialsync_finish(ctx_p, initsync, ret);
@@ -1631,7 +2235,7 @@ int sync_initialsync(const char *path, ctx_t *ctx_p, indexes_t *indexes_p, inits
 		sync_exec_argv(NULL, NULL); sync_exec_argv_thread(NULL, NULL);
 #endif
 
-		ret = sync_initialsync_walk(ctx_p, path, indexes_p, queue_id, initsync);
+		ret = sync_initialsync_walk(ctx_p, path, indexes_p, queue_id, initsync, mark);
 		if(ret)
 			error("Cannot get synclist");
 
@@ -1644,375 +2248,1385 @@ int sync_initialsync(const char *path, ctx_t *ctx_p, indexes_t *indexes_p, inits
 		queueinfo_t *queueinfo = &ctx_p->_queues[queue_id];
 
 		if(!queueinfo->stime)
-			queueinfo->stime = time(NULL); // Useful for debugging
+			queueinfo->stime = clock_monotonic_ms(); // Useful for debugging
 
 
-		eventinfo_t *evinfo = (eventinfo_t *)xmalloc(sizeof(*evinfo));
-		memset(evinfo, 0, sizeof(*evinfo));
-		evinfo->flags |= EVIF_RECURSIVELY;
-		evinfo->seqid_min = sync_seqid();
-		evinfo->seqid_max = evinfo->seqid_min;
-		evinfo->objtype_old  = EOT_DOESNTEXIST;
-		evinfo->objtype_new  = EOT_DIR;
+		eventinfo_t evinfo = {0};
+		evinfo.flags |= EVIF_RECURSIVELY;
+		evinfo.seqid_min = sync_seqid();
+		evinfo.seqid_max = evinfo.seqid_min;
+		evinfo.objtype_old  = EOT_DOESNTEXIST;
+		evinfo.objtype_new  = EOT_DIR;
 
 		// Searching for excludes
-		ret = sync_initialsync_walk(ctx_p, path, indexes_p, queue_id, initsync);
+		ret = sync_initialsync_walk(ctx_p, path, indexes_p, queue_id, initsync, mark);
 		if(ret) {
 			error("Cannot get exclude what to exclude");
 			return sync_initialsync_finish(ctx_p, initsync, ret);
 		}
 
-		debug(3, "queueing \"%s\" with int-flags %p", path, (void *)(unsigned long)evinfo->flags);
+		debug(3, "queueing \"%s\" with int-flags %p", path, (void *)(unsigned long)evinfo.flags);
 
-		char *path_rel = sync_path_abs2rel(ctx_p, path, -1, NULL, NULL);
+		size_t path_rel_len;
+		char *path_rel = sync_path_abs2rel(ctx_p, path, -1, &path_rel_len, NULL);
 
-		ret = indexes_queueevent(indexes_p, path_rel, evinfo, queue_id);
+		int isnew;
+		memcpy(indexes_queueevent(indexes_p, path_rel, path_rel_len, strmap_hash(path_rel, path_rel_len), queue_id, &isnew), &evinfo, sizeof(evinfo));
+		free(path_rel);
+		ret = 0;
 		return sync_initialsync_finish(ctx_p, initsync, ret);
 	}
 
 	// Searching for includes
-	ret = sync_initialsync_walk(ctx_p, path, indexes_p, queue_id, initsync);
+	ret = sync_initialsync_walk(ctx_p, path, indexes_p, queue_id, initsync, mark);
 	return sync_initialsync_finish(ctx_p, initsync, ret);
 }
 
-int sync_notify_mark(ctx_t *ctx_p, const char *accpath, const char *path, size_t pathlen, indexes_t *indexes_p) {
-	debug(3, "(..., \"%s\", %i,...)", path, pathlen);
-	int wd = indexes_fpath2wd(indexes_p, path);
-	if(wd != -1) {
-		debug(1, "\"%s\" is already marked (wd: %i). Skipping.", path, wd);
-		return wd;
-	}
+int sync_initialsync(const char *path, ctx_t *ctx_p, indexes_t *indexes_p, initsync_t initsync) {
+	return _sync_initialsync(path, ctx_p, indexes_p, initsync, 0);
+}
 
-	debug(5, "ctx_p->notifyenginefunct.add_watch_dir(ctx_p, indexes_p, \"%s\")", accpath);
-	if((wd = ctx_p->notifyenginefunct.add_watch_dir(ctx_p, indexes_p, accpath)) == -1) {
-		if(errno == ENOENT)
-			return -2;
+/*
+ * "--initsync-journal": the initial sync is done by units: every directory
+ * of the top level of the watch dir is a unit and the rest objects of the
+ * top level are the last unit ("."). The name of a unit is appended to the
+ * journal after the sync handler is successfully finished on it, so the
+ * initial sync after a restart skips the journaled units. A journaled unit
+ * is synced again if any object of it is changed (by mtime/ctime) since the
+ * start of its sync, as clsync doesn't see the changes while it's down. The
+ * journal is removed when the initial sync is done.
+ *
+ * The journal is a sequence of NUL-terminated records: the header (see
+ * sync_initialsync_journal_header()) and the synced units as
+ * "<the start time of the unit sync>/<the unit name>".
+ */
 
-		error("Cannot ctx_p->notifyenginefunct.add_watch_dir() on \"%s\".", 
-			path);
-		return -1;
-	}
-	debug(6, "endof ctx_p->notifyenginefunct.add_watch_dir(ctx_p, indexes_p, \"%s\")", accpath);
-	indexes_add_wd(indexes_p, wd, path, pathlen);
+#define INITSYNC_UNIT_REST	"."
+#define INITSYNC_JOURNAL_HEADER_RECORDS	3
 
-	return wd;
+int sync_idle_dosync_collectedevents(ctx_t *ctx_p, indexes_t *indexes_p);
+
+// The journal of another watch dir or destination is not used
+static inline void sync_initialsync_journal_header(ctx_t *ctx_p, const char **header) {
+	header[0] = INITSYNC_JOURNAL_MAGIC;
+	header[1] = ctx_p->watchdir;
+	header[2] = ctx_p->destdir == NULL ? "" : ctx_p->destdir;
+	return;
 }
 
-#ifdef CLUSTER_SUPPORT
-static inline int sync_mark_walk_cluster_modtime_update(ctx_t *ctx_p, const char *path, short int dirlevel, mode_t st_mode) {
-	if(ctx_p->cluster_iface) {
-		int ret=cluster_modtime_update(path, dirlevel, st_mode);
-		if(ret) error("cannot cluster_modtime_update()");
-		return ret;
+static int sync_initialsync_journal_write(ctx_t *ctx_p, int journal_fd, const char *record) {
+	size_t record_size = strlen(record)+1;
+
+	if ((write(journal_fd, record, record_size) != (ssize_t)record_size) || fsync(journal_fd)) {
+		error("Cannot write to the initial sync journal \"%s\".", ctx_p->initsync_journal);
+		return errno ? errno : EIO;
 	}
+
 	return 0;
 }
-#endif
-
-int sync_mark_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_p) {
-	int ret = 0;
-	const char *rootpaths[] = {dirpath, NULL};
-	FTS *tree;
-	rule_t *rules_p = ctx_p->rules;
-	debug(2, "(ctx_p, \"%s\", indexes_p).", dirpath);
 
-	int fts_opts = FTS_NOCHDIR|FTS_PHYSICAL|FTS_NOSTAT|(ctx_p->flags[ONEFILESYSTEM]?FTS_XDEV:0);
+static int sync_initialsync_journal_writeunit(ctx_t *ctx_p, int journal_fd, const char *unit, time_t since) {
+	char record[NAME_MAX + 3*sizeof(long long) + 3];
 
-        debug(3, "fts_opts == %p", (void *)(long)fts_opts);
-	tree = privileged_fts_open((char *const *)rootpaths, fts_opts, NULL, PC_SYNC_MARK_WALK_FTS_OPEN);
+	snprintf(record, sizeof(record), "%lld/%s", (long long)since, unit);
+	return sync_initialsync_journal_write(ctx_p, journal_fd, record);
+}
 
-	if (tree == NULL) {
-		error_or_debug((ctx_p->state == STATE_STARTING) ?-1:2, "Cannot privileged_fts_open() on \"%s\".", dirpath);
-		return errno;
-	}
+// Checks if the journaled unit is changed since the start of its sync
 
+static int sync_initialsync_unit_ischanged(ctx_t *ctx_p, const char *path_full, time_t since) {
+	char *rootpaths[] = {(char *)path_full, NULL};
+	int changed = 0;
+	FTS *tree;
 	FTSENT *node;
-	char  *path_rel		= NULL;
-	size_t path_rel_len	= 0;
 
-	while ((node = privileged_fts_read(tree, PC_SYNC_MARK_WALK_FTS_READ))) {
-#ifdef CLUSTER_SUPPORT
-		int ret;
-#endif
-		debug(2, "walking: \"%s\" (depth %u): fts_info == %i", node->fts_path, node->fts_level, node->fts_info);
+	tree = privileged_fts_open(rootpaths, FTS_NOCHDIR|FTS_PHYSICAL, NULL, PC_SYNC_INITSYNCJOURNAL_FTS_OPEN);
+	if (tree == NULL) {
+		debug(1, "Cannot privileged_fts_open() on \"%s\": %s. Considering the unit as changed.", path_full, strerror(errno));
+		return 1;
+	}
 
-		switch(node->fts_info) {
-			// Duplicates:
+	while (!changed && (node = privileged_fts_read(tree, PC_SYNC_INITSYNCJOURNAL_FTS_READ))) {
+		switch (node->fts_info) {
 			case FTS_DP:
 				continue;
-			// Files:
-			case FTS_DEFAULT:
-			case FTS_SL:
-			case FTS_SLNONE:
-			case FTS_F:
-			case FTS_NSOK:
-#ifdef CLUSTER_SUPPORT
-				if ((ret=sync_mark_walk_cluster_modtime_update(ctx_p, node->fts_path, node->fts_level, S_IFREG)))
-					goto l_sync_mark_walk_end;
-#endif
-				continue;
-			// Directories (to mark):
-			case FTS_D:
-			case FTS_DC:    // TODO: think about case of FTS_DC
-			case FTS_DOT:
-#ifdef CLUSTER_SUPPORT
-				if ((ret=sync_mark_walk_cluster_modtime_update(ctx_p, node->fts_path, node->fts_level, S_IFDIR)))
-					goto l_sync_mark_walk_end;
-#endif
-				break;
-			// Error cases:
 			case FTS_ERR:
 			case FTS_NS:
 			case FTS_DNR:
-				if (errno == ENOENT) {
-					debug(1, "Got error while privileged_fts_read(); fts_info: %i.", node->fts_info);
-					continue;
-				} else {
-					error_or_debug((ctx_p->state == STATE_STARTING) ?-1:2, "Got error while privileged_fts_read(); fts_info: %i.", node->fts_info);
-					ret = errno;
-					goto l_sync_mark_walk_end;
-				}
+				debug(1, "Cannot read \"%s\": %s. Considering the unit as changed.", node->fts_path, strerror(node->fts_errno));
+				changed = 1;
+				continue;
 			default:
-				error_or_debug((ctx_p->state == STATE_STARTING) ?-1:2, "Got unknown fts_info vlaue while privileged_fts_read(): %i.", node->fts_info);
-				ret = EINVAL;
-				goto l_sync_mark_walk_end;
+				break;
 		}
 
-		path_rel = sync_path_abs2rel(ctx_p, node->fts_path, -1, &path_rel_len, path_rel);
-		ruleaction_t perm = rules_search_getperm(path_rel, S_IFDIR, rules_p, RA_WALK, NULL);
+		if (MAX(node->fts_statp->st_mtime, node->fts_statp->st_ctime) >= since) {
+			debug(2, "\"%s\" is changed since %lli.", node->fts_path, (long long)since);
+			changed = 1;
+		}
+	}
+	if (!changed && errno) {
+		debug(1, "Got error while privileged_fts_read() on \"%s\": %s. Considering the unit as changed.", path_full, strerror(errno));
+		changed = 1;
+	}
 
-		if (!(perm&RA_WALK)) {
-			fts_set(tree, node, FTS_SKIP);
+	privileged_fts_close(tree, PC_SYNC_INITSYNCJOURNAL_FTS_CLOSE);
+	return changed;
+}
+
+// The same for the unit INITSYNC_UNIT_REST: the watch dir itself and the non-directories of the top level
+
+static int sync_initialsync_unit_rest_ischanged(ctx_t *ctx_p, struct dirent **namelist, int names_count, time_t since) {
+	char   *path_full     = NULL;
+	size_t  path_full_len = 0;
+	struct stat st;
+	int changed = 0, i = 0;
+
+	if (lstat(ctx_p->watchdir, &st) || (MAX(st.st_mtime, st.st_ctime) >= since))
+		return 1;
+
+	while (!changed && (i < names_count)) {
+		const char *name = namelist[i++]->d_name;
+
+		if (!strcmp(name, ".") || !strcmp(name, ".."))
 			continue;
-		}
 
-		debug(2, "marking \"%s\" (depth %u)", node->fts_path, node->fts_level);
-		int wd = sync_notify_mark(ctx_p, node->fts_accpath, node->fts_path, node->fts_pathlen, indexes_p);
-		if (wd == -1) {
-			error_or_debug((ctx_p->state == STATE_STARTING) ?-1:2, "Got error while notify-marking \"%s\".", node->fts_path);
-			ret = errno;
-			goto l_sync_mark_walk_end;
+		path_full = sync_path_rel2abs(ctx_p, name, -1, &path_full_len, path_full);
+		if (lstat(path_full, &st)) {
+			changed = 1;
+			continue;
 		}
-		debug(2, "watching descriptor is %i.", wd);
-	}
-	if (errno) {
-		error_or_debug((ctx_p->state == STATE_STARTING) ?-1:2, "Got error while privileged_fts_read() and related routines.");
-		ret = errno;
-		goto l_sync_mark_walk_end;
-	}
 
-	if (privileged_fts_close(tree, PC_SYNC_MARK_WALK_FTS_CLOSE)) {
-		error_or_debug((ctx_p->state == STATE_STARTING) ?-1:2, "Got error while privileged_fts_close().");
-		ret = errno;
-		goto l_sync_mark_walk_end;
+		if (S_ISDIR(st.st_mode))
+			continue;
+
+		if (MAX(st.st_mtime, st.st_ctime) >= since) {
+			debug(2, "\"%s\" is changed since %lli.", path_full, (long long)since);
+			changed = 1;
+		}
 	}
 
-l_sync_mark_walk_end:
-	if (path_rel != NULL)
-		free(path_rel);
-	return ret;
+	free(path_full);
+	return changed;
 }
 
-int sync_notify_init(ctx_t *ctx_p) {
-	switch (ctx_p->flags[MONITOR]) {
-#ifdef FANOTIFY_SUPPORT
-		case NE_FANOTIFY: {
-			ctx_p->fsmondata = (long)fanotify_init(FANOTIFY_FLAGS, FANOTIFY_EVFLAGS);
-			if((long)ctx_p->fsmondata == -1) {
-				error("cannot fanotify_init(%i, %i).", FANOTIFY_FLAGS, FANOTIFY_EVFLAGS);
-				return -1;
-			}
+// Loads the names of the synced units to "units_done_ht" and opens the journal for appending
+
+static int sync_initialsync_journal_open(ctx_t *ctx_p, GHashTable *units_done_ht) {
+	const char *header[INITSYNC_JOURNAL_HEADER_RECORDS];
+	char   *record      = NULL;
+	size_t  record_size = 0;
+	ssize_t record_len;
+	off_t   journal_len = 0;
+	int     record_num  = 0;
+	int     journal_fd;
+	FILE   *journal_f;
+
+	sync_initialsync_journal_header(ctx_p, header);
+
+	journal_f = fopen(ctx_p->initsync_journal, "r");
+	if (journal_f != NULL) {
+		while ((record_len = getdelim(&record, &record_size, 0, journal_f)) > 0) {
+			// The last record may be written partially
+			if (record[record_len-1] != 0)
+				break;
 
-			return 0;
-		}
-#endif
-#ifdef INOTIFY_SUPPORT
-		case NE_INOTIFY: {
-# ifdef INOTIFY_OLD
-			ctx_p->fsmondata = (void *)(long)inotify_init();
-#  if INOTIFY_FLAGS != 0
-#   warning Do not know how to set inotify flags (too old system)
-#  endif
-# else
-			ctx_p->fsmondata = (void *)(long)inotify_init1(INOTIFY_FLAGS);
-# endif
-			if ((long)ctx_p->fsmondata == -1) {
-				error("cannot inotify_init1(%i).", INOTIFY_FLAGS);
-				return -1;
-			}
+			if (record_num < INITSYNC_JOURNAL_HEADER_RECORDS) {
+				if (strcmp(record, header[record_num])) {
+					debug(1, "The journal \"%s\" is of another initial sync, ignoring it.", ctx_p->initsync_journal);
+					break;
+				}
+			} else {
+				char *name;
+				time_t since = (time_t)strtoll(record, &name, 10);
 
-			return 0;
-		}
-#endif
-#ifdef KQUEUE_SUPPORT
-		case NE_KQUEUE: {
-			int kqueue_d = kqueue_init(ctx_p);
-			if(kqueue_d == -1) {
-				error("cannot kqueue_init(ctx_p).");
-				return -1;
+				if (*name != '/') {
+					debug(1, "The journal \"%s\" has a wrong record \"%s\", ignoring the rest of it.", ctx_p->initsync_journal, record);
+					break;
+				}
+				g_hash_table_replace(units_done_ht, strdup(&name[1]), (gpointer)(long)since);
 			}
 
-			return 0;
+			journal_len += record_len;
+			record_num++;
 		}
-#endif
-#ifdef BSM_SUPPORT
-		case NE_BSM:
-		case NE_BSM_PREFETCH: {
-			int bsm_d = bsm_init(ctx_p);
-			if(bsm_d == -1) {
-				error("cannot bsm_init(ctx_p).");
+		free(record);
+		fclose(journal_f);
+	} else
+	if (errno != ENOENT)
+		warning("Cannot open the initial sync journal \"%s\" for reading. Syncing all the units.", ctx_p->initsync_journal);
+
+	if (record_num < INITSYNC_JOURNAL_HEADER_RECORDS) {
+		g_hash_table_remove_all(units_done_ht);
+		journal_len = 0;
+	}
+
+	journal_fd = open(ctx_p->initsync_journal, O_WRONLY|O_CREAT|O_CLOEXEC, 0600);
+	if (journal_fd == -1) {
+		error("Cannot open the initial sync journal \"%s\".", ctx_p->initsync_journal);
+		return -1;
+	}
+
+	// Dropping the partially written record (or the foreign journal)
+	if (ftruncate(journal_fd, journal_len) || (lseek(journal_fd, journal_len, SEEK_SET) == -1)) {
+		error("Cannot truncate the initial sync journal \"%s\".", ctx_p->initsync_journal);
+		close(journal_fd);
+		return -1;
+	}
+
+	if (journal_len == 0) {
+		record_num = 0;
+		while (record_num < INITSYNC_JOURNAL_HEADER_RECORDS) {
+			if (sync_initialsync_journal_write(ctx_p, journal_fd, header[record_num++])) {
+				close(journal_fd);
 				return -1;
 			}
-
-			return 0;
-		}
-#endif
-#ifdef GIO_SUPPORT
-		case NE_GIO: {
-			critical_on (gio_init(ctx_p) == -1);
-			return 0;
 		}
-#endif
 	}
-	error("unknown notify-engine: %i", ctx_p->flags[MONITOR]);
-	errno = EINVAL;
-	return -1;
-}
 
-static inline int sync_dosync_exec(ctx_t *ctx_p, indexes_t *indexes_p, const char *evmask_str, const char *fpath) {
-	int rc;
-	struct dosync_arg dosync_arg;
-	debug(20, "(ctx_p, indexes_p, \"%s\", \"%s\")", evmask_str, fpath);
+	return journal_fd;
+}
 
-	 dosync_arg.ctx_p	       = ctx_p;
-	*dosync_arg.include_list       = fpath;
-	 dosync_arg.include_list_count = 1;
-	 dosync_arg.list_type_str      = "sync";
-	 dosync_arg.evmask_str         = evmask_str;
+// The handler is not threaded (see ctx_check()), so the unit is synced when it returns
 
-	char **argv = sync_customargv(ctx_p, &dosync_arg, &ctx_p->synchandler_args[SHARGS_PRIMARY]);
-	rc = SYNC_EXEC_ARGV(
-		ctx_p,
-		indexes_p,
-		NULL, NULL,
-		argv);
-	
-	if (!SHOULD_THREAD(ctx_p))	// If it's a thread then it will free the argv in GC. If not a thread then we have to free right here.
-		argv_free(argv);
-	return rc;
+static inline int sync_initialsync_unit_flush(ctx_t *ctx_p, indexes_t *indexes_p, const char *unit) {
+	int ret = sync_idle_dosync_collectedevents(ctx_p, indexes_p);
+	if (ret)
+		error("Got error while syncing the unit \"%s\" of the initial sync.", unit);
 
-#ifdef DOXYGEN
-	sync_exec_argv(NULL, NULL); sync_exec_argv_thread(NULL, NULL);
-#endif
+	return ret;
 }
 
-int sync_dosync(const char *fpath, uint32_t evmask, ctx_t *ctx_p, indexes_t *indexes_p) {
-	int ret;
+static int sync_initialsync_unit_rest(ctx_t *ctx_p, indexes_t *indexes_p, struct sync_initialsync_walk_arg *arg_p, struct dirent **namelist, int names_count) {
+	char   *path_full     = NULL;
+	size_t  path_full_len = 0;
+	int ret = 0, i = 0;
 
-#ifdef CLUSTER_SUPPORT
-	ret = cluster_lock(fpath);
-	if(ret) return ret;
-#endif
+	// The watch dir itself
+	if (!arg_p->rsync_and_prefer_excludes)
+		ret = sync_initialsync_walk_queue(arg_p, ctx_p->watchdir, "", 1, 0);
 
-	char *evmask_str = xmalloc(1<<8);
-	sprintf(evmask_str, "%u", evmask);
-	ret = sync_dosync_exec(ctx_p, indexes_p, evmask_str, fpath);
-	free(evmask_str);
+	while (!ret && (i < names_count)) {
+		const char *name = namelist[i++]->d_name;
+		struct stat st;
 
-#ifdef CLUSTER_SUPPORT
-	ret = cluster_unlock_all();
-#endif
+		if (!strcmp(name, ".") || !strcmp(name, ".."))
+			continue;
 
-	return ret;
-}
+		path_full = sync_path_rel2abs(ctx_p, name, -1, &path_full_len, path_full);
+		if (lstat(path_full, &st)) {
+			debug(1, "Cannot lstat(\"%s\"): %s. Skipping.", path_full, strerror(errno));
+			continue;
+		}
 
-int fileischanged(ctx_t *ctx_p, indexes_t *indexes_p, const char *path_rel, stat64_t *lstat_p, int is_deleted) {
-	if (lstat_p == NULL || !ctx_p->flags[MODSIGN])
-		return 1;
+		if (S_ISDIR(st.st_mode))
+			continue;
 
-	debug(9, "Checking modification signature");
-	fileinfo_t *finfo = indexes_fileinfo(indexes_p, path_rel);
-	if (finfo != NULL) {
-		uint32_t diff;
-		if (!(diff=stat_diff(&finfo->lstat, lstat_p) & ctx_p->flags[MODSIGN])) {
-			debug(8, "Modification signature: File not changed: \"%s\"", path_rel);
-			return 0;	// Skip file syncing if it's metadata not changed enough (according to "--modification-signature" setting)
+		if (!arg_p->skip_rules && !(rules_getperm(name, st.st_mode, ctx_p->rules, RA_WALK|RA_MONITOR) & RA_MONITOR)) {
+			debug(3, "Excluding \"%s\".", name);
+			continue;
 		}
-		debug(8, "Modification signature: stat_diff == 0x%o; significant diff == 0x%o (ctx_p->flags[MODSIGN] == 0x%o)", diff, diff&ctx_p->flags[MODSIGN], ctx_p->flags[MODSIGN]);
 
-		if (is_deleted) {
-			debug(8, "Modification signature: Deleting information about \"%s\"", path_rel);
-			indexes_fileinfo_add(indexes_p, path_rel, NULL);
-			free(finfo);
-		} else {
-			debug(8, "Modification signature: Updating information about \"%s\"", path_rel);
-			memcpy(&finfo->lstat, lstat_p, sizeof(finfo->lstat));
-		}
-	} else {
-		debug(8, "There's no information about this file/dir: \"%s\". Just remembering the current state.", path_rel);
-		// Adding file/dir information
-		finfo = xmalloc(sizeof(*finfo));
-		memcpy(&finfo->lstat, lstat_p, sizeof(finfo->lstat));
-		indexes_fileinfo_add(indexes_p, path_rel, finfo);
+		ret = sync_initialsync_walk_queue(arg_p, path_full, name, 0, st.st_size);
 	}
 
-	return 1;
+	free(path_full);
+	return sync_initialsync_finish(ctx_p, INITSYNC_FULL, ret);
 }
 
-static inline int sync_indexes_fpath2ei_addfixed(ctx_t *ctx_p, indexes_t *indexes_p, const char *fpath, eventinfo_t *evinfo) {
-	static const char fpath_dot[] = ".";
-	const char *fpath_fixed;
+int sync_initialsync_journaled(ctx_t *ctx_p, indexes_t *indexes_p) {
+	struct sync_initialsync_walk_arg arg = {0};
+	struct dirent **namelist = NULL;
+	GHashTable *units_done_ht;
+	char   *path_full     = NULL;
+	size_t  path_full_len = 0;
+	gpointer since_p;
+	time_t since;
+	int ret = 0, i, names_count = 0, journal_fd;
+	debug(1, "Initial sync by units (journal: \"%s\").", ctx_p->initsync_journal);
+
+	units_done_ht = g_hash_table_new_full(g_str_hash, g_str_equal, free, 0);
+
+	journal_fd = sync_initialsync_journal_open(ctx_p, units_done_ht);
+	if (journal_fd == -1) {
+		ret = errno;
+		goto l_sync_initialsync_journaled_end;
+	}
+	debug(1, "%u units are already synced according to the journal.", g_hash_table_size(units_done_ht));
 
-	fpath_fixed = fpath;
-	switch (ctx_p->flags[MODE]) {
-		case MODE_DIRECT:
+	names_count = scandir(ctx_p->watchdir, &namelist, NULL, alphasort);
+	if (names_count == -1) {
+		error("Cannot scandir(\"%s\").", ctx_p->watchdir);
+		ret = errno;
+		goto l_sync_initialsync_journaled_end;
+	}
 
-			// If fpath is empty (that means CWD) then assign it to "."
-			if (!*fpath)
-				fpath_fixed = fpath_dot;
-			break;
-		default:
-			break;
+	arg.ctx_p                     = ctx_p;
+	arg.indexes_p                 = indexes_p;
+	arg.queue_id                  = QUEUE_INSTANT;
+	arg.skip_rules                = ctx_p->flags[INITFULL] || (ctx_p->rules_count == 0);
+	arg.rsync_and_prefer_excludes =
+			(
+				(ctx_p->flags[MODE]==MODE_RSYNCDIRECT) ||
+				(ctx_p->flags[MODE]==MODE_RSYNCSHELL)  ||
+				(ctx_p->flags[MODE]==MODE_RSYNCSO)
+			) &&
+			!ctx_p->flags[RSYNCPREFERINCLUDE];
+
+	// The directories
+	i = 0;
+	while (i < names_count) {
+		const char *name = namelist[i++]->d_name;
+		struct stat st;
+
+		if (!strcmp(name, ".") || !strcmp(name, ".."))
+			continue;
+
+		path_full = sync_path_rel2abs(ctx_p, name, -1, &path_full_len, path_full);
+		if (lstat(path_full, &st)) {
+			debug(1, "Cannot lstat(\"%s\"): %s. Skipping.", path_full, strerror(errno));
+			continue;
+		}
+
+		if (!S_ISDIR(st.st_mode))
+			continue;
+
+		// The excluded directories are not walked by the initial sync of the whole watch dir, too
+		if (!arg.skip_rules) {
+			ruleaction_t perm = rules_getperm(name, st.st_mode, ctx_p->rules, RA_WALK|RA_MONITOR);
+
+			if (!(perm & (arg.rsync_and_prefer_excludes ? RA_MONITOR : RA_WALK))) {
+				debug(3, "Excluding \"%s\".", name);
+				continue;
+			}
+		}
+
+		if (g_hash_table_lookup_extended(units_done_ht, name, NULL, &since_p)) {
+			if (!sync_initialsync_unit_ischanged(ctx_p, path_full, (time_t)(long)since_p)) {
+				debug(2, "The unit \"%s\" is already synced, skipping.", name);
+				continue;
+			}
+			debug(1, "The unit \"%s\" is changed after its sync, syncing it again.", name);
+		}
+
+		debug(1, "Syncing the unit \"%s\".", name);
+		since = time(NULL);
+		if ((ret = _sync_initialsync(path_full, ctx_p, indexes_p, INITSYNC_FULL, 0)))
+			goto l_sync_initialsync_journaled_end;
+		if ((ret = sync_initialsync_unit_flush(ctx_p, indexes_p, name)))
+			goto l_sync_initialsync_journaled_end;
+		if ((ret = sync_initialsync_journal_writeunit(ctx_p, journal_fd, name, since)))
+			goto l_sync_initialsync_journaled_end;
 	}
-	
-	return indexes_fpath2ei_add(indexes_p, strdup(fpath_fixed), evinfo);
+
+	// The rest objects
+	if (
+		!g_hash_table_lookup_extended(units_done_ht, INITSYNC_UNIT_REST, NULL, &since_p) ||
+		sync_initialsync_unit_rest_ischanged(ctx_p, namelist, names_count, (time_t)(long)since_p)
+	) {
+		debug(1, "Syncing the unit \""INITSYNC_UNIT_REST"\".");
+		since = time(NULL);
+		if ((ret = sync_initialsync_unit_rest(ctx_p, indexes_p, &arg, namelist, names_count)))
+			goto l_sync_initialsync_journaled_end;
+		if ((ret = sync_initialsync_unit_flush(ctx_p, indexes_p, INITSYNC_UNIT_REST)))
+			goto l_sync_initialsync_journaled_end;
+		if ((ret = sync_initialsync_journal_writeunit(ctx_p, journal_fd, INITSYNC_UNIT_REST, since)))
+			goto l_sync_initialsync_journaled_end;
+	}
+
+	// The next start should sync the changes made while clsync is not running
+	debug(1, "The initial sync is done, removing the journal \"%s\".", ctx_p->initsync_journal);
+	if (unlink(ctx_p->initsync_journal))
+		warning("Cannot remove the initial sync journal \"%s\".", ctx_p->initsync_journal);
+
+l_sync_initialsync_journaled_end:
+	if (namelist != NULL) {
+		i = 0;
+		while (i < names_count)
+			free(namelist[i++]);
+		free(namelist);
+	}
+	if (journal_fd != -1)
+		close(journal_fd);
+	free(path_full);
+	g_hash_table_destroy(units_done_ht);
+	return ret;
 }
 
-int sync_prequeue_loadmark
-(
-		int monitored,
+#ifdef INOTIFY_SUPPORT
+/* === WATCH BUDGET === */
 
-		ctx_t     *ctx_p,
-		indexes_t *indexes_p,
+/*
+ * "--watch-budget": the count of inotify watches is kept within the budget.
+ * When it's exceeded, the watches of the least recently active directories
+ * are removed and these directories are polled every WATCHBUDGET_POLLINTERVAL
+ * instead: the listing is compared with the previous one and the files
+ * changed since the previous poll are queued. A polled directory that turns
+ * out to be changed gets it's watch back.
+ */
 
-		const char *path_full,
-		const char *path_rel,
+struct watchbudget_polled {
+	time_t		 since;		// files changed since this moment are queued on the next poll
+	GHashTable	*names_ht;	// entry name -> eventobjtype_t (the previous listing)
+};
 
-		stat64_t *lstat_p,
+struct watchbudget_lru {
+	int		 wd;
+	time_t		 active;
+};
 
-		eventobjtype_t objtype_old,
-		eventobjtype_t objtype_new,
+static struct watchbudget {
+	GHashTable	*wd2active_ht;	// wd -> time of the last event on it (only the live watches)
+	GHashTable	*polled_ht;	// path_full -> struct watchbudget_polled
+	uint64_t	 polltime;	// the last poll (monotonic ms)
+	uint64_t	 evicted;
+	uint64_t	 promoted;
+} watchbudget = {NULL};
 
-		uint32_t event_mask,
-		int      event_wd,
-		mode_t st_mode,
-		off_t  st_size,
+static void sync_watchbudget_polled_free(gpointer polled_gp) {
+	struct watchbudget_polled *polled_p = polled_gp;
 
-		char  **path_buf_p,
-		size_t *path_buf_len_p,
+	if (polled_p->names_ht != NULL)
+		g_hash_table_destroy(polled_p->names_ht);
+	free(polled_p);
+	return;
+}
 
-		eventinfo_t *evinfo
-) {
-	debug(10, "%i %p %p %p %p %p %i %i 0x%o %i %i %i %p %p %p",
-			monitored,
-			ctx_p,
-			indexes_p,
-			path_full,
-			path_rel,
-			lstat_p,
-			objtype_old,
-			objtype_new,
-			event_mask,
+static int sync_watchbudget_init(ctx_t *ctx_p) {
+	if (!ctx_p->flags[WATCHBUDGET])
+		return 0;
+
+	debug(1, "watch budget: %i", ctx_p->flags[WATCHBUDGET]);
+	watchbudget.wd2active_ht = g_hash_table_new_full(g_direct_hash, g_direct_equal, 0,    0);
+	watchbudget.polled_ht    = g_hash_table_new_full(g_str_hash,    g_str_equal,    free, sync_watchbudget_polled_free);
+	watchbudget.polltime     = clock_monotonic_ms();
+	return 0;
+}
+
+static void sync_watchbudget_deinit() {
+	if (watchbudget.wd2active_ht == NULL)
+		return;
+
+	g_hash_table_destroy(watchbudget.wd2active_ht);
+	g_hash_table_destroy(watchbudget.polled_ht);
+	watchbudget.wd2active_ht = NULL;
+	watchbudget.polled_ht    = NULL;
+	return;
+}
+
+// Remembers the activity on the watch (called by the monitor on every event)
+
+void sync_watchbudget_touch(ctx_t *ctx_p, int wd) {
+	if (watchbudget.wd2active_ht == NULL)
+		return;
+
+	// The removed watches still may have events in the queue
+	if (!g_hash_table_lookup_extended(watchbudget.wd2active_ht, GINT_TO_POINTER(wd), NULL, NULL))
+		return;
+
+	g_hash_table_replace(watchbudget.wd2active_ht, GINT_TO_POINTER(wd), (gpointer)(long)time(NULL));
+	return;
+}
+
+// Forgets the watch (called by the monitor on IN_IGNORED)
+
+void sync_watchbudget_forget(ctx_t *ctx_p, int wd) {
+	if (watchbudget.wd2active_ht == NULL)
+		return;
+
+	g_hash_table_remove(watchbudget.wd2active_ht, GINT_TO_POINTER(wd));
+	return;
+}
+
+// Return: non-zero if the watch is removed by the budget manager (but IN_IGNORED is not handled, yet)
+
+static inline int sync_watchbudget_isevicted(int wd) {
+	if (watchbudget.wd2active_ht == NULL)
+		return 0;
+
+	return !g_hash_table_lookup_extended(watchbudget.wd2active_ht, GINT_TO_POINTER(wd), NULL, NULL);
+}
+
+static inline int sync_watchbudget_ispolled(const char *path_full) {
+	if (watchbudget.polled_ht == NULL)
+		return 0;
+
+	return g_hash_table_lookup(watchbudget.polled_ht, path_full) != NULL;
+}
+
+/*
+ * Lists the directory and queues the differences with the previous listing
+ * (if there's one). Subdirectories are not entered, they are checked by their
+ * own watches or polls.
+ *
+ * Return: 0 on success, ENOENT if the directory disappeared, errno on fail
+ */
+
+static int sync_watchbudget_polldir(ctx_t *ctx_p, indexes_t *indexes_p, const char *path_full, struct watchbudget_polled *polled_p, int *changed_p) {
+	int ret = 0;
+	FTS *tree;
+	FTSENT *node;
+	char *rootpaths[] = {(char *)path_full, NULL};
+	char  *path_buf     = NULL;
+	size_t path_buf_len = 0;
+	time_t now = time(NULL);
+	GHashTable *names_ht = g_hash_table_new_full(g_str_hash, g_str_equal, free, 0);
+
+	debug(3, "Polling \"%s\" (since %li).", path_full, polled_p->since);
+
+	tree = privileged_fts_open(rootpaths, FTS_NOCHDIR|FTS_PHYSICAL, NULL, PC_SYNC_WATCHBUDGET_FTS_OPEN);
+	if (tree == NULL) {
+		ret = errno;
+		goto l_sync_watchbudget_polldir_end;
+	}
+
+	while ((node = privileged_fts_read(tree, PC_SYNC_WATCHBUDGET_FTS_READ))) {
+		switch (node->fts_info) {
+			case FTS_DP:
+				continue;
+			case FTS_ERR:
+			case FTS_NS:
+			case FTS_DNR:
+				if (node->fts_errno == ENOENT) {
+					if (node->fts_level == 0) {
+						ret = ENOENT;
+						goto l_sync_watchbudget_polldir_end;
+					}
+					continue;
+				}
+				error("Got error while privileged_fts_read(): %s (errno: %i; fts_info: %i).", strerror(node->fts_errno), node->fts_errno, node->fts_info);
+				ret = node->fts_errno;
+				goto l_sync_watchbudget_polldir_end;
+			default:
+				break;
+		}
+
+		if (node->fts_level == 0)
+			continue;
+
+		int is_dir = (node->fts_info == FTS_D);
+		eventobjtype_t objtype_new = is_dir ? EOT_DIR : EOT_FILE;
+		eventobjtype_t objtype_old;
+		uint32_t evmask;
+
+		if (is_dir)
+			fts_set(tree, node, FTS_SKIP);
+
+		g_hash_table_replace(names_ht, strdup(node->fts_name), GINT_TO_POINTER(objtype_new));
+
+		// The first listing is just remembered
+		if (polled_p->names_ht == NULL)
+			continue;
+
+		gpointer objtype_old_gp = g_hash_table_lookup(polled_p->names_ht, node->fts_name);
+		objtype_old = (objtype_old_gp == NULL) ? EOT_DOESNTEXIST : GPOINTER_TO_INT(objtype_old_gp);
+
+		if (objtype_old == objtype_new) {
+			if (is_dir || MAX(node->fts_statp->st_mtime, node->fts_statp->st_ctime) < polled_p->since)
+				continue;
+
+			evmask = IN_MODIFY;
+		} else {
+			// The object is replaced by an object of another type
+			if (objtype_old != EOT_DOESNTEXIST) {
+				if (sync_prequeue_loadmark(1, ctx_p, indexes_p, node->fts_path, NULL, NULL, objtype_old, EOT_DOESNTEXIST, objtype_old == EOT_DIR ? IN_DELETE|IN_ISDIR : IN_DELETE, -1, objtype_old == EOT_DIR ? S_IFDIR : S_IFREG, 0, &path_buf, &path_buf_len, NULL)) {
+					ret = errno ? errno : EINVAL;
+					goto l_sync_watchbudget_polldir_end;
+				}
+				objtype_old = EOT_DOESNTEXIST;
+			}
+
+			evmask = is_dir ? IN_CREATE|IN_ISDIR : IN_CREATE;
+		}
+
+		debug(3, "\"%s\" was changed (evmask: 0x%x).", node->fts_path, evmask);
+		*changed_p = 1;
+
+		stat64_t lstat, *lstat_p = lstat64(node->fts_path, &lstat) ? NULL : &lstat;	// fts_statp is not "struct stat64" everywhere
+		if (sync_prequeue_loadmark(1, ctx_p, indexes_p, node->fts_path, NULL, lstat_p, objtype_old, objtype_new, evmask, -1, node->fts_statp->st_mode, node->fts_statp->st_size, &path_buf, &path_buf_len, NULL)) {
+			ret = errno ? errno : EINVAL;
+			goto l_sync_watchbudget_polldir_end;
+		}
+	}
+	if (errno) {
+		error("Got error while privileged_fts_read() and related routines.");
+		ret = errno;
+		goto l_sync_watchbudget_polldir_end;
+	}
+
+	if (privileged_fts_close(tree, PC_SYNC_WATCHBUDGET_FTS_CLOSE)) {
+		error("Got error while privileged_fts_close().");
+		ret = errno;
+	}
+	tree = NULL;
+
+	// Looking for the deleted objects
+
+	if (polled_p->names_ht != NULL) {
+		GHashTableIter iter;
+		gpointer name_gp, objtype_gp;
+		size_t path_full_len = strlen(path_full);
+
+		g_hash_table_iter_init(&iter, polled_p->names_ht);
+		while (g_hash_table_iter_next(&iter, &name_gp, &objtype_gp)) {
+			const char *name = name_gp;
+			eventobjtype_t objtype_old = GPOINTER_TO_INT(objtype_gp);
+
+			if (g_hash_table_lookup(names_ht, name) != NULL)
+				continue;
+
+			char *path_deleted = xmalloc(path_full_len + strlen(name) + 2);
+			sprintf(path_deleted, "%s/%s", path_full, name);
+			debug(3, "\"%s\" was deleted.", path_deleted);
+			*changed_p = 1;
+
+			int rc = sync_prequeue_loadmark(1, ctx_p, indexes_p, path_deleted, NULL, NULL, objtype_old, EOT_DOESNTEXIST, objtype_old == EOT_DIR ? IN_DELETE|IN_ISDIR : IN_DELETE, -1, objtype_old == EOT_DIR ? S_IFDIR : S_IFREG, 0, &path_buf, &path_buf_len, NULL);
+			free(path_deleted);
+			if (rc) {
+				ret = errno ? errno : EINVAL;
+				goto l_sync_watchbudget_polldir_end;
+			}
+		}
+
+		g_hash_table_destroy(polled_p->names_ht);
+	}
+
+	polled_p->names_ht = names_ht;
+	polled_p->since    = now - 1;	// FS timestamps may be coarser than time()
+	names_ht = NULL;
+
+l_sync_watchbudget_polldir_end:
+	if (tree != NULL)
+		privileged_fts_close(tree, PC_SYNC_WATCHBUDGET_FTS_CLOSE);
+	if (names_ht != NULL)
+		g_hash_table_destroy(names_ht);
+	if (path_buf != NULL)
+		free(path_buf);
+	return ret;
+}
+
+// Starts polling the directory instead of watching it
+// Return: 0 on success, errno on fail
+
+static int sync_watchbudget_polladd(ctx_t *ctx_p, indexes_t *indexes_p, const char *path_full) {
+	struct watchbudget_polled *polled_p = xcalloc(1, sizeof(*polled_p));
+	int changed = 0;
+
+	int rc = sync_watchbudget_polldir(ctx_p, indexes_p, path_full, polled_p, &changed);
+	if (rc) {
+		sync_watchbudget_polled_free(polled_p);
+		return rc;
+	}
+
+	g_hash_table_replace(watchbudget.polled_ht, strdup(path_full), polled_p);
+	return 0;
+}
+
+static int sync_watchbudget_lru_cmp(const void *a, const void *b) {
+	const struct watchbudget_lru *a_p = a, *b_p = b;
+
+	return (a_p->active > b_p->active) - (a_p->active < b_p->active);
+}
+
+/*
+ * Removes the watches of the least recently active directories (1/WATCHBUDGET_EVICT_DIVISOR
+ * of the budget) and starts polling these directories. The directory is listed
+ * before it's watch removal, so the changes happened in between are reported
+ * twice but not missed. The indexes are cleaned up on IN_IGNORED as usual.
+ *
+ * Return: 0 on success, ENOSPC if nothing could be evicted
+ */
+
+static int sync_watchbudget_evict(ctx_t *ctx_p, indexes_t *indexes_p) {
+	int inotify_d = (int)(long)ctx_p->fsmondata;
+	size_t count   = g_hash_table_size(watchbudget.wd2active_ht);
+	size_t portion = MAX(1, ctx_p->flags[WATCHBUDGET] / WATCHBUDGET_EVICT_DIVISOR);
+	size_t evicted = 0;
+	struct watchbudget_lru *lru;
+
+	if (!count)
+		return ENOSPC;
+
+	lru = xmalloc(count * sizeof(*lru));
+	{
+		GHashTableIter iter;
+		gpointer wd_gp, active_gp;
+		size_t i = 0;
+
+		g_hash_table_iter_init(&iter, watchbudget.wd2active_ht);
+		while (g_hash_table_iter_next(&iter, &wd_gp, &active_gp)) {
+			lru[i].wd     = GPOINTER_TO_INT(wd_gp);
+			lru[i].active = (time_t)(long)active_gp;
+			i++;
+		}
+	}
+	qsort(lru, count, sizeof(*lru), sync_watchbudget_lru_cmp);
+
+	size_t i = 0;
+	while ((i < count) && (evicted < portion)) {
+		int wd = lru[i++].wd;
+		const char *fpath = indexes_wd2fpath(indexes_p, wd);
+
+		if (fpath == NULL) {
+			g_hash_table_remove(watchbudget.wd2active_ht, GINT_TO_POINTER(wd));
+			continue;
+		}
+
+		if (sync_watchbudget_polladd(ctx_p, indexes_p, fpath)) {
+			debug(2, "Cannot start polling \"%s\", keeping the watch.", fpath);
+			continue;
+		}
+
+		debug(3, "Evicting the watch of \"%s\" (wd: %i; last activity: %li).", fpath, wd, lru[i-1].active);
+		if (privileged_inotify_rm_watch(inotify_d, wd))
+			warning("Cannot inotify_rm_watch() the watch of \"%s\" (wd: %i)", fpath, wd);
+
+		g_hash_table_remove(watchbudget.wd2active_ht, GINT_TO_POINTER(wd));
+		evicted++;
+	}
+	free(lru);
+
+	watchbudget.evicted += evicted;
+	debug(1, "Evicted %zu watches (polled directories: %u).", evicted, g_hash_table_size(watchbudget.polled_ht));
+
+	return evicted ? 0 : ENOSPC;
+}
+
+// Makes room for one more watch if the budget is exhausted
+
+static inline int sync_watchbudget_reserve(ctx_t *ctx_p, indexes_t *indexes_p) {
+	if (g_hash_table_size(watchbudget.wd2active_ht) < (guint)ctx_p->flags[WATCHBUDGET])
+		return 0;
+
+	return sync_watchbudget_evict(ctx_p, indexes_p);
+}
+
+/* === /WATCH BUDGET === */
+#endif
+
+int sync_notify_mark(ctx_t *ctx_p, const char *accpath, const char *path, size_t pathlen, indexes_t *indexes_p) {
+	debug(3, "(..., \"%s\", %i,...)", path, pathlen);
+	int wd = indexes_fpath2wd(indexes_p, path);
+	if(wd != -1) {
+#ifdef INOTIFY_SUPPORT
+		if (sync_watchbudget_isevicted(wd)) {
+			debug(2, "\"%s\" was evicted (wd: %i). Forgetting the old watch.", path, wd);
+			indexes_remove_bywd(indexes_p, wd);
+		} else
+#endif
+		{
+			debug(1, "\"%s\" is already marked (wd: %i). Skipping.", path, wd);
+			return wd;
+		}
+	}
+
+#ifdef INOTIFY_SUPPORT
+	if (watchbudget.wd2active_ht != NULL) {
+		// The directory is going to be watched, so stop polling it
+		g_hash_table_remove(watchbudget.polled_ht, path);
+
+		if (sync_watchbudget_reserve(ctx_p, indexes_p) == ENOSPC)
+			debug(1, "The watch budget is exhausted and there's nothing to evict.");
+	}
+#endif
+
+	debug(5, "ctx_p->notifyenginefunct.add_watch_dir(ctx_p, indexes_p, \"%s\")", accpath);
+	if((wd = ctx_p->notifyenginefunct.add_watch_dir(ctx_p, indexes_p, accpath)) == -1) {
+		if(errno == ENOENT)
+			return -2;
+
+#ifdef INOTIFY_SUPPORT
+		// The kernel limit is reached (max_user_watches is shared by all the processes of the user)
+		if ((errno == ENOSPC) && (watchbudget.wd2active_ht != NULL)) {
+			if (!sync_watchbudget_evict(ctx_p, indexes_p))
+				wd = ctx_p->notifyenginefunct.add_watch_dir(ctx_p, indexes_p, accpath);
+
+			if (wd == -1) {
+				debug(1, "Cannot watch \"%s\", polling it.", path);
+				int rc = sync_watchbudget_polladd(ctx_p, indexes_p, path);
+				if (rc == ENOENT)
+					return -2;
+				if (rc) {
+					errno = rc;
+					error("Cannot start polling \"%s\".", path);
+					return -1;
+				}
+				return -2;
+			}
+		} else
+#endif
+		{
+			error("Cannot ctx_p->notifyenginefunct.add_watch_dir() on \"%s\".", 
+				path);
+			return -1;
+		}
+	}
+	debug(6, "endof ctx_p->notifyenginefunct.add_watch_dir(ctx_p, indexes_p, \"%s\")", accpath);
+	indexes_add_wd(indexes_p, wd, path, pathlen);
+#ifdef INOTIFY_SUPPORT
+	if (watchbudget.wd2active_ht != NULL)
+		g_hash_table_replace(watchbudget.wd2active_ht, GINT_TO_POINTER(wd), (gpointer)(long)time(NULL));
+#endif
+
+	return wd;
+}
+
+struct sync_markthread;
+static int sync_markthread_mark(ctx_t *ctx_p, struct sync_markthread *markthread_p, const char *accpath, const char *path, size_t pathlen);
+
+/*
+ * If markthread_p is not NULL, the walk is done by a parallel marking thread
+ * (see sync_mark_walk_parallel()): the marks are collected by the thread and
+ * the indexes are not touched.
+ */
+static int _sync_mark_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_p, struct sync_markthread *markthread_p) {
+	int ret = 0;
+	const char *rootpaths[] = {dirpath, NULL};
+	FTS *tree;
+	rule_t *rules_p = ctx_p->rules;
+	debug(2, "(ctx_p, \"%s\", indexes_p).", dirpath);
+
+#ifdef FANOTIFY_SUPPORT
+	// The filesystem mark is already set by fanotify_start(), there's nothing to walk for
+	if (ctx_p->flags[MONITOR] == NE_FANOTIFY)
+		return 0;
+#endif
+
+	int fts_opts = FTS_NOCHDIR|FTS_PHYSICAL|FTS_NOSTAT|(ctx_p->flags[ONEFILESYSTEM]?FTS_XDEV:0);
+
+        debug(3, "fts_opts == %p", (void *)(long)fts_opts);
+	tree = privileged_fts_open((char *const *)rootpaths, fts_opts, NULL, PC_SYNC_MARK_WALK_FTS_OPEN);
+
+	if (tree == NULL) {
+		error_or_debug((ctx_p->state == STATE_STARTING) ?-1:2, "Cannot privileged_fts_open() on \"%s\".", dirpath);
+		return errno;
+	}
+
+	FTSENT *node;
+	char  *path_rel		= NULL;
+	size_t path_rel_len	= 0;
+
+	while ((node = privileged_fts_read(tree, PC_SYNC_MARK_WALK_FTS_READ))) {
+#ifdef CLUSTER_SUPPORT
+		int ret;
+#endif
+		debug(2, "walking: \"%s\" (depth %u): fts_info == %i", node->fts_path, node->fts_level, node->fts_info);
+
+		switch(node->fts_info) {
+			// Duplicates:
+			case FTS_DP:
+				continue;
+			// Files:
+			case FTS_DEFAULT:
+			case FTS_SL:
+			case FTS_SLNONE:
+			case FTS_F:
+			case FTS_NSOK:
+#ifdef CLUSTER_SUPPORT
+				if ((ret=sync_mark_walk_cluster_modtime_update(ctx_p, node->fts_path, node->fts_level, S_IFREG)))
+					goto l_sync_mark_walk_end;
+#endif
+				continue;
+			// Directories (to mark):
+			case FTS_D:
+			case FTS_DC:    // TODO: think about case of FTS_DC
+			case FTS_DOT:
+#ifdef CLUSTER_SUPPORT
+				if ((ret=sync_mark_walk_cluster_modtime_update(ctx_p, node->fts_path, node->fts_level, S_IFDIR)))
+					goto l_sync_mark_walk_end;
+#endif
+				break;
+			// Error cases:
+			case FTS_ERR:
+			case FTS_NS:
+			case FTS_DNR:
+				if (errno == ENOENT) {
+					debug(1, "Got error while privileged_fts_read(); fts_info: %i.", node->fts_info);
+					continue;
+				} else {
+					error_or_debug((ctx_p->state == STATE_STARTING) ?-1:2, "Got error while privileged_fts_read(); fts_info: %i.", node->fts_info);
+					ret = errno;
+					goto l_sync_mark_walk_end;
+				}
+			default:
+				error_or_debug((ctx_p->state == STATE_STARTING) ?-1:2, "Got unknown fts_info vlaue while privileged_fts_read(): %i.", node->fts_info);
+				ret = EINVAL;
+				goto l_sync_mark_walk_end;
+		}
+
+		path_rel = sync_path_abs2rel(ctx_p, node->fts_path, -1, &path_rel_len, path_rel);
+		ruleaction_t perm = rules_search_getperm(path_rel, S_IFDIR, rules_p, RA_WALK, NULL);
+
+		if (!(perm&RA_WALK)) {
+			fts_set(tree, node, FTS_SKIP);
+			continue;
+		}
+
+		debug(2, "marking \"%s\" (depth %u)", node->fts_path, node->fts_level);
+		int wd = (markthread_p == NULL) ?
+				sync_notify_mark    (ctx_p, node->fts_accpath, node->fts_path, node->fts_pathlen, indexes_p) :
+				sync_markthread_mark(ctx_p, markthread_p, node->fts_accpath, node->fts_path, node->fts_pathlen);
+		if (wd == -1) {
+			error_or_debug((ctx_p->state == STATE_STARTING) ?-1:2, "Got error while notify-marking \"%s\".", node->fts_path);
+			ret = errno;
+			goto l_sync_mark_walk_end;
+		}
+		debug(2, "watching descriptor is %i.", wd);
+	}
+	if (errno) {
+		error_or_debug((ctx_p->state == STATE_STARTING) ?-1:2, "Got error while privileged_fts_read() and related routines.");
+		ret = errno;
+		goto l_sync_mark_walk_end;
+	}
+
+	if (privileged_fts_close(tree, PC_SYNC_MARK_WALK_FTS_CLOSE)) {
+		error_or_debug((ctx_p->state == STATE_STARTING) ?-1:2, "Got error while privileged_fts_close().");
+		ret = errno;
+		goto l_sync_mark_walk_end;
+	}
+
+l_sync_mark_walk_end:
+	if (path_rel != NULL)
+		free(path_rel);
+	return ret;
+}
+
+int sync_mark_walk(ctx_t *ctx_p, const char *dirpath, indexes_t *indexes_p) {
+	return _sync_mark_walk(ctx_p, dirpath, indexes_p, NULL);
+}
+
+/* === PARALLEL MARKING === */
+
+/*
+ * "--mark-threads": the top-level subdirectories of the watch directory are
+ * distributed between the threads, every thread walks its subdirectories and
+ * adds the watches. The resulting wd-s are collected per thread and are
+ * added to the indexes by the main thread after all the threads are done.
+ */
+
+struct sync_markthread_mark {
+	int	 wd;
+	size_t	 pathlen;
+	char	*path;
+};
+
+struct sync_markthread {
+	pthread_t			 pthread;
+	int				 num;
+	ctx_t				*ctx_p;
+
+	char			       **subdir;
+	size_t				 subdir_count;
+	size_t				*subdir_next_p;	// shared between the threads
+
+	struct sync_markthread_mark	*mark;
+	size_t				 mark_count;
+	size_t				 mark_alloc;
+
+	int				 ret;
+};
+
+static int sync_markthread_mark(ctx_t *ctx_p, struct sync_markthread *markthread_p, const char *accpath, const char *path, size_t pathlen) {
+	struct sync_markthread_mark *mark_p;
+	int wd;
+
+	if ((wd = ctx_p->notifyenginefunct.add_watch_dir(ctx_p, NULL, accpath)) == -1) {
+		if (errno == ENOENT)
+			return -2;
+
+		error("Cannot ctx_p->notifyenginefunct.add_watch_dir() on \"%s\".", path);
+		return -1;
+	}
+
+	if (markthread_p->mark_count >= markthread_p->mark_alloc) {
+		markthread_p->mark_alloc += ALLOC_PORTION;
+		markthread_p->mark        = xrealloc(markthread_p->mark, markthread_p->mark_alloc * sizeof(*markthread_p->mark));
+	}
+
+	mark_p = &markthread_p->mark[markthread_p->mark_count++];
+	mark_p->wd      = wd;
+	mark_p->pathlen = pathlen;
+	mark_p->path    = xmalloc(pathlen+1);
+	memcpy(mark_p->path, path, pathlen+1);
+
+	if (!(markthread_p->mark_count % MARKTHREADS_PROGRESS_INTERVAL))
+		info("Mark thread #%i: %lu directories are marked (at \"%s\").", markthread_p->num, (unsigned long)markthread_p->mark_count, path);
+
+	return wd;
+}
+
+static void *sync_markthread(void *_markthread_p) {
+	struct sync_markthread *markthread_p = _markthread_p;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(markthread_p->subdir_next_p, 1, __ATOMIC_RELAXED)) < markthread_p->subdir_count) {
+		debug(2, "Mark thread #%i: walking \"%s\".", markthread_p->num, markthread_p->subdir[i]);
+
+		if ((markthread_p->ret = _sync_mark_walk(markthread_p->ctx_p, markthread_p->subdir[i], NULL, markthread_p)))
+			break;
+	}
+
+	info("Mark thread #%i: finished, %lu directories are marked.", markthread_p->num, (unsigned long)markthread_p->mark_count);
+	return NULL;
+}
+
+int sync_mark_walk_parallel(ctx_t *ctx_p, indexes_t *indexes_p) {
+	struct sync_markthread *markthread;
+	struct dirent *dent;
+	stat64_t root_st, st;
+	char **subdir = NULL;
+	size_t subdir_count = 0, subdir_alloc = 0, subdir_next = 0, i;
+	int threads_count, ret = 0;
+	DIR *dir;
+
+#ifdef CLUSTER_SUPPORT
+	if (ctx_p->cluster_iface != NULL) {
+		debug(1, "The cluster modification times are updated while walking, so marking in one thread.");
+		return sync_mark_walk(ctx_p, ctx_p->watchdir, indexes_p);
+	}
+#endif
+
+	if (lstat64(ctx_p->watchdir, &root_st)) {
+		error("Cannot lstat64(\"%s\").", ctx_p->watchdir);
+		return errno;
+	}
+
+	if (sync_notify_mark(ctx_p, ctx_p->watchdir, ctx_p->watchdir, ctx_p->watchdirlen, indexes_p) == -1) {
+		error("Got error while notify-marking \"%s\".", ctx_p->watchdir);
+		return errno;
+	}
+
+	// Collecting the top-level subdirectories to be distributed between the threads
+
+	dir = opendir(ctx_p->watchdir);
+	if (dir == NULL) {
+		error("Cannot opendir(\"%s\").", ctx_p->watchdir);
+		return errno;
+	}
+
+	while ((dent = readdir(dir)) != NULL) {
+		char *path;
+
+		if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+			continue;
+
+		if ((dent->d_type != DT_DIR) && (dent->d_type != DT_UNKNOWN))
+			continue;
+
+		path = xmalloc(ctx_p->watchdirlen + strlen(dent->d_name) + 2);
+		sprintf(path, "%s%s", ctx_p->watchdirwslash, dent->d_name);
+
+		if (lstat64(path, &st) || !S_ISDIR(st.st_mode)) {
+			free(path);
+			continue;
+		}
+
+		// FTS_XDEV wouldn't descend into such directories
+		if (ctx_p->flags[ONEFILESYSTEM] && (st.st_dev != root_st.st_dev)) {
+			debug(2, "\"%s\" is on another filesystem. Skipping.", path);
+			free(path);
+			continue;
+		}
+
+		if (!(rules_search_getperm(dent->d_name, S_IFDIR, ctx_p->rules, RA_WALK, NULL) & RA_WALK)) {
+			free(path);
+			continue;
+		}
+
+		if (subdir_count >= subdir_alloc) {
+			subdir_alloc += ALLOC_PORTION;
+			subdir        = xrealloc(subdir, subdir_alloc * sizeof(*subdir));
+		}
+		subdir[subdir_count++] = path;
+	}
+	closedir(dir);
+
+	threads_count = MIN((size_t)ctx_p->flags[MARKTHREADS], subdir_count);
+	info("Marking %lu top-level directories using %i threads.", (unsigned long)subdir_count, threads_count);
+
+	// Walking
+
+	markthread = xcalloc(threads_count ? threads_count : 1, sizeof(*markthread));
+
+	i = 0;
+	while (i < threads_count) {
+		markthread[i].num           = i;
+		markthread[i].ctx_p         = ctx_p;
+		markthread[i].subdir        = subdir;
+		markthread[i].subdir_count  = subdir_count;
+		markthread[i].subdir_next_p = &subdir_next;
+
+		if (pthread_create(&markthread[i].pthread, NULL, sync_markthread, &markthread[i])) {
+			error("Cannot pthread_create() the mark thread #%i.", i);
+			ret = errno ? errno : EAGAIN;
+			// The already created threads will take the rest of subdirectories
+			break;
+		}
+		i++;
+	}
+	threads_count = i;
+
+	// Collecting the results
+
+	i = 0;
+	while (i < threads_count) {
+		struct sync_markthread *markthread_p = &markthread[i++];
+		size_t j;
+
+		pthread_join(markthread_p->pthread, NULL);
+
+		if (markthread_p->ret && !ret)
+			ret = markthread_p->ret;
+
+		j = 0;
+		while (j < markthread_p->mark_count) {
+			struct sync_markthread_mark *mark_p = &markthread_p->mark[j++];
+			indexes_add_wd(indexes_p, mark_p->wd, mark_p->path, mark_p->pathlen);
+			free(mark_p->path);
+		}
+		free(markthread_p->mark);
+	}
+	free(markthread);
+
+	if (!threads_count && subdir_count && !ret)
+		ret = EAGAIN;
+
+	i = 0;
+	while (i < subdir_count)
+		free(subdir[i++]);
+	free(subdir);
+
+	if (ret)
+		error("Got error while marking the tree in parallel.");
+	else
+		info("Marked %i directories.", indexes_wdcount(indexes_p));
+
+	return ret;
+}
+
+int sync_notify_init(ctx_t *ctx_p) {
+	switch (ctx_p->flags[MONITOR]) {
+#ifdef FANOTIFY_SUPPORT
+		case NE_FANOTIFY: {
+			ctx_p->fsmondata = (void *)(long)fanotify_init(FANOTIFY_FLAGS, FANOTIFY_EVFLAGS);
+			if((long)ctx_p->fsmondata == -1) {
+				error("cannot fanotify_init(%i, %i).", FANOTIFY_FLAGS, FANOTIFY_EVFLAGS);
+				return -1;
+			}
+
+			// Marking here: CAP_SYS_ADMIN may be already dropped at sync_mark_walk()
+			if (fanotify_start(ctx_p)) {
+				error("cannot fanotify_start(ctx_p).");
+				return -1;
+			}
+
+			return 0;
+		}
+#endif
+#ifdef INOTIFY_SUPPORT
+		case NE_INOTIFY: {
+# ifdef INOTIFY_OLD
+			ctx_p->fsmondata = (void *)(long)inotify_init();
+			// inotify_handle() reads until EAGAIN, so O_NONBLOCK is mandatory
+			if ((long)ctx_p->fsmondata != -1)
+				if (fcntl((int)(long)ctx_p->fsmondata, F_SETFL, O_NONBLOCK) == -1) {
+					error("cannot fcntl(%i, F_SETFL, O_NONBLOCK).", (int)(long)ctx_p->fsmondata);
+					return -1;
+				}
+#  if INOTIFY_FLAGS != 0
+#   warning Do not know how to set inotify flags (too old system)
+#  endif
+# else
+			ctx_p->fsmondata = (void *)(long)inotify_init1(INOTIFY_FLAGS);
+# endif
+			if ((long)ctx_p->fsmondata == -1) {
+				error("cannot inotify_init1(%i).", INOTIFY_FLAGS);
+				return -1;
+			}
+
+			if (ctx_p->flags[INOTIFYRING])
+				if (inotify_reader_start(ctx_p)) {
+					error("cannot inotify_reader_start(ctx_p).");
+					return -1;
+				}
+
+			if (statbatch_init(ctx_p)) {
+				error("cannot statbatch_init(ctx_p).");
+				return -1;
+			}
+
+			return 0;
+		}
+#endif
+#ifdef KQUEUE_SUPPORT
+		case NE_KQUEUE: {
+			int kqueue_d = kqueue_init(ctx_p);
+			if(kqueue_d == -1) {
+				error("cannot kqueue_init(ctx_p).");
+				return -1;
+			}
+
+			return 0;
+		}
+#endif
+#ifdef BSM_SUPPORT
+		case NE_BSM:
+		case NE_BSM_PREFETCH: {
+			int bsm_d = bsm_init(ctx_p);
+			if(bsm_d == -1) {
+				error("cannot bsm_init(ctx_p).");
+				return -1;
+			}
+
+			return 0;
+		}
+#endif
+#ifdef GIO_SUPPORT
+		case NE_GIO: {
+			critical_on (gio_init(ctx_p) == -1);
+			return 0;
+		}
+#endif
+	}
+	error("unknown notify-engine: %i", ctx_p->flags[MONITOR]);
+	errno = EINVAL;
+	return -1;
+}
+
+static inline int sync_dosync_exec(ctx_t *ctx_p, indexes_t *indexes_p, const char *evmask_str, const char *fpath) {
+	int rc;
+	struct dosync_arg dosync_arg;
+	debug(20, "(ctx_p, indexes_p, \"%s\", \"%s\")", evmask_str, fpath);
+
+	 dosync_arg.ctx_p	       = ctx_p;
+	*dosync_arg.include_list       = fpath;
+	 dosync_arg.include_list_count = 1;
+	 dosync_arg.list_type_str      = "sync";
+	 dosync_arg.evmask_str         = evmask_str;
+
+	char **argv = sync_customargv(ctx_p, &dosync_arg, &ctx_p->synchandler_args[SHARGS_PRIMARY]);
+	rc = SYNC_EXEC_ARGV(
+		ctx_p,
+		indexes_p,
+		NULL, NULL,
+		argv);
+	
+	if (!SHOULD_THREAD(ctx_p))	// If it's a thread then it will free the argv in GC. If not a thread then we have to free right here.
+		argv_free(argv);
+	return rc;
+
+#ifdef DOXYGEN
+	sync_exec_argv(NULL, NULL); sync_exec_argv_thread(NULL, NULL);
+#endif
+}
+
+int sync_dosync(const char *fpath, uint32_t evmask, ctx_t *ctx_p, indexes_t *indexes_p) {
+	int ret;
+
+#ifdef CLUSTER_SUPPORT
+	ret = cluster_lock(fpath);
+	if(ret) return ret;
+#endif
+
+	char *evmask_str = xmalloc(1<<8);
+	sprintf(evmask_str, "%u", evmask);
+	ret = sync_dosync_exec(ctx_p, indexes_p, evmask_str, fpath);
+	free(evmask_str);
+
+#ifdef CLUSTER_SUPPORT
+	ret = cluster_unlock_all();
+#endif
+
+	return ret;
+}
+
+int fileischanged(ctx_t *ctx_p, indexes_t *indexes_p, const char *path_rel, stat64_t *lstat_p, int is_deleted) {
+	if (lstat_p == NULL || !ctx_p->flags[MODSIGN])
+		return 1;
+
+	debug(9, "Checking modification signature");
+	fileinfo_t *finfo = indexes_fileinfo(indexes_p, path_rel);
+	if (finfo != NULL) {
+		uint32_t diff;
+		if (!(diff=fileinfo_diff(indexes_p->fileinfo, finfo, lstat_p) & ctx_p->flags[MODSIGN])) {
+			debug(8, "Modification signature: File not changed: \"%s\"", path_rel);
+			return 0;	// Skip file syncing if it's metadata not changed enough (according to "--modification-signature" setting)
+		}
+		debug(8, "Modification signature: stat_diff == 0x%o; significant diff == 0x%o (ctx_p->flags[MODSIGN] == 0x%o)", diff, diff&ctx_p->flags[MODSIGN], ctx_p->flags[MODSIGN]);
+
+		if (is_deleted) {
+			debug(8, "Modification signature: Deleting information about \"%s\"", path_rel);
+			indexes_fileinfo_remove(indexes_p, path_rel);
+		} else {
+			debug(8, "Modification signature: Updating information about \"%s\"", path_rel);
+			fileinfo_set(indexes_p->fileinfo, finfo, lstat_p);
+		}
+	} else {
+		debug(8, "There's no information about this file/dir: \"%s\". Just remembering the current state.", path_rel);
+		// Adding file/dir information
+		indexes_fileinfo_add(indexes_p, path_rel, lstat_p);
+	}
+
+	return 1;
+}
+
+// Returns the event information to be synced for "fpath" (zeroed if "*isnew_p" is set)
+
+static inline eventinfo_t *sync_indexes_fpath2ei_addfixed(ctx_t *ctx_p, indexes_t *indexes_p, const char *fpath, size_t fpath_len, strmap_hash_t hash, int *isnew_p) {
+	static const char fpath_dot[] = ".";
+
+	switch (ctx_p->flags[MODE]) {
+		case MODE_DIRECT:
+
+			// If fpath is empty (that means CWD) then assign it to "."
+			if (!*fpath) {
+				fpath	  = fpath_dot;
+				fpath_len = sizeof(fpath_dot)-1;
+				hash	  = strmap_hash(fpath, fpath_len);
+			}
+			break;
+		default:
+			break;
+	}
+	
+	return indexes_fpath2ei_add(indexes_p, fpath, fpath_len, hash, isnew_p);
+}
+
+int sync_prequeue_loadmark
+(
+		int monitored,
+
+		ctx_t     *ctx_p,
+		indexes_t *indexes_p,
+
+		const char *path_full,
+		const char *path_rel,
+
+		stat64_t *lstat_p,
+
+		eventobjtype_t objtype_old,
+		eventobjtype_t objtype_new,
+
+		uint32_t event_mask,
+		int      event_wd,
+		mode_t st_mode,
+		off_t  st_size,
+
+		char  **path_buf_p,
+		size_t *path_buf_len_p,
+
+		eventinfo_t *evinfo
+) {
+	debug(10, "%i %p %p %p %p %p %i %i 0x%o %i %i %i %p %p %p",
+			monitored,
+			ctx_p,
+			indexes_p,
+			path_full,
+			path_rel,
+			lstat_p,
+			objtype_old,
+			objtype_new,
+			event_mask,
 			event_wd,
 			st_mode,
 			st_size,
@@ -2027,224 +3641,858 @@ int sync_prequeue_loadmark
 		return EINVAL;
 	}
 #endif
-#ifdef VERYPARANOID
-	if (path_full == NULL && path_rel == NULL) {
-		error("path_full == NULL && path_rel == NULL");
-		return EINVAL;
+#ifdef VERYPARANOID
+	if (path_full == NULL && path_rel == NULL) {
+		error("path_full == NULL && path_rel == NULL");
+		return EINVAL;
+	}
+#endif
+
+
+	if (path_rel == NULL) {
+		*path_buf_p   = sync_path_abs2rel(ctx_p, path_full, -1, path_buf_len_p, *path_buf_p);
+		 path_rel     = *path_buf_p;
+	}
+
+	ruleaction_t perm = RA_ALL;
+	if (st_mode) {
+		// Checking by filter rules
+		perm = rules_getperm(path_rel, st_mode, ctx_p->rules, RA_WALK|RA_MONITOR);
+
+		if(!(perm&(RA_MONITOR|RA_WALK))) {
+			return 0;
+		}
+	}
+
+	// Handling different cases
+
+	int is_dir	= objtype_old == EOT_DIR || objtype_new == EOT_DIR;
+	int is_created	= objtype_old == EOT_DOESNTEXIST;
+	int is_deleted	= objtype_new == EOT_DOESNTEXIST;
+
+	debug(4, "is_dir == %x; is_created == %x; is_deleted == %x", is_dir, is_created, is_deleted);
+
+	if (is_dir) {
+		if (is_created) {
+			int ret;
+
+			if (perm & RA_WALK) {
+				if (path_full == NULL) {
+					*path_buf_p   = sync_path_rel2abs(ctx_p, path_rel,  -1, path_buf_len_p, *path_buf_p);
+					 path_full    = *path_buf_p;
+				}
+
+				// The new subtree is marked by the same walk that queues it
+				ret = _sync_initialsync(path_full, ctx_p, indexes_p, INITSYNC_SUBDIR, monitored);
+				if (ret) {
+					errno = ret;
+					error("Got error from sync_initialsync()");
+					return errno;
+				}
+			}
+
+			fileischanged(ctx_p, indexes_p, path_rel, lstat_p, is_deleted);	// Just to remember it's state
+			return 0;
+		} else 
+		if (is_deleted) {
+			debug(2, "Disappeared \".../%s\".", path_rel);
+		}
+	}
+
+	if (!(perm&RA_WALK)) {
+		return 0;
+	}
+
+	if (!fileischanged(ctx_p, indexes_p, path_rel, lstat_p, is_deleted)) {
+		debug(4, "The file is not changed. Returning.");
+		return 0;
+	}
+
+	switch (ctx_p->flags[MODE]) {
+		case MODE_SIMPLE:
+			return SAFE(sync_dosync(path_rel, event_mask, ctx_p, indexes_p), debug(1, "fpath == \"%s\"; evmask == 0x%o", path_rel, event_mask); return -1;);
+		default:
+			break;
+	}
+
+	// Locally queueing the event
+
+	int isnew;
+	size_t path_rel_len = strlen(path_rel);
+	eventinfo_t *evinfo_lockwait = evinfo;
+
+	evinfo = sync_indexes_fpath2ei_addfixed(ctx_p, indexes_p, path_rel, path_rel_len, strmap_hash(path_rel, path_rel_len), &isnew);
+
+	if (evinfo_lockwait != NULL) {
+		// It's new for prequeue (but old for lockwait queue)
+		memcpy(evinfo, evinfo_lockwait, sizeof(*evinfo));
+	} else
+	if (isnew) {
+		evinfo->fsize        = st_size;
+		evinfo->wd           = event_wd;
+		evinfo->seqid_min    = sync_seqid();
+		evinfo->seqid_max    = evinfo->seqid_min;
+		evinfo->objtype_old  = objtype_old;
+		debug(3, "new event: fsize == %i; wd == %i", evinfo->fsize, evinfo->wd);
+	} else {
+		evinfo->seqid_max    = sync_seqid();
+	}
+
+	switch(ctx_p->flags[MONITOR]) {
+#ifdef KQUEUE_SUPPORT
+		case NE_KQUEUE:
+#endif
+#ifdef INOTIFY_SUPPORT
+		case NE_INOTIFY:
+#endif
+#ifdef FANOTIFY_SUPPORT
+		case NE_FANOTIFY:
+#endif
+#if KQUEUE_SUPPORT | INOTIFY_SUPPORT | FANOTIFY_SUPPORT
+			evinfo->evmask |= event_mask;
+			break;
+#endif
+#ifdef BSM_SUPPORT
+		case NE_BSM:
+		case NE_BSM_PREFETCH:
+			evinfo->evmask  = event_mask;
+			break;
+#endif
+#ifdef GIO_SUPPORT
+		case NE_GIO:
+			evinfo->evmask  = event_mask;
+			break;
+#endif
+	}
+
+	evinfo->objtype_new = objtype_new;
+
+	debug(2, "path_rel == \"%s\"; evinfo->objtype_old == %i; evinfo->objtype_new == %i; "
+		 "evinfo->seqid_min == %u; evinfo->seqid_max == %u", 
+		 path_rel, evinfo->objtype_old, evinfo->objtype_new,
+		 evinfo->seqid_min, evinfo->seqid_max
+	     );
+
+	return 0;
+}
+
+/*
+ * Moves queued events and remembered file states from the old path (and
+ * paths under it) to the new one.
+ */
+
+static void sync_rename_rekey(GHashTable *ht, const char *fpath_old, const char *fpath_new) {
+	size_t fpath_old_len = strlen(fpath_old);
+	size_t fpath_new_len = strlen(fpath_new);
+	char **keys = NULL;
+	size_t keys_count = 0, keys_alloc = 0;
+
+	GHashTableIter iter;
+	gpointer key_gp, value_gp;
+	g_hash_table_iter_init(&iter, ht);
+	while (g_hash_table_iter_next(&iter, &key_gp, &value_gp)) {
+		char *fpath = key_gp;
+
+		if (strncmp(fpath, fpath_old, fpath_old_len))
+			continue;
+		if (fpath[fpath_old_len] != 0 && fpath[fpath_old_len] != '/')
+			continue;
+
+		if (keys_count >= keys_alloc) {
+			keys_alloc += ALLOC_PORTION;
+			keys = xrealloc(keys, keys_alloc * sizeof(*keys));
+		}
+		keys[keys_count++] = fpath;
+	}
+
+	size_t i = 0;
+	while (i < keys_count) {
+		char *fpath = keys[i++];
+		size_t fpath_rest_len = strlen(&fpath[fpath_old_len]);
+
+		char *fpath_renamed = xmalloc(fpath_new_len + fpath_rest_len + 1);
+		memcpy(fpath_renamed, fpath_new, fpath_new_len);
+		memcpy(&fpath_renamed[fpath_new_len], &fpath[fpath_old_len], fpath_rest_len+1);
+
+		debug(4, "\"%s\" -> \"%s\"", fpath, fpath_renamed);
+
+		g_hash_table_lookup_extended(ht, fpath, &key_gp, &value_gp);
+		g_hash_table_steal(ht, fpath);
+		free(key_gp);
+
+		// The old state of the object by the new path is not actual anymore
+		g_hash_table_replace(ht, fpath_renamed, value_gp);
+	}
+
+	free(keys);
+	return;
+}
+
+struct rename_rekey_arg {
+	const char	 *fpath_old;
+	size_t		  fpath_old_len;
+	char		**keys;
+	size_t		  keys_count;
+	size_t		  keys_alloc;
+};
+
+static int sync_rename_rekey_collect(strmap_entry_t *entry, void *value, void *arg_v) {
+	struct rename_rekey_arg *arg_p = arg_v;
+	size_t fpath_old_len = arg_p->fpath_old_len;
+
+	if (entry->key_len < fpath_old_len || memcmp(entry->key, arg_p->fpath_old, fpath_old_len))
+		return 0;
+	if (entry->key[fpath_old_len] != 0 && entry->key[fpath_old_len] != '/')
+		return 0;
+
+	if (arg_p->keys_count >= arg_p->keys_alloc) {
+		arg_p->keys_alloc += ALLOC_PORTION;
+		arg_p->keys = xrealloc(arg_p->keys, arg_p->keys_alloc * sizeof(*arg_p->keys));
+	}
+
+	// The keys are moved on re-keying, so they're copied
+	arg_p->keys[arg_p->keys_count++] = strdup(entry->key);
+	return 0;
+}
+
+// The same as sync_rename_rekey() for an event table. A file has no objects
+// under it, so only its own key is moved. For a directory the table is
+// scanned, but only if it's not empty: the tables hold the events collected
+// since the last sync, not the whole tree.
+
+static void sync_rename_rekey_strmap(strmap_t *map, const char *fpath_old, const char *fpath_new, eventobjtype_t objtype) {
+	struct rename_rekey_arg arg = {0};
+	size_t fpath_new_len = strlen(fpath_new);
+
+	if (!strmap_count(map))
+		return;
+
+	if (objtype != EOT_DIR) {
+		if (strmap_rekey(map, fpath_old, fpath_new))
+			debug(4, "\"%s\" -> \"%s\"", fpath_old, fpath_new);
+		return;
+	}
+
+	arg.fpath_old	  = fpath_old;
+	arg.fpath_old_len = strlen(fpath_old);
+	strmap_foreach(map, sync_rename_rekey_collect, &arg);
+
+	size_t i = 0;
+	while (i < arg.keys_count) {
+		char *fpath = arg.keys[i++];
+		size_t fpath_rest_len = strlen(&fpath[arg.fpath_old_len]);
+
+		char *fpath_renamed = xmalloc(fpath_new_len + fpath_rest_len + 1);
+		memcpy(fpath_renamed, fpath_new, fpath_new_len);
+		memcpy(&fpath_renamed[fpath_new_len], &fpath[arg.fpath_old_len], fpath_rest_len+1);
+
+		debug(4, "\"%s\" -> \"%s\"", fpath, fpath_renamed);
+
+		// The old state of the object by the new path is not actual anymore
+		strmap_rekey(map, fpath, fpath_renamed);
+
+		free(fpath_renamed);
+		free(fpath);
+	}
+
+	free(arg.keys);
+	return;
+}
+
+/*
+ * The rules are regular expressions, so it's not known in advance if they
+ * treat the objects below a renamed directory the same way before and after
+ * the rename. The moved subtree is walked to check it for every object.
+ */
+
+struct sync_rename_rulescheck_arg {
+	ctx_t		*ctx_p;
+	const char	*path_old_rel;
+	const char	*path_new_rel;
+	size_t		 path_new_full_len;
+};
+
+static treewalk_check_t sync_rename_rulescheck(treewalk_entry_t *entry, void *_arg_p) {
+	struct sync_rename_rulescheck_arg *arg_p = _arg_p;
+	const char *path_rest = &entry->path[arg_p->path_new_full_len];
+	char path_old_rel[PATH_MAX+1], path_new_rel[PATH_MAX+1];
+
+	// The top of the subtree is already checked
+	if (!*path_rest)
+		return TWC_DROP;
+
+	if (
+		(snprintf(path_old_rel, sizeof(path_old_rel), "%s%s", arg_p->path_old_rel, path_rest) >= (int)sizeof(path_old_rel)) ||
+		(snprintf(path_new_rel, sizeof(path_new_rel), "%s%s", arg_p->path_new_rel, path_rest) >= (int)sizeof(path_new_rel))
+	)
+		return TWC_SKIP;	// Is reported to the calling thread as a difference
+
+	ruleaction_t perm_old = rules_getperm(path_old_rel, entry->st_mode, arg_p->ctx_p->rules, RA_WALK|RA_MONITOR);
+	ruleaction_t perm_new = rules_getperm(path_new_rel, entry->st_mode, arg_p->ctx_p->rules, RA_WALK|RA_MONITOR);
+
+	if (perm_old != perm_new)
+		return TWC_SKIP;
+
+	// Nothing below is synced in any case
+	if (!(perm_old & RA_WALK))
+		return TWC_SKIP|TWC_DROP;
+
+	return TWC_DROP;
+}
+
+static int sync_rename_rulescheck_found(treewalk_entry_t *entry, void *_arg_p) {
+	debug(3, "\"%s\" is treated by different rules after the rename.", entry->path);
+	return ECANCELED;
+}
+
+// Return: 1 if the rules differ, 0 if not, -1 on error
+
+static int sync_rename_rulesdiffer(ctx_t *ctx_p, const char *path_new_full, const char *path_old_rel, const char *path_new_rel) {
+	struct sync_rename_rulescheck_arg arg = {
+		.ctx_p			= ctx_p,
+		.path_old_rel		= path_old_rel,
+		.path_new_rel		= path_new_rel,
+		.path_new_full_len	= strlen(path_new_full),
+	};
+
+	// No rules, no difference
+	if (ctx_p->rules[0].mask == RA_NONE)
+		return 0;
+
+	int rc = treewalk(path_new_full, 1, TWF_NONE, sync_rename_rulescheck, sync_rename_rulescheck_found, &arg);
+	switch (rc) {
+		case 0:
+			return 0;
+		case ECANCELED:
+			return 1;
+	}
+
+	errno = rc;
+	error("Cannot check the rules below \"%s\".", path_new_full);
+	return -1;
+}
+
+/*
+ * Handles a paired rename (e.g. IN_MOVED_FROM+IN_MOVED_TO with the same
+ * cookie). The watching descriptors' indexes are rewritten in place instead of
+ * re-marking the new subtree and, if option "--rename-events" is set, a
+ * "rename" event is passed to the sync handler instead of a deletion plus an
+ * initial sync of the new path.
+ *
+ * Return: 0 if the rename is handled, 1 if it should be handled as a
+ * deletion of the old path plus a creation of the new one, -1 on error.
+ */
+
+int sync_prequeue_rename(ctx_t *ctx_p, indexes_t *indexes_p, const char *path_old_full, const char *path_new_full, eventobjtype_t objtype, uint32_t event_mask) {
+	int ret = 1;
+	size_t path_rel_len;
+	mode_t st_mode = (objtype == EOT_DIR ? S_IFDIR : S_IFREG);
+
+	char *path_old_rel = sync_path_abs2rel(ctx_p, path_old_full, -1, &path_rel_len, NULL);
+	char *path_new_rel = sync_path_abs2rel(ctx_p, path_new_full, -1, &path_rel_len, NULL);
+
+	debug(2, "\"%s\" -> \"%s\" (objtype == %i)", path_old_rel, path_new_rel, objtype);
+
+	// See the comment in sync_queuesync()
+	if (strchr(path_old_rel, '\n') || strchr(path_new_rel, '\n'))
+		goto l_sync_prequeue_rename_end;
+
+	// The object should be treated by the same rules before and after the rename
+	ruleaction_t perm_old = rules_getperm(path_old_rel, st_mode, ctx_p->rules, RA_WALK|RA_MONITOR);
+	ruleaction_t perm_new = rules_getperm(path_new_rel, st_mode, ctx_p->rules, RA_WALK|RA_MONITOR);
+	if ((perm_old != perm_new) || !(perm_old & RA_WALK)) {
+		debug(3, "Different rules for the old and the new path (0x%o, 0x%o) or the paths are not synced.", perm_old, perm_new);
+		goto l_sync_prequeue_rename_end;
+	}
+
+	if (objtype == EOT_DIR) {
+		int rc = sync_rename_rulesdiffer(ctx_p, path_new_full, path_old_rel, path_new_rel);
+		if (rc) {
+			if (rc == -1)
+				ret = -1;
+			else
+				debug(3, "Different rules for some objects below the old and the new path.");
+			goto l_sync_prequeue_rename_end;
+		}
+	}
+
+	// The watching descriptors follow the directories, so it's enough to fix the paths
+	if (objtype == EOT_DIR) {
+		indexes_rename_wd(indexes_p, path_old_full, path_new_full);
+#ifdef INOTIFY_SUPPORT
+		if (watchbudget.polled_ht != NULL)
+			sync_rename_rekey(watchbudget.polled_ht, path_old_full, path_new_full);
+#endif
+	}
+
+	if (!ctx_p->flags[RENAMEEVENTS])
+		goto l_sync_prequeue_rename_end;
+
+	// If the object was created after the last sync, there's nothing to rename on the destination side
+	int is_created = 0;
+	{
+		eventinfo_t *evinfo = indexes_fpath2ei(indexes_p, path_old_rel);
+		int queue_id = 0;
+		while ((evinfo == NULL) && (queue_id < QUEUE_MAX))
+			evinfo = indexes_lookupinqueue(indexes_p, path_old_rel, queue_id++);
+
+		if (evinfo != NULL && evinfo->objtype_old == EOT_DOESNTEXIST)
+			is_created = 1;
+	}
+
+	sync_rename_rekey_strmap(indexes_p->fpath2ei_ht, path_old_rel, path_new_rel, objtype);
+	{
+		int queue_id = 0;
+		while (queue_id < QUEUE_MAX) {
+			sync_rename_rekey_strmap(indexes_p->fpath2ei_coll_ht[queue_id], path_old_rel, path_new_rel, objtype);
+			if (indexes_p->exc_fpath_coll_ht[queue_id] != NULL)
+				sync_rename_rekey_strmap(indexes_p->exc_fpath_coll_ht[queue_id], path_old_rel, path_new_rel, objtype);
+			queue_id++;
+		}
+	}
+	fileinfo_rename(indexes_p->fileinfo, path_old_rel, path_new_rel);
+
+	if (is_created) {
+		debug(3, "\"%s\" is not synced, yet. The creation event is moved to \"%s\".", path_old_rel, path_new_rel);
+	} else {
+		indexes_rename_add(indexes_p, path_old_rel, path_new_rel, objtype, event_mask);
+
+		// Renames are collected with the normal queue
+		queueinfo_t *queueinfo = &ctx_p->_queues[QUEUE_NORMAL];
+		if (!queueinfo->stime)
+			queueinfo->stime = clock_monotonic_ms();
+	}
+
+	ret = 0;
+l_sync_prequeue_rename_end:
+	free(path_old_rel);
+	free(path_new_rel);
+	return ret;
+}
+
+#ifdef INOTIFY_SUPPORT
+/* === RESCAN === */
+
+/*
+ * Recovery after a monitor queue overflow: the lost events cannot be
+ * restored, so every watched directory is rescanned and the objects with
+ * ctime/mtime newer than the overflow window start are queued. A write to an
+ * existing file doesn't change the directory, so the unchanged directories
+ * are rescanned, too. The directories with ctime/mtime newer than the window
+ * start (and, if there's a record, different from the remembered one) are
+ * the only ones where files may be deleted silently.
+ */
+
+struct sync_rescan_arg {
+	ctx_t		 *ctx_p;
+	indexes_t	 *indexes_p;
+	time_t		  since;
+	GHashTable	 *rescan_ht;	// path_rel -> wd
+	GHashTable	 *changed_ht;	// path_rel -> wd
+	GHashTable	 *vanished_ht;	// path_full -> wd
+	char		 *path_rel;
+	size_t		  path_rel_len;
+	char		 *path_full;
+	size_t		  path_full_len;
+};
+
+static void sync_rescan_checkdir(gpointer wd_gp, gpointer fpath_gp, gpointer arg_gp) {
+	struct sync_rescan_arg *arg_p = arg_gp;
+	ctx_t     *ctx_p     = arg_p->ctx_p;
+	indexes_t *indexes_p = arg_p->indexes_p;
+	char      *fpath     = fpath_gp;
+	stat64_t   lstat;
+
+	// The directory is polled instead
+	if (sync_watchbudget_isevicted(GPOINTER_TO_INT(wd_gp)))
+		return;
+
+	if (lstat64(fpath, &lstat)) {
+		debug(2, "Watched directory \"%s\" disappeared.", fpath);
+		g_hash_table_replace(arg_p->vanished_ht, strdup(fpath), wd_gp);
+		return;
+	}
+
+	arg_p->path_rel = sync_path_abs2rel(ctx_p, fpath, -1, &arg_p->path_rel_len, arg_p->path_rel);
+	g_hash_table_replace(arg_p->rescan_ht, strdup(arg_p->path_rel), wd_gp);
+
+	if (MAX(lstat.st_mtime, lstat.st_ctime) < arg_p->since)
+		return;
+
+	// Only the fields of "--modification-signature" are remembered
+	fileinfo_t *finfo = indexes_fileinfo(indexes_p, arg_p->path_rel);
+	if (finfo != NULL && (indexes_p->fileinfo->mask & (STAT_FIELD_MTIME|STAT_FIELD_CTIME)))
+		if (!(fileinfo_diff(indexes_p->fileinfo, finfo, &lstat) & (STAT_FIELD_MTIME|STAT_FIELD_CTIME)))
+			return;
+
+	debug(2, "Watched directory \"%s\" changed since %li.", fpath, arg_p->since);
+	g_hash_table_replace(arg_p->changed_ht, strdup(arg_p->path_rel), wd_gp);
+	return;
+}
+
+static int sync_rescan_checkfile(const char *path_rel, uint32_t flags, void *finfo, void *arg_v) {
+	struct sync_rescan_arg *arg_p = arg_v;
+	char *slash, *dir_rel;
+	stat64_t lstat;
+
+	// Only the files in the changed directories may be deleted silently
+
+	slash   = strrchr(path_rel, '/');
+	dir_rel = (slash == NULL) ? "" : strndupa(path_rel, slash - path_rel);
+	if (g_hash_table_lookup(arg_p->changed_ht, dir_rel) == NULL)
+		return 0;
+
+	arg_p->path_full = sync_path_rel2abs(arg_p->ctx_p, path_rel, -1, &arg_p->path_full_len, arg_p->path_full);
+	if (!lstat64(arg_p->path_full, &lstat) || errno != ENOENT)
+		return 0;
+
+	g_hash_table_replace(arg_p->vanished_ht, strdup(arg_p->path_full), GINT_TO_POINTER(-1));
+	return 0;
+}
+
+static int sync_rescan_dir(struct sync_rescan_arg *arg_p, const char *dir_rel, int wd) {
+	ctx_t     *ctx_p     = arg_p->ctx_p;
+	indexes_t *indexes_p = arg_p->indexes_p;
+	int ret = 0;
+	FTS *tree;
+	FTSENT *node;
+	char *rootpaths[] = {NULL, NULL};
+
+	rootpaths[0] = sync_path_rel2abs(ctx_p, dir_rel, -1, NULL, NULL);
+	debug(2, "Rescanning \"%s\".", rootpaths[0]);
+
+	tree = privileged_fts_open(rootpaths, FTS_NOCHDIR|FTS_PHYSICAL, NULL, PC_SYNC_RESCAN_FTS_OPEN);
+	if (tree == NULL) {
+		error("Cannot privileged_fts_open() on \"%s\".", rootpaths[0]);
+		ret = errno;
+		goto l_sync_rescan_dir_end;
+	}
+
+	while ((node = privileged_fts_read(tree, PC_SYNC_RESCAN_FTS_READ))) {
+		eventobjtype_t objtype_old, objtype_new;
+		uint32_t evmask;
+
+		switch (node->fts_info) {
+			case FTS_DP:
+				continue;
+			case FTS_ERR:
+			case FTS_NS:
+			case FTS_DNR:
+				if (node->fts_errno == ENOENT)
+					continue;
+				error("Got error while privileged_fts_read(): %s (errno: %i; fts_info: %i).", strerror(node->fts_errno), node->fts_errno, node->fts_info);
+				ret = node->fts_errno;
+				goto l_sync_rescan_dir_end;
+			default:
+				break;
+		}
+
+		if (node->fts_level == 0)
+			continue;
+
+		if (node->fts_info == FTS_D) {
+			// The content of the subdirectories is checked by their own watches
+			fts_set(tree, node, FTS_SKIP);
+			if (indexes_fpath2wd(indexes_p, node->fts_path) != -1)
+				continue;
+			if (sync_watchbudget_ispolled(node->fts_path))
+				continue;
+
+			objtype_old = EOT_DOESNTEXIST;
+			objtype_new = EOT_DIR;
+			evmask      = IN_CREATE|IN_ISDIR;
+		} else {
+			if (MAX(node->fts_statp->st_mtime, node->fts_statp->st_ctime) < arg_p->since)
+				continue;
+
+			objtype_old = EOT_FILE;
+			objtype_new = EOT_FILE;
+			evmask      = IN_MODIFY;
+		}
+
+		debug(3, "\"%s\" was changed during the overflow (evmask: 0x%x).", node->fts_path, evmask);
+		stat64_t lstat, *lstat_p = lstat64(node->fts_path, &lstat) ? NULL : &lstat;	// fts_statp is not "struct stat64" everywhere
+		if (sync_prequeue_loadmark(1, ctx_p, indexes_p, node->fts_path, NULL, lstat_p, objtype_old, objtype_new, evmask, wd, node->fts_statp->st_mode, node->fts_statp->st_size, &arg_p->path_rel, &arg_p->path_rel_len, NULL)) {
+			ret = errno ? errno : EINVAL;
+			goto l_sync_rescan_dir_end;
+		}
+	}
+	if (errno) {
+		error("Got error while privileged_fts_read() and related routines.");
+		ret = errno;
+		goto l_sync_rescan_dir_end;
+	}
+
+	if (privileged_fts_close(tree, PC_SYNC_RESCAN_FTS_CLOSE)) {
+		error("Got error while privileged_fts_close().");
+		ret = errno;
 	}
-#endif
+	tree = NULL;
 
+l_sync_rescan_dir_end:
+	if (tree != NULL)
+		privileged_fts_close(tree, PC_SYNC_RESCAN_FTS_CLOSE);
+	free(rootpaths[0]);
+	return ret;
+}
 
-	if (path_rel == NULL) {
-		*path_buf_p   = sync_path_abs2rel(ctx_p, path_full, -1, path_buf_len_p, *path_buf_p);
-		 path_rel     = *path_buf_p;
-	}
+int sync_rescan_changed(ctx_t *ctx_p, indexes_t *indexes_p, time_t since) {
+	struct sync_rescan_arg arg = {0};
+	GHashTableIter iter;
+	gpointer key, value;
+	int ret = 0;
 
-	ruleaction_t perm = RA_ALL;
-	if (st_mode) {
-		// Checking by filter rules
-		perm = rules_getperm(path_rel, st_mode, ctx_p->rules, RA_WALK|RA_MONITOR);
+	arg.ctx_p       = ctx_p;
+	arg.indexes_p   = indexes_p;
+	arg.since       = since - 1;	// FS timestamps may be coarser than time()
+	arg.rescan_ht   = g_hash_table_new_full(g_str_hash, g_str_equal, free, 0);
+	arg.changed_ht  = g_hash_table_new_full(g_str_hash, g_str_equal, free, 0);
+	arg.vanished_ht = g_hash_table_new_full(g_str_hash, g_str_equal, free, 0);
 
-		if(!(perm&(RA_MONITOR|RA_WALK))) {
-			return 0;
+	debug(1, "Looking for objects changed since %li.", arg.since);
+
+	// The indexes are modified while handling, so collecting first
+
+	indexes_wd_foreach(indexes_p, sync_rescan_checkdir, &arg);
+	if (ctx_p->flags[MODSIGN])
+		fileinfo_foreach(indexes_p->fileinfo, sync_rescan_checkfile, &arg);
+
+	debug(1, "Directories to rescan: %u (changed: %u); vanished objects: %u.", g_hash_table_size(arg.rescan_ht), g_hash_table_size(arg.changed_ht), g_hash_table_size(arg.vanished_ht));
+
+	g_hash_table_iter_init(&iter, arg.vanished_ht);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		char *path_full = key;
+		int   wd        = GPOINTER_TO_INT(value);
+		int   is_dir    = (wd != -1);
+
+		if (is_dir)
+			indexes_remove_bywd(indexes_p, wd);
+
+		if (sync_prequeue_loadmark(1, ctx_p, indexes_p, path_full, NULL, NULL, is_dir ? EOT_DIR : EOT_FILE, EOT_DOESNTEXIST, is_dir ? IN_DELETE|IN_ISDIR : IN_DELETE, wd, is_dir ? S_IFDIR : S_IFREG, 0, &arg.path_rel, &arg.path_rel_len, NULL)) {
+			ret = errno ? errno : EINVAL;
+			goto l_sync_rescan_changed_end;
 		}
 	}
 
-	// Handling different cases
+	g_hash_table_iter_init(&iter, arg.rescan_ht);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		if ((ret = sync_rescan_dir(&arg, key, GPOINTER_TO_INT(value))))
+			goto l_sync_rescan_changed_end;
 
-	int is_dir	= objtype_old == EOT_DIR || objtype_new == EOT_DIR;
-	int is_created	= objtype_old == EOT_DOESNTEXIST;
-	int is_deleted	= objtype_new == EOT_DOESNTEXIST;
+l_sync_rescan_changed_end:
+	g_hash_table_destroy(arg.rescan_ht);
+	g_hash_table_destroy(arg.changed_ht);
+	g_hash_table_destroy(arg.vanished_ht);
+	if (arg.path_rel != NULL)
+		free(arg.path_rel);
+	if (arg.path_full != NULL)
+		free(arg.path_full);
 
-	debug(4, "is_dir == %x; is_created == %x; is_deleted == %x", is_dir, is_created, is_deleted);
+	if (ret)
+		error("Cannot rescan the changed directories.");
 
-	if (is_dir) {
-		if (is_created) {
-			int ret;
+	return ret;
+}
 
-			if (perm & RA_WALK) {
-				if (path_full == NULL) {
-					*path_buf_p   = sync_path_rel2abs(ctx_p, path_rel,  -1, path_buf_len_p, *path_buf_p);
-					 path_full    = *path_buf_p;
-				}
+/* === /RESCAN === */
+#endif
 
-				if (monitored) {
-					ret = sync_mark_walk(ctx_p, path_full, indexes_p);
-					if(ret) {
-						debug(1, "Seems, that directory \"%s\" disappeared, while trying to mark it.", path_full);
-						return 0;
-					}
-				}
+#ifdef INOTIFY_SUPPORT
+/*
+ * Polls the directories evicted by the watch budget manager (see "=== WATCH
+ * BUDGET ===") if it's time to.
+ */
 
-				ret = sync_initialsync(path_full, ctx_p, indexes_p, INITSYNC_SUBDIR);
-				if (ret) {
-					errno = ret;
-					error("Got error from sync_initialsync()");
-					return errno;
-				}
-			}
+static int sync_watchbudget_poll(ctx_t *ctx_p, indexes_t *indexes_p) {
+	int ret = 0;
 
-			fileischanged(ctx_p, indexes_p, path_rel, lstat_p, is_deleted);	// Just to remember it's state
-			return 0;
-		} else 
-		if (is_deleted) {
-			debug(2, "Disappeared \".../%s\".", path_rel);
-		}
-	}
+	if (watchbudget.polled_ht == NULL)
+		return 0;
 
-	if (!(perm&RA_WALK)) {
+	uint64_t tm = clock_monotonic_ms();
+	if (watchbudget.polltime + WATCHBUDGET_POLLINTERVAL > tm)
 		return 0;
-	}
+	watchbudget.polltime = tm;
 
-	if (!fileischanged(ctx_p, indexes_p, path_rel, lstat_p, is_deleted)) {
-		debug(4, "The file is not changed. Returning.");
+	size_t count = g_hash_table_size(watchbudget.polled_ht);
+	if (!count)
 		return 0;
-	}
 
-	switch (ctx_p->flags[MODE]) {
-		case MODE_SIMPLE:
-			return SAFE(sync_dosync(path_rel, event_mask, ctx_p, indexes_p), debug(1, "fpath == \"%s\"; evmask == 0x%o", path_rel, event_mask); return -1;);
-		default:
-			break;
-	}
+	debug(2, "Polling %zu directories.", count);
 
-	// Locally queueing the event
+	// The set is modified while polling (evictions, promotions), so collecting first
+	char **paths = xmalloc(count * sizeof(*paths));
+	{
+		GHashTableIter iter;
+		gpointer path_gp;
+		size_t i = 0;
 
-	int isnew = 0;
+		g_hash_table_iter_init(&iter, watchbudget.polled_ht);
+		while (g_hash_table_iter_next(&iter, &path_gp, NULL))
+			paths[i++] = strdup(path_gp);
+	}
 
-	if (evinfo == NULL)
-		evinfo = indexes_fpath2ei(indexes_p, path_rel);
-	else
-		isnew++;	// It's new for prequeue (but old for lockwait queue)
+	size_t i = 0;
+	while (i < count) {
+		char *path = paths[i++];
+		struct watchbudget_polled *polled_p = g_hash_table_lookup(watchbudget.polled_ht, path);
+		int changed = 0, rc;
 
-	if (evinfo == NULL) {
-		evinfo = (eventinfo_t *)xmalloc(sizeof(*evinfo));
-		memset(evinfo, 0, sizeof(*evinfo));
-		evinfo->fsize        = st_size;
-		evinfo->wd           = event_wd;
-		evinfo->seqid_min    = sync_seqid();
-		evinfo->seqid_max    = evinfo->seqid_min;
-		evinfo->objtype_old  = objtype_old;
-		isnew++;
-		debug(3, "new event: fsize == %i; wd == %i", evinfo->fsize, evinfo->wd);
-	} else {
-		evinfo->seqid_max    = sync_seqid();
-	}
+		if (polled_p == NULL)
+			continue;
 
-	switch(ctx_p->flags[MONITOR]) {
-#ifdef KQUEUE_SUPPORT
-		case NE_KQUEUE:
-#endif
-#ifdef INOTIFY_SUPPORT
-		case NE_INOTIFY:
-#endif
-#if KQUEUE_SUPPORT | INOTIFY_SUPPORT
-			evinfo->evmask |= event_mask;
-			break;
-#endif
-#ifdef BSM_SUPPORT
-		case NE_BSM:
-		case NE_BSM_PREFETCH:
-			evinfo->evmask  = event_mask;
-			break;
-#endif
-#ifdef GIO_SUPPORT
-		case NE_GIO:
-			evinfo->evmask  = event_mask;
+		rc = sync_watchbudget_polldir(ctx_p, indexes_p, path, polled_p, &changed);
+		if (rc == ENOENT) {
+			// The deletion is reported by the parent directory
+			debug(2, "Polled directory \"%s\" disappeared.", path);
+			g_hash_table_remove(watchbudget.polled_ht, path);
+			continue;
+		}
+		if (rc) {
+			errno = ret = rc;
+			error("Cannot poll directory \"%s\".", path);
 			break;
-#endif
+		}
+
+		if (!changed)
+			continue;
+
+		// The directory is active again, so watching it. sync_notify_mark() drops
+		// the poll entry, so taking it out to list the directory once more after
+		// the watch is added (to do not miss changes in between).
+		debug(2, "Polled directory \"%s\" is changed, watching it again.", path);
+		gpointer path_orig;
+		g_hash_table_lookup_extended(watchbudget.polled_ht, path, &path_orig, NULL);
+		g_hash_table_steal(watchbudget.polled_ht, path);
+		free(path_orig);
+
+		rc = sync_notify_mark(ctx_p, path, path, strlen(path), indexes_p);
+		if (rc >= 0) {
+			watchbudget.promoted++;
+			rc = sync_watchbudget_polldir(ctx_p, indexes_p, path, polled_p, &changed);
+			if (rc && rc != ENOENT) {
+				errno = ret = rc;
+				error("Cannot list directory \"%s\".", path);
+				sync_watchbudget_polled_free(polled_p);
+				break;
+			}
+		} else
+		if ((rc == -1) && (errno != ENOENT) && (g_hash_table_lookup(watchbudget.polled_ht, path) == NULL)) {
+			// Cannot watch it (e.g. EMFILE), so keeping polling it not to lose it's changes
+			debug(1, "Cannot watch \"%s\" again, keeping polling it.", path);
+			g_hash_table_insert(watchbudget.polled_ht, strdup(path), polled_p);
+			continue;
+		}
+		sync_watchbudget_polled_free(polled_p);
 	}
 
-	evinfo->objtype_new = objtype_new;
+	while (count)
+		free(paths[--count]);
+	free(paths);
 
-	debug(2, "path_rel == \"%s\"; evinfo->objtype_old == %i; evinfo->objtype_new == %i; "
-		 "evinfo->seqid_min == %u; evinfo->seqid_max == %u", 
-		 path_rel, evinfo->objtype_old, evinfo->objtype_new,
-		 evinfo->seqid_min, evinfo->seqid_max
-	     );
+	sync_prequeue_unload(ctx_p, indexes_p);
+	return ret;
+}
 
-	if (isnew)
-		// Fix the path (if required) and call indexes_fpath2ei_add() to remeber the new object to be synced
-		sync_indexes_fpath2ei_addfixed(ctx_p, indexes_p, path_rel, evinfo);
+static void sync_watchbudget_dump(ctx_t *ctx_p, int fd_out) {
+	if (watchbudget.wd2active_ht == NULL)
+		return;
 
-	return 0;
+	dprintf(fd_out,
+		"watch budget:\n\tbudget == %i\n\twatches == %u\n\tpolled == %u\n\tevicted == %lu\n\tpromoted == %lu\n",
+			ctx_p->flags[WATCHBUDGET],
+			g_hash_table_size(watchbudget.wd2active_ht),
+			g_hash_table_size(watchbudget.polled_ht),
+			(unsigned long)watchbudget.evicted,
+			(unsigned long)watchbudget.promoted
+		);
+
+	return;
 }
+#endif
 
-void _sync_idle_dosync_collectedexcludes(gpointer fpath_gp, gpointer flags_gp, gpointer arg_gp) {
-	char *fpath		  = (char *)fpath_gp;
+int _sync_idle_dosync_collectedexcludes(strmap_entry_t *entry, void *flags_v, void *arg_gp) {
+	const char *fpath	  = entry->key;
+	eventinfo_flags_t flags	  = *(eventinfo_flags_t *)flags_v;
 	indexes_t *indexes_p 	  = ((struct dosync_arg *)arg_gp)->indexes_p;
 
-	debug(3, "\"%s\", %u (%p).", fpath, GPOINTER_TO_INT(flags_gp), flags_gp);
+	debug(3, "\"%s\", %u.", fpath, flags);
 
-	indexes_addexclude_aggr(indexes_p, strdup(fpath), (eventinfo_flags_t)GPOINTER_TO_INT(flags_gp));
+	indexes_addexclude_aggr(indexes_p, fpath, flags);
 
-	return;
+	return 0;
 }
 
-// Is not a thread-save function!
-eventinfo_t *ht_fpath_isincluded(GHashTable *ht, const char *const fpath) {
-	static char buf[PATH_MAX+2]={0};
-	char *ptr, *end;
-	eventinfo_t *evinfo = g_hash_table_lookup(ht, fpath);
-	debug(5, "looking up for \"%s\": %p", fpath, evinfo);
-	if (evinfo != NULL)
-		return evinfo;
+// May be called by the main thread only (see thread_lockindex_rebuild())
 
-	if (!*fpath)
-		return NULL;
+static inline int sync_islocked(const char *const fpath) {
+	pathtree_t *tree = __atomic_load_n(&thread_lockindex, __ATOMIC_ACQUIRE);
+	int rc = (tree != NULL) && pathtree_isincluded(tree, fpath, NULL, NULL);
+	debug(3, "<%s>: %u", fpath, rc);
+	return rc;
+}
 
-	evinfo = g_hash_table_lookup(ht, "");
+/*
+ * The renames are passed to the sync handler before the other events, so
+ * they wait while a thread syncs the old or the new path (or an object below
+ * them for a directory), and the events on these paths wait for the renames.
+ */
 
-	if (evinfo != NULL) {
-		debug(5, "recursive looking up for \"\": %p (%x: recusively: %x)", evinfo, evinfo->flags, evinfo->flags & EVIF_RECURSIVELY);
-		if (evinfo->flags & EVIF_RECURSIVELY)
-			return evinfo;
-	}
+static int sync_renames_islocked(indexes_t *indexes_p) {
+	pathtree_t *tree = __atomic_load_n(&thread_lockindex, __ATOMIC_ACQUIRE);
+	size_t i = 0;
 
-	size_t fpath_len = strlen(fpath);
-	memcpy(buf, fpath, fpath_len+1);
-	ptr  =  buf;
-	end  = &buf[fpath_len];
-
-	while(ptr < end) {
-		if (*ptr == '/') {
-			*ptr = 0;
-			evinfo = g_hash_table_lookup(ht, buf);
-
-			if (evinfo != NULL) {
-				debug(5, "recursive looking up for \"%s\": %p (%x: recusively: %x)", buf, evinfo, evinfo->flags, evinfo->flags & EVIF_RECURSIVELY);
-				*ptr = '/';
-				if (evinfo->flags & EVIF_RECURSIVELY)
-					return evinfo;
-			}
-		}
+	if (tree == NULL)
+		return 0;
 
-		ptr++;
+	while (i < indexes_p->renames_count) {
+		rename_t *rename_p = &indexes_p->renames[i++];
+
+		if (
+			pathtree_isincluded(tree, rename_p->fpath_old, NULL, NULL) ||
+			pathtree_isincluded(tree, rename_p->fpath_new, NULL, NULL) ||
+			(
+				(rename_p->objtype == EOT_DIR) && (
+					pathtree_hassubtree(tree, rename_p->fpath_old) ||
+					pathtree_hassubtree(tree, rename_p->fpath_new)
+				)
+			)
+		) {
+			debug(3, "The rename \"%s\" -> \"%s\" is locked.", rename_p->fpath_old, rename_p->fpath_new);
+			return 1;
+		}
 	}
 
-	return evinfo;
+	return 0;
 }
 
-int _sync_islocked(threadinfo_t *threadinfo_p, void *_fpath) {
-	char *fpath = _fpath;
+// Builds the set of the paths of the renames (the whole subtree for a directory)
 
-	eventinfo_t *evinfo = ht_fpath_isincluded(threadinfo_p->fpath2ei_ht, fpath);
-	debug(4, "scanning thread %p: fpath<%s> -> evinfo<%p>", threadinfo_p->pthread, fpath, evinfo);
-	if (evinfo != NULL)
-		return 1;
+static pathtree_t *sync_renames_pathset(indexes_t *indexes_p) {
+	pathtree_t *tree = pathtree_new();
+	size_t i = 0;
 
-	return 0;
+	while (i < indexes_p->renames_count) {
+		rename_t *rename_p = &indexes_p->renames[i++];
+		uint32_t  flags    = (rename_p->objtype == EOT_DIR) ? EVIF_RECURSIVELY : EVIF_NONE;
+
+		pathtree_set(tree, rename_p->fpath_old, flags, NULL);
+		pathtree_set(tree, rename_p->fpath_new, flags, NULL);
+	}
+
+	return tree;
 }
 
-static inline int sync_islocked(const char *const fpath) {
-	int rc = threads_foreach(_sync_islocked, STATE_RUNNING, (void *)fpath);
-	debug(3, "<%s>: %u", fpath, rc);
-	return rc;
+static inline int sync_islocked_orwaiting(indexes_t *indexes_p, const char *const fpath) {
+	if (sync_islocked(fpath))
+		return 1;
+
+	return (indexes_p->renames_waiting != NULL) && pathtree_isincluded(indexes_p->renames_waiting, fpath, NULL, NULL);
 }
 
-void _sync_idle_dosync_collectedevents(gpointer fpath_gp, gpointer evinfo_gp, gpointer arg_gp) {
-	char *fpath		  = (char *)fpath_gp;
-	eventinfo_t *evinfo	  = (eventinfo_t *)evinfo_gp;
+int _sync_idle_dosync_collectedevents(strmap_entry_t *entry, void *evinfo_v, void *arg_gp) {
+	const char *fpath	  = entry->key;
+	eventinfo_t *evinfo	  = (eventinfo_t *)evinfo_v;
 	int *evcount_p		  =&((struct dosync_arg *)arg_gp)->evcount;
 	ctx_t *ctx_p 		  = ((struct dosync_arg *)arg_gp)->ctx_p;
 	indexes_t *indexes_p 	  = ((struct dosync_arg *)arg_gp)->indexes_p;
@@ -2253,29 +4501,25 @@ void _sync_idle_dosync_collectedevents(gpointer fpath_gp, gpointer evinfo_gp, gp
 	debug(3, "queue_id == %i.", queue_id);
 
 	if (ctx_p->flags[THREADING] == PM_SAFE)
-		if (sync_islocked(fpath)) {
+		if (sync_islocked_orwaiting(indexes_p, fpath)) {
 			debug(3, "\"%s\" is locked, dropping to waitlock queue", fpath);
 
-			eventinfo_t *evinfo_dup = xmalloc(sizeof(*evinfo_dup));
-			memcpy(evinfo_dup, evinfo, sizeof(*evinfo));
-			
-			sync_queuesync(fpath, evinfo_dup, ctx_p, indexes_p, QUEUE_LOCKWAIT);
-			return;
+			_sync_queuesync(fpath, entry->key_len, entry->hash, evinfo, ctx_p, indexes_p, QUEUE_LOCKWAIT);
+			return 0;
 		}
 
 	if ((ctx_p->listoutdir == NULL) && (!(ctx_p->synchandler_argf & SHFL_INCLUDE_LIST)) && (!(ctx_p->flags[MODE]==MODE_SO))) {
 		debug(3, "calling sync_dosync()");
 		SAFE(sync_dosync(fpath, evinfo->evmask, ctx_p, indexes_p), debug(1, "fpath == \"%s\"; evmask == 0x%o", fpath, evinfo->evmask); exit(errno ? errno : -1));	// TODO: remove exit() from here
-		return;
+		return 0;
 	}
 
-	int isnew = 0;
-	eventinfo_t *evinfo_idx = indexes_fpath2ei(indexes_p, fpath);
+	// Fix the path (if required) and call indexes_fpath2ei_add() to remeber the new object to be synced
+	int isnew;
+	eventinfo_t *evinfo_idx = sync_indexes_fpath2ei_addfixed(ctx_p, indexes_p, fpath, entry->key_len, entry->hash, &isnew);
 
-	if (evinfo_idx == NULL) {
-		evinfo_idx = (eventinfo_t *)xmalloc(sizeof(*evinfo_idx));
-		memset(evinfo_idx, 0, sizeof(*evinfo_idx));
-		isnew++;
+	if (isnew) {
+		debug(4, "Collecting \"%s\"", fpath);
 		(*evcount_p)++;
 
 		evinfo_idx->evmask       = evinfo->evmask;
@@ -2295,35 +4539,27 @@ void _sync_idle_dosync_collectedevents(gpointer fpath_gp, gpointer evinfo_gp, gp
 			continue;
 		}
 
-		eventinfo_t *evinfo_q = indexes_lookupinqueue(indexes_p, fpath, _queue_id);
+		eventinfo_t *evinfo_q = indexes_lookupinqueue_hashed(indexes_p, fpath, entry->key_len, entry->hash, _queue_id);
 		if(evinfo_q != NULL) {
 			evinfo_merge(ctx_p, evinfo_idx, evinfo_q);
 
-			indexes_removefromqueue(indexes_p, fpath, _queue_id);
+			indexes_removefromqueue_hashed(indexes_p, fpath, entry->key_len, entry->hash, _queue_id);
 			if(!indexes_queuelen(indexes_p, _queue_id))
 				ctx_p->_queues[_queue_id].stime = 0;
 		}
 		_queue_id++;
 	}
 
-	if (isnew) {
-		debug(4, "Collecting \"%s\"", fpath);
-
-		// Fix the path (if required) and call indexes_fpath2ei_add() to remeber the new object to be synced
-		sync_indexes_fpath2ei_addfixed(ctx_p, indexes_p, fpath, evinfo_idx);
-	} else
-		free(fpath);
-
-	return;
+	return 0;
 }
 
 struct trylocked_arg {
 	char   *path_full;
 	size_t  path_full_len;
 };
-gboolean sync_trylocked(gpointer fpath_gp, gpointer evinfo_gp, gpointer arg_gp) {
-	char *fpath		   = (char *)fpath_gp;
-	eventinfo_t *evinfo	   = (eventinfo_t *)evinfo_gp;
+int sync_trylocked(strmap_entry_t *entry, void *evinfo_v, void *arg_gp) {
+	char *fpath		   = (char *)entry->key;
+	eventinfo_t *evinfo	   = (eventinfo_t *)evinfo_v;
 
 	struct dosync_arg *arg_p   = (struct dosync_arg *)arg_gp;
 
@@ -2332,18 +4568,18 @@ gboolean sync_trylocked(gpointer fpath_gp, gpointer evinfo_gp, gpointer arg_gp)
 
 	struct trylocked_arg *data =  arg_p->data;
 
-	if (!sync_islocked(fpath)) {
+	if (!sync_islocked_orwaiting(indexes_p, fpath)) {
 		if (sync_prequeue_loadmark(0, ctx_p, indexes_p, NULL, fpath, NULL,
 				evinfo->evmask,
 				evinfo->objtype_old,
 				evinfo->objtype_new,
 				0, 0, 0, &data->path_full, &data->path_full_len, evinfo)) {
 			critical("Cannot re-queue \"%s\" to be synced", fpath);
-			return FALSE;
+			return 0;
 		}
-		return TRUE;
+		return 1;
 	}
-	return FALSE;
+	return 0;
 }
 
 int sync_idle_dosync_collectedevents_cleanup(ctx_t *ctx_p, thread_callbackfunct_arg_t *arg_p) {
@@ -2369,15 +4605,14 @@ int sync_idle_dosync_collectedevents_cleanup(ctx_t *ctx_p, thread_callbackfunct_
 	return ret0 ? ret0 : ret1;
 }
 
-void sync_queuesync_wrapper(gpointer fpath_gp, gpointer evinfo_gp, gpointer arg_gp) {
-	char *fpath_rel		  = (char *)fpath_gp;
-	eventinfo_t *evinfo	  = (eventinfo_t *)evinfo_gp;
+int sync_queuesync_wrapper(strmap_entry_t *entry, void *evinfo_v, void *arg_gp) {
+	eventinfo_t *evinfo	  = (eventinfo_t *)evinfo_v;
 	ctx_t *ctx_p 		  = ((struct dosync_arg *)arg_gp)->ctx_p;
 	indexes_t *indexes_p 	  = ((struct dosync_arg *)arg_gp)->indexes_p;
 
-	sync_queuesync(fpath_rel, evinfo, ctx_p, indexes_p, QUEUE_AUTO);
+	_sync_queuesync(entry->key, entry->key_len, entry->hash, evinfo, ctx_p, indexes_p, QUEUE_AUTO);
 
-	return;
+	return 0;
 }
 
 int sync_prequeue_unload(ctx_t *ctx_p, indexes_t *indexes_p) {
@@ -2385,26 +4620,26 @@ int sync_prequeue_unload(ctx_t *ctx_p, indexes_t *indexes_p) {
 	dosync_arg.ctx_p 	= ctx_p;
 	dosync_arg.indexes_p	= indexes_p;
 
-	debug(3, "collected %i events per this time.", g_hash_table_size(indexes_p->fpath2ei_ht));
+	debug(3, "collected %zu events per this time.", strmap_count(indexes_p->fpath2ei_ht));
 
-	g_hash_table_foreach(indexes_p->fpath2ei_ht, sync_queuesync_wrapper, &dosync_arg);
-	g_hash_table_remove_all(indexes_p->fpath2ei_ht);
+	strmap_foreach(indexes_p->fpath2ei_ht, sync_queuesync_wrapper, &dosync_arg);
+	indexes_fpath2ei_clear(indexes_p);
 
 	return 0;
 }
 
 int sync_idle_dosync_collectedevents_aggrqueue(queue_id_t queue_id, ctx_t *ctx_p, indexes_t *indexes_p, struct dosync_arg *dosync_arg) {
-	time_t tm = time(NULL);
+	uint64_t tm = clock_monotonic_ms();
 
 	queueinfo_t *queueinfo = &ctx_p->_queues[queue_id];
 
 	if ((queueinfo->stime + queueinfo->collectdelay > tm) && (queueinfo->collectdelay != COLLECTDELAY_INSTANT) && (!ctx_p->flags[EXITONNOEVENTS])) {
-		debug(3, "(%i, ...): too early (%i + %i > %i).", queue_id, queueinfo->stime, queueinfo->collectdelay, tm);
+		debug(3, "(%i, ...): too early (%llu + %u > %llu).", queue_id, (unsigned long long)queueinfo->stime, queueinfo->collectdelay, (unsigned long long)tm);
 		return 0;
 	}
 	queueinfo->stime = 0;
 
-	int evcount_real = g_hash_table_size(indexes_p->fpath2ei_coll_ht[queue_id]);
+	int evcount_real = indexes_queuelen(indexes_p, queue_id);
 
 	debug(3, "(%i, ...): evcount_real == %i", queue_id, evcount_real);
 
@@ -2418,7 +4653,7 @@ int sync_idle_dosync_collectedevents_aggrqueue(queue_id_t queue_id, ctx_t *ctx_p
 			struct trylocked_arg arg_data = {0};
 
 			dosync_arg->data = &arg_data;
-			g_hash_table_foreach_remove(indexes_p->fpath2ei_coll_ht[queue_id], sync_trylocked, dosync_arg);
+			strmap_foreach(indexes_p->fpath2ei_coll_ht[queue_id], sync_trylocked, dosync_arg);
 
 			// Placing to global queues recently unlocked objects
 			sync_prequeue_unload(ctx_p, indexes_p);
@@ -2430,12 +4665,12 @@ int sync_idle_dosync_collectedevents_aggrqueue(queue_id_t queue_id, ctx_t *ctx_p
 			break;
 		}
 		default: {
-			g_hash_table_foreach(indexes_p->fpath2ei_coll_ht[queue_id], _sync_idle_dosync_collectedevents, dosync_arg);
-			g_hash_table_remove_all(indexes_p->fpath2ei_coll_ht[queue_id]);
+			strmap_foreach(indexes_p->fpath2ei_coll_ht[queue_id], _sync_idle_dosync_collectedevents, dosync_arg);
+			indexes_queueclear(indexes_p, queue_id);
 
 			if(!ctx_p->flags[RSYNCPREFERINCLUDE]) {
-				g_hash_table_foreach(indexes_p->exc_fpath_coll_ht[queue_id], _sync_idle_dosync_collectedexcludes, dosync_arg);
-				g_hash_table_remove_all(indexes_p->exc_fpath_coll_ht[queue_id]);
+				strmap_foreach(indexes_p->exc_fpath_coll_ht[queue_id], _sync_idle_dosync_collectedexcludes, dosync_arg);
+				strmap_clear(indexes_p->exc_fpath_coll_ht[queue_id]);
 			}
 			break;
 		}
@@ -2565,11 +4800,11 @@ static inline int rsync_outline(FILE *outf, char *outline, eventinfo_flags_t fla
 	return 0;
 }
 
-gboolean rsync_aggrout(gpointer outline_gp, gpointer flags_gp, gpointer arg_gp) {
+int rsync_aggrout(strmap_entry_t *entry, void *flags_v, void *arg_gp) {
 	struct dosync_arg *dosync_arg_p = (struct dosync_arg *)arg_gp;
-	char *outline		  = (char *)outline_gp;
+	char *outline		  = (char *)entry->key;
 	FILE *outf		  = dosync_arg_p->outf;
-	eventinfo_flags_t flags	 = (eventinfo_flags_t)GPOINTER_TO_INT(flags_gp);
+	eventinfo_flags_t flags	 = *(eventinfo_flags_t *)flags_v;
 //	debug(3, "\"%s\"", outline);
 
 	int ret;
@@ -2578,7 +4813,7 @@ gboolean rsync_aggrout(gpointer outline_gp, gpointer flags_gp, gpointer arg_gp)
 		exit(ret);	// TODO: replace this with kill(0, ...)
 	}
 
-	return TRUE;
+	return 1;
 }
 
 static inline int rsync_listpush(indexes_t *indexes_p, const char *fpath, size_t fpath_len, eventinfo_flags_t flags, int *linescount_p) {
@@ -2602,7 +4837,7 @@ static inline int rsync_listpush(indexes_t *indexes_p, const char *fpath, size_t
 
 	debug(3, "\"%s\": Adding to rsynclist: \"%s\" with flags %p.", 
 		fpathwslash, fpathwslash, (void *)(long)flags);
-	indexes_outaggr_add(indexes_p, strdup(fpathwslash), flags);
+	indexes_outaggr_add(indexes_p, fpathwslash, flags);
 	if(linescount_p != NULL)
 		(*linescount_p)++;
 
@@ -2610,7 +4845,7 @@ static inline int rsync_listpush(indexes_t *indexes_p, const char *fpath, size_t
 		if(*fpathwslash == 0x00)
 			break;
 		debug(3, "Non-recursively \"%s\": Adding to rsynclist: \"%s\".", fpathwslash, fpathwslash);
-		indexes_outaggr_add(indexes_p, strdup(fpathwslash), EVIF_NONE);
+		indexes_outaggr_add(indexes_p, fpathwslash, EVIF_NONE);
 		if(linescount_p != NULL)
 			(*linescount_p)++;
 		end = strrchr(fpathwslash, '/');
@@ -2625,11 +4860,13 @@ static inline int rsync_listpush(indexes_t *indexes_p, const char *fpath, size_t
 	return 0;
 }
 
-gboolean sync_idle_dosync_collectedevents_rsync_exclistpush(gpointer fpath_gp, gpointer flags_gp, gpointer arg_gp) {
+// The entries under a recursively excluded directory are skipped: they're excluded already
+
+int sync_idle_dosync_collectedevents_rsync_exclistpush(const char *fpath_const, uint32_t flags_u32, void *data, void *arg_gp) {
 	struct dosync_arg *dosync_arg_p = (struct dosync_arg *)arg_gp;
-	char *fpath		  = (char *)fpath_gp;
+	char *fpath		  = (char *)fpath_const;
 	FILE *excf		  = dosync_arg_p->outf;
-	eventinfo_flags_t flags	  = GPOINTER_TO_INT(flags_gp);
+	eventinfo_flags_t flags	  = flags_u32;
 //	ctx_t *ctx_p 	  = dosync_arg_p->ctx_p;
 //	indexes_t *indexes_p	  = dosync_arg_p->indexes_p;
 	debug(3, "\"%s\"", fpath);
@@ -2656,7 +4893,7 @@ gboolean sync_idle_dosync_collectedevents_rsync_exclistpush(gpointer fpath_gp, g
 		exit(ret);	// TODO: replace this with kill(0, ...)
 	}
 
-	return TRUE;
+	return flags & EVIF_RECURSIVELY ? 1 : 0;
 }
 
 int sync_idle_dosync_collectedevents_commitpart(struct dosync_arg *dosync_arg_p) {
@@ -2670,7 +4907,7 @@ int sync_idle_dosync_collectedevents_commitpart(struct dosync_arg *dosync_arg_p)
 		(ctx_p->flags[MODE] == MODE_RSYNCSHELL)	 ||
 		(ctx_p->flags[MODE] == MODE_RSYNCSO)
 	)
-		g_hash_table_foreach_remove(indexes_p->out_lines_aggr_ht, rsync_aggrout, dosync_arg_p);
+		strmap_foreach(indexes_p->out_lines_aggr_ht, rsync_aggrout, dosync_arg_p);
 
 	if (dosync_arg_p->outf != NULL) {
 		fclose(dosync_arg_p->outf);
@@ -2776,10 +5013,10 @@ void sync_inclist_rotate(ctx_t *ctx_p, struct dosync_arg *dosync_arg_p) {
 	return;
 }
 
-void sync_idle_dosync_collectedevents_listpush(gpointer fpath_gp, gpointer evinfo_gp, gpointer arg_gp) {
+int sync_idle_dosync_collectedevents_listpush(strmap_entry_t *entry, void *evinfo_v, void *arg_gp) {
 	struct dosync_arg *dosync_arg_p = (struct dosync_arg *)arg_gp;
-	char *fpath		   =  (char *)fpath_gp;
-	eventinfo_t *evinfo	   =  (eventinfo_t *)evinfo_gp;
+	char *fpath		   =  (char *)entry->key;
+	eventinfo_t *evinfo	   =  (eventinfo_t *)evinfo_v;
 	//int *evcount_p		  =&dosync_arg_p->evcount;
 	FILE *outf		   =  dosync_arg_p->outf;
 	ctx_t *ctx_p 		   =  dosync_arg_p->ctx_p;
@@ -2803,7 +5040,9 @@ void sync_idle_dosync_collectedevents_listpush(gpointer fpath_gp, gpointer evinf
 		ei->objtype_new = evinfo->objtype_new;
 		ei->path_len    = strlen(fpath);
 		ei->path        = strdup(fpath);
-		return;
+		ei->path_old_len = 0;
+		ei->path_old    = NULL;
+		return 0;
 	}
 
 	if (ctx_p->synchandler_argf & SHFL_INCLUDE_LIST) {
@@ -2824,34 +5063,171 @@ void sync_idle_dosync_collectedevents_listpush(gpointer fpath_gp, gpointer evinf
 	if (!(ctx_p->synchandler_argf &
 		( SHFL_INCLUDE_LIST_PATH | SHFL_EXCLUDE_LIST_PATH ) ))
 
-		return;
+		return 0;
+
+	// List files cases:
+
+	// non-RSYNC case
+	if (!(
+		(ctx_p->flags[MODE] == MODE_RSYNCSHELL)	 || 
+		(ctx_p->flags[MODE] == MODE_RSYNCDIRECT) ||
+		(ctx_p->flags[MODE] == MODE_RSYNCSO)
+	)) {
+		if (ctx_p->flags[SYNCLISTSIMPLIFY])
+			fprintf(outf, "%s\n", fpath);
+		else 
+			fprintf(outf, "sync %s %i %s\n", ctx_p->label, evinfo->evmask, fpath);
+		return 0;
+	}
+
+	// RSYNC case
+	if (ctx_p->rsyncinclimit && (*linescount_p >= ctx_p->rsyncinclimit))
+		sync_inclist_rotate(ctx_p, dosync_arg_p);
+
+	int ret;
+	if ((ret=rsync_listpush(indexes_p, fpath, strlen(fpath), evinfo->flags, linescount_p))) {
+		error("Got error from rsync_listpush(). Exit.");
+		exit(ret);
+	}
+
+	return 0;
+}
+
+static void sync_idle_dosync_collectedevents_renamespush(struct dosync_arg *dosync_arg_p) {
+	ctx_t *ctx_p 		   =  dosync_arg_p->ctx_p;
+	indexes_t *indexes_p 	   =  dosync_arg_p->indexes_p;
+	size_t i = 0;
+
+	while (i < indexes_p->renames_count) {
+		rename_t *rename_p = &indexes_p->renames[i++];
+		debug(3, "\"%s\" -> \"%s\"", rename_p->fpath_old, rename_p->fpath_new);
+
+		// so-module case:
+		if (ctx_p->flags[MODE] == MODE_SO) {
+			api_eventinfo_t *ei = &dosync_arg_p->api_ei[dosync_arg_p->api_ei_count++];
+			ei->evmask       = rename_p->evmask;
+			ei->flags        = EVIF_RENAMED;
+			ei->objtype_old  = rename_p->objtype;
+			ei->objtype_new  = rename_p->objtype;
+			ei->path_len     = strlen(rename_p->fpath_new);
+			ei->path         = strdup(rename_p->fpath_new);
+			ei->path_old_len = strlen(rename_p->fpath_old);
+			ei->path_old     = strdup(rename_p->fpath_old);
+			continue;
+		}
+
+		// List files case (other modes are rejected by ctx_check() if "--rename-events" is set)
+		fprintf(dosync_arg_p->outf, "rename-from %s %i %s\n", ctx_p->label, rename_p->evmask, rename_p->fpath_old);
+		fprintf(dosync_arg_p->outf, "rename-to %s %i %s\n",   ctx_p->label, rename_p->evmask, rename_p->fpath_new);
+	}
+
+	// The paths are locked by the thread of the sync handler (see thread_lockset_init())
+	if (ctx_p->flags[THREADING] == PM_SAFE)
+		indexes_p->renames_lockset = sync_renames_pathset(indexes_p);
+
+	indexes_renames_cleanup(indexes_p);
+	return;
+}
+
+/*
+ * "--shards": the events of an iteration are partitioned by the top level
+ * component of the path, and every partition ("shard") gets it's own list
+ * file and it's own call of the sync handler. The calls are threaded, and
+ * the lock set of every thread is the shard's events only (see
+ * thread_lockset_init()), so the shards don't lock each other.
+ */
+
+struct sync_shards_arg {
+	ctx_t		 *ctx_p;
+	strmap_t	**shards;
+};
+
+static int sync_idle_dosync_collectedevents_shardpush(strmap_entry_t *entry, void *evinfo_v, void *arg_gp) {
+	struct sync_shards_arg *arg_p = arg_gp;
+	const char *slash = memchr(entry->key, '/', entry->key_len);
+	size_t top_len    = slash == NULL ? entry->key_len : (size_t)(slash - entry->key);
+	int shard_num     = strmap_hash(entry->key, top_len) % arg_p->ctx_p->flags[SHARDS];
+	int isnew;
+
+	if (arg_p->shards[shard_num] == NULL)
+		arg_p->shards[shard_num] = strmap_new(sizeof(eventinfo_t));
+
+	memcpy(strmap_insert_hashed(arg_p->shards[shard_num], entry->key, entry->key_len, entry->hash, &isnew), evinfo_v, sizeof(eventinfo_t));
+	return 0;
+}
+
+// The list file of the first shard is already created by sync_idle_dosync_collectedevents()
+
+static int sync_idle_dosync_collectedevents_shards(struct dosync_arg *dosync_arg_p) {
+	ctx_t *ctx_p          = dosync_arg_p->ctx_p;
+	indexes_t *indexes_p  = dosync_arg_p->indexes_p;
+	strmap_t *fpath2ei_ht = indexes_p->fpath2ei_ht;
+	struct sync_shards_arg arg;
+	int ret = 0, shard_num, shard_next;
+
+	arg.ctx_p  = ctx_p;
+	arg.shards = xcalloc(ctx_p->flags[SHARDS], sizeof(*arg.shards));
+	strmap_foreach(fpath2ei_ht, sync_idle_dosync_collectedevents_shardpush, &arg);
+
+	shard_num = 0;
+	while ((shard_num < ctx_p->flags[SHARDS]) && (arg.shards[shard_num] == NULL))
+		shard_num++;
+
+	while (shard_num < ctx_p->flags[SHARDS]) {
+		char newexc_path[PATH_MAX+1];
+
+		shard_next = shard_num+1;
+		while ((shard_next < ctx_p->flags[SHARDS]) && (arg.shards[shard_next] == NULL))
+			shard_next++;
+
+		// The exclude list is unlinked after the sync, so every shard gets it's own copy
+		if ((shard_next < ctx_p->flags[SHARDS]) && *dosync_arg_p->excf_path) {
+			if ((ret=sync_idle_dosync_collectedevents_uniqfname(ctx_p, newexc_path, "exclist")))
+				break;
+			if ((ret=fileutils_copy(dosync_arg_p->excf_path, newexc_path))) {
+				error("Cannot copy file \"%s\" to \"%s\".", dosync_arg_p->excf_path, newexc_path);
+				break;
+			}
+		}
+
+		debug(3, "Shard #%i: %zu events.", shard_num, strmap_count(arg.shards[shard_num]));
+		dosync_arg_p->evcount  = strmap_count(arg.shards[shard_num]);
+		indexes_p->fpath2ei_ht = arg.shards[shard_num];
+		strmap_foreach(arg.shards[shard_num], sync_idle_dosync_collectedevents_listpush, dosync_arg_p);
+		ret = sync_idle_dosync_collectedevents_commitpart(dosync_arg_p);
+		indexes_p->fpath2ei_ht = fpath2ei_ht;
+		if (ret) {
+			error("Cannot submit to sync the list \"%s\" of the shard #%i", dosync_arg_p->outf_path, shard_num);
+			break;
+		}
 
-	// List files cases:
+		if (shard_next < ctx_p->flags[SHARDS]) {
+			if (*dosync_arg_p->excf_path)
+				strcpy(dosync_arg_p->excf_path, newexc_path);
 
-	// non-RSYNC case
-	if (!(
-		(ctx_p->flags[MODE] == MODE_RSYNCSHELL)	 || 
-		(ctx_p->flags[MODE] == MODE_RSYNCDIRECT) ||
-		(ctx_p->flags[MODE] == MODE_RSYNCSO)
-	)) {
-		if (ctx_p->flags[SYNCLISTSIMPLIFY])
-			fprintf(outf, "%s\n", fpath);
-		else 
-			fprintf(outf, "sync %s %i %s\n", ctx_p->label, evinfo->evmask, fpath);
-		return;
+			if ((ret=sync_idle_dosync_collectedevents_listcreate(dosync_arg_p, "list"))) {
+				error("Cannot create new list-file");
+				break;
+			}
+		}
+
+		shard_num = shard_next;
 	}
 
-	// RSYNC case
-	if (ctx_p->rsyncinclimit && (*linescount_p >= ctx_p->rsyncinclimit))
-		sync_inclist_rotate(ctx_p, dosync_arg_p);
+	if (ret && (dosync_arg_p->outf != NULL)) {
+		fclose(dosync_arg_p->outf);
+		dosync_arg_p->outf = NULL;
+	}
 
-	int ret;
-	if ((ret=rsync_listpush(indexes_p, fpath, strlen(fpath), evinfo->flags, linescount_p))) {
-		error("Got error from rsync_listpush(). Exit.");
-		exit(ret);
+	shard_num = 0;
+	while (shard_num < ctx_p->flags[SHARDS]) {
+		if (arg.shards[shard_num] != NULL)
+			strmap_free(arg.shards[shard_num]);
+		shard_num++;
 	}
+	free(arg.shards);
 
-	return;
+	return ret;
 }
 
 int sync_idle_dosync_collectedevents(ctx_t *ctx_p, indexes_t *indexes_p) {
@@ -2870,15 +5246,26 @@ int sync_idle_dosync_collectedevents(ctx_t *ctx_p, indexes_t *indexes_p) {
 
 #ifdef PARANOID
 	if(ctx_p->listoutdir != NULL) {
-		g_hash_table_remove_all(indexes_p->fpath2ei_ht);
+		indexes_fpath2ei_clear(indexes_p);
 		if(isrsyncpreferexclude)
-			g_hash_table_remove_all(indexes_p->exc_fpath_ht);
+			pathtree_clear(indexes_p->exc_fpath_tree);
 	}
 #endif
 
 	// Setting the time to sync not before it:
-	ctx_p->synctime = time(NULL) + ctx_p->syncdelay;
-	debug(3, "Next sync will be not before: %u", ctx_p->synctime);
+	ctx_p->synctime = clock_monotonic_ms() + ctx_p->syncdelay;
+	debug(3, "Next sync will be not before: %llu", (unsigned long long)ctx_p->synctime);
+
+	int renames_due = 0;
+
+	if (indexes_p->renames_waiting != NULL) {
+		pathtree_free(indexes_p->renames_waiting);
+		indexes_p->renames_waiting = NULL;
+	}
+	if ((ctx_p->flags[THREADING] == PM_SAFE) && indexes_p->renames_count && sync_renames_islocked(indexes_p)) {
+		debug(3, "The renames are locked, the events on their paths are postponed.");
+		indexes_p->renames_waiting = sync_renames_pathset(indexes_p);
+	}
 
 	int queue_id=0;
 	while (queue_id < QUEUE_MAX) {
@@ -2894,15 +5281,29 @@ int sync_idle_dosync_collectedevents(ctx_t *ctx_p, indexes_t *indexes_p) {
 		ret = sync_idle_dosync_collectedevents_aggrqueue(queue_id, ctx_p, indexes_p, &dosync_arg);
 		if(ret) {
 			error("Got error while processing queue #%i\n.", queue_id);
-			g_hash_table_remove_all(indexes_p->fpath2ei_ht);
+			indexes_fpath2ei_clear(indexes_p);
 			if(isrsyncpreferexclude)
-				g_hash_table_remove_all(indexes_p->exc_fpath_ht);
+				pathtree_clear(indexes_p->exc_fpath_tree);
 			return ret;
 		}
 
 		queue_id++;
 	}
 
+	// Renames are collected with the normal queue, but they should be passed
+	// to the sync handler before any other event on the new paths
+	if (indexes_p->renames_count && (dosync_arg.evcount || !ctx_p->_queues[QUEUE_NORMAL].stime)) {
+		if (indexes_p->renames_waiting != NULL) {
+			// Retrying with the normal queue
+			if (!ctx_p->_queues[QUEUE_NORMAL].stime)
+				ctx_p->_queues[QUEUE_NORMAL].stime = clock_monotonic_ms();
+		} else {
+			debug(3, "There're %zu renames.", indexes_p->renames_count);
+			dosync_arg.evcount += indexes_p->renames_count;
+			renames_due = 1;
+		}
+	}
+
 	if (!dosync_arg.evcount) {
 		debug(3, "Summary events' count is zero. Return 0.");
 		return 0;
@@ -2926,10 +5327,11 @@ int sync_idle_dosync_collectedevents(ctx_t *ctx_p, indexes_t *indexes_p) {
 					}
 
 #ifdef PARANOID
-					g_hash_table_remove_all(indexes_p->out_lines_aggr_ht);
+					strmap_clear(indexes_p->out_lines_aggr_ht);
 #endif
-					g_hash_table_foreach_remove(indexes_p->exc_fpath_ht, sync_idle_dosync_collectedevents_rsync_exclistpush, &dosync_arg);
-					g_hash_table_foreach_remove(indexes_p->out_lines_aggr_ht, rsync_aggrout, &dosync_arg);
+					pathtree_foreach(indexes_p->exc_fpath_tree, sync_idle_dosync_collectedevents_rsync_exclistpush, &dosync_arg);
+					pathtree_clear(indexes_p->exc_fpath_tree);
+					strmap_foreach(indexes_p->out_lines_aggr_ht, rsync_aggrout, &dosync_arg);
 					fclose(dosync_arg.outf);
 #ifdef VERYPARANOID
 					require_strlen_le(dosync_arg.outf_path, PATH_MAX);
@@ -2948,19 +5350,34 @@ int sync_idle_dosync_collectedevents(ctx_t *ctx_p, indexes_t *indexes_p) {
 		if ((ctx_p->listoutdir != NULL) || (ctx_p->flags[MODE] == MODE_SO) || (ctx_p->synchandler_argf & SHFL_INCLUDE_LIST)) {
 
 #ifdef PARANOID
-			g_hash_table_remove_all(indexes_p->out_lines_aggr_ht);
+			strmap_clear(indexes_p->out_lines_aggr_ht);
 #endif
 
-			g_hash_table_foreach(indexes_p->fpath2ei_ht, sync_idle_dosync_collectedevents_listpush, &dosync_arg);
+			if (renames_due)
+				sync_idle_dosync_collectedevents_renamespush(&dosync_arg);
 
-			if ((ret=sync_idle_dosync_collectedevents_commitpart(&dosync_arg))) {
+			// The renames should be synced before the events on the new paths, so the iteration with them is not sharded
+			if (ctx_p->flags[SHARDS] > 1 && (ctx_p->listoutdir != NULL) && !renames_due && (strmap_count(indexes_p->fpath2ei_ht) > 1))
+				ret = sync_idle_dosync_collectedevents_shards(&dosync_arg);
+			else {
+				strmap_foreach(indexes_p->fpath2ei_ht, sync_idle_dosync_collectedevents_listpush, &dosync_arg);
+				ret = sync_idle_dosync_collectedevents_commitpart(&dosync_arg);
+			}
+
+			// Is not taken by a thread if the handler is not threaded
+			if (indexes_p->renames_lockset != NULL) {
+				pathtree_free(indexes_p->renames_lockset);
+				indexes_p->renames_lockset = NULL;
+			}
+
+			if (ret) {
 				error("Cannot submit to sync the list \"%s\"", dosync_arg.outf_path);
 				// TODO: free dosync_arg.api_ei on case of error
-				g_hash_table_remove_all(indexes_p->fpath2ei_ht);
+				indexes_fpath2ei_clear(indexes_p);
 				return ret;
 			}
 
-			g_hash_table_remove_all(indexes_p->fpath2ei_ht);
+			indexes_fpath2ei_clear(indexes_p);
 		}
 	}
 
@@ -2985,11 +5402,267 @@ int apievinfo2rsynclist(indexes_t *indexes_p, FILE *listfile, int n, api_eventin
 
 	struct dosync_arg dosync_arg = {0};
 	dosync_arg.outf = listfile;
-	g_hash_table_foreach_remove(indexes_p->out_lines_aggr_ht, rsync_aggrout, &dosync_arg);
+	strmap_foreach(indexes_p->out_lines_aggr_ht, rsync_aggrout, &dosync_arg);
+
+	return 0;
+}
+
+/*
+ * "--fileinfo-snapshot": the remembered states of the objects are saved
+ * every FILEINFO_SNAPSHOT_INTERVAL seconds and on exit. The objects that
+ * are queued or being synced are not saved: their new states are not on
+ * the destination side, yet. The periodic snapshot is written by a child
+ * process (see fisnapshot_write_fork()), the one on exit is written
+ * directly.
+ */
+
+static uint64_t sync_fisnapshot_time = 0;
+static pid_t    sync_fisnapshot_pid  = 0;
+
+static int sync_fisnapshot_pending_add(strmap_entry_t *entry, void *evinfo_v, void *tree_v) {
+	pathtree_set(tree_v, entry->key, ((eventinfo_t *)evinfo_v)->flags, NULL);
+	return 0;
+}
+
+static int sync_fisnapshot_pending_addthread(threadinfo_t *threadinfo_p, void *tree_v) {
+	if (threadinfo_p->fpath2ei_ht != NULL)
+		strmap_foreach(threadinfo_p->fpath2ei_ht, sync_fisnapshot_pending_add, tree_v);
+
+	return 0;
+}
+
+// Return: 1 if the previous snapshot is still being written, 0 otherwise
+
+static int sync_fisnapshot_wait(ctx_t *ctx_p, int options) {
+	int status;
+
+	if (!sync_fisnapshot_pid)
+		return 0;
+
+	pid_t pid = waitpid(sync_fisnapshot_pid, &status, options);
+	if (!pid)
+		return 1;
+
+	sync_fisnapshot_pid = 0;
+	if (pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		if (pid != -1 && WIFEXITED(status))
+			errno = WEXITSTATUS(status);
+		warning("Cannot save the snapshot \"%s\". The next start will sync the objects without it.", ctx_p->fileinfo_snapshot);
+	}
+
+	return 0;
+}
+
+static void sync_fisnapshot_checkpoint(ctx_t *ctx_p, indexes_t *indexes_p, int force) {
+	if (ctx_p->fileinfo_snapshot == NULL)
+		return;
+
+	// The snapshot of the previous run is in use by the initial sync
+	if (indexes_p->fisnapshot != NULL)
+		return;
+
+	if (sync_fisnapshot_wait(ctx_p, force ? 0 : WNOHANG))
+		return;
+
+	uint64_t tm = clock_monotonic_ms();
+	if (!sync_fisnapshot_time)
+		sync_fisnapshot_time = tm;
+	if (!force && sync_fisnapshot_time + FILEINFO_SNAPSHOT_INTERVAL*1000 > tm)
+		return;
+	sync_fisnapshot_time = tm;
+
+	pathtree_t *pending = pathtree_new();
+	int queue_id = 0;
+
+	strmap_foreach(indexes_p->fpath2ei_ht, sync_fisnapshot_pending_add, pending);
+	while (queue_id < QUEUE_MAX)
+		strmap_foreach(indexes_p->fpath2ei_coll_ht[queue_id++], sync_fisnapshot_pending_add, pending);
+	threads_foreach(sync_fisnapshot_pending_addthread, STATE_UNKNOWN, pending);
+
+	if (force) {
+		// Exiting, so the store is not needed anymore
+		fisnapshot_drop_pending(indexes_p->fileinfo, pending);
+		if (fisnapshot_write(indexes_p->fileinfo, ctx_p->fileinfo_snapshot))
+			warning("Cannot save the snapshot \"%s\". The next start will sync the objects without it.", ctx_p->fileinfo_snapshot);
+	} else {
+		pid_t pid = fisnapshot_write_fork(indexes_p->fileinfo, ctx_p->fileinfo_snapshot, pending);
+		if (pid != -1)
+			sync_fisnapshot_pid = pid;
+	}
+
+	pathtree_free(pending);
+	return;
+}
+
+// Memory accounting. The sizes of the indexes are recounted by the main
+// thread (the owner of the indexes) and are read by the control socket
+// and the status file from the copy below.
+
+#define SYNC_MEMINFO_ROWS	(2*QUEUE_MAX + 12)
+
+struct sync_meminfo_row {
+	char	name[32];
+	size_t	entries;
+	size_t	bytes;
+};
+
+static struct sync_meminfo_row sync_meminfo_rows[SYNC_MEMINFO_ROWS];
+static int             sync_meminfo_rows_count = 0;
+static pthread_mutex_t sync_meminfo_mutex      = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t        sync_meminfo_time       = 0;
+
+static inline void sync_meminfo_add(struct sync_meminfo_row *rows, int *count_p, const char *name, size_t entries, size_t bytes) {
+#ifdef PARANOID
+	if (*count_p >= SYNC_MEMINFO_ROWS) {
+		error("Too many memory accounting rows. Skipping \"%s\".", name);
+		return;
+	}
+#endif
+	struct sync_meminfo_row *row = &rows[(*count_p)++];
+
+	snprintf(row->name, sizeof(row->name), "%s", name);
+	row->entries = entries;
+	row->bytes   = bytes;
+
+	return;
+}
+
+static inline void sync_meminfo_add_strmap(struct sync_meminfo_row *rows, int *count_p, const char *name, strmap_t *map) {
+	if (map != NULL)
+		sync_meminfo_add(rows, count_p, name, strmap_count(map), strmap_memsize(map));
+	return;
+}
+
+struct sync_meminfo_threads_arg {
+	size_t entries;
+	size_t bytes;
+};
+
+static int sync_meminfo_threads(threadinfo_t *threadinfo_p, void *arg) {
+	struct sync_meminfo_threads_arg *arg_p = arg;
+
+	if (threadinfo_p->fpath2ei_ht != NULL) {
+		arg_p->entries += strmap_count(threadinfo_p->fpath2ei_ht);
+		arg_p->bytes   += strmap_memsize(threadinfo_p->fpath2ei_ht);
+	}
 
 	return 0;
 }
 
+static void sync_meminfo_update(ctx_t *ctx_p, indexes_t *indexes_p) {
+	if (ctx_p->statusfile == NULL && ctx_p->socketpath == NULL)
+		return;
+
+	uint64_t tm = clock_monotonic_ms();
+	if (sync_meminfo_time && sync_meminfo_time + MEMINFO_INTERVAL*1000 > tm)
+		return;
+	sync_meminfo_time = tm;
+
+	struct sync_meminfo_row rows[SYNC_MEMINFO_ROWS];
+	int    count = 0, i;
+	char   name[sizeof(rows[0].name)];
+	size_t entries, bytes;
+
+	// Watched directories: the slots and the paths
+	bytes   = (size_t)indexes_p->wdslots_alloc * sizeof(*indexes_p->wdslots)
+		+ indexes_p->wdfree_alloc * sizeof(*indexes_p->wdfree)
+		+ pathtree_memsize(indexes_p->fpath2wd_tree);
+	i = 0;
+	while (i < indexes_p->wdslots_alloc) {
+		wdslot_t *wdslot = &indexes_p->wdslots[i++];
+		if (wdslot->fpath == NULL)
+			continue;
+		bytes += wdslot->fpath_len + 1;
+	}
+	sync_meminfo_add(rows, &count, "fpath2wd_tree", indexes_wdcount(indexes_p), bytes);
+
+	sync_meminfo_add_strmap(rows, &count, "fpath2ei_ht", indexes_p->fpath2ei_ht);
+	i = 0;
+	while (i < QUEUE_MAX) {
+		snprintf(name, sizeof(name), "fpath2ei_coll_ht[%i]", i);
+		sync_meminfo_add_strmap(rows, &count, name, indexes_p->fpath2ei_coll_ht[i]);
+		snprintf(name, sizeof(name), "exc_fpath_coll_ht[%i]", i);
+		sync_meminfo_add_strmap(rows, &count, name, indexes_p->exc_fpath_coll_ht[i]);
+		i++;
+	}
+	sync_meminfo_add_strmap(rows, &count, "out_lines_aggr_ht", indexes_p->out_lines_aggr_ht);
+	sync_meminfo_add_strmap(rows, &count, "nonthreaded_syncing_fpath2ei_ht", indexes_p->nonthreaded_syncing_fpath2ei_ht);
+
+	if (indexes_p->exc_fpath_tree != NULL)
+		sync_meminfo_add(rows, &count, "exc_fpath_tree", pathtree_count(indexes_p->exc_fpath_tree), pathtree_memsize(indexes_p->exc_fpath_tree));
+
+	if (indexes_p->fileinfo != NULL)
+		sync_meminfo_add(rows, &count, "fileinfo", fileinfo_count(indexes_p->fileinfo), fileinfo_memsize(indexes_p->fileinfo));
+
+	if (indexes_p->fisnapshot != NULL)
+		sync_meminfo_add(rows, &count, "fisnapshot", indexes_p->fisnapshot->header->recs_count,
+			indexes_p->fisnapshot->map_size + indexes_p->fisnapshot->header->recs_count + 1);
+
+	bytes = indexes_p->renames_alloc * sizeof(*indexes_p->renames);
+	size_t rename_i = 0;
+	while (rename_i < indexes_p->renames_count) {
+		rename_t *rename_p = &indexes_p->renames[rename_i++];
+		bytes += strlen(rename_p->fpath_old) + strlen(rename_p->fpath_new) + 2;
+	}
+	sync_meminfo_add(rows, &count, "renames", indexes_p->renames_count, bytes);
+
+	struct sync_meminfo_threads_arg threads_arg = {0};
+	threads_foreach(sync_meminfo_threads, STATE_UNKNOWN, &threads_arg);
+	sync_meminfo_add(rows, &count, "threads_fpath2ei_ht", threads_arg.entries, threads_arg.bytes);
+
+#ifdef CLUSTER_SUPPORT
+	if (ctx_p->cluster_iface != NULL) {
+		entries = bytes = 0;
+		cluster_meminfo(&entries, &bytes);
+		sync_meminfo_add(rows, &count, "cluster_modtime_ht", entries, bytes);
+	}
+#endif
+
+	entries = bytes = 0;
+	i = 0;
+	while (i < count) {
+		entries += rows[i].entries;
+		bytes   += rows[i].bytes;
+		i++;
+	}
+	sync_meminfo_add(rows, &count, "total", entries, bytes);
+
+	pthread_mutex_lock(&sync_meminfo_mutex);
+	memcpy(sync_meminfo_rows, rows, count * sizeof(*rows));
+	sync_meminfo_rows_count = count;
+	pthread_mutex_unlock(&sync_meminfo_mutex);
+
+	debug(3, "%zu entries, %zu bytes in the indexes", entries, bytes);
+	main_status_meminfo_update(ctx_p);
+	return;
+}
+
+// Formats the last counted memory usage into "buf" as "<name> <entries> <bytes>"
+// rows, every row is prefixed with "prefix" and followed by "separator".
+// Return: the length of the text (truncated by the whole rows)
+
+size_t sync_meminfo_format(char *buf, size_t buf_size, const char *prefix, const char *separator) {
+	size_t len = 0;
+	int    i   = 0;
+
+	buf[0] = 0;
+
+	pthread_mutex_lock(&sync_meminfo_mutex);
+	while (i < sync_meminfo_rows_count) {
+		struct sync_meminfo_row *row = &sync_meminfo_rows[i++];
+		int rc = snprintf(&buf[len], buf_size - len, "%s%s %zu %zu%s", prefix, row->name, row->entries, row->bytes, separator);
+
+		if (rc < 0 || (size_t)rc >= buf_size - len) {
+			buf[len] = 0;
+			break;
+		}
+		len += rc;
+	}
+	pthread_mutex_unlock(&sync_meminfo_mutex);
+
+	return len;
+}
+
 int sync_idle(ctx_t *ctx_p, indexes_t *indexes_p) {
 
 	// Collecting garbage
@@ -3008,6 +5681,11 @@ int sync_idle(ctx_t *ctx_p, indexes_t *indexes_p) {
 		}
 	}
 
+#ifdef INOTIFY_SUPPORT
+	ret = sync_watchbudget_poll(ctx_p, indexes_p);
+	if(ret) return ret;
+#endif
+
 	// Syncing
 
 	debug(3, "calling sync_idle_dosync_collectedevents()");
@@ -3025,13 +5703,137 @@ int sync_idle(ctx_t *ctx_p, indexes_t *indexes_p) {
 	if(ret) return ret;
 #endif
 
+	sync_fisnapshot_checkpoint(ctx_p, indexes_p, 0);
+	sync_meminfo_update(ctx_p, indexes_p);
+
+	return 0;
+}
+
+#ifdef EPOLL_SUPPORT
+static int sync_evloop_init(ctx_t *ctx_p) {
+	int i;
+
+	if (ctx_p->notifyenginefunct.fd == NULL) {
+		debug(1, "The FS monitor subsystem has no pollable descriptor. Using its wait() function.");
+		return 0;
+	}
+
+	evloop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (evloop.epoll_fd == -1) {
+		error("Cannot epoll_create1(EPOLL_CLOEXEC).");
+		return errno;
+	}
+
+	evloop.fd[EVLOOP_MONITOR] = ctx_p->notifyenginefunct.fd(ctx_p);
+	evloop.fd[EVLOOP_TIMER]   = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC|TFD_NONBLOCK);
+	evloop.fd[EVLOOP_THREADS] = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+
+	i = 0;
+	while (i < EVLOOP_MAX) {
+		struct epoll_event ev = {0};
+
+		if (evloop.fd[i] == -1) {
+			error("Cannot create a descriptor #%i for the main loop.", i);
+			return errno ? errno : EINVAL;
+		}
+
+		ev.events   = EPOLLIN;
+		ev.data.u32 = i;
+		if (epoll_ctl(evloop.epoll_fd, EPOLL_CTL_ADD, evloop.fd[i], &ev) == -1) {
+			error("Cannot epoll_ctl(%i, EPOLL_CTL_ADD, %i).", evloop.epoll_fd, evloop.fd[i]);
+			return errno;
+		}
+		i++;
+	}
+
+	debug(2, "epoll_fd == %i (monitor: %i; timer: %i; threads: %i)", evloop.epoll_fd,
+		evloop.fd[EVLOOP_MONITOR], evloop.fd[EVLOOP_TIMER], evloop.fd[EVLOOP_THREADS]);
 	return 0;
 }
 
+static void sync_evloop_deinit() {
+	// evloop.fd[EVLOOP_MONITOR] belongs to the FS monitor subsystem
+	if (evloop.fd[EVLOOP_THREADS] != -1)
+		close(evloop.fd[EVLOOP_THREADS]);
+	if (evloop.fd[EVLOOP_TIMER] != -1)
+		close(evloop.fd[EVLOOP_TIMER]);
+	if (evloop.epoll_fd != -1)
+		close(evloop.epoll_fd);
+
+	evloop.fd[EVLOOP_THREADS] = evloop.fd[EVLOOP_TIMER] = evloop.fd[EVLOOP_MONITOR] = -1;
+	evloop.epoll_fd = -1;
+	return;
+}
+
+/**
+ * @brief 			Waits for FS events, the nearest deadline or finished threads in one epoll_wait()
+ *
+ * @param[in] 	ctx_p 		Pointer to "context"
+ * @param[in] 	tv_p 		Time to wait; zero means "don't block"
+ * @param[out] 	threadsdone_p 	Set to non-zero if some sync threads have finished
+ *
+ * @retval	1		There're events in the FS monitor subsystem
+ * @retval	0		Timed out (or only threads have finished)
+ * @retval	-1		Error (see errno)
+ *
+ */
+static int sync_evloop_wait(ctx_t *ctx_p, struct timeval *tv_p, int *threadsdone_p) {
+	struct itimerspec its = {{0}};
+	struct epoll_event ev[EVLOOP_MAX];
+	int timeout = -1, ret = 0, n;
+
+	if ((!tv_p->tv_sec) && (!tv_p->tv_usec))
+		timeout = 0;
+	else
+	if (tv_p->tv_sec != (long)((unsigned long)~0 >> 1)) {
+		its.it_value.tv_sec  = tv_p->tv_sec;
+		its.it_value.tv_nsec = tv_p->tv_usec * 1000;
+	}
+
+	// Zeroed "its" disarms the timer, so there's no stale expiration left from the previous cycle
+	if (timerfd_settime(evloop.fd[EVLOOP_TIMER], 0, &its, NULL) == -1) {
+		error("Cannot timerfd_settime(%i, 0, {%li, %li}).", evloop.fd[EVLOOP_TIMER], its.it_value.tv_sec, its.it_value.tv_nsec);
+		return -1;
+	}
+
+	debug(3, "epoll_wait(): timer is set to %li.%06li secs (timeout == %i).", tv_p->tv_sec, tv_p->tv_usec, timeout);
+	n = epoll_wait(evloop.epoll_fd, ev, EVLOOP_MAX, timeout);
+	if (n <= 0)
+		return n;
+
+	while (n--) {
+		uint64_t counter;
+
+		switch (ev[n].data.u32) {
+			case EVLOOP_MONITOR:
+				ret = 1;
+				break;
+			case EVLOOP_TIMER:
+				if (read(evloop.fd[EVLOOP_TIMER], &counter, sizeof(counter)) == sizeof(counter))
+					debug(3, "The timer has expired.");
+				break;
+			case EVLOOP_THREADS:
+				if (read(evloop.fd[EVLOOP_THREADS], &counter, sizeof(counter)) == sizeof(counter)) {
+					debug(3, "%lu thread(s) have finished.", (unsigned long)counter);
+					*threadsdone_p = 1;
+				}
+				break;
+#ifdef PARANOID
+			default:
+				critical("Unknown event source: %u", ev[n].data.u32);
+#endif
+		}
+	}
+
+	return ret;
+}
+#endif
+
 int notify_wait(ctx_t *ctx_p, indexes_t *indexes_p) {
 	static struct timeval tv;
-	time_t tm = time(NULL);
-	long delay = ((unsigned long)~0 >> 1);
+	int ret, threadsdone = 0;
+	uint64_t tm = clock_monotonic_ms();
+	long delay = ((unsigned long)~0 >> 1);	// in milliseconds
 
 	threadsinfo_t *threadsinfo_p = thread_info();
 
@@ -3051,15 +5853,23 @@ int notify_wait(ctx_t *ctx_p, indexes_t *indexes_p) {
 			return 0;
 		}
 
-		int qdelay = queueinfo->stime + queueinfo->collectdelay - tm;
-		debug(3, "queue #%i: %i %i %i -> %i", queue_id-1, queueinfo->stime, queueinfo->collectdelay, tm, qdelay);
+		long qdelay = (long)(int64_t)(queueinfo->stime + queueinfo->collectdelay - tm);
+		debug(3, "queue #%i: %llu %u %llu -> %li", queue_id-1, (unsigned long long)queueinfo->stime, queueinfo->collectdelay, (unsigned long long)tm, qdelay);
 		if (qdelay < -(long)ctx_p->syncdelay)
 			qdelay = -(long)ctx_p->syncdelay;
 
 		delay = MIN(delay, qdelay);
 	}
 
-	long synctime_delay = ((long)ctx_p->synctime) - ((long)tm);
+#ifdef INOTIFY_SUPPORT
+	if ((watchbudget.polled_ht != NULL) && g_hash_table_size(watchbudget.polled_ht)) {
+		long polldelay = (long)(int64_t)(watchbudget.polltime + WATCHBUDGET_POLLINTERVAL - tm);
+		debug(3, "polldelay == %li", polldelay);
+		delay = MIN(delay, polldelay);
+	}
+#endif
+
+	long synctime_delay = (long)(int64_t)(ctx_p->synctime - tm);
 	synctime_delay = synctime_delay > 0 ? synctime_delay : 0;
 
 	debug(3, "delay = MAX(%li, %li)", delay, synctime_delay);
@@ -3070,7 +5880,8 @@ int notify_wait(ctx_t *ctx_p, indexes_t *indexes_p) {
 		time_t _thread_nextexpiretime = thread_nextexpiretime();
 		debug(3, "thread_nextexpiretime == %i", _thread_nextexpiretime);
 		if(_thread_nextexpiretime) {
-			long thread_expiredelay = (long)thread_nextexpiretime() - (long)tm + 1; // +1 is to make "tm>threadinfo_p->expiretime" after select() definitely TRUE
+			// The threads expiration time is a wall clock one in seconds
+			long thread_expiredelay = ((long)_thread_nextexpiretime - (long)time(NULL) + 1) * 1000; // +1 is to make "tm>threadinfo_p->expiretime" after select() definitely TRUE
 			debug(3, "thread_expiredelay == %i", thread_expiredelay);
 			thread_expiredelay = thread_expiredelay > 0 ? thread_expiredelay : 0;
 			debug(3, "delay = MIN(%li, %li)", delay, thread_expiredelay);
@@ -3085,12 +5896,25 @@ int notify_wait(ctx_t *ctx_p, indexes_t *indexes_p) {
 		tv.tv_sec  = 0;
 		tv.tv_usec = 0;
 	} else {
-		debug(3, "sleeping for %li second(s).", SLEEP_SECONDS);
-		sleep(SLEEP_SECONDS);
-		delay = ((long)delay)>SLEEP_SECONDS ? delay-SLEEP_SECONDS : 0;
+#ifdef EPOLL_SUPPORT
+		// The events are handled as soon as they arrive, the queues take care of collecting them
+		if (evloop.epoll_fd == -1)
+#endif
+		{
+			debug(3, "sleeping for %li second(s).", SLEEP_SECONDS);
+			sleep(SLEEP_SECONDS);
+			if (delay != (long)((unsigned long)~0 >> 1))
+				delay = delay > SLEEP_SECONDS*1000 ? delay - SLEEP_SECONDS*1000 : 0;
+		}
 
-		tv.tv_sec  = delay;
-		tv.tv_usec = 0;
+		if (delay == (long)((unsigned long)~0 >> 1)) {
+			// No deadlines, waiting for events only
+			tv.tv_sec  = delay;
+			tv.tv_usec = 0;
+		} else {
+			tv.tv_sec  =  delay / 1000;
+			tv.tv_usec = (delay % 1000) * 1000;
+		}
 	}
 
 	debug(4, "pthread_mutex_lock(&threadsinfo_p->mutex[PTHREAD_MUTEX_STATE])");
@@ -3104,8 +5928,15 @@ int notify_wait(ctx_t *ctx_p, indexes_t *indexes_p) {
 	pthread_mutex_lock(&threadsinfo_p->mutex[PTHREAD_MUTEX_SELECT]);
 	pthread_mutex_unlock(&threadsinfo_p->mutex[PTHREAD_MUTEX_STATE]);
 
-	debug(8, "ctx_p->notifyenginefunct.wait() [%p]", ctx_p->notifyenginefunct.wait);
-	int ret = ctx_p->notifyenginefunct.wait(ctx_p, indexes_p, &tv);
+#ifdef EPOLL_SUPPORT
+	if (evloop.epoll_fd != -1)
+		ret = sync_evloop_wait(ctx_p, &tv, &threadsdone);
+	else
+#endif
+	{
+		debug(8, "ctx_p->notifyenginefunct.wait() [%p]", ctx_p->notifyenginefunct.wait);
+		ret = ctx_p->notifyenginefunct.wait(ctx_p, indexes_p, &tv);
+	}
 
 	pthread_mutex_unlock(&threadsinfo_p->mutex[PTHREAD_MUTEX_SELECT]);
 
@@ -3117,6 +5948,9 @@ int notify_wait(ctx_t *ctx_p, indexes_t *indexes_p) {
 	debug(4, "pthread_mutex_lock(&threadsinfo_p->mutex[PTHREAD_MUTEX_STATE])");
 	pthread_mutex_lock(&threadsinfo_p->mutex[PTHREAD_MUTEX_STATE]);
 
+	if (threadsdone && (ctx_p->state == STATE_RUNNING))
+		ctx_p->state = STATE_THREAD_GC;
+
 	if ((ctx_p->flags[EXITONNOEVENTS]) && (ret == 0)) {
 		// if not events and "--exit-on-no-events" is set
 		if (ctx_p->flags[PREEXITHOOK])
@@ -3197,7 +6031,10 @@ int sync_loop(ctx_t *ctx_p, indexes_t *indexes_p) {
 				main_status_update(ctx_p);
 				pthread_cond_broadcast(&threadsinfo_p->cond[PTHREAD_MUTEX_STATE]);
 				pthread_mutex_unlock(&threadsinfo_p->mutex[PTHREAD_MUTEX_STATE]);
-				ret = sync_initialsync(ctx_p->watchdir, ctx_p, indexes_p, INITSYNC_FULL);
+				if (ctx_p->initsync_journal != NULL)
+					ret = sync_initialsync_journaled(ctx_p, indexes_p);
+				else
+					ret = sync_initialsync(ctx_p->watchdir, ctx_p, indexes_p, INITSYNC_FULL);
 				if(ret) return ret;
 
 				if(ctx_p->flags[ONLYINITSYNC]) {
@@ -3264,10 +6101,15 @@ int sync_loop(ctx_t *ctx_p, indexes_t *indexes_p) {
 		}
 
 		int count = ctx_p->notifyenginefunct.handle(ctx_p, indexes_p);
-		if (count  <= 0) {
+		if (count  < 0) {
 			error("Cannot handle with notify events.");
 			return errno;
 		}
+		if (count == 0) {
+			// The descriptor may wake up after its events were already consumed by the previous handle()
+			debug(3, "No events to handle (a spurious wake-up).");
+			continue;
+		}
 		main_status_update(ctx_p);
 
 		if (ctx_p->flags[EXITONNOEVENTS]) // clsync exits on no events, so sync_idle() is never called. We have to force the calling of it.
@@ -3421,15 +6263,11 @@ struct sync_dump_arg {
 	int		 data;
 };
 
-void sync_dump_liststep(gpointer fpath_gp, gpointer evinfo_gp, gpointer arg_gp) {
-	char *fpath			=         (char *)fpath_gp;
-	eventinfo_t *evinfo		=  (eventinfo_t *)evinfo_gp;
+int sync_dump_liststep(strmap_entry_t *entry, void *value, void *arg_gp) {
+	const char *fpath		=		  entry->key;
 	struct sync_dump_arg *arg 	= 		  arg_gp;
 	char act, num;
 
-	if (fpath == NULL || evinfo == NULL)
-		return;
-
 	switch (arg->data) {
 		case DUMP_LTYPE_INCLUDE:
 			act = '+';
@@ -3439,11 +6277,13 @@ void sync_dump_liststep(gpointer fpath_gp, gpointer evinfo_gp, gpointer arg_gp)
 			act = '-';
 			num = '1';
 			break;
-		case DUMP_LTYPE_EVINFO:
+		case DUMP_LTYPE_EVINFO: {
+			eventinfo_t *evinfo = value;
 			act = '+';
 			num = 	 evinfo->flags&EVIF_RECURSIVELY        ? '*' : 
 				(evinfo->flags&EVIF_CONTENTRECURSIVELY ? '/' : '1');
 			break;
+		}
 		default:
 			act = '?';
 			num = '?';
@@ -3451,7 +6291,7 @@ void sync_dump_liststep(gpointer fpath_gp, gpointer evinfo_gp, gpointer arg_gp)
 
 	dprintf(arg->fd_out, "%c%c\t%s\n", act, num, fpath);
 
-	return;
+	return 0;
 }
 
 int sync_dump_thread(threadinfo_t *threadinfo_p, void *_arg) {
@@ -3486,7 +6326,7 @@ int sync_dump_thread(threadinfo_t *threadinfo_p, void *_arg) {
 	}
 
 	arg->data = DUMP_LTYPE_EVINFO;
-	g_hash_table_foreach(threadinfo_p->fpath2ei_ht, sync_dump_liststep, arg);
+	strmap_foreach(threadinfo_p->fpath2ei_ht, sync_dump_liststep, arg);
 
 	close(arg->fd_out);
 
@@ -3527,10 +6367,21 @@ int sync_dump(ctx_t *ctx_p, const char *const dir_path) {
 	}
 
 	dprintf(fd_out, "status == %s\n", getenv("CLSYNC_STATUS"));	// TODO: remove getenv() from here
+#ifdef INOTIFY_SUPPORT
+	if (ctx_p->flags[MONITOR] == NE_INOTIFY) {
+		inotify_dump(ctx_p, fd_out);
+		sync_watchbudget_dump(ctx_p, fd_out);
+		statbatch_dump(fd_out);
+	}
+#endif
+#ifdef FANOTIFY_SUPPORT
+	if (ctx_p->flags[MONITOR] == NE_FANOTIFY)
+		fanotify_dump(ctx_p, fd_out);
+#endif
 	arg.fd_out = fd_out;
 	arg.data   = DUMP_LTYPE_EVINFO;
 	if (indexes_p->nonthreaded_syncing_fpath2ei_ht != NULL)
-		g_hash_table_foreach(indexes_p->nonthreaded_syncing_fpath2ei_ht, sync_dump_liststep, &arg);
+		strmap_foreach(indexes_p->nonthreaded_syncing_fpath2ei_ht, sync_dump_liststep, &arg);
 
 	close(fd_out);
 
@@ -3557,10 +6408,10 @@ int sync_dump(ctx_t *ctx_p, const char *const dir_path) {
 		arg.fd_out = openat(arg.dirfd[DUMP_DIRFD_QUEUE], buf, O_WRONLY|O_CREAT, DUMP_FILEMODE);
 
 		arg.data = DUMP_LTYPE_EVINFO;
-		g_hash_table_foreach(indexes_p->fpath2ei_coll_ht[queue_id],  sync_dump_liststep, &arg);
+		strmap_foreach(indexes_p->fpath2ei_coll_ht[queue_id],  sync_dump_liststep, &arg);
 		if (indexes_p->exc_fpath_coll_ht[queue_id] != NULL) {
 			arg.data = DUMP_LTYPE_EXCLUDE;
-			g_hash_table_foreach(indexes_p->exc_fpath_coll_ht[queue_id], sync_dump_liststep, &arg);
+			strmap_foreach(indexes_p->exc_fpath_coll_ht[queue_id], sync_dump_liststep, &arg);
 		}
 
 		close(arg.fd_out);
@@ -3761,21 +6612,25 @@ int sync_run(ctx_t *ctx_p) {
 
 		ctx_p->indexes_p	  = &indexes;
 
-		indexes.wd2fpath_ht	  = g_hash_table_new_full(g_direct_hash, g_direct_equal, 0,    0);
-		indexes.fpath2wd_ht	  = g_hash_table_new_full(g_str_hash,	 g_str_equal,	 free, 0);
-		indexes.fpath2ei_ht	  = g_hash_table_new_full(g_str_hash,	 g_str_equal,	 free, free);
-		indexes.exc_fpath_ht	  = g_hash_table_new_full(g_str_hash,	 g_str_equal,	 free, 0);
-		indexes.out_lines_aggr_ht = g_hash_table_new_full(g_str_hash,	 g_str_equal,	 free, 0);
-		indexes.fileinfo_ht	  = g_hash_table_new_full(g_str_hash,	 g_str_equal,	 free, free);
+		indexes.fpath2wd_tree	  = pathtree_new();
+		indexes.fpath2ei_ht	  = strmap_new(sizeof(eventinfo_t));
+		indexes.exc_fpath_tree	  = pathtree_new();
+		indexes.out_lines_aggr_ht = strmap_new(sizeof(eventinfo_flags_t));
+		indexes.fileinfo	  = fileinfo_store_new(ctx_p->flags[MODSIGN]);
+		if (ctx_p->fileinfo_snapshot != NULL)
+			indexes.fisnapshot = fisnapshot_open(indexes.fileinfo, ctx_p->fileinfo_snapshot);
+#ifdef INOTIFY_SUPPORT
+		sync_watchbudget_init(ctx_p);
+#endif
 		i=0;
 		while (i<QUEUE_MAX) {
 			switch (i) {
 				case QUEUE_LOCKWAIT:
-					indexes.fpath2ei_coll_ht[i]  = g_hash_table_new_full(g_str_hash,    g_str_equal,    free, 0);
+					indexes.fpath2ei_coll_ht[i]  = strmap_new(sizeof(eventinfo_t));
 					break;
 				default:
-					indexes.fpath2ei_coll_ht[i]  = g_hash_table_new_full(g_str_hash,    g_str_equal,    free, free);
-					indexes.exc_fpath_coll_ht[i] = g_hash_table_new_full(g_str_hash,    g_str_equal,    free, 0);
+					indexes.fpath2ei_coll_ht[i]  = strmap_new(sizeof(eventinfo_t));
+					indexes.exc_fpath_coll_ht[i] = strmap_new(sizeof(eventinfo_flags_t));
 			}
 			i++;
 		}
@@ -3856,6 +6711,10 @@ int sync_run(ctx_t *ctx_p) {
 			}
 	}
 
+	if (ctx_p->flags[HANDLERWORKERS])
+		if ((ret = coprocess_init(ctx_p)))
+			return ret;
+
 	// Initializing rand-generator if it's required
 
 	if (ctx_p->listoutdir)
@@ -3867,17 +6726,23 @@ int sync_run(ctx_t *ctx_p) {
 			return errno;
 	}
 
-	if ((ret=privileged_init(ctx_p)))
-		return ret;
-
 	{
 		// Preparing monitor subsystem context function pointers
 		switch (ctx_p->flags[MONITOR]) {
+#ifdef FANOTIFY_SUPPORT
+			case NE_FANOTIFY:
+				ctx_p->notifyenginefunct.add_watch_dir = fanotify_add_watch_dir;
+				ctx_p->notifyenginefunct.wait          = fanotify_wait;
+				ctx_p->notifyenginefunct.handle        = fanotify_handle;
+				ctx_p->notifyenginefunct.fd            = fanotify_fd;
+				break;
+#endif
 #ifdef INOTIFY_SUPPORT
 			case NE_INOTIFY:
 				ctx_p->notifyenginefunct.add_watch_dir = inotify_add_watch_dir;
 				ctx_p->notifyenginefunct.wait          = inotify_wait;
 				ctx_p->notifyenginefunct.handle        = inotify_handle;
+				ctx_p->notifyenginefunct.fd            = inotify_fd;
 				break;
 #endif
 #ifdef KQUEUE_SUPPORT
@@ -3916,6 +6781,15 @@ int sync_run(ctx_t *ctx_p) {
 		}
 	}
 
+#ifdef EPOLL_SUPPORT
+	if (!ctx_p->flags[ONLYINITSYNC])
+		if ((ret=sync_evloop_init(ctx_p)))
+			return ret;
+#endif
+
+	if ((ret=privileged_init(ctx_p)))
+		return ret;
+
 #ifdef CLUSTER_SUPPORT
 	// Initializing cluster subsystem
 
@@ -3938,7 +6812,10 @@ int sync_run(ctx_t *ctx_p) {
 	if (!ctx_p->flags[ONLYINITSYNC]) {
 		// Marking file tree for FS monitor
 		debug(30, "Running recursive notify marking function");
-		ret = sync_mark_walk(ctx_p, ctx_p->watchdir, &indexes);
+		if (ctx_p->flags[MARKTHREADS] > 1)
+			ret = sync_mark_walk_parallel(ctx_p, &indexes);
+		else
+			ret = sync_mark_walk(ctx_p, ctx_p->watchdir, &indexes);
 		if (ret) return ret;
 	}
 
@@ -3964,8 +6841,17 @@ int sync_run(ctx_t *ctx_p) {
 
 	thread_cleanup(ctx_p);
 
+#ifdef EPOLL_SUPPORT
+	sync_evloop_deinit();
+#endif
+
 	debug(2, "Deinitializing the FS monitor subsystem");
 	switch (ctx_p->flags[MONITOR]) {
+#ifdef FANOTIFY_SUPPORT
+		case NE_FANOTIFY:
+			fanotify_deinit(ctx_p);
+			break;
+#endif
 #ifdef INOTIFY_SUPPORT
 		case NE_INOTIFY:
 			inotify_deinit(ctx_p);
@@ -4010,6 +6896,9 @@ int sync_run(ctx_t *ctx_p) {
 		}
 	}
 
+	// Stopping the coprocesses of the handler
+	coprocess_deinit(ctx_p);
+
 	// Cleaning up run-time routines
 	rsync_escape_cleanup();
 
@@ -4017,22 +6906,34 @@ int sync_run(ctx_t *ctx_p) {
 	{
 		int i;
 
+		// Saving the states of the synced objects for the next start
+		if (!ret)
+			sync_fisnapshot_checkpoint(ctx_p, &indexes, 1);
+		fisnapshot_close(indexes.fisnapshot);
+
 		debug(3, "Closing hash tables");
-		g_hash_table_destroy(indexes.wd2fpath_ht);
-		g_hash_table_destroy(indexes.fpath2wd_ht);
-		g_hash_table_destroy(indexes.fpath2ei_ht);
-		g_hash_table_destroy(indexes.exc_fpath_ht);
-		g_hash_table_destroy(indexes.out_lines_aggr_ht);
-		g_hash_table_destroy(indexes.fileinfo_ht);
+		indexes_wdslots_free(&indexes);
+		pathtree_free(indexes.fpath2wd_tree);
+		strmap_free(indexes.fpath2ei_ht);
+		pathtree_free(indexes.exc_fpath_tree);
+		strmap_free(indexes.out_lines_aggr_ht);
+		fileinfo_store_free(indexes.fileinfo);
+		indexes_renames_cleanup(&indexes);
+		free(indexes.renames);
+		pathtree_free(indexes.renames_waiting);
+		pathtree_free(indexes.renames_lockset);
+#ifdef INOTIFY_SUPPORT
+		sync_watchbudget_deinit();
+#endif
 		i = 0;
 		while (i<QUEUE_MAX) {
 			switch (i) {
 				case QUEUE_LOCKWAIT:
-					g_hash_table_destroy(indexes.fpath2ei_coll_ht[i]);
+					strmap_free(indexes.fpath2ei_coll_ht[i]);
 					break;
 				default:
-					g_hash_table_destroy(indexes.fpath2ei_coll_ht[i]);
-					g_hash_table_destroy(indexes.exc_fpath_coll_ht[i]);
+					strmap_free(indexes.fpath2ei_coll_ht[i]);
+					strmap_free(indexes.exc_fpath_coll_ht[i]);
 			}
 			i++;
 		}
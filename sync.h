@@ -41,8 +41,10 @@ struct threadinfo {
 	time_t				  starttime;
 	time_t				  expiretime;
 	int				  child_pid;
+	int				  expireheap_pos;	// the position in threadsinfo_t.expireheap or -1
 
-	GHashTable			 *fpath2ei_ht;		// file path -> event information
+	struct strmap			 *fpath2ei_ht;		// file path -> event information
+	struct pathtree			 *fpath2ei_tree;	// the same paths to check if a path is locked by the thread ("--threading=safe" only)
 
 	int				  try_n;
 
@@ -61,12 +63,17 @@ struct threadsinfo {
 	threadinfo_t 		 *threads;
 	threadinfo_t 		**threadsstack;	// stack of threadinfo_t to be used on thread_new()
 	int			  stacklen;
+	int			 *threadsdone;	// numbers of the finished threads to be joined by thread_gc()
+	int			  threadsdonelen;
+	int			 *expireheap;	// numbers of the threads with expiretime, min-heap by expiretime
+	int			  expireheaplen;
 };
 typedef struct threadsinfo threadsinfo_t;
 
 
 extern int sync_run(struct ctx *ctx);
 extern int sync_dump(struct ctx *ctx, const char *const dest_dir);
+extern size_t sync_meminfo_format(char *buf, size_t buf_size, const char *prefix, const char *separator);
 extern int sync_term(int exitcode);
 extern int threads_foreach(int (*funct)(threadinfo_t *, void *), state_t state, void *arg);
 extern threadsinfo_t *thread_info();
@@ -97,6 +104,13 @@ extern int sync_prequeue_loadmark
 		struct eventinfo *evinfo
 	);
 extern int sync_prequeue_unload(struct ctx *ctx_p, struct indexes *indexes_p);
+extern int sync_prequeue_rename(struct ctx *ctx_p, struct indexes *indexes_p, const char *path_old_full, const char *path_new_full, eventobjtype_t objtype, uint32_t event_mask);
+extern int sync_rescan_changed(struct ctx *ctx_p, struct indexes *indexes_p, time_t since);
+extern const char *sync_path_abs2rel_inplace(struct ctx *ctx_p, const char *path_abs, size_t path_abs_len);
+extern void sync_watchbudget_touch(struct ctx *ctx_p, int wd);
+extern void sync_watchbudget_forget(struct ctx *ctx_p, int wd);
+extern int sync_initialsync(const char *path, struct ctx *ctx_p, struct indexes *indexes_p, initsync_t initsync);
+extern int sync_initialsync_journaled(struct ctx *ctx_p, struct indexes *indexes_p);
 extern const char *sync_parameter_get(const char *variable_name, void *_dosync_arg_p);
 extern pthread_t pthread_sighandler;
 
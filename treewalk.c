@@ -0,0 +1,604 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+#include "malloc.h"
+#include "error.h"
+#include "treewalk.h"
+
+#include <pthread.h>
+#ifdef __linux__
+#	include <sys/syscall.h>
+#endif
+
+/*
+ * A parallel walker of a directory tree. Every thread has a deque of the
+ * directories to be read: a thread takes the directories from the tail of
+ * its own deque (depth-first) and steals from the heads of the deques of
+ * the other threads (the directories closest to the root, so the biggest
+ * subtrees) when its own deque is empty. The directories are listed by
+ * getdents64() and the types of the entries are taken from the listing, so
+ * only the entries of unknown types are lstat()-ed unless TWF_STAT is set.
+ * The entries are passed to the calling thread in batches.
+ */
+
+struct treewalk_batch {
+	struct treewalk_batch	*next;
+	size_t			 count;
+	arena_t			 paths;
+	treewalk_entry_t	 entry[TREEWALK_BATCH_ENTRIES];
+};
+
+struct treewalk;
+
+struct treewalk_worker {
+	pthread_t		 pthread;
+	int			 num;
+	struct treewalk		*walk_p;
+
+	pthread_mutex_t		 mutex;		// of the deque
+	char		       **dir;		// the directories to be read: [dir_head, dir_tail)
+	size_t			 dir_head;
+	size_t			 dir_tail;
+	size_t			 dir_alloc;
+
+	struct treewalk_batch	*batch;
+	char			*path;		// to compose the paths of the entries
+	size_t			 path_size;
+	char			*dents;
+};
+
+struct treewalk {
+	treewalk_flags_t	 flags;
+	treewalk_check_funct_t	 check;
+	void			*arg;
+	dev_t			 root_dev;
+
+	struct treewalk_worker	*worker;
+	int			 workers_count;
+
+	pthread_mutex_t		 mutex;
+	pthread_cond_t		 cond_work;	// a directory is queued or the walk is over -> the idle workers
+	pthread_cond_t		 cond_batch;	// the workers -> the calling thread
+	pthread_cond_t		 cond_room;	// the calling thread -> the workers waiting to pass a batch
+	size_t			 pending;	// the directories queued or being read, atomic
+	int			 idle;		// the workers waiting for a directory, atomic
+	int			 running;	// the workers not finished yet
+	int			 abort;
+	int			 ret;
+
+	struct treewalk_batch	*ready_head;
+	struct treewalk_batch	*ready_tail;
+	size_t			 ready_count;
+};
+
+/* === LISTING === */
+
+struct treewalk_dir {
+	int		 fd;
+#ifdef __linux__
+	char		*buf;
+	long		 len;
+	long		 pos;
+#else
+	DIR		*dir;
+#endif
+};
+
+#ifdef __linux__
+struct linux_dirent64 {
+	uint64_t	 d_ino;
+	int64_t		 d_off;
+	unsigned short	 d_reclen;
+	unsigned char	 d_type;
+	char		 d_name[];
+};
+#endif
+
+static int treewalk_opendir(struct treewalk_dir *dir_p, const char *path, char *buf) {
+	dir_p->fd = open(path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+	if (dir_p->fd == -1)
+		return errno;
+
+#ifdef __linux__
+	dir_p->buf = buf;
+	dir_p->len = 0;
+	dir_p->pos = 0;
+#else
+	int fd = dup(dir_p->fd);
+	if (fd == -1 || (dir_p->dir = fdopendir(fd)) == NULL) {
+		int rc = errno;
+		if (fd != -1)
+			close(fd);
+		close(dir_p->fd);
+		return rc;
+	}
+#endif
+	return 0;
+}
+
+// Return: 1 if an entry is got, 0 at the end of the directory, -1 on error
+
+static int treewalk_readdir(struct treewalk_dir *dir_p, const char **name_p, unsigned char *type_p) {
+#ifdef __linux__
+	if (dir_p->pos >= dir_p->len) {
+		dir_p->len = syscall(SYS_getdents64, dir_p->fd, dir_p->buf, TREEWALK_DENTS_BUFSIZ);
+		dir_p->pos = 0;
+		if (dir_p->len <= 0)
+			return dir_p->len < 0 ? -1 : 0;
+	}
+
+	struct linux_dirent64 *dent = (struct linux_dirent64 *)&dir_p->buf[dir_p->pos];
+	dir_p->pos += dent->d_reclen;
+#else
+	errno = 0;
+	struct dirent *dent = readdir(dir_p->dir);
+	if (dent == NULL)
+		return errno ? -1 : 0;
+#endif
+	*name_p = dent->d_name;
+	*type_p = dent->d_type;
+	return 1;
+}
+
+static void treewalk_closedir(struct treewalk_dir *dir_p) {
+#ifndef __linux__
+	closedir(dir_p->dir);
+#endif
+	close(dir_p->fd);
+	return;
+}
+
+static inline mode_t treewalk_dtype2mode(unsigned char d_type) {
+	switch (d_type) {
+		case DT_REG:	return S_IFREG;
+		case DT_DIR:	return S_IFDIR;
+		case DT_LNK:	return S_IFLNK;
+		case DT_FIFO:	return S_IFIFO;
+		case DT_SOCK:	return S_IFSOCK;
+		case DT_CHR:	return S_IFCHR;
+		case DT_BLK:	return S_IFBLK;
+	}
+
+	return 0;	// DT_UNKNOWN
+}
+
+/* === WORKERS === */
+
+static void treewalk_abort(struct treewalk *walk_p, int ret) {
+	pthread_mutex_lock(&walk_p->mutex);
+	if (!walk_p->ret)
+		walk_p->ret = ret;
+	__atomic_store_n(&walk_p->abort, 1, __ATOMIC_RELAXED);
+	pthread_cond_broadcast(&walk_p->cond_work);
+	pthread_cond_broadcast(&walk_p->cond_room);
+	pthread_cond_broadcast(&walk_p->cond_batch);
+	pthread_mutex_unlock(&walk_p->mutex);
+
+	return;
+}
+
+static void treewalk_push(struct treewalk_worker *worker_p, const char *path, size_t path_len) {
+	struct treewalk *walk_p = worker_p->walk_p;
+	char *dir = xmalloc(path_len+1);
+
+	memcpy(dir, path, path_len+1);
+	__atomic_add_fetch(&walk_p->pending, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&worker_p->mutex);
+	if (worker_p->dir_tail >= worker_p->dir_alloc) {
+		if (worker_p->dir_head) {
+			memmove(worker_p->dir, &worker_p->dir[worker_p->dir_head], (worker_p->dir_tail - worker_p->dir_head) * sizeof(*worker_p->dir));
+			worker_p->dir_tail -= worker_p->dir_head;
+			worker_p->dir_head  = 0;
+		}
+		if (worker_p->dir_tail >= worker_p->dir_alloc) {
+			worker_p->dir_alloc += ALLOC_PORTION;
+			worker_p->dir        = xrealloc(worker_p->dir, worker_p->dir_alloc * sizeof(*worker_p->dir));
+		}
+	}
+	worker_p->dir[worker_p->dir_tail++] = dir;
+	pthread_mutex_unlock(&worker_p->mutex);
+
+	if (__atomic_load_n(&walk_p->idle, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&walk_p->mutex);
+		pthread_cond_signal(&walk_p->cond_work);
+		pthread_mutex_unlock(&walk_p->mutex);
+	}
+
+	return;
+}
+
+// Takes a directory from the tail of the own deque ("victim_p == worker_p")
+// or from the head of the deque of another worker
+
+static char *treewalk_pop(struct treewalk_worker *worker_p, struct treewalk_worker *victim_p) {
+	char *dir = NULL;
+
+	pthread_mutex_lock(&victim_p->mutex);
+	if (victim_p->dir_tail > victim_p->dir_head) {
+		if (victim_p == worker_p)
+			dir = victim_p->dir[--victim_p->dir_tail];
+		else
+			dir = victim_p->dir[victim_p->dir_head++];
+
+		if (victim_p->dir_head == victim_p->dir_tail)
+			victim_p->dir_head = victim_p->dir_tail = 0;
+	}
+	pthread_mutex_unlock(&victim_p->mutex);
+
+	return dir;
+}
+
+static char *treewalk_steal(struct treewalk_worker *worker_p) {
+	struct treewalk *walk_p = worker_p->walk_p;
+	int i = 1;
+
+	while (i < walk_p->workers_count) {
+		struct treewalk_worker *victim_p = &walk_p->worker[(worker_p->num + i++) % walk_p->workers_count];
+		char *dir = treewalk_pop(worker_p, victim_p);
+		if (dir != NULL)
+			return dir;
+	}
+
+	return NULL;
+}
+
+// Return: the next directory to be read, NULL if the walk is over
+
+static char *treewalk_take(struct treewalk_worker *worker_p) {
+	struct treewalk *walk_p = worker_p->walk_p;
+	char *dir = treewalk_pop(worker_p, worker_p);
+
+	if (dir != NULL)
+		return dir;
+
+	pthread_mutex_lock(&walk_p->mutex);
+	__atomic_add_fetch(&walk_p->idle, 1, __ATOMIC_SEQ_CST);
+	while (!walk_p->abort && __atomic_load_n(&walk_p->pending, __ATOMIC_SEQ_CST)) {
+		if ((dir = treewalk_steal(worker_p)) != NULL)
+			break;
+		pthread_cond_wait(&walk_p->cond_work, &walk_p->mutex);
+	}
+	__atomic_sub_fetch(&walk_p->idle, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&walk_p->mutex);
+
+	return dir;
+}
+
+static void treewalk_batch_pass(struct treewalk_worker *worker_p) {
+	struct treewalk *walk_p      = worker_p->walk_p;
+	struct treewalk_batch *batch = worker_p->batch;
+
+	worker_p->batch = NULL;
+
+	pthread_mutex_lock(&walk_p->mutex);
+	while (!walk_p->abort && walk_p->ready_count >= TREEWALK_BATCHES_MAX)
+		pthread_cond_wait(&walk_p->cond_room, &walk_p->mutex);
+
+	if (walk_p->abort) {
+		pthread_mutex_unlock(&walk_p->mutex);
+		arena_free(&batch->paths);
+		free(batch);
+		return;
+	}
+
+	if (walk_p->ready_tail == NULL)
+		walk_p->ready_head = batch;
+	else
+		walk_p->ready_tail->next = batch;
+	walk_p->ready_tail = batch;
+	walk_p->ready_count++;
+	pthread_cond_signal(&walk_p->cond_batch);
+	pthread_mutex_unlock(&walk_p->mutex);
+
+	return;
+}
+
+static void treewalk_report(struct treewalk_worker *worker_p, treewalk_entry_t *entry) {
+	if (worker_p->batch == NULL)
+		worker_p->batch = xcalloc(1, sizeof(*worker_p->batch));
+
+	struct treewalk_batch *batch = worker_p->batch;
+	treewalk_entry_t      *dst   = &batch->entry[batch->count++];
+	char                  *path  = arena_alloc(&batch->paths, entry->path_len+1);
+
+	memcpy(path, entry->path, entry->path_len+1);
+	*dst      = *entry;
+	dst->path = path;
+
+	if (batch->count >= TREEWALK_BATCH_ENTRIES)
+		treewalk_batch_pass(worker_p);
+
+	return;
+}
+
+static void treewalk_readdir_entries(struct treewalk_worker *worker_p, const char *dirpath) {
+	struct treewalk *walk_p = worker_p->walk_p;
+	struct treewalk_dir dir = {0};
+	size_t dirpath_len = strlen(dirpath);
+	const char *name;
+	unsigned char d_type;
+	int rc;
+
+	if ((rc = treewalk_opendir(&dir, dirpath, worker_p->dents))) {
+		if (rc == ENOENT) {
+			debug(2, "\"%s\" disappeared.", dirpath);
+			return;
+		}
+		errno = rc;
+		error("Cannot open the directory \"%s\".", dirpath);
+		treewalk_abort(walk_p, rc);
+		return;
+	}
+
+	if (worker_p->path_size < dirpath_len + 2) {
+		worker_p->path_size = dirpath_len + 2 + PATH_MAX;
+		worker_p->path      = xrealloc(worker_p->path, worker_p->path_size);
+	}
+	memcpy(worker_p->path, dirpath, dirpath_len);
+	if (!dirpath_len || dirpath[dirpath_len-1] != '/')
+		worker_p->path[dirpath_len++] = '/';
+
+	while (!__atomic_load_n(&walk_p->abort, __ATOMIC_RELAXED) && (rc = treewalk_readdir(&dir, &name, &d_type)) > 0) {
+		treewalk_entry_t entry;
+		size_t name_len;
+
+		if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+			continue;
+
+		name_len = strlen(name);
+		if (worker_p->path_size < dirpath_len + name_len + 1) {
+			worker_p->path_size = dirpath_len + name_len + 1 + PATH_MAX;
+			worker_p->path      = xrealloc(worker_p->path, worker_p->path_size);
+		}
+		memcpy(&worker_p->path[dirpath_len], name, name_len+1);
+
+		memset(&entry, 0, sizeof(entry));
+		entry.path     = worker_p->path;
+		entry.path_len = dirpath_len + name_len;
+		entry.st_mode  = treewalk_dtype2mode(d_type);
+
+		if ((walk_p->flags & TWF_STAT) || !entry.st_mode || ((walk_p->flags & TWF_XDEV) && S_ISDIR(entry.st_mode))) {
+			struct stat st;
+
+			if (fstatat(dir.fd, name, &st, AT_SYMLINK_NOFOLLOW)) {
+				rc = errno;
+				if (rc == ENOENT)
+					continue;
+				error("Cannot lstat() \"%s\".", entry.path);
+				treewalk_abort(walk_p, rc);
+				rc = 0;
+				break;
+			}
+
+			entry.st_mode = (walk_p->flags & TWF_STAT) ? st.st_mode : (st.st_mode & S_IFMT);
+			entry.st_size = (walk_p->flags & TWF_STAT) ? st.st_size : 0;
+			entry.st_dev  = st.st_dev;
+		}
+
+		treewalk_check_t check = walk_p->check == NULL ? TWC_NONE : walk_p->check(&entry, walk_p->arg);
+
+		if (S_ISDIR(entry.st_mode) && !(check & TWC_SKIP)) {
+			if ((walk_p->flags & TWF_XDEV) && entry.st_dev != walk_p->root_dev) {
+				debug(2, "\"%s\" is on another filesystem. Skipping.", entry.path);
+			} else
+				treewalk_push(worker_p, entry.path, entry.path_len);
+		}
+
+		if (!(check & TWC_DROP))
+			treewalk_report(worker_p, &entry);
+	}
+
+	if (rc < 0) {
+		rc = errno;
+		error("Cannot read the directory \"%s\".", dirpath);
+		treewalk_abort(walk_p, rc);
+	}
+
+	treewalk_closedir(&dir);
+	return;
+}
+
+static void *treewalk_worker(void *_worker_p) {
+	struct treewalk_worker *worker_p = _worker_p;
+	struct treewalk        *walk_p   = worker_p->walk_p;
+	char *dir;
+
+	while ((dir = treewalk_take(worker_p)) != NULL) {
+		debug(4, "Walker thread #%i: reading \"%s\".", worker_p->num, dir);
+
+		treewalk_readdir_entries(worker_p, dir);
+		free(dir);
+
+		if (!__atomic_sub_fetch(&walk_p->pending, 1, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&walk_p->mutex);
+			pthread_cond_broadcast(&walk_p->cond_work);
+			pthread_mutex_unlock(&walk_p->mutex);
+		}
+	}
+
+	if (worker_p->batch != NULL)
+		treewalk_batch_pass(worker_p);
+
+	pthread_mutex_lock(&walk_p->mutex);
+	walk_p->running--;
+	pthread_cond_signal(&walk_p->cond_batch);
+	pthread_mutex_unlock(&walk_p->mutex);
+
+	return NULL;
+}
+
+/* === THE CALLING THREAD === */
+
+static int treewalk_consume(struct treewalk *walk_p, treewalk_funct_t funct) {
+	struct treewalk_batch *batch;
+
+	pthread_mutex_lock(&walk_p->mutex);
+	while (1) {
+		while (walk_p->ready_head == NULL && walk_p->running)
+			pthread_cond_wait(&walk_p->cond_batch, &walk_p->mutex);
+
+		if ((batch = walk_p->ready_head) == NULL)
+			break;
+
+		walk_p->ready_head = batch->next;
+		if (walk_p->ready_head == NULL)
+			walk_p->ready_tail = NULL;
+		walk_p->ready_count--;
+		pthread_cond_signal(&walk_p->cond_room);
+
+		int aborted = walk_p->abort;
+		pthread_mutex_unlock(&walk_p->mutex);
+
+		size_t i = 0;
+		while (!aborted && i < batch->count) {
+			int rc = funct(&batch->entry[i++], walk_p->arg);
+			if (rc) {
+				treewalk_abort(walk_p, rc);
+				aborted = 1;
+			}
+		}
+		arena_free(&batch->paths);
+		free(batch);
+
+		pthread_mutex_lock(&walk_p->mutex);
+	}
+	pthread_mutex_unlock(&walk_p->mutex);
+
+	return walk_p->ret;
+}
+
+/*
+ * Walks "dirpath" using "threads_count" threads. "check" is called by the
+ * walking threads for every entry (including "dirpath" itself) to decide
+ * whether to descend into it and whether to pass it to "funct", "funct" is
+ * called by the calling thread (in no particular order).
+ */
+
+int treewalk(const char *dirpath, int threads_count, treewalk_flags_t flags, treewalk_check_funct_t check, treewalk_funct_t funct, void *arg) {
+	struct treewalk walk;
+	treewalk_entry_t entry;
+	treewalk_check_t rc;
+	struct stat st;
+	int i, ret, err = 0;
+
+	debug(2, "(\"%s\", %i, 0x%x)", dirpath, threads_count, flags);
+
+	if (lstat(dirpath, &st)) {
+		error("Cannot lstat() \"%s\".", dirpath);
+		return errno;
+	}
+
+	// The root itself
+
+	memset(&entry, 0, sizeof(entry));
+	entry.path     = dirpath;
+	entry.path_len = strlen(dirpath);
+	entry.st_mode  = (flags & TWF_STAT) ? st.st_mode : (st.st_mode & S_IFMT);
+	entry.st_size  = (flags & TWF_STAT) ? st.st_size : 0;
+	entry.st_dev   = st.st_dev;
+
+	rc = check == NULL ? TWC_NONE : check(&entry, arg);
+	if (!(rc & TWC_DROP) && (ret = funct(&entry, arg)))
+		return ret;
+
+	if (!S_ISDIR(st.st_mode) || (rc & TWC_SKIP))
+		return 0;
+
+	// The subtree
+
+	memset(&walk, 0, sizeof(walk));
+	walk.flags         = flags;
+	walk.check         = check;
+	walk.arg           = arg;
+	walk.root_dev      = st.st_dev;
+	walk.workers_count = threads_count > 0 ? threads_count : 1;
+	walk.worker        = xcalloc(walk.workers_count, sizeof(*walk.worker));
+	pthread_mutex_init(&walk.mutex,     NULL);
+	pthread_cond_init (&walk.cond_work,  NULL);
+	pthread_cond_init (&walk.cond_batch, NULL);
+	pthread_cond_init (&walk.cond_room,  NULL);
+
+	i = 0;
+	while (i < walk.workers_count) {
+		struct treewalk_worker *worker_p = &walk.worker[i];
+
+		worker_p->num    = i++;
+		worker_p->walk_p = &walk;
+		worker_p->dents  = xmalloc(TREEWALK_DENTS_BUFSIZ);
+		pthread_mutex_init(&worker_p->mutex, NULL);
+	}
+
+	treewalk_push(&walk.worker[0], dirpath, entry.path_len);
+
+	i = 0;
+	while (i < walk.workers_count) {
+		// pthread_create() returns the error code instead of setting errno
+		if ((err = pthread_create(&walk.worker[i].pthread, NULL, treewalk_worker, &walk.worker[i]))) {
+			errno = err;
+			error("Cannot pthread_create() the walker thread #%i.", i);
+			// The already created threads will steal the directories of the rest
+			break;
+		}
+		pthread_mutex_lock(&walk.mutex);
+		walk.running++;
+		pthread_mutex_unlock(&walk.mutex);
+		i++;
+	}
+
+	if (i)
+		ret = treewalk_consume(&walk, funct);
+	else
+		ret = err;
+
+	while (i--)
+		pthread_join(walk.worker[i].pthread, NULL);
+
+	// Cleanup (there may be leftovers if the walk is aborted)
+
+	while (walk.ready_head != NULL) {
+		struct treewalk_batch *batch = walk.ready_head;
+		walk.ready_head = batch->next;
+		arena_free(&batch->paths);
+		free(batch);
+	}
+
+	i = 0;
+	while (i < walk.workers_count) {
+		struct treewalk_worker *worker_p = &walk.worker[i++];
+
+		while (worker_p->dir_tail > worker_p->dir_head)
+			free(worker_p->dir[--worker_p->dir_tail]);
+		free(worker_p->dir);
+		free(worker_p->path);
+		free(worker_p->dents);
+		pthread_mutex_destroy(&worker_p->mutex);
+	}
+	free(walk.worker);
+
+	pthread_cond_destroy (&walk.cond_room);
+	pthread_cond_destroy (&walk.cond_batch);
+	pthread_cond_destroy (&walk.cond_work);
+	pthread_mutex_destroy(&walk.mutex);
+
+	return ret;
+}
+
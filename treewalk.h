@@ -0,0 +1,57 @@
+/*
+    clsync - file tree sync utility based on inotify/kqueue
+
+    Copyright (C) 2013-2014 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLSYNC_TREEWALK_H
+#define __CLSYNC_TREEWALK_H
+
+enum treewalk_flags {
+	TWF_NONE	= 0x00,
+	TWF_STAT	= 0x01,		// lstat() every entry (otherwise only the type from the directory listing is known)
+	TWF_XDEV	= 0x02,		// do not descend into the directories of other filesystems
+};
+typedef enum treewalk_flags treewalk_flags_t;
+
+// The result of the check function
+
+enum treewalk_check {
+	TWC_NONE	= 0x00,
+	TWC_SKIP	= 0x01,		// do not descend into the directory
+	TWC_DROP	= 0x02,		// do not pass the entry to the calling thread
+};
+typedef enum treewalk_check treewalk_check_t;
+
+struct treewalk_entry {
+	const char	*path;		// the full path
+	size_t		 path_len;
+	mode_t		 st_mode;	// only the type bits if TWF_STAT is not set
+	off_t		 st_size;	// zero if TWF_STAT is not set
+	dev_t		 st_dev;	// zero if neither TWF_STAT nor TWF_XDEV is set
+	uint32_t	 data;		// set by the check function
+};
+typedef struct treewalk_entry treewalk_entry_t;
+
+// Is called by the walking threads for every entry
+typedef treewalk_check_t (*treewalk_check_funct_t)(treewalk_entry_t *entry, void *arg);
+// Is called by the calling thread for every entry that is not dropped; returns non-zero to stop the walk
+typedef int (*treewalk_funct_t)(treewalk_entry_t *entry, void *arg);
+
+extern int treewalk(const char *dirpath, int threads_count, treewalk_flags_t flags, treewalk_check_funct_t check, treewalk_funct_t funct, void *arg);
+
+#endif
+